@@ -0,0 +1,266 @@
+/**
+ * adaptive_evictor.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the adaptive eviction policy interface in adaptive_evictor.hh.
+ */
+#include "adaptive_evictor.hh"
+
+#include <algorithm>
+#include <functional>
+
+#include "lfu_evictor.hh"
+#include "lru_evictor.hh"
+
+/**
+ * Start out as LRU, with cold ghosts.
+ */
+Adaptive_Evictor::Adaptive_Evictor(uint64_t capacity, uint32_t sample_every,
+                                   size_t window)
+    : sample_every(std::max(sample_every, 1u)),
+      window(std::max<size_t>(window, 1)),
+      ghost_capacity(std::max<uint64_t>(capacity / this->sample_every, 1)) {
+    candidates.resize(3);
+    candidates[0].name = "fifo";
+    candidates[0].counts_hits = false;
+    candidates[0].live = std::make_unique<Lru_Evictor>();
+    candidates[0].ghost = std::make_unique<Lru_Evictor>();
+    candidates[1].name = "lru";
+    candidates[1].counts_hits = true;
+    candidates[1].live = std::make_unique<Lru_Evictor>();
+    candidates[1].ghost = std::make_unique<Lru_Evictor>();
+    candidates[2].name = "lfu";
+    candidates[2].counts_hits = true;
+    candidates[2].live = std::make_unique<Lfu_Evictor>();
+    candidates[2].ghost = std::make_unique<Lfu_Evictor>();
+    active = 1;
+}
+
+/**
+ * A trivial destructor for an adaptive evictor object.
+ */
+Adaptive_Evictor::~Adaptive_Evictor() = default;
+
+/**
+ * Whether key is one the ghosts simulate.
+ * @param hash set to what the ghosts call it, if it is
+ */
+bool Adaptive_Evictor::sampled(key_view_type key, key_type &hash) const {
+    const uint64_t h = std::hash<key_view_type>()(key);
+    if (h % sample_every != 0) return false;
+    hash.assign(reinterpret_cast<const char *>(&h), sizeof h);
+    return true;
+}
+
+/**
+ * Pass the hits counted since the last call on to the candidates that count
+ * hits, and run those on sampled keys through the ghosts.
+ */
+void Adaptive_Evictor::count_hits() {
+    std::lock_guard<std::mutex> guard(ghost_lock);
+    hits.drain([this](const key_type &key, const Hit_Queue::Hits &got) {
+        for (Candidate &candidate : candidates)
+            if (candidate.counts_hits) candidate.live->add_hits(key, got.count);
+        key_type hash;
+        if (sampled(key, hash)) reference(hash, got.size, false, got.count);
+    });
+}
+
+/**
+ * Run a set or count hits in a row of a sampled key through every ghost.
+ * The caller holds ghost_lock.
+ */
+void Adaptive_Evictor::reference(const key_type &hash, uint64_t size,
+                                 bool set, uint64_t count) {
+    size = std::max<uint64_t>(size, 1);
+    std::vector<key_type> victims;
+    for (Candidate &candidate : candidates) {
+        auto found = candidate.ghost_sizes.find(hash);
+        if (found == candidate.ghost_sizes.end()) {
+            candidate.misses++;
+            candidate.ghost_sizes.emplace(hash, size);
+            candidate.ghost_used += size;
+        } else {
+            if (!set && !candidate.counts_hits) continue;
+            candidate.ghost_used += size - found->second;
+            found->second = size;
+        }
+        candidate.ghost->touch_key(hash, size, 1);
+        while (candidate.ghost_used > ghost_capacity) {
+            victims.clear();
+            candidate.ghost->evict_batch(candidate.ghost_used - ghost_capacity,
+                                         SIZE_MAX, victims);
+            if (victims.empty()) break;
+            for (const key_type &victim : victims) {
+                auto gone = candidate.ghost_sizes.find(victim);
+                if (gone == candidate.ghost_sizes.end()) continue;
+                candidate.ghost_used -= gone->second;
+                candidate.ghost_sizes.erase(gone);
+            }
+        }
+    }
+    // Only the first of hits in a row can miss
+    if (count > 1) {
+        for (Candidate &candidate : candidates) {
+            if (candidate.counts_hits &&
+                candidate.ghost_sizes.count(hash) != 0)
+                candidate.ghost->add_hits(hash, count - 1);
+        }
+    }
+    references += count;
+    if (references >= window) end_window();
+}
+
+/**
+ * Average in each ghost's miss ratio over the window that just ended, and
+ * switch to the best candidate if it's enough better than the one in use.
+ * The caller holds ghost_lock.
+ */
+void Adaptive_Evictor::end_window() {
+    size_t best = active;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        Candidate &candidate = candidates[i];
+        const double ratio = static_cast<double>(candidate.misses) /
+                             static_cast<double>(references);
+        candidate.miss_ratio =
+                averaged ? (candidate.miss_ratio + ratio) / 2 : ratio;
+        candidate.misses = 0;
+        if (candidate.miss_ratio < candidates[best].miss_ratio) best = i;
+    }
+    references = 0;
+    averaged = true;
+    if (candidates[best].miss_ratio + switch_margin <
+        candidates[active].miss_ratio) {
+        active = best;
+    }
+}
+
+/**
+ * Have every candidate but in_use forget victims from index from on.
+ */
+void Adaptive_Evictor::forget_victims(const std::vector<key_type> &victims,
+                                      size_t from, size_t in_use) {
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (i == in_use) continue;
+        for (size_t v = from; v < victims.size(); v++)
+            candidates[i].live->forget_key(victims[v]);
+    }
+}
+
+/**
+ * Let the evictor know a key was set, without its size.
+ * @param key The key being added to the cache
+ */
+void Adaptive_Evictor::touch_key(const key_type &key) {
+    count_hits();
+    for (Candidate &candidate : candidates) candidate.live->touch_key(key);
+    key_type hash;
+    if (sampled(key, hash)) {
+        std::lock_guard<std::mutex> guard(ghost_lock);
+        reference(hash, 1, true);
+    }
+}
+
+/**
+ * Let the evictor know a key was set.
+ * @param key  The key being added to the cache
+ * @param size Bytes in its value
+ * @param cost What it costs to get the value again
+ */
+void Adaptive_Evictor::touch_key(const key_type &key, uint64_t size,
+                                 double cost) {
+    count_hits();
+    for (Candidate &candidate : candidates)
+        candidate.live->touch_key(key, size, cost);
+    key_type hash;
+    if (sampled(key, hash)) {
+        std::lock_guard<std::mutex> guard(ghost_lock);
+        reference(hash, size, true);
+    }
+}
+
+/**
+ * Count a get, to be passed on by the next call made under the cache's
+ * lock. Safe to call from any thread.
+ */
+bool Adaptive_Evictor::hit_key(key_view_type key, uint64_t size) {
+    return hits.push(key, size);
+}
+
+/**
+ * Pass on the gets hit_key() put off.
+ */
+void Adaptive_Evictor::settle() { count_hits(); }
+
+/**
+ * Stop tracking a key that was deleted, here and in the ghosts.
+ */
+void Adaptive_Evictor::forget_key(const key_type &key) {
+    count_hits();
+    for (Candidate &candidate : candidates) candidate.live->forget_key(key);
+    key_type hash;
+    if (!sampled(key, hash)) return;
+    std::lock_guard<std::mutex> guard(ghost_lock);
+    for (Candidate &candidate : candidates) {
+        auto gone = candidate.ghost_sizes.find(hash);
+        if (gone == candidate.ghost_sizes.end()) continue;
+        candidate.ghost->forget_key(hash);
+        candidate.ghost_used -= gone->second;
+        candidate.ghost_sizes.erase(gone);
+    }
+}
+
+/**
+ * Evict the key the policy in use picks.
+ * @return The key of the item to remove, or "" if there are none
+ */
+const key_type Adaptive_Evictor::evict() {
+    count_hits();
+    const size_t in_use = active;
+    key_type key = candidates[in_use].live->evict();
+    if (key.empty()) return key;
+    for (size_t i = 0; i < candidates.size(); i++)
+        if (i != in_use) candidates[i].live->forget_key(key);
+    return key;
+}
+
+/**
+ * Evict the keys the policy in use picks to make room for bytes.
+ * @param victims the keys to remove are appended to this
+ */
+void Adaptive_Evictor::evict_batch(uint64_t bytes, size_t max_keys,
+                                   std::vector<key_type> &victims) {
+    count_hits();
+    const size_t in_use = active, from = victims.size();
+    candidates[in_use].live->evict_batch(bytes, max_keys, victims);
+    forget_victims(victims, from, in_use);
+}
+
+/**
+ * Forget every key. The ghosts go cold too, but their miss ratios and the
+ * policy in use stay.
+ */
+void Adaptive_Evictor::clear() {
+    hits.clear();
+    for (Candidate &candidate : candidates) candidate.live->clear();
+    std::lock_guard<std::mutex> guard(ghost_lock);
+    for (Candidate &candidate : candidates) {
+        candidate.ghost->clear();
+        std::unordered_map<key_type, uint64_t>().swap(candidate.ghost_sizes);
+        candidate.ghost_used = 0;
+    }
+}
+
+void Adaptive_Evictor::set_capacity(uint64_t capacity) {
+    std::lock_guard<std::mutex> guard(ghost_lock);
+    ghost_capacity = std::max<uint64_t>(capacity / sample_every, 1);
+}
+
+Adaptive_Evictor::Report Adaptive_Evictor::report() {
+    std::lock_guard<std::mutex> guard(ghost_lock);
+    Report out;
+    out.active = candidates[active].name;
+    for (const Candidate &candidate : candidates)
+        out.miss_ratios.emplace_back(candidate.name, candidate.miss_ratio);
+    return out;
+}
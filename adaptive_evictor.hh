@@ -0,0 +1,128 @@
+/**
+ * adaptive_evictor.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare an eviction policy that picks the best of several as it goes.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "evictor.hh"
+#include "hit_queue.hh"
+
+/**
+ * Evicts as FIFO, LRU or LFU would, whichever has missed the least lately.
+ *
+ * Each candidate keeps track of every key in the cache all the time, so
+ * switching between them is a matter of which one we ask for victims; the
+ * victims are forgotten by the others. FIFO is an LRU list that isn't told
+ * of hits, so it can forget keys too.
+ *
+ * Each candidate also runs on a ghost cache: a simulation that holds only
+ * the hashes and sizes of one key in sample_every, in capacity /
+ * sample_every bytes. Every set and hit of a sampled key is a reference,
+ * which misses if the ghost doesn't hold the key (a set is counted too,
+ * since a client sets what it missed). After each window of references,
+ * each ghost's miss ratio goes into an average of the recent ones, and the
+ * candidate with the lowest takes over if it beats the one in use by at
+ * least switch_margin.
+ *
+ * Gets are counted once, here, and passed on to the candidates that count
+ * hits and to the ghosts at the next call made under the cache's lock
+ * (see hit_queue.hh); all the hits on a key in between are references in
+ * a row.
+ *
+ * This takes about three times the memory of one evictor, plus the ghosts.
+ */
+class Adaptive_Evictor final : virtual public Evictor {
+public:
+    struct Report {
+        std::string active;
+        // (candidate, recent miss ratio of its ghost), in a fixed order
+        std::vector<std::pair<std::string, double>> miss_ratios;
+    };
+
+private:
+    // Take over only when doing this much better, so we don't flap between
+    // two policies that do about as well
+    static constexpr double switch_margin = 0.01;
+
+    struct Candidate {
+        std::string name;
+        bool counts_hits;
+        std::unique_ptr<Evictor> live;  // Keeps track of the cache's keys
+
+        std::unique_ptr<Evictor> ghost;  // Keeps track of sampled hashes
+        std::unordered_map<key_type, uint64_t> ghost_sizes;
+        uint64_t ghost_used = 0;
+        uint64_t misses = 0;    // In this window
+        double miss_ratio = 0;  // Recent, averaged over windows
+    };
+
+    std::vector<Candidate> candidates;
+    std::atomic<size_t> active{0};
+
+    const uint32_t sample_every;
+    const size_t window;
+
+    Hit_Queue hits;
+
+    std::mutex ghost_lock;  // Guards the ghosts, which report() reads
+    uint64_t ghost_capacity;
+    size_t references = 0;  // In this window
+    bool averaged = false;  // Whether a window has ended yet
+
+    bool sampled(key_view_type key, key_type &hash) const;
+    void count_hits();
+    void reference(const key_type &hash, uint64_t size, bool set,
+                   uint64_t count = 1);
+    void end_window();
+    void forget_victims(const std::vector<key_type> &victims, size_t from,
+                        size_t in_use);
+
+public:
+    /**
+     * @param capacity     bytes the cache holds
+     * @param sample_every how many keys there are to each one simulated
+     * @param window       how many simulated sets and hits there are to
+     *                     each choice of policy
+     */
+    explicit Adaptive_Evictor(uint64_t capacity, uint32_t sample_every = 64,
+                              size_t window = 4096);
+
+    ~Adaptive_Evictor() override;
+
+    void touch_key(const key_type &key) override;
+
+    void touch_key(const key_type &key, uint64_t size, double cost) override;
+
+    bool hit_key(key_view_type key, uint64_t size) override;
+
+    void settle() override;
+
+    void forget_key(const key_type &key) override;
+
+    const key_type evict() override;
+
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) override;
+
+    void clear() override;
+
+    // Scale the ghosts to a cache that now holds capacity bytes; they
+    // shrink at the next reference. Safe to call from any thread.
+    void set_capacity(uint64_t capacity);
+
+    // The policy in use and how each candidate has done. Safe to call from
+    // any thread.
+    Report report();
+};
@@ -0,0 +1,110 @@
+/**
+ * admission.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the admission control in admission.hh.
+ */
+#include "admission.hh"
+
+#include <algorithm>
+#include <utility>
+
+Admission::Admission(size_t connections, size_t in_flight, size_t queue,
+                     std::chrono::microseconds target,
+                     std::chrono::microseconds interval,
+                     std::function<clock::time_point()> now)
+    : max_connections(connections),
+      max_in_flight(std::max<size_t>(in_flight, 1)),
+      max_queue(queue),
+      target(target),
+      interval(std::max(interval, target)),
+      read_clock(std::move(now)),
+      last_good(read_clock()) {}
+
+bool Admission::open() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (max_connections != 0 && counts.connections >= max_connections) {
+        counts.refused_connections++;
+        return false;
+    }
+    counts.connections++;
+    return true;
+}
+
+void Admission::close() {
+    std::lock_guard<std::mutex> guard(lock);
+    counts.connections--;
+}
+
+/**
+ * Whether a request that has waited this long should be shed rather than
+ * worked on. The caller holds lock.
+ */
+bool Admission::too_late(clock::duration waited, clock::time_point now) {
+    if (waited <= target) {
+        last_good = now;
+        return false;
+    }
+    const bool standing = now - last_good > interval;
+    return waited > (standing ? target : interval);
+}
+
+bool Admission::admit() {
+    std::unique_lock<std::mutex> guard(lock);
+    const clock::time_point now = read_clock();
+    if (counts.in_flight < max_in_flight && queue.empty()) {
+        counts.in_flight++;
+        counts.admitted++;
+        last_good = now;
+        return true;
+    }
+    if (queue.size() >= max_queue) {
+        counts.rejected++;
+        return false;
+    }
+
+    Waiter waiter;
+    waiter.since = now;
+    queue.push_back(&waiter);
+    counts.queued++;
+    // Nothing is worked on after waiting longer than interval. The wait is
+    // measured on read_clock, but slept on the real one.
+    while (!waiter.done) {
+        const clock::duration left = now + interval - read_clock();
+        if (left <= clock::duration::zero()) {
+            queue.erase(std::find(queue.begin(), queue.end(), &waiter));
+            counts.queued--;
+            counts.shed++;
+            return false;
+        }
+        waiter.wake.wait_for(guard, left);
+    }
+    if (waiter.admitted) counts.admitted++;
+    return waiter.admitted;
+}
+
+/**
+ * Hand the slot straight to the oldest waiting request, shedding any that
+ * waited too long on the way, or free it if no one is waiting.
+ */
+void Admission::release() {
+    std::lock_guard<std::mutex> guard(lock);
+    const clock::time_point now = read_clock();
+    while (!queue.empty()) {
+        Waiter *waiter = queue.front();
+        queue.pop_front();
+        counts.queued--;
+        waiter->done = true;
+        waiter->admitted = !too_late(now - waiter->since, now);
+        waiter->wake.notify_one();
+        if (waiter->admitted) return;
+        counts.shed++;
+    }
+    counts.in_flight--;
+    last_good = now;
+}
+
+Admission::Stats Admission::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return counts;
+}
@@ -0,0 +1,108 @@
+/**
+ * admission.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the server's admission control, which turns work away before it
+ * piles up.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+/**
+ * Limits how many connections the server holds and how many requests it
+ * works on at once, and sheds what it can't get to in time, so that under
+ * overload the requests it does take are served as fast as ever instead of
+ * everything slowing down together.
+ *
+ * A connection over max_connections is refused. A request that finds every
+ * one of the max_in_flight slots taken waits its turn in a queue, and if
+ * that's full too it's rejected at once. Waiting is bounded CoDel-style,
+ * by how long requests have been waiting rather than how many there are:
+ * while the queue drains quickly, a request may wait up to interval, which
+ * rides out a burst; but once no request has got through in under target
+ * for a whole interval, the queue is standing, and requests that have
+ * waited longer than target are shed as they come to the front. A shed
+ * request would have been answered too late to be of use, and shedding
+ * it gets the queue back down to target.
+ *
+ * Safe to call from any thread.
+ */
+class Admission {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Stats {
+        size_t connections;          // Open now
+        size_t refused_connections;  // Over max_connections
+        size_t in_flight;            // Requests being worked on now
+        size_t queued;               // and waiting for a slot
+        size_t admitted;             // Requests given a slot, ever
+        size_t rejected;             // Turned away with the queue full
+        size_t shed;                 // Turned away after waiting too long
+    };
+
+private:
+    // A request waiting for a slot; lives on its thread's stack
+    struct Waiter {
+        clock::time_point since;
+        std::condition_variable wake;
+        bool done = false;      // Taken off the queue by release()
+        bool admitted = false;  // and given its slot, rather than shed
+    };
+
+    const size_t max_connections;
+    const size_t max_in_flight;
+    const size_t max_queue;
+    const std::chrono::microseconds target;
+    const std::chrono::microseconds interval;
+    const std::function<clock::time_point()> read_clock;
+
+    mutable std::mutex lock;  // Guards everything below
+    std::deque<Waiter *> queue;  // Oldest first
+    clock::time_point last_good;  // The queue was last drained or quick
+    Stats counts{};
+
+    bool too_late(clock::duration waited, clock::time_point now);
+
+public:
+    /**
+     * @param connections most connections open at once; 0 for no limit
+     * @param in_flight   most requests worked on at once
+     * @param queue       most requests waiting for a slot
+     * @param target      how long a request may wait once the queue is
+     *                    standing
+     * @param interval    how long the queue may stay above target before
+     *                    it's standing, and the longest any request waits
+     * @param now         what time it is; only tests need another clock
+     */
+    Admission(size_t connections, size_t in_flight, size_t queue,
+              std::chrono::microseconds target = std::chrono::milliseconds(5),
+              std::chrono::microseconds interval =
+                      std::chrono::milliseconds(100),
+              std::function<clock::time_point()> now = clock::now);
+
+    // Count a new connection, unless there are too many
+    // @return false if it should be refused
+    bool open();
+
+    // Count a connection open() let in as closed
+    void close();
+
+    /**
+     * Wait for a slot to work on a request in.
+     * @return false if the request should be turned away instead
+     */
+    bool admit();
+
+    // Give back a slot admit() gave, to the next request in the queue
+    void release();
+
+    Stats stats() const;
+};
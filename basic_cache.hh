@@ -0,0 +1,1271 @@
+/**
+ * basic_cache.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * A cache store whose eviction policy, hasher and allocator are fixed at
+ * compile time, so calls to them can be inlined.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cache.hh"
+#include "epoch.hh"
+#include "evictor.hh"
+#include "lz4.hh"
+#include "seeded_hash.hh"
+
+/**
+ * An eviction policy that never evicts: sets fail once maxmem is reached.
+ */
+struct No_Evictor {
+    void touch_key(const key_type &, uint64_t, double) {}
+    void forget_key(const key_type &) {}
+    void evict_batch(uint64_t, size_t, std::vector<key_type> &) {}
+    void clear() {}
+};
+
+/**
+ * The same store as Cache, without the type erasure: the evictor is held by
+ * value and the hasher and allocator are template parameters.
+ *
+ * EvictorT needs touch_key(const key_type &, uint64_t size, double cost),
+ *          forget_key(const key_type &), evict_batch(uint64_t bytes,
+ *          size_t max_keys, std::vector<key_type> &) and clear(), like
+ *          the Evictor interface (any final Evictor works, and its
+ *          calls are no longer virtual). Gets don't tell it anything.
+ * HasherT  is called as hasher(key_view_type) -> size_t, from several
+ *          threads at once.
+ * Alloc    allocates nodes, buckets and stored values. Retired memory may
+ *          be given back from another thread.
+ *
+ * The table is chained and remembers the hash of every entry. Each
+ * operation hashes its key once and walks one chain once (see probe()),
+ * and growing the table never hashes a key again. Growing is incremental:
+ * the old and new tables are kept side by side, and every write moves a
+ * few old buckets over until the old table is empty, so no single request
+ * pays for rehashing everything.
+ *
+ * get() and hit_rate() take no lock and may run on any number of threads
+ * alongside one writer; everything else must be serialized by the caller
+ * (Cache uses a mutex). Readers stay inside an Epoch::Guard, and writers
+ * keep them safe:
+ * - links and values are published with release stores,
+ * - a stored value is never changed; set() swaps in a new one,
+ * - whatever is unlinked or replaced is retired to the Epoch, not freed,
+ * - growing moves nodes between chains, so a reader that misses while
+ *   buckets were being moved (see resize_seq) looks again.
+ *
+ * reset() swaps in an empty table and leaves the old one to a background
+ * thread, which frees it a few buckets at a time once readers are done.
+ *
+ * Values can be stored packed, as Lz4 frames: pack() one and store it with
+ * set_buffer(). space_used() counts what's stored, and readers get values
+ * back as they were set, except through find_stored() and get_stored().
+ *
+ * With set_dedup(), a value of at least the limit that's byte for byte one
+ * already stored under another key is shared rather than stored again: an
+ * index on a hash of their contents finds them, and each stored value
+ * counts the keys it's stored under. space_used() counts it once, until
+ * the last of its keys goes. Values stored with a head aren't shared,
+ * since the head may depend on the key.
+ */
+template <typename EvictorT = No_Evictor, typename HasherT = Seeded_Hash,
+          typename Alloc = std::allocator<char>>
+class BasicCache {
+public:
+    using byte_type = Cache::byte_type;
+    using size_type = Cache::size_type;
+    using val_type = Cache::val_type;
+
+private:
+    // A stored value; its bytes follow it in the same allocation, and then
+    // head more bytes the caller stored along with it (see set()). A packed
+    // value's bytes are an Lz4 frame of it, and it has no head. Nodes,
+    // including retired ones, and replaced values waiting to be retired
+    // each hold a reference; the last to let go frees it.
+    struct Value {
+        size_type size;
+        uint32_t head = 0;
+        uint8_t packed = 0;
+        uint8_t indexed = 0;  // In the dedup index
+        uint32_t links = 1;   // Keys it's stored under; writers only
+        std::atomic<uint32_t> refs{1};
+        byte_type *data() { return reinterpret_cast<byte_type *>(this + 1); }
+        std::string_view extra() {
+            return std::string_view(data() + size, head);
+        }
+    };
+
+    struct Node {
+        const size_t hash;  // hasher's result for key
+        const key_type key;
+        std::atomic<Value *> val;
+        std::atomic<Node *> next{nullptr};
+
+        Node(size_t h, key_view_type k, Value *v) : hash(h), key(k), val(v) {}
+    };
+
+    using link_type = std::atomic<Node *>;
+
+    struct Table {
+        size_t bits;  // log2 of the number of buckets
+        link_type *buckets;
+
+        size_t size() const { return size_t(1) << bits; }
+
+        /**
+         * Pick a bucket with the high bits of a Fibonacci product, so a
+         * weak hasher still spreads over the buckets.
+         */
+        link_type &bucket(size_t h) const {
+            return buckets[(static_cast<uint64_t>(h) *
+                            0x9E3779B97F4A7C15ULL) >>
+                           (64 - bits)];
+        }
+    };
+
+    // Readers count on their own cache line instead of all sharing one
+    struct alignas(64) Stripe {
+        std::atomic<size_t> gets{0};  // Number of calls to get
+        std::atomic<size_t> hits{0};  // Number of successful calls to get()
+    };
+    static constexpr size_t stripe_count = 16;
+
+    using traits = std::allocator_traits<Alloc>;
+    using node_alloc_type = typename traits::template rebind_alloc<Node>;
+    using byte_alloc_type = typename traits::template rebind_alloc<byte_type>;
+    using link_alloc_type = typename traits::template rebind_alloc<link_type>;
+    using table_alloc_type = typename traits::template rebind_alloc<Table>;
+    using node_traits = std::allocator_traits<node_alloc_type>;
+
+    size_type maxmem;
+    float max_load_factor;
+    EvictorT evictor_;
+    HasherT hasher;
+    node_alloc_type node_alloc;
+    byte_alloc_type byte_alloc;
+    link_alloc_type link_alloc;
+    table_alloc_type table_alloc;
+
+    mutable Stripe stripes[stripe_count];
+
+    // Told about every value that leaves the store, except through reset()
+    std::function<void(const key_type &, size_type)> dropped;
+
+    // Told about every value that's evicted, as it's stored
+    std::function<void(const key_type &, val_type, bool)> evicted;
+
+    // Most buckets the freer empties before giving the CPU up
+    static constexpr size_t free_batch = 256;
+
+    // The freer thread, started by the first reset()
+    std::thread freer;
+    std::mutex freer_lock;  // Guards to_free and freer_stopping
+    std::condition_variable freer_cv;
+    std::vector<Table *> to_free;
+    bool freer_stopping = false;
+
+    // Most old buckets moved to the new table by each write
+    static constexpr size_t migrate_batch = 4;
+
+    std::atomic<Table *> table{nullptr};
+    std::atomic<Table *> old_table{nullptr};  // Being emptied into table
+    size_t migrated = 0;  // Buckets of old_table already moved
+    std::atomic<uint64_t> resize_seq{0};  // Odd while buckets are moving
+    size_t count = 0;                     // Number of entries
+    size_type used = 0;                   // Sum of the sizes of all values
+    std::vector<key_type> victims;        // Reused by every eviction
+
+    // Values of at least this many bytes are packed; 0 for never
+    size_type pack_limit = 0;
+    size_t packed_count = 0;     // Packed values stored
+    size_type packed_raw = 0;    // Their sizes before packing
+    size_type packed_size = 0;   // and after
+
+    // Values of at least this many bytes are shared between keys when
+    // they're the same; 0 for never
+    size_type dedup_limit = 0;
+    // Shared values by the hash of their contents; writers only
+    std::unordered_multimap<size_t, Value *> shared_values;
+    size_t shared_keys = 0;     // Keys stored under a value another key has
+    size_type shared_size = 0;  // Bytes those keys would have taken
+
+    Stripe &stripe() const {
+        thread_local const size_t index =
+                std::hash<std::thread::id>()(std::this_thread::get_id()) %
+                stripe_count;
+        return stripes[index];
+    }
+
+    Value *make_value(val_type val, std::string_view head = {}) {
+        const auto extra = static_cast<uint32_t>(head.size());
+        byte_type *mem =
+                byte_alloc.allocate(sizeof(Value) + val.size_ + extra);
+        auto *value = new (mem) Value{val.size_, extra};
+        memcpy(value->data(), val.data_, val.size_);
+        memcpy(value->data() + val.size_, head.data(), extra);
+        return value;
+    }
+
+    // Count a value in or out of the compression totals
+    void count_packed(const Value *value, bool in) {
+        if (!value->packed) return;
+        const byte_type *frame = reinterpret_cast<const byte_type *>(value + 1);
+        const size_type raw = Lz4::raw_size(frame, value->size);
+        if (in) {
+            packed_count++;
+            packed_raw += raw;
+            packed_size += value->size;
+        } else {
+            packed_count--;
+            packed_raw -= raw;
+            packed_size -= value->size;
+        }
+    }
+
+    // Whether a value of size bytes stored with head may be shared
+    bool dedupable(size_type size, std::string_view head) const {
+        return dedup_limit != 0 && size >= dedup_limit && head.empty();
+    }
+
+    static size_t digest(const byte_type *data, size_type size) {
+        return std::hash<std::string_view>()(std::string_view(data, size));
+    }
+
+    /**
+     * @return a stored value with the same bytes and packing, or nullptr
+     */
+    Value *find_shared(size_t d, const byte_type *data, size_type size,
+                       bool packed) const {
+        auto [from, to] = shared_values.equal_range(d);
+        for (; from != to; ++from) {
+            Value *value = from->second;
+            if (value->size == size && (value->packed != 0) == packed &&
+                memcmp(value->data(), data, size) == 0)
+                return value;
+        }
+        return nullptr;
+    }
+
+    // Store value under one more key
+    Value *share(Value *value) {
+        value->links++;
+        value->refs.fetch_add(1, std::memory_order_relaxed);
+        shared_keys++;
+        shared_size += value->size;
+        return value;
+    }
+
+    /**
+     * Take value from one of the keys it's stored under. The last one to
+     * go takes it out of the accounting and the dedup index; it's freed
+     * once it's dropped as often as it was referenced.
+     */
+    void release(Value *value) {
+        if (--value->links != 0) {
+            shared_keys--;
+            shared_size -= value->size;
+            return;
+        }
+        used -= value->size;
+        count_packed(value, false);
+        if (!value->indexed) return;
+        auto [from, to] =
+                shared_values.equal_range(digest(value->data(), value->size));
+        for (; from != to; ++from) {
+            if (from->second == value) {
+                shared_values.erase(from);
+                break;
+            }
+        }
+    }
+
+    /**
+     * put() what make() builds under key, or the same value stored under
+     * another key if it's dedupable; bytes are what would be stored.
+     */
+    template <typename Make>
+    bool put_dedup(key_view_type key, val_type bytes, bool packed,
+                   std::string_view head, double cost, Make &&make) {
+        if (!dedupable(bytes.size_, head))
+            return put(key, bytes.size_, cost, make);
+        const size_t d = digest(bytes.data_, bytes.size_);
+        if (Value *same = find_shared(d, bytes.data_, bytes.size_, packed))
+            return put(key, bytes.size_, cost,
+                       [&]() { return share(same); }, true);
+        Value *made = nullptr;
+        if (!put(key, bytes.size_, cost, [&]() { return made = make(); }))
+            return false;
+        made->indexed = 1;
+        shared_values.emplace(d, made);
+        return true;
+    }
+
+    /**
+     * Walk key's chain like find(), but call visit(const Value &) on what's
+     * stored, packed or not.
+     */
+    template <typename Visit>
+    bool find_value(key_view_type key, Visit &&visit) const {
+        Stripe &counters = stripe();
+        counters.gets.fetch_add(1, std::memory_order_relaxed);
+
+        const size_t h = hasher(key);
+        Epoch::Guard guard;
+        for (;;) {
+            const uint64_t seq = resize_seq.load(std::memory_order_acquire);
+            const Table *tables[] = {
+                    old_table.load(std::memory_order_acquire),
+                    table.load(std::memory_order_acquire)};
+            for (const Table *t : tables) {
+                if (t == nullptr) continue;
+                for (const Node *node =
+                             t->bucket(h).load(std::memory_order_acquire);
+                     node != nullptr;
+                     node = node->next.load(std::memory_order_acquire)) {
+                    if (node->hash != h || node->key != key) continue;
+
+                    Value *value = node->val.load(std::memory_order_acquire);
+                    counters.hits.fetch_add(1, std::memory_order_relaxed);
+                    visit(*value);
+                    return true;
+                }
+            }
+            // A miss only counts if no buckets moved under us
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq & 1) == 0 &&
+                resize_seq.load(std::memory_order_relaxed) == seq)
+                return false;
+        }
+    }
+
+    /**
+     * @return a new[] copy of what value holds, unpacked if it's packed, or
+     *         nullptr with size 0 if the frame is corrupt
+     */
+    static val_type copy_value(Value &value) {
+        if (!value.packed) {
+            auto *buff = new byte_type[value.size];
+            memcpy(buff, value.data(), value.size);
+            return {buff, value.size};
+        }
+        const size_type raw = Lz4::raw_size(value.data(), value.size);
+        auto *buff = new byte_type[raw];
+        if (!Lz4::decompress(value.data(), value.size, buff)) {
+            delete[] buff;
+            return {nullptr, 0};
+        }
+        return {buff, raw};
+    }
+
+    void free_value(Value *value) {
+        byte_alloc.deallocate(reinterpret_cast<byte_type *>(value),
+                              sizeof(Value) + value->size + value->head);
+    }
+
+    // Let go of a reference to value, freeing it if it was the last
+    void drop_value(Value *value) {
+        if (value->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            free_value(value);
+    }
+
+    Node *make_node(size_t h, key_view_type key, Value *value) {
+        Node *node = node_traits::allocate(node_alloc, 1);
+        try {
+            node_traits::construct(node_alloc, node, h, key, value);
+        } catch (...) {
+            node_traits::deallocate(node_alloc, node, 1);
+            throw;
+        }
+        return node;
+    }
+
+    void free_node(Node *node) {
+        drop_value(node->val.load(std::memory_order_relaxed));
+        node_traits::destroy(node_alloc, node);
+        node_traits::deallocate(node_alloc, node, 1);
+    }
+
+    Table *make_table(size_t bits) {
+        Table *t = table_alloc.allocate(1);
+        t->bits = bits;
+        try {
+            t->buckets = link_alloc.allocate(t->size());
+        } catch (...) {
+            table_alloc.deallocate(t, 1);
+            throw;
+        }
+        for (size_t i = 0; i < t->size(); i++) new (&t->buckets[i]) link_type();
+        return t;
+    }
+
+    // Free a table's buckets, but not its nodes
+    void free_table(Table *t) {
+        link_alloc.deallocate(t->buckets, t->size());
+        table_alloc.deallocate(t, 1);
+    }
+
+    // Free a table along with every node in it
+    void free_table_all(Table *t) {
+        for (size_t i = 0; i < t->size(); i++) {
+            Node *node = t->buckets[i].load(std::memory_order_relaxed);
+            while (node != nullptr) {
+                Node *next = node->next.load(std::memory_order_relaxed);
+                free_node(node);
+                node = next;
+            }
+        }
+        free_table(t);
+    }
+
+    // Deleters for Epoch::retire(); ctx is the cache
+    static void retire_value(void *p, void *self) {
+        static_cast<BasicCache *>(self)->drop_value(static_cast<Value *>(p));
+    }
+    static void retire_node(void *p, void *self) {
+        static_cast<BasicCache *>(self)->free_node(static_cast<Node *>(p));
+    }
+    static void retire_nodes(void *p, void *self) {
+        auto *nodes = static_cast<std::vector<Node *> *>(p);
+        for (Node *node : *nodes) static_cast<BasicCache *>(self)->free_node(node);
+        delete nodes;
+    }
+    static void retire_table(void *p, void *self) {
+        static_cast<BasicCache *>(self)->free_table(static_cast<Table *>(p));
+    }
+
+    /**
+     * Body of the freer thread: wait for tables that reset() swapped out,
+     * wait for readers to leave them, then free them in batches. Anything
+     * queued is freed before the thread stops.
+     */
+    void free_in_background() {
+        std::unique_lock<std::mutex> guard(freer_lock);
+        for (;;) {
+            freer_cv.wait(guard,
+                          [this]() { return freer_stopping || !to_free.empty(); });
+            if (to_free.empty()) return;
+            std::vector<Table *> tables;
+            tables.swap(to_free);
+            guard.unlock();
+
+            Epoch::synchronize();
+            for (Table *t : tables) {
+                for (size_t i = 0; i < t->size(); i++) {
+                    Node *node = t->buckets[i].load(std::memory_order_relaxed);
+                    while (node != nullptr) {
+                        Node *next = node->next.load(std::memory_order_relaxed);
+                        free_node(node);
+                        node = next;
+                    }
+                    if (i % free_batch == free_batch - 1)
+                        std::this_thread::yield();
+                }
+                free_table(t);
+            }
+            guard.lock();
+        }
+    }
+
+    /**
+     * Walk the chain for a key once (twice while growing, if its old bucket
+     * hasn't been moved yet). Writers only.
+     * @return the link that points at the key's node, or the null link at
+     *         the end of its chain in the current table if it isn't there.
+     *         Either way the key can be replaced or unlinked through it.
+     */
+    link_type *probe(size_t h, key_view_type key) const {
+        link_type *link;
+        const Table *old = old_table.load(std::memory_order_relaxed);
+        if (old != nullptr) {
+            link = &old->bucket(h);
+            for (Node *node = link->load(std::memory_order_relaxed);
+                 node != nullptr; node = link->load(std::memory_order_relaxed)) {
+                if (node->hash == h && node->key == key) return link;
+                link = &node->next;
+            }
+        }
+        link = &table.load(std::memory_order_relaxed)->bucket(h);
+        for (Node *node = link->load(std::memory_order_relaxed);
+             node != nullptr && (node->hash != h || node->key != key);
+             node = link->load(std::memory_order_relaxed)) {
+            link = &node->next;
+        }
+        return link;
+    }
+
+    /**
+     * Unlink the node at link, which the caller retires.
+     * @return the node
+     */
+    Node *unlink(link_type *link) {
+        Node *node = link->load(std::memory_order_relaxed);
+        link->store(node->next.load(std::memory_order_relaxed),
+                    std::memory_order_release);
+        Value *value = node->val.load(std::memory_order_relaxed);
+        const size_type size = value->size;
+        release(value);
+        count--;
+        if (dropped) dropped(node->key, size);
+        return node;
+    }
+
+    /**
+     * Unlink the node at link and retire it and its value.
+     */
+    void erase(link_type *link) { Epoch::retire(unlink(link), retire_node, this); }
+
+    /**
+     * Evict what the evictor picked: unlink whichever victims are still
+     * here and retire them all as one, so the batch costs one trip to the
+     * Epoch and is freed in one pass.
+     * @param watch a node to look out for
+     * @return true iff watch was among them
+     */
+    bool erase_victims(const Node *watch = nullptr) {
+        auto *nodes = new std::vector<Node *>();
+        nodes->reserve(victims.size());
+        bool found = false;
+        for (const key_type &victim : victims) {
+            link_type *link = probe(hasher(victim), victim);
+            if (link->load(std::memory_order_relaxed) == nullptr)
+                continue;  // Already gone
+            Node *node = unlink(link);
+            found = found || node == watch;
+            if (evicted) {
+                Value *value = node->val.load(std::memory_order_relaxed);
+                evicted(node->key, val_type{value->data(), value->size},
+                        value->packed != 0);
+            }
+            nodes->push_back(node);
+        }
+        if (nodes->empty())
+            delete nodes;
+        else
+            Epoch::retire(nodes, retire_nodes, this);
+        return found;
+    }
+
+    /**
+     * Move up to buckets buckets of the old table into the current one,
+     * relinking the nodes by their saved hashes, and drop the old table
+     * once it is empty. Readers that miss meanwhile retry.
+     */
+    void migrate(size_t buckets) {
+        Table *old = old_table.load(std::memory_order_relaxed);
+        if (old == nullptr) return;
+        const Table *t = table.load(std::memory_order_relaxed);
+        const size_t end = std::min(old->size(), migrated + buckets);
+
+        const uint64_t seq = resize_seq.load(std::memory_order_relaxed);
+        resize_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (; migrated < end; migrated++) {
+            link_type &from = old->buckets[migrated];
+            Node *node = from.load(std::memory_order_relaxed);
+            while (node != nullptr) {
+                Node *next = node->next.load(std::memory_order_relaxed);
+                link_type &head = t->bucket(node->hash);
+                node->next.store(head.load(std::memory_order_relaxed),
+                                 std::memory_order_release);
+                head.store(node, std::memory_order_release);
+                from.store(next, std::memory_order_release);
+                node = next;
+            }
+        }
+        if (migrated == old->size()) {
+            old_table.store(nullptr, std::memory_order_release);
+            migrated = 0;
+        }
+        resize_seq.store(seq + 2, std::memory_order_release);
+
+        if (old_table.load(std::memory_order_relaxed) == nullptr)
+            Epoch::retire(old, retire_table, this);
+    }
+
+    /**
+     * Start moving everything into a table of 2^bits buckets. A move that
+     * is still under way is finished first.
+     */
+    void resize(size_t bits) {
+        Table *bigger = make_table(bits);
+        while (old_table.load(std::memory_order_relaxed) != nullptr)
+            migrate(free_batch);
+
+        const uint64_t seq = resize_seq.load(std::memory_order_relaxed);
+        resize_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        old_table.store(table.load(std::memory_order_relaxed),
+                        std::memory_order_release);
+        table.store(bigger, std::memory_order_release);
+        migrated = 0;
+        resize_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    /**
+     * @return log2 of the fewest buckets that hold entries under the load
+     *         factor
+     */
+    size_t bits_for(size_t entries) const {
+        size_t bits = 3;
+        while (static_cast<float>(entries) >
+               max_load_factor * static_cast<float>(size_t(1) << bits))
+            bits++;
+        return bits;
+    }
+
+    bool must_grow() const {
+        const Table *t = table.load(std::memory_order_relaxed);
+        return static_cast<float>(count + 1) >
+               max_load_factor * static_cast<float>(t->size());
+    }
+
+    /**
+     * Store a value of size bytes under key, evicting until it fits, and
+     * only then call make() for the value itself.
+     * @param cost   passed on to the evictor with the key
+     * @param shared make() gives a value that's already stored, which takes
+     *               no more room
+     * @return true iff the insertion of the data to the store was successful.
+     */
+    template <typename Make>
+    bool put(key_view_type key, size_type size, double cost, Make &&make,
+             bool shared = false) {
+        if (size > maxmem) return false;  // Would never fit
+        migrate(migrate_batch);
+
+        const size_t h = hasher(key);
+        link_type *link = probe(h, key);
+
+        // Find things to evict; the value being overwritten makes room too,
+        // unless another key shares it. Unlinking a victim can change the
+        // node that link lives in, so keep the node itself until the loop
+        // is done.
+        const Node *existing = link->load(std::memory_order_relaxed);
+        const Value *old =
+                existing == nullptr
+                        ? nullptr
+                        : existing->val.load(std::memory_order_relaxed);
+        size_type replaced = old == nullptr || old->links > 1 ? 0 : old->size;
+        const size_type charge = shared ? 0 : size;
+        // Over maxmem after it shrank, only keep from adding to what's used
+        const size_type limit = std::max(maxmem, used - replaced);
+        bool evicted = false;
+        while (used - replaced + charge > limit) {
+            // custom hasher should not cause SIGABRT
+            try {
+                victims.clear();
+                evictor_.evict_batch(used - replaced + charge - limit,
+                                     SIZE_MAX, victims);
+                if (victims.empty()) return false;
+                if (erase_victims(replaced != 0 ? existing : nullptr))
+                    replaced = 0;
+                evicted = true;
+            } catch (const std::exception &e) {
+                std::cerr << "BasicCache::put(): evict: " << e.what()
+                          << std::endl;
+                return false;
+            }
+        }
+        // Only after evicting do we need to look for our link again
+        if (evicted) link = probe(h, key);
+
+        Value *value;
+        try {
+            value = make();
+        } catch (const std::exception &e) {
+            std::cerr << "BasicCache::put(): allocate: " << e.what()
+                      << std::endl;
+            return false;
+        }
+
+        Node *node = link->load(std::memory_order_relaxed);
+        if (node != nullptr) {  // Swap the value; readers may still copy the old
+            Value *old = node->val.load(std::memory_order_relaxed);
+            node->val.store(value, std::memory_order_release);
+            release(old);
+            if (dropped) dropped(node->key, old->size);
+            Epoch::retire(old, retire_value, this);
+        } else {
+            try {
+                node = make_node(h, key, value);
+                if (must_grow())
+                    resize(table.load(std::memory_order_relaxed)->bits + 1);
+            } catch (const std::exception &e) {
+                // we have to free it if it wasn't inserted
+                if (shared) {
+                    value->links--;
+                    shared_keys--;
+                    shared_size -= value->size;
+                }
+                if (node != nullptr) {
+                    free_node(node);
+                } else {
+                    drop_value(value);
+                }
+                std::cerr << "BasicCache::put(): insert: " << e.what()
+                          << std::endl;
+                return false;
+            }
+            // It's absent, so the head of its bucket is as good as anywhere
+            link_type &head = table.load(std::memory_order_relaxed)->bucket(h);
+            node->next.store(head.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+            head.store(node, std::memory_order_release);
+            count++;
+        }
+        if (!shared) {
+            used += size;
+            count_packed(value, true);
+        }
+
+        // Register key with the evictor
+        evictor_.touch_key(node->key, size, cost);
+
+        return true;
+    }
+
+public:
+    /**
+     * Create a store with a default-constructed evictor.
+     * @param max_mem     The maximum allowance for storage used by values.
+     * @param load_factor Maximum allowed ratio between entries and buckets.
+     * @param hash        Hash function to use on the keys.
+     * @param alloc       Allocator for the table and the stored values.
+     */
+    explicit BasicCache(size_type max_mem, float load_factor = 0.75,
+                        HasherT hash = HasherT(), const Alloc &alloc = Alloc())
+            : maxmem(max_mem),
+              max_load_factor(load_factor > 0 ? load_factor : 0.75f),
+              evictor_(),
+              hasher(std::move(hash)),
+              node_alloc(alloc),
+              byte_alloc(alloc),
+              link_alloc(alloc),
+              table_alloc(alloc) {
+        table.store(make_table(3));
+    }
+
+    /**
+     * Create a store with the given evictor, which is moved in.
+     */
+    BasicCache(size_type max_mem, float load_factor, EvictorT evictor,
+               HasherT hash = HasherT(), const Alloc &alloc = Alloc())
+            : maxmem(max_mem),
+              max_load_factor(load_factor > 0 ? load_factor : 0.75f),
+              evictor_(std::move(evictor)),
+              hasher(std::move(hash)),
+              node_alloc(alloc),
+              byte_alloc(alloc),
+              link_alloc(alloc),
+              table_alloc(alloc) {
+        table.store(make_table(3));
+    }
+
+    /**
+     * No reader may be left by now. What we retired is freed before we go,
+     * since the deleters need our allocators.
+     */
+    ~BasicCache() {
+        if (freer.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(freer_lock);
+                freer_stopping = true;
+            }
+            freer_cv.notify_one();
+            freer.join();
+        }
+        Epoch::synchronize();
+        if (old_table.load() != nullptr) free_table_all(old_table.load());
+        free_table_all(table.load());
+    }
+
+    BasicCache(const BasicCache &) = delete;
+    BasicCache &operator=(const BasicCache &) = delete;
+
+    EvictorT &evictor() { return evictor_; }
+
+    /**
+     * Call on_drop(key, size) whenever a value is deleted, evicted, swept
+     * or overwritten, so callers can keep their own accounting. reset()
+     * doesn't call it.
+     */
+    void on_drop(std::function<void(const key_type &, size_type)> hook) {
+        dropped = std::move(hook);
+    }
+
+    /**
+     * Call on_evict(key, val, packed) with each value as it's evicted, as
+     * it's stored (see find_stored()), e.g. to keep it somewhere else. It's
+     * called by writers, so it should be quick.
+     */
+    void on_evict(std::function<void(const key_type &, val_type, bool)> hook) {
+        evicted = std::move(hook);
+    }
+
+    /**
+     * Add a <key, value> pair, deep-copying both, and evict until it fits.
+     * @param head stored along with the value and handed to find()'s visit
+     *             with it, e.g. a response rendered ahead of time. Only
+     *             the value counts toward space_used().
+     * @param cost what it costs to get the value again, for the evictor
+     * @return true iff the insertion of the data to the store was successful.
+     */
+    bool set(key_view_type key, val_type val, std::string_view head = {},
+             double cost = 1) {
+        return put_dedup(key, val, false, head, cost,
+                         [&]() { return make_value(val, head); });
+    }
+
+    /**
+     * Room for a value of size bytes, to be filled in and then stored with
+     * set_buffer(), so a value that arrives in pieces is copied only once.
+     * Takes no lock of ours; it's safe alongside writers if Alloc is.
+     * @param packed it will be filled with an Lz4 frame, like pack() makes
+     * @return the bytes to fill in
+     * @throw whatever Alloc throws
+     */
+    byte_type *make_buffer(size_type size, bool packed = false) {
+        byte_type *mem = byte_alloc.allocate(sizeof(Value) + size);
+        auto *value = new (mem) Value{size};
+        value->packed = packed;
+        return value->data();
+    }
+
+    /**
+     * @return the size a buffer from make_buffer() was made with
+     */
+    static size_type buffer_size(const byte_type *buffer) {
+        return (reinterpret_cast<const Value *>(buffer) - 1)->size;
+    }
+
+    /**
+     * Free a buffer from make_buffer() that won't be stored.
+     */
+    void drop_buffer(byte_type *buffer) {
+        free_value(reinterpret_cast<Value *>(buffer) - 1);
+    }
+
+    /**
+     * Pack values of at least limit bytes from now on (0 turns it off); see
+     * pack(). Not thread safe; call it before sharing the store.
+     */
+    void set_compression(size_type limit) { pack_limit = limit; }
+
+    /**
+     * Compress val into a buffer for set_buffer(), if it's big enough to be
+     * packed and packing makes it smaller. Takes no lock of ours, so the
+     * compressing can happen before the caller takes its own.
+     * @return the packed buffer, or nullptr to store val as it is
+     * @throw whatever Alloc throws
+     */
+    byte_type *pack(val_type val) {
+        if (pack_limit == 0 || val.size_ < pack_limit) return nullptr;
+        std::unique_ptr<byte_type[]> frame(new byte_type[Lz4::bound(val.size_)]);
+        const size_t size = Lz4::compress(val.data_, val.size_, frame.get());
+        if (size >= val.size_) return nullptr;  // It didn't help
+        byte_type *buffer = make_buffer(static_cast<size_type>(size), true);
+        memcpy(buffer, frame.get(), size);
+        return buffer;
+    }
+
+    /**
+     * @return how many packed values are stored, and their sizes before
+     *         and after packing. Writers only.
+     */
+    size_t packed_values() const { return packed_count; }
+    size_type packed_raw_bytes() const { return packed_raw; }
+    size_type packed_bytes() const { return packed_size; }
+
+    /**
+     * Share values of at least limit bytes between the keys they're stored
+     * under when they're the same, from now on (0 turns it off). Values
+     * already stored aren't looked at again. Not thread safe; call it
+     * before sharing the store.
+     */
+    void set_dedup(size_type limit) { dedup_limit = limit; }
+
+    /**
+     * @return how many keys share a value with an earlier one, and the
+     *         bytes their copies would have taken. Writers only.
+     */
+    size_t deduped_keys() const { return shared_keys; }
+    size_type deduped_bytes() const { return shared_size; }
+
+    /**
+     * Store a filled-in buffer from make_buffer() or pack() under key, like
+     * set(). The buffer is ours afterwards, stored or not. With a head, the
+     * value is copied once more to make room for it; a packed buffer is
+     * stored without one.
+     * @return true iff the insertion of the data to the store was successful.
+     */
+    bool set_buffer(key_view_type key, byte_type *buffer,
+                    std::string_view head = {}, double cost = 1) {
+        Value *value = reinterpret_cast<Value *>(buffer) - 1;
+        if (!head.empty() && !value->packed) {
+            const bool ok = set(key, {buffer, value->size}, head, cost);
+            free_value(value);
+            return ok;
+        }
+        bool taken = false;
+        const bool ok = put_dedup(key, {buffer, value->size}, value->packed != 0,
+                                  head, cost, [&]() {
+                                      taken = true;
+                                      return value;
+                                  });
+        if (!taken) free_value(value);
+        return ok;
+    }
+
+    /**
+     * Lock-free; see the class comment.
+     * @return a newly-allocated (new[]) copy of the value associated with
+     *         key, or nullptr with size 0 if not found.
+     */
+    val_type get(key_view_type key) const {
+        val_type found{nullptr, 0};
+        find_value(key, [&found](Value &value) { found = copy_value(value); });
+        return found;
+    }
+
+    /**
+     * Look key up like get(), but call visit(head, val) on the stored
+     * value in place instead of copying it; head is what set() stored with
+     * it. Both are only good during the call, and memory isn't reclaimed
+     * until it returns, so visit should be quick. A packed value is
+     * unpacked into a copy for visit.
+     * @return true iff key was found
+     */
+    template <typename Visit>
+    bool find(key_view_type key, Visit &&visit) const {
+        return find_value(key, [&visit](Value &value) {
+            if (!value.packed) {
+                visit(value.extra(), val_type{value.data(), value.size});
+                return;
+            }
+            const val_type copy = copy_value(value);
+            visit(std::string_view(), copy);
+            delete[] copy.data_;
+        });
+    }
+
+    /**
+     * Look key up like find(), but call visit(head, val, packed) on what's
+     * stored as it is: the Lz4 frame of a packed value (see lz4.hh), so it
+     * can be sent on without unpacking it here.
+     * @return true iff key was found
+     */
+    template <typename Visit>
+    bool find_stored(key_view_type key, Visit &&visit) const {
+        return find_value(key, [&visit](Value &value) {
+            visit(value.extra(), val_type{value.data(), value.size},
+                  value.packed != 0);
+        });
+    }
+
+    /**
+     * Look key up like get(), but copy what's stored as it is, like
+     * find_stored().
+     * @param packed set to whether the copy is packed
+     * @return a new[] copy of what's stored under key, or nullptr with
+     *         size 0 if not found.
+     */
+    val_type get_stored(key_view_type key, bool &packed) const {
+        val_type found{nullptr, 0};
+        find_stored(key, [&](std::string_view, val_type val, bool p) {
+            auto *buff = new byte_type[val.size_];
+            memcpy(buff, val.data_, val.size_);
+            found = {buff, val.size_};
+            packed = p;
+        });
+        return found;
+    }
+
+    /**
+     * Look key up like find_stored(), but hold on to what's stored instead
+     * of copying it, until unpin(pin). It stays good however long that
+     * takes: a value set over, deleted or evicted meanwhile is only freed
+     * once it's unpinned. Its memory counts as given back from then on, so
+     * hold on no longer than it takes to send.
+     * @param head   set to what set() stored with it
+     * @param packed set to whether it's packed
+     * @param pin    set to what to unpin, if found
+     * @return what's stored under key, or nullptr with size 0 if not found
+     */
+    val_type pin(key_view_type key, std::string_view &head, bool &packed,
+                 const void *&pin) const {
+        val_type found{nullptr, 0};
+        // Whatever refers to value lets go of it only after our guard ends
+        find_value(key, [&](Value &value) {
+            value.refs.fetch_add(1, std::memory_order_relaxed);
+            found = {value.data(), value.size};
+            head = value.extra();
+            packed = value.packed != 0;
+            pin = &value;
+        });
+        return found;
+    }
+
+    // Let go of a value pin() held on to
+    void unpin(const void *pin) const {
+        const_cast<BasicCache *>(this)->drop_value(
+                static_cast<Value *>(const_cast<void *>(pin)));
+    }
+
+    /**
+     * @return true iff key was in the store and has been deleted.
+     */
+    bool del(key_view_type key) {
+        migrate(migrate_batch);
+        link_type *link = probe(hasher(key), key);
+        const Node *node = link->load(std::memory_order_relaxed);
+        if (node == nullptr) return false;
+        evictor_.forget_key(node->key);
+        erase(link);
+        return true;
+    }
+
+    /**
+     * Evict until no more than target bytes are used.
+     * @param target      bytes to get down to
+     * @param max_victims stop after the evictor picked this many keys (0
+     *                    for no limit), so callers can do it in steps
+     * @return the number of keys the evictor picked; if target wasn't
+     *         reached and this is under max_victims, the evictor ran dry
+     */
+    size_t evict_to(size_type target, size_t max_victims = 0) {
+        migrate(migrate_batch);
+        size_t picked = 0;
+        while (used > target && (max_victims == 0 || picked < max_victims)) {
+            victims.clear();
+            evictor_.evict_batch(used - target,
+                                 max_victims == 0 ? SIZE_MAX
+                                                  : max_victims - picked,
+                                 victims);
+            if (victims.empty()) break;
+            picked += victims.size();
+            erase_victims();
+        }
+        return picked;
+    }
+
+    /**
+     * Delete the entries whose keys stale(key) picks, a few buckets at a
+     * time, so callers can let others in between steps.
+     * @param cursor  the first bucket to look at; moved past the ones
+     *                looked at. Start from 0. If the table grows between
+     *                steps a few entries may be missed.
+     * @param buckets most buckets to look at in this step; while the table
+     *                is growing, the step moves that many buckets instead
+     * @return true iff the whole table has been looked at
+     */
+    template <typename Stale>
+    bool sweep(size_t &cursor, size_t buckets, Stale &&stale) {
+        if (old_table.load(std::memory_order_relaxed) != nullptr) {
+            migrate(buckets);
+            return false;
+        }
+        const Table *t = table.load(std::memory_order_relaxed);
+        const size_t end = std::min(t->size(), cursor + buckets);
+        for (; cursor < end; cursor++) {
+            link_type *link = &t->buckets[cursor];
+            for (Node *node = link->load(std::memory_order_relaxed);
+                 node != nullptr; node = link->load(std::memory_order_relaxed)) {
+                if (stale(node->key)) {
+                    evictor_.forget_key(node->key);
+                    erase(link);
+                } else {
+                    link = &node->next;
+                }
+            }
+        }
+        return cursor >= t->size();
+    }
+
+    /**
+     * Call visit(const key_type &, val_type) like for_each(), but a few
+     * buckets at a time, so callers can let others in between steps.
+     * Writers only.
+     * @param cursor  the first bucket to visit; moved past the ones visited.
+     *                Start from 0.
+     * @param size    the size of the table cursor is in; start from 0. If
+     *                the table grows between steps, cursor moves to where
+     *                the buckets it had got to went, so every entry there
+     *                throughout is still visited exactly once.
+     * @param buckets most buckets to visit in this step; while the table is
+     *                growing, the step moves that many buckets instead
+     * @return true iff the whole table has been visited
+     */
+    template <typename Visit>
+    bool walk(size_t &cursor, size_t &size, size_t buckets, Visit &&visit) {
+        if (old_table.load(std::memory_order_relaxed) != nullptr) {
+            migrate(buckets);
+            return false;
+        }
+        // Bucket i of a table 2^k times smaller is split into the 2^k from
+        // i * 2^k on, since buckets are picked by the high bits
+        const Table *t = table.load(std::memory_order_relaxed);
+        if (size == 0) {
+            size = t->size();
+        } else if (t->size() > size) {
+            cursor *= t->size() / size;
+            size = t->size();
+        } else if (t->size() < size) {  // Reset: everything in it is new
+            cursor /= size / t->size();
+            size = t->size();
+        }
+        const size_t end = std::min(size, cursor + buckets);
+        for (; cursor < end; cursor++) {
+            for (const Node *node =
+                         t->buckets[cursor].load(std::memory_order_relaxed);
+                 node != nullptr;
+                 node = node->next.load(std::memory_order_relaxed)) {
+                Value *value = node->val.load(std::memory_order_relaxed);
+                if (!value->packed) {
+                    visit(node->key, val_type{value->data(), value->size});
+                    continue;
+                }
+                const val_type copy = copy_value(*value);
+                visit(node->key, copy);
+                delete[] copy.data_;
+            }
+        }
+        return cursor >= size;
+    }
+
+    /**
+     * Size the table for expected entries up front, so filling it doesn't
+     * grow it step by step. Writers only.
+     * @return true iff successful; a table already that big is left alone.
+     */
+    bool reserve(size_t expected) {
+        const size_t bits = bits_for(expected);
+        if (bits <= table.load(std::memory_order_relaxed)->bits) return true;
+        try {
+            resize(bits);
+        } catch (const std::exception &e) {
+            std::cerr << "BasicCache::reserve(): " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @return the total amount of memory used up by all values (not keys).
+     */
+    size_type space_used() const { return used; }
+
+    size_type capacity() const { return maxmem; }
+
+    /**
+     * Change the most bytes values may take up. After shrinking below what's
+     * used, sets only keep from adding to it, and evict_to() can take the
+     * excess out in steps instead of a set evicting it all at once.
+     * Writers only.
+     */
+    void set_capacity(size_type max_mem) { maxmem = max_mem; }
+
+    /**
+     * @return the ratio of gets that had been successful.
+     */
+    double hit_rate() const {
+        size_t gets = 0, hits = 0;
+        for (const Stripe &s : stripes) {
+            gets += s.gets.load(std::memory_order_relaxed);
+            hits += s.hits.load(std::memory_order_relaxed);
+        }
+        if (gets == 0) return 0;
+        return static_cast<double>(hits) / static_cast<double>(gets);
+    }
+
+    /**
+     * Delete all data from the store in O(1): the old table is swapped out
+     * whole, along with the evictor's state, and the freer thread frees
+     * it once readers are done with it.
+     * @return true iff successful.
+     */
+    bool reset() {
+        Table *fresh = nullptr;
+        try {
+            fresh = make_table(3);
+            std::lock_guard<std::mutex> guard(freer_lock);
+            to_free.reserve(to_free.size() + 2);
+            if (!freer.joinable())
+                freer = std::thread([this]() { free_in_background(); });
+        } catch (const std::exception &e) {
+            if (fresh != nullptr) free_table(fresh);
+            std::cerr << "BasicCache::reset(): " << e.what() << std::endl;
+            return false;
+        }
+        Table *old = table.load(std::memory_order_relaxed);
+        Table *older = old_table.load(std::memory_order_relaxed);
+        old_table.store(nullptr, std::memory_order_release);
+        table.store(fresh, std::memory_order_release);
+        migrated = 0;
+        {
+            std::lock_guard<std::mutex> guard(freer_lock);
+            to_free.push_back(old);
+            if (older != nullptr) to_free.push_back(older);
+        }
+        freer_cv.notify_one();
+        evictor_.clear();
+        count = 0;
+        used = 0;
+        packed_count = 0;
+        packed_raw = 0;
+        packed_size = 0;
+        std::unordered_multimap<size_t, Value *>().swap(shared_values);
+        shared_keys = 0;
+        shared_size = 0;
+        for (Stripe &s : stripes) {
+            s.gets.store(0, std::memory_order_relaxed);
+            s.hits.store(0, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    /**
+     * Call visit(const key_type &, val_type) on every pair in the store,
+     * with packed values unpacked into a copy. Writers only.
+     */
+    template <typename Visit>
+    void for_each(Visit &&visit) const {
+        const Table *tables[] = {old_table.load(std::memory_order_relaxed),
+                                 table.load(std::memory_order_relaxed)};
+        for (const Table *t : tables) {
+            if (t == nullptr) continue;
+            for (size_t i = 0; i < t->size(); i++) {
+                for (const Node *node =
+                             t->buckets[i].load(std::memory_order_relaxed);
+                     node != nullptr;
+                     node = node->next.load(std::memory_order_relaxed)) {
+                    Value *value = node->val.load(std::memory_order_relaxed);
+                    if (!value->packed) {
+                        visit(node->key, val_type{value->data(), value->size});
+                        continue;
+                    }
+                    const val_type copy = copy_value(*value);
+                    visit(node->key, copy);
+                    delete[] copy.data_;
+                }
+            }
+        }
+    }
+};
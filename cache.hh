@@ -5,10 +5,17 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "disk_tier.hh"
 #include "evictor.hh"
+#include "hot_keys.hh"
 
 class Cache {
  private:
@@ -19,7 +26,7 @@ class Cache {
 
  public:
   using byte_type = char;
-  using size_type = uint32_t;         // Internal indexing to K-V elements
+  using size_type = uint64_t;         // Sizes of values and of the cache
   struct val_type  {   // Values for K-V pairs
     const byte_type* data_;
     size_type size_;
@@ -40,12 +47,21 @@ class Cache {
   // evictor: Eviction policy implementation (if nullptr, no evictions occur
   // and new insertions fail after maxmem has been exceeded).
   // hasher: Hash function to use on the keys. Defaults to C++'s std::hash.
+  // The key is hashed once per call; std::hash<key_type> and Seeded_Hash
+  // (seeded_hash.hh) are recognized and run on the key's view directly, any
+  // other hasher gets a key_type copy. For a cache without type erasure,
+  // see BasicCache in basic_cache.hh.
+  // expected_keys: How many keys to size the table for up front (0 to
+  // start small). The table still grows past it, a few buckets per write.
   Cache(size_type maxmem,
         float max_load_factor = 0.75,
         Evictor* evictor = nullptr,
-        hash_func hasher = std::hash<key_type>());
+        hash_func hasher = std::hash<key_type>(),
+        size_t expected_keys = 0);
 
-  // Create a new Cache networked client with a given host and port.
+  // Create a new Cache networked client with a given host and port. For a
+  // server on this host, host may instead be "unix" or "shm", with port the
+  // path of its Unix socket, to skip TCP or go through shared memory.
   Cache(std::string host, std::string port);
 
   ~Cache();
@@ -61,17 +77,17 @@ class Cache {
   // from the cache to accomodate the new value. If unable, the new value
   // isn't inserted to the cache.
   // Returns true iff the insertion of the data to the store was successful.
-  bool set(key_type key, val_type val);
+  bool set(key_view_type key, val_type val);
 
   // Retrieve a copy of the value associated with key in the cache,
   // or nullptr (in data_) with size_ = 0 if not found.
   // Note that the data_ pointer in the return key is a newly-allocated
   // copy of the data. It is the caller's responsibility to free it.
-  val_type get(key_type key) const;
+  val_type get(key_view_type key) const;
 
   // Delete an object from the cache, if it's still there.
   // Returns true iff the object was deleted from the store.
-  bool del(key_type key);
+  bool del(key_view_type key);
 
   // Compute the total amount of memory used up by all cache values (not keys)
   size_type space_used() const;
@@ -81,5 +97,217 @@ class Cache {
 
   // Delete all data and metdata from the cache and return true iff successful
   bool reset();
-};
 
+  // Evict in a background thread: whenever more than high * maxmem bytes
+  // are used, evict down to low * maxmem, a few keys at a time. set() only
+  // evicts inline if it can't wait for that. Needs 0 < low <= high <= 1.
+  // Only the cache object (library) implements this.
+  // Returns false if the watermarks are out of range.
+  bool set_watermarks(double low, double high);
+
+  // Change maxmem while the cache is in use. Growing takes effect at once.
+  // After shrinking, sets only have to keep from adding to what's used,
+  // while a background thread evicts the excess a few keys at a time and
+  // hands the memory back to the OS as it goes (a cache without an evictor
+  // just refuses sets until enough is deleted). The watermarks stay the
+  // same fractions of maxmem.
+  // Only the cache object (library) implements this.
+  // Returns false if maxmem is 0.
+  bool set_maxmem(size_type maxmem);
+
+  // Call visit on every <namespace, key, value> in the cache; ns is "" for
+  // keys outside any namespace. The cache can't be changed while this runs,
+  // so visit should only copy what it needs.
+  // Only the cache object (library) implements this.
+  void for_each(const std::function<void(std::string_view ns, key_view_type key,
+                                         val_type)>& visit) const;
+
+  // Walk the cache like for_each(), but a step of up to buckets buckets at
+  // a time, holding up changes only during a step, so a big cache can be
+  // walked while it's in use. Start from Cursor{}; each step moves it on.
+  // Every entry that's there for the whole walk is visited once, even if
+  // the table grows meanwhile; entries changed meanwhile may be visited or
+  // not.
+  // Returns true once the whole cache has been visited.
+  // Only the cache object (library) implements this.
+  struct Cursor {
+    size_t bucket = 0;
+    size_t table_size = 0;
+  };
+  bool for_each_step(Cursor& cursor, size_t buckets,
+                     const std::function<void(std::string_view ns,
+                                              key_view_type key,
+                                              val_type)>& visit) const;
+
+  // Namespaces: the same key in different namespaces names different
+  // values, and flush() drops a whole namespace in O(1). These work like
+  // the calls above, which use the default namespace "".
+  // cost is what it would take to get the value again, relative to other
+  // values (1 if not known); an evictor may weigh it (see evictor.hh).
+  bool set(std::string_view ns, key_view_type key, val_type val,
+           double cost = 1);
+  val_type get(std::string_view ns, key_view_type key) const;
+  bool del(std::string_view ns, key_view_type key);
+
+  // Delete every key in namespace ns (not ""). The memory is given back
+  // lazily, by eviction or a background sweep.
+  // Returns true iff successful.
+  bool flush(std::string_view ns);
+
+  // Store a value that arrives a piece at a time without copying it again:
+  // make_buffer() gives room for size bytes, which can be filled in without
+  // holding anything up, and set_buffer() stores them under key like
+  // set(ns, key, val). set_buffer() takes the buffer over, stored or not;
+  // a buffer that won't be stored goes back through drop_buffer().
+  // make_buffer() returns nullptr if the value could never fit.
+  // Only the cache object (library) implements these.
+  byte_type* make_buffer(size_type size);
+  bool set_buffer(std::string_view ns, key_view_type key, byte_type* buffer,
+                  double cost = 1);
+  void drop_buffer(byte_type* buffer);
+
+  // Pre-rendered responses: from now on, store render(key, val) along with
+  // every value of up to limit bytes that is set (0 turns this off), and
+  // get_rendered() hands both to visit in place, with no copy. visit gets
+  // "" for what was rendered if nothing was. Both are only good during the
+  // call, which holds up freeing memory, so visit should be quick. With
+  // packed, a compressed value (see set_compression()) is handed to visit
+  // as it's stored, and *packed tells which it is.
+  // Returns true iff key was found.
+  // Only the cache object (library) implements these.
+  void set_renderer(size_type limit,
+                    std::function<std::string(key_view_type, val_type)> render);
+  bool get_rendered(std::string_view ns, key_view_type key,
+                    const std::function<void(std::string_view rendered,
+                                             val_type)>& visit,
+                    bool* packed = nullptr) const;
+
+  // Compression: from now on, store values of at least limit bytes that are
+  // set compressed, if that makes them smaller (0 turns this off); values
+  // that get a rendered response aren't. space_used() counts them
+  // compressed. Everything else still hands back values as they were set,
+  // but get_stored() copies what's stored as it is, setting packed if
+  // that's an Lz4 frame (see lz4.hh) rather than the value.
+  // set_compression() isn't thread safe; call it before sharing the cache.
+  // Only the cache object (library) implements these.
+  void set_compression(size_type limit);
+  val_type get_stored(std::string_view ns, key_view_type key,
+                      bool& packed) const;
+
+  // A value got with get_pinned(), held on to until this goes out of scope
+  class Pinned {
+   public:
+    Pinned() = default;
+    Pinned(Pinned&& other) noexcept { *this = std::move(other); }
+    Pinned& operator=(Pinned&& other) noexcept {
+      std::swap(cache_, other.cache_);
+      std::swap(pin_, other.pin_);
+      std::swap(val_, other.val_);
+      std::swap(rendered_, other.rendered_);
+      std::swap(packed_, other.packed_);
+      return *this;
+    }
+    ~Pinned() { release(); }
+
+    val_type value() const { return val_; }  // nullptr if not found
+    std::string_view rendered() const { return rendered_; }  // "" if none
+    bool packed() const { return packed_; }
+
+   private:
+    friend class Cache;
+    const Cache* cache_ = nullptr;  // Set if pin_ is, and val_ isn't ours
+    const void* pin_ = nullptr;
+    val_type val_{nullptr, 0};
+    std::string_view rendered_;
+    bool packed_ = false;
+    void release();
+  };
+
+  // Pinning: get_pinned() looks a key up like get(ns, key), but hands back
+  // the value as it's stored rather than a copy, and it stays good while
+  // the Pinned lives, however long that is, even if the key is set,
+  // deleted or evicted meanwhile; it's only freed once the Pinned lets go.
+  // Its memory counts as given back from then on, so a Pinned shouldn't be
+  // kept longer than it takes to send the value. What set_renderer()
+  // rendered for it is pinned along with it. With take_packed, a compressed
+  // value is handed back as it's stored, like get_stored(); without it, or
+  // for a value found on the disk tier, the Pinned holds a copy instead,
+  // with nothing rendered.
+  // Only the cache object (library) implements this.
+  Pinned get_pinned(std::string_view ns, key_view_type key,
+                    bool take_packed = false) const;
+
+  struct Compression_Stats {
+    size_t values;        // Compressed values stored
+    size_type raw_bytes;  // Their sizes before compressing
+    size_type bytes;      // and after
+  };
+  Compression_Stats compression_stats() const;
+
+  // Deduplication: from now on, a value of at least limit bytes as stored
+  // (compressed, if it is) that's the same as one already stored under
+  // another key is shared with that key instead of being stored again (0
+  // turns this off); values that get a rendered response aren't shared.
+  // space_used() counts a shared value once, until its last key goes; a
+  // namespace's space_used still counts it for each of its keys.
+  // set_dedup() isn't thread safe; call it before sharing the cache.
+  // Only the cache object (library) implements these.
+  void set_dedup(size_type limit);
+
+  struct Dedup_Stats {
+    size_t keys;            // Keys sharing a value stored under another
+    size_type saved_bytes;  // What their own copies would have taken
+  };
+  Dedup_Stats dedup_stats() const;
+
+  // Disk tier: from now on, values evicted from memory are kept in a log in
+  // the file at path, of up to capacity bytes, reused oldest first (see
+  // disk_tier.hh). A get that misses in memory looks there, and moves what
+  // it finds back into memory. Returns false if the file can't be opened.
+  // set_disk_tier() isn't thread safe; call it before sharing the cache.
+  // Only the cache object (library) implements these.
+  bool set_disk_tier(const std::string& path, size_type capacity);
+  Disk_Tier::Stats disk_stats() const;
+
+  // Over the network, the namespace travels in this header
+  static constexpr const char* namespace_header = "X-Namespace";
+
+  // and a set's cost in this one
+  static constexpr const char* cost_header = "X-Cost";
+
+  // A client that accepts this encoding is sent a compressed value's Lz4
+  // frame as the body of a GET, instead of the value in JSON
+  static constexpr const char* packed_encoding = "x-lz4-value";
+
+  struct Namespace_Stats {
+    std::string name;
+    size_type space_used;  // Flushed values count until they're reclaimed
+    double hit_rate;       // Since the last flush or reset
+  };
+
+  // Report on every namespace but the default one.
+  // Only the cache object (library) implements this.
+  std::vector<Namespace_Stats> namespace_stats() const;
+
+  // Return the k hottest keys, by requests or by bytes moved, estimated
+  // from a sample of gets and sets (see hot_keys.hh). Memory for this is
+  // fixed however many keys there are.
+  // Only the cache object (library) implements this.
+  std::vector<Hot_Keys::Entry> hot_keys(size_t k, bool by_bytes = false) const;
+
+  // Keep up to maxmem bytes of recently got values in this process and
+  // serve repeated gets from there. The server tells us when those keys
+  // change, and leases them out for a short time in case we miss that.
+  // Only the networked client implements this.
+  // Returns true iff the near cache was turned on.
+  bool set_near_cache(size_type maxmem);
+
+  // Send gets to the server's UDP port in a datagram each, with tries sent
+  // timeout apart before falling back to TCP, as it does for values too big
+  // for a datagram and for every write (see udp_get.hh).
+  // Only the networked client implements this.
+  // Returns true iff gets go over UDP from now on.
+  bool set_udp(unsigned short port,
+               std::chrono::milliseconds timeout = std::chrono::milliseconds(20),
+               unsigned tries = 3);
+};
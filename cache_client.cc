@@ -4,14 +4,33 @@
  * October 2020
  * Implement the API defined in cache.hh as an HTTP client.
  */
+#include <poll.h>        // For poll()
+#include <sys/mman.h>    // For shm_unlink()
+#include <sys/socket.h>  // For send() and recv()
+#include <unistd.h>      // For getpid()
+
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 #include "cache.hh"
+#include "invalidator.hh"
+#include "lz4.hh"
+#include "shm_channel.hh"
+#include "udp_get.hh"
 
 //#define DEBUG
 
@@ -19,6 +38,168 @@ namespace beast = boost::beast;  // from <boost/beast.hpp>
 namespace http = beast::http;    // from <boost/beast/http.hpp>
 namespace net = boost::asio;     // from <boost/asio.hpp>
 using tcp = net::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
+using local = net::local::stream_protocol;
+using udp = net::ip::udp;
+
+/**
+ * The near cache: values this client got recently, kept in the process so
+ * repeated gets don't go over the network. See Cache::set_near_cache().
+ * Entries are only kept while the server's lease on them lasts, and are
+ * dropped early when the server says they changed.
+ */
+struct Near_Cache {
+    using clock = std::chrono::steady_clock;
+
+    struct Entry {
+        std::string val;  // Including the terminator
+        clock::time_point expires;
+        std::list<key_type>::iterator age;  // Our place in lru
+    };
+
+    const Cache::size_type maxmem;
+
+    std::mutex lock;  // Guards everything up to id
+    std::unordered_map<key_type, Entry> entries;
+    std::list<key_type> lru;  // Most recently used first
+    Cache::size_type used = 0;
+    uint64_t generation = 0;  // Bumped whenever anything is invalidated
+
+    std::atomic<uint64_t> id{0};  // Our subscription; 0 if we have none
+    std::atomic<bool> stopping{false};
+    std::thread poller;
+
+    explicit Near_Cache(Cache::size_type max_mem) : maxmem(max_mem) {}
+
+    // Needs lock
+    void erase(std::unordered_map<key_type, Entry>::iterator it) {
+        used -= static_cast<Cache::size_type>(it->second.val.size());
+        lru.erase(it->second.age);
+        entries.erase(it);
+    }
+
+    /**
+     * @return a new[] copy of key's value, or nullptr if we don't have it
+     */
+    Cache::val_type find(key_view_type key) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = entries.find(key_type(key));
+        if (found == entries.end()) return {nullptr, 0};
+        if (found->second.expires <= clock::now()) {
+            erase(found);
+            return {nullptr, 0};
+        }
+        lru.splice(lru.begin(), lru, found->second.age);
+        const std::string &val = found->second.val;
+        auto *buf = new Cache::byte_type[val.size()];
+        memcpy(buf, val.data(), val.size());
+        return {buf, static_cast<Cache::size_type>(val.size())};
+    }
+
+    /**
+     * Keep a value we just got, unless something was invalidated since we
+     * asked for it (then it may already be stale).
+     * @param seen generation when the get was sent
+     */
+    void insert(key_view_type key, Cache::val_type val, uint64_t seen,
+                std::chrono::milliseconds lease) {
+        if (val.size_ > maxmem) return;
+        std::lock_guard<std::mutex> guard(lock);
+        if (generation != seen) return;
+        auto found = entries.find(key_type(key));
+        if (found != entries.end()) erase(found);
+        while (used + val.size_ > maxmem) erase(entries.find(lru.back()));
+        lru.emplace_front(key);
+        entries[lru.front()] = {std::string(val.data_, val.size_),
+                                clock::now() + lease, lru.begin()};
+        used += val.size_;
+    }
+
+    void drop(key_view_type key) {
+        std::lock_guard<std::mutex> guard(lock);
+        generation++;
+        auto found = entries.find(key_type(key));
+        if (found != entries.end()) erase(found);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        generation++;
+        entries.clear();
+        lru.clear();
+        used = 0;
+    }
+};
+
+/**
+ * The UDP fast path for small gets: a socket connected to the server's UDP
+ * port. See Cache::set_udp().
+ */
+struct Udp_Path {
+    using clock = std::chrono::steady_clock;
+
+    udp::socket sock;
+    const std::chrono::milliseconds timeout;  // For each try
+    const unsigned tries;
+    uint32_t next_id = 1;
+
+    Udp_Path(net::io_context &ioc, std::chrono::milliseconds wait,
+             unsigned times)
+        : sock(ioc), timeout(wait), tries(times) {}
+
+    /**
+     * Ask for a value in a datagram, and wait for the answer, trying again
+     * if it doesn't come in time. An answer to an earlier try of this or
+     * another get is told apart by its ID, and ignored.
+     * @param out set to a new[] copy of the value with its terminator, or
+     *            nullptr with size 0 if there isn't one
+     * @return false if there was no answer, or the value is too big for a
+     *         datagram, so it's for TCP
+     */
+    bool get(std::string_view ns, key_view_type key, Cache::val_type &out) {
+        char request[Udp_Get::max_datagram];
+        const uint32_t id = next_id++;
+        const size_t size = Udp_Get::put_request(request, id, ns, key);
+        if (size == 0) return false;
+
+        char answer[Udp_Get::max_datagram];
+        const int fd = sock.native_handle();
+        for (unsigned attempt = 0; attempt < tries; attempt++) {
+            if (send(fd, request, size, 0) < 0) return false;
+            const clock::time_point deadline = clock::now() + timeout;
+            for (;;) {
+                const auto left =
+                        std::chrono::ceil<std::chrono::milliseconds>(
+                                deadline - clock::now())
+                                .count();
+                pollfd p{fd, POLLIN, 0};
+                if (left <= 0 || poll(&p, 1, static_cast<int>(left)) <= 0)
+                    break;
+                // Nothing listening shows up here as ECONNREFUSED
+                const ssize_t got = recv(fd, answer, sizeof(answer), 0);
+                if (got < 0) return false;
+
+                uint32_t answer_id = 0;
+                Udp_Get::Kind kind{};
+                std::string_view value;
+                if (!Udp_Get::get_answer(answer, static_cast<size_t>(got),
+                                         answer_id, kind, value) ||
+                    answer_id != id)
+                    continue;
+                if (kind == Udp_Get::Kind::miss) {
+                    out = {nullptr, 0};
+                    return true;
+                }
+                if (kind != Udp_Get::Kind::hit) return false;
+                auto *copy = new Cache::byte_type[value.size() + 1];
+                memcpy(copy, value.data(), value.size());
+                copy[value.size()] = '\0';
+                out = {copy, static_cast<Cache::size_type>(value.size() + 1)};
+                return true;
+            }
+        }
+        return false;
+    }
+};
 
 /**
  * Implement the private parts of Cache using the pimpl idiom.
@@ -34,22 +215,29 @@ public:
     /// Required for all I/O
     net::io_context ioc;
 
+    // How requests go to the server; see Cache(host, port)
+    enum class Transport { tcp, local, shm } transport = Transport::tcp;
+
     // These objects send our I/O
     tcp::resolver resolver{ioc};
     beast::tcp_stream stream{ioc};
+    local::socket local_sock{ioc};  // Unless transport is tcp
+    std::unique_ptr<Shm_Channel> channel;  // Once set up, if transport is shm
 
     /// The domain name
     tcp::resolver::results_type results;
 
     /**
      * Loop up and connect to host.
-     * @param ip_addr host
-     * @param port_no port
+     * @param ip_addr host, or "unix" or "shm"
+     * @param port_no port, or with those, the path to the server's socket
      */
     Impl(std::string ip_addr, std::string port_no) {
         // Use arguments
         host = std::move(ip_addr);
         port = std::move(port_no);
+        if (host == "unix") transport = Transport::local;
+        if (host == "shm") transport = Transport::shm;
 
 #ifdef DEBUG
         std::cerr << "==> CONNECT TCP STREAM HOST AT PORT <==\n"
@@ -59,20 +247,86 @@ public:
 #endif  // DEBUG
 
         // Look up the domain name
-        results = resolver.resolve(host, port);
+        if (transport == Transport::tcp) results = resolver.resolve(host, port);
 
         /// A boost error code
         beast::error_code ec;
     }
 
+    bool is_open() const {
+        switch (transport) {
+            case Transport::tcp:
+                return stream.socket().is_open();
+            case Transport::local:
+                return local_sock.is_open();
+            default:
+                return channel && channel->is_open();
+        }
+    }
+
+    /**
+     * Connect to the server. For shared memory, that's making a channel
+     * and naming it to the server over its Unix socket, which then stays
+     * open so each side can tell the other is still there.
+     * @return false, with ec set, if we couldn't
+     */
+    bool connect(beast::error_code &ec) {
+        if (transport == Transport::tcp) {
+            // Make the connection on the IP address we got from a lookup
+            stream.connect(results, ec);
+            return !ec;
+        }
+        local_sock.connect(local::endpoint(port), ec);
+        if (ec || transport == Transport::local) return !ec;
+
+        static std::atomic<unsigned> channels{0};
+        const std::string name = "cache-" + std::to_string(getpid()) + "-" +
+                                 std::to_string(channels++);
+        try {
+            channel = Shm_Channel::create("/" + name);
+        } catch (const std::exception &e) {
+            std::cerr << "Impl::connect(): " << e.what() << std::endl;
+            ec = net::error::connection_refused;
+            disconnect();
+            return false;
+        }
+        http::request<http::empty_body> req{http::verb::post, "/shm/" + name,
+                                            version};
+        req.set(http::field::host, host);
+        http::write(local_sock, req, ec);
+        beast::flat_buffer buffer;
+        http::response<http::empty_body> res;
+        if (!ec) http::read(local_sock, buffer, res, ec);
+        // Both sides have it mapped by now, or never will
+        shm_unlink(("/" + name).c_str());
+        if (!ec && res.result() != http::status::ok)
+            ec = net::error::connection_refused;
+        if (ec) {
+            disconnect();
+            return false;
+        }
+        channel->watch(local_sock.native_handle());
+        return true;
+    }
+
+    void disconnect() {
+        beast::error_code ec;
+        channel.reset();
+        stream.socket().close(ec);
+        local_sock.close(ec);
+    }
+
     /**
      * Set up and send an HTTP request message; receive and return HTTP
      * response.
      * @param method HTTP request method
+     * @param body   sent as is, without being copied
      * @return msg to follow verb
      */
     http::response<http::dynamic_body> send(const http::verb &method,
-                                            const std::string &target) {
+                                            const std::string &target,
+                                            const http::fields &extra = {},
+                                            std::string_view body = {}) {
         /// A boost error code
         beast::error_code ec;
 
@@ -83,32 +337,59 @@ public:
         http::response<http::dynamic_body> res;
 
         /// Set up an HTTP request
-        http::request<http::string_body> req{method, target, version};
+        http::request<http::span_body<const char>> req{method, target,
+                                                       version};
         req.set(http::field::host, host);
         req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+        for (const auto &field : extra)
+            req.set(field.name_string(), field.value());
+        if (!body.empty()) {
+            req.body() = {body.data(), body.size()};
+            req.prepare_payload();
+        }
 
 #ifdef DEBUG
         std::cerr << "==> SEND HTTP REQUEST <==\n"
                   << req << "\n==[ END HTTP REQUEST ]==" << std::endl;
 #endif  // DEBUG
 
-        try {
-            // Make the connection on the IP address we get from a lookup
-            stream.connect(results, ec);
-            if (ec) std::cerr << "Impl::send(): stream.connect: " << ec.message() << std::endl;
+        // Send the HTTP request, and receive the HTTP response, over any of
+        // our streams
+        auto round_trip = [&](auto &to) {
+            http::write(to, req, ec);
+            if (!ec) http::read(to, buffer, res, ec);
+        };
 
-            // TODO: This throws a broken pipe exception and fails the test
-            // Send the HTTP request to the remote host
-            http::write(stream, req, ec);
-            if (ec) std::cerr << "Impl::send(): http::write: " << ec.message() << std::endl;
-
-            // Receive the HTTP response
-            // Send the HTTP request to the remote host
-            http::read(stream, buffer, res, ec);
-            if (ec) std::cerr << "Impl::send(): http::read: " << ec.message() << std::endl;
-        } catch (const std::exception &e) {
-            std::cerr << "impl::send(): " << e.what() << std::endl;
+        // The connection is kept alive between requests. If the server has
+        // dropped it since the last one, reconnect and try once more.
+        for (int attempt = 0; attempt < 2; attempt++) {
+            try {
+                if (!is_open() && !connect(ec)) {
+                    std::cerr << "Impl::send(): connect: " << ec.message()
+                              << std::endl;
+                    break;
+                }
+                if (channel)
+                    round_trip(*channel);
+                else if (transport == Transport::local)
+                    round_trip(local_sock);
+                else
+                    round_trip(stream);
+            } catch (const std::exception &e) {
+                std::cerr << "impl::send(): " << e.what() << std::endl;
+            }
+            if (!ec) {
+                if (!res.keep_alive()) disconnect();
+                break;
+            }
+            if (attempt > 0)
+                std::cerr << "Impl::send(): " << ec.message() << std::endl;
+            disconnect();
+            buffer.clear();
+            res = {};
         }
+        // Don't let a response that never came look like 200 OK
+        if (ec) res.result(http::status::unknown);
 
 #ifdef DEBUG
         std::cerr << "==> RECEIVED HTTP RESPONSE <==\n"
@@ -117,6 +398,69 @@ public:
 
         return res;
     }
+
+    // Only there if set_near_cache() turned it on
+    std::unique_ptr<Near_Cache> near;
+
+    // Only there if set_udp() turned it on
+    std::unique_ptr<Udp_Path> udp_path;
+
+    /**
+     * Body of the near cache's poller thread. It subscribes to the server
+     * and then keeps a long poll open on its own connection, applying the
+     * invalidations that come back. Whenever it can't be sure it has heard
+     * about every change, it drops everything.
+     */
+    void poll_invalidations() {
+        Impl conn(host, port);
+        while (!near->stopping) {
+            const uint64_t id = near->id;
+            if (id == 0) {
+                auto res = conn.send(http::verb::post, "/subscribe");
+                const std::string body =
+                        beast::buffers_to_string(res.body().data());
+                uint64_t new_id = 0;
+                std::from_chars(body.data(), body.data() + body.size(), new_id);
+                if (res.result() != http::status::ok || new_id == 0) {
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                    continue;
+                }
+                near->clear();
+                near->id = new_id;
+                continue;
+            }
+
+            auto res = conn.send(http::verb::post,
+                                 "/invalidations/" + std::to_string(id));
+            if (res.result() != http::status::ok) {
+                // The server lost track of us or went away
+                near->id = 0;
+                near->clear();
+                continue;
+            }
+            if (res.find(Invalidator::all_header) != res.end()) {
+                near->clear();
+                continue;
+            }
+            const std::string body = beast::buffers_to_string(res.body().data());
+            for (size_t begin = 0; begin < body.size();) {
+                size_t end = body.find('\n', begin);
+                if (end == std::string::npos) end = body.size();
+                near->drop(std::string_view(body).substr(begin, end - begin));
+                begin = end + 1;
+            }
+        }
+    }
+
+    /**
+     * Stop the poller, which notices within one long poll.
+     */
+    ~Impl() {
+        if (near && near->poller.joinable()) {
+            near->stopping = true;
+            near->poller.join();
+        }
+    }
 };
 
 /**
@@ -125,27 +469,37 @@ public:
  * @param max_load_factor   Maximum allowed ratio between buckets and table rows
  * @param evictor           Eviction policy implementation
  * @param hasher            Hash function to use on the keys
+ * @param expected_keys     How many keys to size the table for
  */
 Cache::Cache([[maybe_unused]] size_type maxmem,
              [[maybe_unused]] float max_load_factor,
              [[maybe_unused]] Evictor *evictor,
-             [[maybe_unused]] hash_func hasher) {
+             [[maybe_unused]] hash_func hasher,
+             [[maybe_unused]] size_t expected_keys) {
     assert(false);
 }
 
 /**
  * Create a new Cache networked client with a given host and port.
  * Establish a connection with the server or exit the program if it fails.
- * @param host server IP address
- * @param port server port number
+ * A host of "unix" or "shm" means a server on this host, with port the path
+ * of its Unix socket (see cache_server -U): "unix" talks over that socket,
+ * and "shm" over shared memory set up through it.
+ * @param host server IP address, or "unix" or "shm"
+ * @param port server port number, or the path of the server's socket
  */
 Cache::Cache(std::string host, std::string port)
         : pImpl_(new Impl(std::move(host), std::move(port))) {}
 
 /**
- * Gracefully shutdown the tcp stream socket.
+ * Gracefully shutdown the tcp stream socket, or close whichever other
+ * transport we have.
  */
 Cache::~Cache() {
+    if (pImpl_->transport != Impl::Transport::tcp) {
+        pImpl_->disconnect();
+        return;
+    }
     beast::error_code ec;
     this->pImpl_->stream.socket().shutdown(tcp::socket::shutdown_both, ec);
 
@@ -164,15 +518,76 @@ static void check_status(http::status status, char const *what) {
         std::cerr << what << ": " << status << std::endl;
 }
 
+/**
+ * Pull the value out of the response to a GET: a compressed value comes as
+ * its Lz4 frame, anything else as JSON.
+ * @return a new[] copy of the value with its terminator, or nullptr with
+ *         size 0 if there wasn't one
+ */
+static Cache::val_type parse_val(
+        const http::response<http::dynamic_body> &response) {
+    if (response.result() != http::status::ok) return {nullptr, 0};
+
+    auto encoding = response.find(http::field::content_encoding);
+    if (encoding != response.end() &&
+        encoding->value() == Cache::packed_encoding) {
+        const std::string frame =
+                beast::buffers_to_string(response.body().data());
+        const uint64_t raw = Lz4::raw_size(frame.data(), frame.size());
+        if (raw == 0) return {nullptr, 0};
+        auto *buf = new Cache::byte_type[raw];
+        if (!Lz4::decompress(frame.data(), frame.size(), buf)) {
+            std::cerr << "parse_val(): corrupt value" << std::endl;
+            delete[] buf;
+            return {nullptr, 0};
+        }
+        return {buf, static_cast<Cache::size_type>(raw)};
+    }
+
+    // The body looks like {key: "<key>", val: "<val>"}
+    const std::string body = beast::buffers_to_string(response.body().data());
+    const std::string field = "val: \"";
+    const size_t begin = body.find(field);
+    const size_t end = body.find_last_of('"');
+    if (begin == std::string::npos || end < begin + field.size())
+        return {nullptr, 0};
+    const std::string val = body.substr(begin + field.size(),
+                                        end - begin - field.size());
+
+    // deep copy buff from val for return; the server stores the terminator
+    auto *buf = new Cache::byte_type[val.size() + 1];
+    memcpy(buf, val.c_str(), val.size() + 1);
+    return {buf, static_cast<Cache::size_type>(val.size() + 1)};
+}
+
+/**
+ * Values are sent as the body of PUT /key, without their terminator, which
+ * the server adds back. An empty body can't be told from none, so an empty
+ * value is sent the old way, as PUT /key/.
+ * @param body set to the body to send
+ * @return the target to send it to
+ */
+static std::string put_target(key_view_type key, Cache::val_type val,
+                              std::string_view &body) {
+    body = std::string_view(val.data_, strnlen(val.data_, val.size_));
+    std::string target = "/";
+    target.append(key);
+    if (body.empty()) target.append("/");
+    return target;
+}
+
 /**
  * Add or replace <key, value> pair to the cache.
  * @param key string
  * @param val struct
  * @return true iff the insertion of the data to the store was successful.
  */
-bool Cache::set(key_type key, val_type val) {
-    return this->pImpl_->send(http::verb::put, '/' + key + '/' + val.data_)
-                   .result() == http::status::ok;
+bool Cache::set(key_view_type key, val_type val) {
+    if (this->pImpl_->near) this->pImpl_->near->drop(key);
+    std::string_view body;
+    const std::string target = put_target(key, val, body);
+    return this->pImpl_->send(http::verb::put, target, {}, body).result() ==
+           http::status::ok;
 }
 
 /**
@@ -182,20 +597,42 @@ bool Cache::set(key_type key, val_type val) {
  *         Note that the data_ pointer in the return key is a newly-allocated
  *         copy of the data. It is the caller's responsibility to free it.
  */
-Cache::val_type Cache::get(key_type key) const {
-    // TODO: FIX THIS!!!
-    http::response<http::dynamic_body> response =
-            this->pImpl_->send(http::verb::get, '/' + key);
-    beast::string_view val = response.find("val")->value();
+Cache::val_type Cache::get(key_view_type key) const {
+    Near_Cache *near = this->pImpl_->near.get();
+    // What the near cache keeps needs a lease, which only comes over TCP
+    Udp_Path *udp_path = this->pImpl_->udp_path.get();
+    val_type found{nullptr, 0};
+    if (near == nullptr && udp_path != nullptr &&
+        udp_path->get({}, key, found))
+        return found;
 
-    if (response.result() == http::status::not_found)
-        return {nullptr, 0};
+    http::fields extra;
+    extra.set(http::field::accept_encoding, packed_encoding);
+    uint64_t seen = 0;
+    if (near != nullptr) {
+        val_type val = near->find(key);
+        if (val.data_ != nullptr) return val;
+        // Ask for a lease so we can keep what we get
+        const uint64_t id = near->id;
+        if (id != 0) extra.set(Invalidator::client_header, std::to_string(id));
+        std::lock_guard<std::mutex> guard(near->lock);
+        seen = near->generation;
+    }
+
+    http::response<http::dynamic_body> response =
+            this->pImpl_->send(http::verb::get, "/" + key_type(key), extra);
 
-    // deep copy buff from val for return
-    auto *buf = new byte_type[val.size()];
-    memcpy(buf, val.data(), val.size());
+    const val_type result = parse_val(response);
 
-    return {buf, static_cast<size_type>(val.size())};
+    auto lease = response.find(Invalidator::lease_header);
+    if (near != nullptr && result.data_ != nullptr &&
+        lease != response.end()) {
+        const auto ms = lease->value();
+        unsigned long length = 0;
+        std::from_chars(ms.data(), ms.data() + ms.size(), length);
+        near->insert(key, result, seen, std::chrono::milliseconds(length));
+    }
+    return result;
 }
 
 /**
@@ -203,8 +640,10 @@ Cache::val_type Cache::get(key_type key) const {
  * @param key of pair to erase
  * @return true if pair erased else false
  */
-bool Cache::del(key_type key) {
-    return this->pImpl_->send(http::verb::delete_, '/' + key).result() ==
+bool Cache::del(key_view_type key) {
+    if (this->pImpl_->near) this->pImpl_->near->drop(key);
+    return this->pImpl_->send(http::verb::delete_, "/" + key_type(key))
+                   .result() ==
            http::status::ok;
 }
 
@@ -263,6 +702,328 @@ double Cache::hit_rate() const {
  * @return true iff successful.
  */
 bool Cache::reset() {
+    if (this->pImpl_->near) this->pImpl_->near->clear();
     return this->pImpl_->send(http::verb::post, "/reset").result() ==
            http::status::reset_content;
 }
+
+/**
+ * A client can't walk the server's table; don't call this.
+ * @param visit would be called on every <key, value> pair
+ */
+void Cache::for_each([[maybe_unused]] const std::function<
+                     void(std::string_view, key_view_type, val_type)> &visit)
+        const {
+    assert(false);
+}
+
+/**
+ * A client can't walk the server's table; don't call this.
+ * @param cursor  would be where the walk has got to
+ * @param buckets would be the most buckets to visit in this step
+ * @param visit   would be called on every <key, value> pair
+ */
+bool Cache::for_each_step(
+        [[maybe_unused]] Cursor &cursor, [[maybe_unused]] size_t buckets,
+        [[maybe_unused]] const std::function<void(std::string_view,
+                                                  key_view_type, val_type)>
+                &visit) const {
+    assert(false);
+    return true;
+}
+
+/**
+ * Add or replace a <key, value> pair in a namespace.
+ * @param ns   the namespace; "" is the default one
+ * @param cost sent along for the server's evictor, unless it's 1
+ * @return true iff the insertion of the data to the store was successful.
+ */
+bool Cache::set(std::string_view ns, key_view_type key, val_type val,
+                double cost) {
+    if (ns.empty() && cost == 1) return set(key, val);
+    if (ns.empty() && this->pImpl_->near) this->pImpl_->near->drop(key);
+    http::fields extra;
+    if (!ns.empty()) extra.set(namespace_header, std::string(ns));
+    if (cost != 1) extra.set(cost_header, std::to_string(cost));
+    std::string_view body;
+    const std::string target = put_target(key, val, body);
+    return this->pImpl_->send(http::verb::put, target, extra, body).result() ==
+           http::status::ok;
+}
+
+/**
+ * Look a key up in a namespace. The near cache only holds the default one.
+ * @param ns the namespace; "" is the default one
+ * @return val: a new[] copy of the value, or nullptr with size 0
+ */
+Cache::val_type Cache::get(std::string_view ns, key_view_type key) const {
+    if (ns.empty()) return get(key);
+    Udp_Path *udp_path = this->pImpl_->udp_path.get();
+    val_type found{nullptr, 0};
+    if (udp_path != nullptr && udp_path->get(ns, key, found)) return found;
+    http::fields extra;
+    extra.set(namespace_header, std::string(ns));
+    extra.set(http::field::accept_encoding, packed_encoding);
+    return parse_val(
+            this->pImpl_->send(http::verb::get, "/" + key_type(key), extra));
+}
+
+/**
+ * Delete a key from a namespace.
+ * @param ns the namespace; "" is the default one
+ * @return true if pair erased else false
+ */
+bool Cache::del(std::string_view ns, key_view_type key) {
+    if (ns.empty()) return del(key);
+    http::fields extra;
+    extra.set(namespace_header, std::string(ns));
+    return this->pImpl_->send(http::verb::delete_, "/" + key_type(key), extra)
+                   .result() == http::status::ok;
+}
+
+/**
+ * Drop every key in a namespace.
+ * @param ns the namespace; not the default one
+ * @return true iff successful.
+ */
+bool Cache::flush(std::string_view ns) {
+    if (ns.empty()) return false;
+    return this->pImpl_->send(http::verb::post, "/flush/" + std::string(ns))
+                   .result() == http::status::ok;
+}
+
+/**
+ * Namespace stats are served by the server's POST /stats; don't call this.
+ */
+std::vector<Cache::Namespace_Stats> Cache::namespace_stats() const {
+    assert(false);
+    return {};
+}
+
+/**
+ * Values go to the server in the body of a PUT, which it reads straight
+ * into its cache; don't call this.
+ * @param size would be the bytes in the value
+ */
+Cache::byte_type *Cache::make_buffer([[maybe_unused]] size_type size) {
+    assert(false);
+    return nullptr;
+}
+
+/**
+ * Don't call this; see make_buffer().
+ */
+bool Cache::set_buffer([[maybe_unused]] std::string_view ns,
+                       [[maybe_unused]] key_view_type key,
+                       [[maybe_unused]] byte_type *buffer,
+                       [[maybe_unused]] double cost) {
+    assert(false);
+    return false;
+}
+
+/**
+ * Don't call this; see make_buffer().
+ */
+void Cache::drop_buffer([[maybe_unused]] byte_type *buffer) {
+    assert(false);
+}
+
+/**
+ * The server renders its own responses; don't call this.
+ * @param limit  would be the biggest value to render for
+ * @param render would render what's stored with a value
+ */
+void Cache::set_renderer(
+        [[maybe_unused]] size_type limit,
+        [[maybe_unused]] std::function<std::string(key_view_type, val_type)>
+                render) {
+    assert(false);
+}
+
+/**
+ * Don't call this; see set_renderer().
+ */
+bool Cache::get_rendered(
+        [[maybe_unused]] std::string_view ns,
+        [[maybe_unused]] key_view_type key,
+        [[maybe_unused]] const std::function<void(std::string_view, val_type)>
+                &visit,
+        [[maybe_unused]] bool *packed) const {
+    assert(false);
+    return false;
+}
+
+/**
+ * Watermarks are set on the server's command line; don't call this.
+ * @param low  would be the fraction of maxmem to evict down to
+ * @param high would be the fraction of maxmem to start evicting at
+ */
+bool Cache::set_watermarks([[maybe_unused]] double low,
+                           [[maybe_unused]] double high) {
+    assert(false);
+    return false;
+}
+
+/**
+ * Compression is set on the server's command line; don't call this.
+ * @param limit would be the smallest value to compress
+ */
+void Cache::set_compression([[maybe_unused]] size_type limit) {
+    assert(false);
+}
+
+/**
+ * get() already takes compressed values as they're stored; don't call this.
+ * @param ns     would be the namespace
+ * @param key    would be the key to look up
+ * @param packed would be set to whether the copy is compressed
+ */
+Cache::val_type Cache::get_stored([[maybe_unused]] std::string_view ns,
+                                  [[maybe_unused]] key_view_type key,
+                                  [[maybe_unused]] bool &packed) const {
+    assert(false);
+    return {nullptr, 0};
+}
+
+/**
+ * Values got over the network are already copies; don't call this.
+ * @param ns          would be the namespace
+ * @param key         would be the key to look up
+ * @param take_packed would be whether a compressed value may be handed back
+ */
+Cache::Pinned Cache::get_pinned(
+        [[maybe_unused]] std::string_view ns,
+        [[maybe_unused]] key_view_type key,
+        [[maybe_unused]] bool take_packed) const {
+    assert(false);
+    return {};
+}
+
+/**
+ * Nothing is pinned here, so a Pinned only ever holds nothing.
+ */
+void Cache::Pinned::release() {
+    delete[] val_.data_;
+    val_ = {nullptr, 0};
+    rendered_ = {};
+}
+
+/**
+ * Compression ratios are served by the server's POST /stats; don't call
+ * this.
+ */
+Cache::Compression_Stats Cache::compression_stats() const {
+    assert(false);
+    return {0, 0, 0};
+}
+
+/**
+ * Deduplication is set on the server's command line; don't call this.
+ * @param limit would be the smallest value to share
+ */
+void Cache::set_dedup([[maybe_unused]] size_type limit) {
+    assert(false);
+}
+
+/**
+ * What deduplication saves is served by the server's POST /stats; don't
+ * call this.
+ */
+Cache::Dedup_Stats Cache::dedup_stats() const {
+    assert(false);
+    return {0, 0};
+}
+
+/**
+ * The disk tier is set on the server's command line; don't call this.
+ * @param path     would be the file to keep evicted values in
+ * @param capacity would be the most bytes to keep there
+ */
+bool Cache::set_disk_tier([[maybe_unused]] const std::string &path,
+                          [[maybe_unused]] size_type capacity) {
+    assert(false);
+    return false;
+}
+
+/**
+ * The disk tier's stats are served by the server's POST /stats; don't call
+ * this.
+ */
+Disk_Tier::Stats Cache::disk_stats() const {
+    assert(false);
+    return {};
+}
+
+/**
+ * The server's maxmem is changed through its POST /config; don't call this.
+ * @param maxmem would be the new maximum allowance for values
+ */
+bool Cache::set_maxmem([[maybe_unused]] size_type maxmem) {
+    assert(false);
+    return false;
+}
+
+/**
+ * Hot keys are served by the server's POST /stats; don't call this.
+ * @param k        would be the most keys to return
+ * @param by_bytes would rank keys by bytes instead of requests
+ */
+std::vector<Hot_Keys::Entry> Cache::hot_keys([[maybe_unused]] size_t k,
+                                             [[maybe_unused]] bool by_bytes)
+        const {
+    assert(false);
+    return {};
+}
+
+/**
+ * Keep recently got values in this process, so repeated gets of the same
+ * keys don't go over the network. A background connection hears from the
+ * server when kept keys change, and nothing is kept longer than the
+ * server's lease in case such a message is lost. Only one near cache can
+ * be set up per client.
+ * @param maxmem most bytes of values to keep
+ * @return true iff the near cache was turned on
+ */
+bool Cache::set_near_cache(size_type maxmem) {
+    Impl &impl = *this->pImpl_;
+    if (maxmem == 0 || impl.near) return false;
+    impl.near = std::make_unique<Near_Cache>(maxmem);
+    impl.near->poller = std::thread([&impl]() { impl.poll_invalidations(); });
+    return true;
+}
+
+/**
+ * Send gets to the server's UDP port (see cache_server -g) from now on,
+ * each in a datagram, and its answer back in another; that skips TCP and
+ * HTTP for small values. A get that isn't answered within timeout is sent
+ * again, up to tries times in all, and after that, or if the value is too
+ * big for a datagram, it goes over TCP. Writes always go over TCP, and so
+ * do gets while there's a near cache, which needs leases.
+ * @param port    the server's UDP port, on the address we connect to
+ * @param timeout how long to wait for each try
+ * @param tries   how many times to send a get over UDP
+ * @return true iff the UDP path was turned on
+ */
+bool Cache::set_udp(unsigned short port, std::chrono::milliseconds timeout,
+                    unsigned tries) {
+    Impl &impl = *this->pImpl_;
+    if (impl.transport != Impl::Transport::tcp || impl.udp_path ||
+        port == 0 || tries == 0)
+        return false;
+    beast::error_code ec;
+    if (!impl.is_open() && !impl.connect(ec)) {
+        std::cerr << "Cache::set_udp(): " << ec.message() << std::endl;
+        return false;
+    }
+
+    // The address TCP got through to, rather than another the name has
+    const auto at = impl.stream.socket().remote_endpoint(ec).address();
+    auto path = std::make_unique<Udp_Path>(impl.ioc, timeout, tries);
+    if (!ec) path->sock.connect(udp::endpoint(at, port), ec);
+    if (ec) {
+        std::cerr << "Cache::set_udp(): " << ec.message() << std::endl;
+        return false;
+    }
+    impl.udp_path = std::move(path);
+    return true;
+}
@@ -4,29 +4,136 @@
  * October 2020
  */
 
-#include <libgen.h>  // For basename()
-#include <unistd.h>  // For getopt()
+#include <libgen.h>      // For basename()
+#include <pthread.h>     // For pthread_setaffinity_np()
+#include <sched.h>       // For cpu_set_t
+#include <sys/socket.h>  // For recvmmsg(), sendmmsg() and SO_REUSEPORT
+#include <unistd.h>      // For getopt()
 
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <csignal>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "cache.hh"
+#include "adaptive_evictor.hh"
+#include "admission.hh"
 #include "evictor.hh"
 #include "fifo_evictor.hh"
+#include "gdsf_evictor.hh"
+#include "invalidator.hh"
+#include "lfu_evictor.hh"
+#include "lru_evictor.hh"
+#include "replicator.hh"
+#include "seeded_hash.hh"
+#include "shm_channel.hh"
+#include "udp_get.hh"
+#include "uring_server.hh"
 
 namespace beast = boost::beast;  // from <boost/beast.hpp>
 namespace http = beast::http;    // from <boost/beast/http.hpp>
 namespace net = boost::asio;     // from <boost/asio.hpp>
 using tcp = net::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
+using local_socket = net::local::stream_protocol::socket;
+using udp = net::ip::udp;
 
-// A global cache object
-static std::shared_ptr<Cache> cache;
+// The cache, split by key into one shard per acceptor with -S; see shard()
+static std::vector<std::shared_ptr<Cache>> shards;
+
+// Each shard's evictor with -e adaptive, for POST /stats; they belong to
+// their shards
+static std::vector<Adaptive_Evictor *> adaptive_evictors;
+
+// Picks a key's shard; independent of where the key lands in its shard
+static const Seeded_Hash shard_hash{Seeded_Hash()(key_view_type("shard"))};
+
+// Lets acceptors share a port, so the kernel spreads connections over them
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+// Streams our writes to our replicas, if we have any
+static std::unique_ptr<Replicator> replicator;
+
+// Turns connections and requests away when we're overloaded; set up in main
+static std::unique_ptr<Admission> admission;
+
+// Replicas only accept writes from their primary
+static bool replica_mode = false;
+
+// Tells clients with near caches when the keys they hold change
+static Invalidator invalidator;
+
+// Longest a client's poll for invalidations is held open
+static constexpr std::chrono::milliseconds poll_time{500};
+
+// Biggest value body accepted; no bigger value fits in the cache anyway.
+// POST /config can change it along with maxmem.
+static std::atomic<uint64_t> value_limit{65536};
+
+// What goes to std::cerr: errors always, then with each level up the
+// configuration and its changes, then every request and response
+enum Log_Level { log_errors = 0, log_config = 1, log_requests = 2 };
+static std::atomic<int> log_level{log_requests};
+
+// The configuration POST /config changes, as on the command line; guarded
+// by config_lock
+static std::mutex config_lock;
+static uint64_t maxmem = 65536;  // Split evenly between the shards
+static double low_mark = 85;     // Percent of maxmem
+static double high_mark = 95;
+
+// A chunked PUT body has no length up front, so it's read into a piece of
+// this size and copied into the cache once it's all in; a bigger one gets a
+// 413, and has to be sent with a Content-Length
+static constexpr size_t piece_size = 64 * 1024;
+
+// The biggest chunked value taken, like a sized one under value_limit
+static uint64_t chunked_limit() {
+    return std::min<uint64_t>(value_limit.load(), piece_size) - 1;
+}
+
+// A full copy for a replica holds up writes to one shard for this many
+// buckets at a time
+static constexpr size_t copy_buckets = 64;
+
+// GET hits on values up to this many bytes are answered from responses
+// rendered when the values were set; 0 for never
+static Cache::size_type render_limit = 0;
+
+// Values of at least this many bytes are stored compressed where that makes
+// them smaller, and sent that way to clients that accept it; 0 for never
+static Cache::size_type compress_limit = 0;
+
+// Values of at least this many bytes are stored once however many keys
+// they're set under; 0 for never
+static Cache::size_type dedup_limit = 0;
+
+// Evicted values are kept in this file, of up to disk_capacity bytes (10
+// times maxmem if 0), split between the shards; "" for nowhere
+static std::string disk_path;
+static uint64_t disk_capacity = 0;
+
+// What follows the value in the body of a GET response
+static constexpr std::string_view val_tail = "\"}";
+
+// Serve connections through io_uring rather than a thread each, with -u
+static bool use_uring = false;
 
 /**
  * Die gracefully
@@ -47,196 +154,1491 @@ void die(const std::string &croak) {
 
 /**
  * Helper functions to parse the data received through a socket.
- * get_field1() and get_field2() find key and value data respectively
+ * get_field1() and get_field2() find key and value data respectively.
+ * They return views into msg, so looking a key up never copies it.
  */
-static std::string get_field1(const std::string &msg) {
+static std::string_view get_field1(std::string_view msg) {
     const size_t begin = msg.find_first_of('/');
     const size_t end = msg.find_last_of('/');
     if (end == begin)
-        return msg.substr(begin + 1,
-                          msg.length());  // There one or fewer fields
+        return msg.substr(begin + 1);  // There one or fewer fields
     return msg.substr(begin + 1, end - 1);
 }
 
-static std::string get_field2(const std::string &msg) {
+static std::string_view get_field2(std::string_view msg) {
     const size_t begin = msg.find_first_of('/');
     const size_t end = msg.find_last_of('/');
-    if (end == begin) return std::string(" ");  // There are no values
-    return msg.substr(end + 1, msg.length());
+    if (end == begin) return " ";  // There are no values
+    return msg.substr(end + 1);
+}
+
+/**
+ * @return the shard of the cache that owns key. Any thread may use any
+ *         shard; each connection just works on the shard of its key.
+ */
+static Cache &shard(key_view_type key) {
+    if (shards.size() == 1) return *shards.front();
+    return *shards[shard_hash(key) % shards.size()];
+}
+
+/**
+ * Apply a mutation to the cache and pass it on to the replicas, if any.
+ * @param op    what kind of mutation this is
+ * @param ns    the namespace it applies to
+ * @param key   the key it applies to
+ * @param val   the value for a set
+ * @param apply performs the mutation on our cache
+ * @return true iff apply succeeded
+ */
+template <typename Apply>
+static bool replicate(Replicator::Op op, std::string_view ns,
+                      key_view_type key, std::string_view val, Apply apply) {
+    if (!replicator) return apply();
+    return replicator->apply(
+            {op, key_type(key), std::string(val), std::string(ns)}, apply);
+}
+
+/**
+ * @return the namespace a request is for; "" for the default one
+ */
+static std::string_view namespace_of(const http::request<http::string_body> &req) {
+    auto field = req.find(Cache::namespace_header);
+    if (field == req.end()) return "";
+    return std::string_view(field->value().data(), field->value().size());
+}
+
+/**
+ * @return whether the client takes a value as it's stored compressed,
+ *         rather than in JSON
+ */
+static bool accepts_packed(const http::request<http::string_body> &req) {
+    auto field = req.find(http::field::accept_encoding);
+    if (field == req.end()) return false;
+    return std::string_view(field->value().data(), field->value().size())
+                   .find(Cache::packed_encoding) != std::string_view::npos;
+}
+
+/**
+ * @return what the client says the value of a PUT costs it to get again,
+ *         for the evictor; 1 if it didn't say
+ */
+static double cost_of(const http::request<http::string_body> &req) {
+    auto field = req.find(Cache::cost_header);
+    if (field == req.end()) return 1;
+    double cost = 1;
+    auto [end, ec] = std::from_chars(
+            field->value().data(), field->value().data() + field->value().size(),
+            cost);
+    return ec != std::errc() || cost < 0 ? 1 : cost;
+}
+
+/**
+ * @return the client ID a POST /invalidations/id polls for
+ */
+static uint64_t poll_id(std::string_view target) {
+    const std::string_view arg = get_field2(target);
+    uint64_t id = 0;
+    std::from_chars(arg.data(), arg.data() + arg.size(), id);
+    return id;
+}
+
+/**
+ * Fill in the answer to a poll for invalidations, with what
+ * Invalidator::wait() returned and filled in.
+ */
+static void answer_poll(http::response<http::string_body> &res,
+                        bool subscribed, const std::vector<key_type> &keys,
+                        bool all) {
+    if (!subscribed) {
+        res.result(404);  // 404 Not Found; subscribe again
+        return;
+    }
+    res.result(200);  // 200 OK
+    if (all) res.set(Invalidator::all_header, "1");
+    for (const key_type &key : keys) res.body().append(key).append("\n");
+}
+
+/**
+ * Read the body of a PUT /key into a buffer from the cache, so however big
+ * the value is, it's held once and never copied again to be stored. The
+ * parser takes what arrives a socket read at a time. A chunked body has no
+ * length up front, so it's read into a piece of up to piece_size bytes
+ * first and copied in once at the end.
+ * @param parser has read the request's header
+ * @param status set to why there's no value, if there isn't
+ * @return the value with a terminator added, in a buffer from
+ *         Cache::make_buffer(), or nullptr
+ */
+template <typename Stream>
+static Cache::byte_type *read_value(
+        Stream &sock, beast::flat_buffer &buf, Cache &cache,
+        http::request_parser<http::buffer_body> &parser, http::status &status) {
+    beast::error_code ec;
+    http::buffer_body::value_type &body = parser.get().body();
+
+    Cache::byte_type *value = nullptr;
+    uint64_t length = 0;
+    std::unique_ptr<char[]> piece;
+    if (parser.content_length()) {
+        length = *parser.content_length();
+        if (length >= value_limit) {
+            status = http::status::payload_too_large;
+            return nullptr;
+        }
+        value = cache.make_buffer(static_cast<Cache::size_type>(length + 1));
+        if (value == nullptr) {
+            status = http::status::payload_too_large;
+            return nullptr;
+        }
+        parser.body_limit(length);
+    } else {
+        length = chunked_limit();
+        piece.reset(new char[length]);
+        parser.body_limit(length);
+    }
+
+    char *into = value != nullptr ? value : piece.get();
+    uint64_t got = 0;
+    while (!parser.is_done()) {
+        body.data = into + got;
+        body.size = length - got;
+        http::read(sock, buf, parser, ec);
+        if (ec == http::error::need_buffer) ec = {};
+        if (ec) {
+            std::cerr << "read_value(): " << ec.message() << std::endl;
+            if (value != nullptr) cache.drop_buffer(value);
+            status = ec == http::error::body_limit
+                             ? http::status::payload_too_large
+                             : http::status::bad_request;
+            return nullptr;
+        }
+        got = length - body.size;
+    }
+
+    if (value == nullptr) {
+        length = got;
+        value = cache.make_buffer(static_cast<Cache::size_type>(length + 1));
+        if (value == nullptr) {
+            status = http::status::payload_too_large;
+            return nullptr;
+        }
+        memcpy(value, piece.get(), length);
+    }
+    value[length] = '\0';  // Values are stored with a terminator
+    return value;
+}
+
+/**
+ * Send the response to a GET that hit, in the same form as ever, without
+ * building it in memory: the header, the JSON around the value and the
+ * value itself, out of the cache where it's pinned, go out in one gather
+ * write.
+ * @param res has the status and headers
+ * @return true iff it was all sent
+ */
+template <typename Stream>
+static bool write_value(Stream &sock, http::response<http::empty_body> &res,
+                        key_view_type key, Cache::val_type val) {
+    beast::error_code ec;
+    std::string head = "{key: \"";
+    head.append(key).append("\", val: \"");
+    const size_t size = strnlen(val.data_, val.size_);
+    res.content_length(head.size() + size + val_tail.size());
+
+    if (log_level >= log_requests) {
+        std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
+                  << res.base() << head << "..." << val_tail << std::endl
+                  << "==[ END HTTP RESPONSE ]==" << std::endl;
+    }
+
+    http::response_serializer<http::empty_body> sr{res};
+    sr.next(ec, [&](beast::error_code &error, const auto &header) {
+        net::write(sock,
+                   beast::buffers_cat(header, net::buffer(head),
+                                      net::buffer(val.data_, size),
+                                      net::buffer(val_tail.data(),
+                                                  val_tail.size())),
+                   error);
+        sr.consume(net::buffer_size(header));
+    });
+    if (ec) {
+        std::cerr << "BoostError: write_value(): " << ec.message()
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send the response to a GET that hit a compressed value to a client that
+ * accepts it: the value's Lz4 frame, as stored, is the whole body.
+ * @param res has the status and headers
+ * @return true iff it was all sent
+ */
+template <typename Stream>
+static bool write_packed(Stream &sock, http::response<http::empty_body> &res,
+                         Cache::val_type val) {
+    beast::error_code ec;
+    res.set(http::field::content_type, "application/octet-stream");
+    res.set(http::field::content_encoding, Cache::packed_encoding);
+    res.content_length(val.size_);
+
+    if (log_level >= log_requests) {
+        std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
+                  << res.base() << "(" << val.size_ << " bytes packed)"
+                  << std::endl
+                  << "==[ END HTTP RESPONSE ]==" << std::endl;
+    }
+
+    http::response_serializer<http::empty_body> sr{res};
+    sr.next(ec, [&](beast::error_code &error, const auto &header) {
+        net::write(sock,
+                   beast::buffers_cat(header, net::buffer(val.data_, val.size_)),
+                   error);
+        sr.consume(net::buffer_size(header));
+    });
+    if (ec) {
+        std::cerr << "BoostError: write_packed(): " << ec.message()
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The header write_packed() sends to a client that keeps its connection
+ * open, for a frame of size bytes.
+ */
+static std::string packed_head(size_t size) {
+    return std::string("HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Encoding: ")
+            .append(Cache::packed_encoding)
+            .append("\r\nContent-Length: ")
+            .append(std::to_string(size))
+            .append("\r\n\r\n");
+}
+
+/**
+ * Render the response to a GET that finds val under key, up to where the
+ * value goes, for Cache::set_renderer(). It must match what write_value()
+ * sends to a client that keeps its connection open.
+ */
+static std::string render_head(key_view_type key, Cache::val_type val) {
+    std::string body = "{key: \"";
+    body.append(key).append("\", val: \"");
+    const size_t length =
+            body.size() + strnlen(val.data_, val.size_) + val_tail.size();
+    return std::string("HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/json\r\n"
+                       "Content-Length: ")
+            .append(std::to_string(length))
+            .append("\r\n\r\n")
+            .append(body);
+}
+
+/**
+ * Answer a GET from the response rendered when the value was set: its
+ * start, the value and the tail go out in one gather write straight from
+ * the pinned value, with nothing formatted or allocated. A compressed value
+ * goes out the same way, as write_packed() would send it, to a client that
+ * accepts it.
+ * @param pinned has a rendered response, or is packed
+ * @return true iff it was all sent
+ */
+template <typename Stream>
+static bool send_rendered(Stream &sock, const Cache::Pinned &pinned) {
+    const Cache::val_type val = pinned.value();
+    std::string start;
+    std::string_view head = pinned.rendered();
+    if (pinned.packed()) {
+        start = packed_head(val.size_);
+        head = start;
+    }
+    const std::string_view tail = pinned.packed() ? "" : val_tail;
+    const size_t size =
+            pinned.packed() ? val.size_ : strnlen(val.data_, val.size_);
+    beast::error_code ec;
+    net::write(sock,
+               beast::buffers_cat(net::buffer(head.data(), head.size()),
+                                  net::buffer(val.data_, size),
+                                  net::buffer(tail.data(), tail.size())),
+               ec);
+    if (ec) {
+        std::cerr << "send_rendered(): " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @return the bytes used in every shard
+ */
+static Cache::size_type space_used() {
+    Cache::size_type used = 0;
+    for (const auto &cache : shards) used += cache->space_used();
+    return used;
+}
+
+/**
+ * @return the hit rate of the shards, averaged; keys are spread evenly
+ */
+static double hit_rate() {
+    double rate = 0;
+    for (const auto &cache : shards) rate += cache->hit_rate();
+    return rate / static_cast<double>(shards.size());
+}
+
+/**
+ * @return the k hottest keys of all the shards; each key is in one shard
+ */
+static std::vector<Hot_Keys::Entry> hot_keys(size_t k, bool by_bytes) {
+    std::vector<Hot_Keys::Entry> hot;
+    for (const auto &cache : shards) {
+        std::vector<Hot_Keys::Entry> more = cache->hot_keys(k, by_bytes);
+        hot.insert(hot.end(), more.begin(), more.end());
+    }
+    std::sort(hot.begin(), hot.end(),
+              [](const Hot_Keys::Entry &a, const Hot_Keys::Entry &b) {
+                  return a.count > b.count;
+              });
+    if (hot.size() > k) hot.resize(k);
+    return hot;
+}
+
+/**
+ * @return every namespace's stats, added up over the shards it's in and
+ *         with its hit rates averaged
+ */
+static std::vector<Cache::Namespace_Stats> namespace_stats() {
+    std::vector<Cache::Namespace_Stats> all;
+    std::vector<size_t> seen;  // How many shards each of all is in
+    for (const auto &cache : shards) {
+        for (const Cache::Namespace_Stats &space : cache->namespace_stats()) {
+            auto found = std::find_if(
+                    all.begin(), all.end(),
+                    [&](const auto &other) { return other.name == space.name; });
+            if (found == all.end()) {
+                all.push_back(space);
+                seen.push_back(1);
+                continue;
+            }
+            found->space_used += space.space_used;
+            found->hit_rate += space.hit_rate;
+            seen[found - all.begin()]++;
+        }
+    }
+    for (size_t i = 0; i < all.size(); i++)
+        all[i].hit_rate /= static_cast<double>(seen[i]);
+    return all;
+}
+
+/**
+ * Do the same to every shard.
+ * @return true iff it worked on all of them
+ */
+template <typename Each>
+static bool all_shards(Each each) {
+    bool ok = true;
+    for (const auto &cache : shards) ok = each(*cache) && ok;
+    return ok;
+}
+
+/**
+ * Describe the cache for POST /stats, in the same style as GET responses.
+ * @param k how many hot keys to list for each ranking
+ */
+static std::string stats_json(size_t k) {
+    auto list = [k](bool by_bytes) {
+        std::string out = "[";
+        for (const Hot_Keys::Entry &entry : hot_keys(k, by_bytes)) {
+            if (out.size() > 1) out.append(", ");
+            out.append("{key: \"")
+                    .append(entry.key)
+                    .append("\", count: ")
+                    .append(std::to_string(entry.count))
+                    .append(", error: ")
+                    .append(std::to_string(entry.error))
+                    .append("}");
+        }
+        return out.append("]");
+    };
+    std::string spaces = "[";
+    for (const Cache::Namespace_Stats &space : namespace_stats()) {
+        if (spaces.size() > 1) spaces.append(", ");
+        spaces.append("{name: \"")
+                .append(space.name)
+                .append("\", space_used: ")
+                .append(std::to_string(space.space_used))
+                .append(", hit_rate: ")
+                .append(std::to_string(space.hit_rate))
+                .append("}");
+    }
+    std::string evictors = "[";
+    for (Adaptive_Evictor *evictor : adaptive_evictors) {
+        const Adaptive_Evictor::Report report = evictor->report();
+        if (evictors.size() > 1) evictors.append(", ");
+        evictors.append("{active: \"").append(report.active).append(
+                "\", miss_ratios: {");
+        for (size_t i = 0; i < report.miss_ratios.size(); i++) {
+            if (i != 0) evictors.append(", ");
+            evictors.append(report.miss_ratios[i].first)
+                    .append(": ")
+                    .append(std::to_string(report.miss_ratios[i].second));
+        }
+        evictors.append("}}");
+    }
+    Cache::Compression_Stats packed{0, 0, 0};
+    for (const auto &cache : shards) {
+        const Cache::Compression_Stats more = cache->compression_stats();
+        packed.values += more.values;
+        packed.raw_bytes += more.raw_bytes;
+        packed.bytes += more.bytes;
+    }
+    Cache::Dedup_Stats deduped{0, 0};
+    for (const auto &cache : shards) {
+        const Cache::Dedup_Stats more = cache->dedup_stats();
+        deduped.keys += more.keys;
+        deduped.saved_bytes += more.saved_bytes;
+    }
+    Disk_Tier::Stats disk{};
+    for (const auto &cache : shards) {
+        const Disk_Tier::Stats more = cache->disk_stats();
+        disk.keys += more.keys;
+        disk.bytes += more.bytes;
+        disk.capacity += more.capacity;
+        disk.hits += more.hits;
+        disk.misses += more.misses;
+        disk.writes += more.writes;
+        disk.dropped += more.dropped;
+        disk.reclaimed += more.reclaimed;
+    }
+    const Admission::Stats overload = admission->stats();
+    const double ratio = packed.bytes == 0
+                                 ? 1
+                                 : static_cast<double>(packed.raw_bytes) /
+                                           static_cast<double>(packed.bytes);
+    return std::string("{space_used: ")
+            .append(std::to_string(space_used()))
+            .append(", hit_rate: ")
+            .append(std::to_string(hit_rate()))
+            .append(", hot_requests: ")
+            .append(list(false))
+            .append(", hot_bytes: ")
+            .append(list(true))
+            .append(", namespaces: ")
+            .append(spaces.append("]"))
+            .append(", evictors: ")
+            .append(evictors.append("]"))
+            .append(", compression: {values: ")
+            .append(std::to_string(packed.values))
+            .append(", raw_bytes: ")
+            .append(std::to_string(packed.raw_bytes))
+            .append(", bytes: ")
+            .append(std::to_string(packed.bytes))
+            .append(", ratio: ")
+            .append(std::to_string(ratio))
+            .append("}, dedup: {keys: ")
+            .append(std::to_string(deduped.keys))
+            .append(", saved_bytes: ")
+            .append(std::to_string(deduped.saved_bytes))
+            .append("}, disk: {keys: ")
+            .append(std::to_string(disk.keys))
+            .append(", bytes: ")
+            .append(std::to_string(disk.bytes))
+            .append(", capacity: ")
+            .append(std::to_string(disk.capacity))
+            .append(", hits: ")
+            .append(std::to_string(disk.hits))
+            .append(", misses: ")
+            .append(std::to_string(disk.misses))
+            .append(", writes: ")
+            .append(std::to_string(disk.writes))
+            .append(", dropped: ")
+            .append(std::to_string(disk.dropped))
+            .append(", reclaimed: ")
+            .append(std::to_string(disk.reclaimed))
+            .append("}, overload: {connections: ")
+            .append(std::to_string(overload.connections))
+            .append(", refused_connections: ")
+            .append(std::to_string(overload.refused_connections))
+            .append(", in_flight: ")
+            .append(std::to_string(overload.in_flight))
+            .append(", queued: ")
+            .append(std::to_string(overload.queued))
+            .append(", admitted: ")
+            .append(std::to_string(overload.admitted))
+            .append(", rejected: ")
+            .append(std::to_string(overload.rejected))
+            .append(", shed: ")
+            .append(std::to_string(overload.shed))
+            .append("}}");
+}
+
+/**
+ * Describe the configuration POST /config can change, as stats_json() does.
+ * Needs config_lock.
+ */
+static std::string config_json() {
+    std::ostringstream out;
+    out << "{maxmem: " << maxmem << ", low: " << low_mark
+        << ", high: " << high_mark << ", log: " << log_level << "}";
+    return out.str();
+}
+
+/**
+ * Change the configuration for POST /config/settings, where settings are
+ * name=value pairs joined by '&': maxmem in bytes, split between the shards
+ * as with -m; the low and high watermarks in percent of maxmem, as with -L
+ * and -H; and the log level, as with -l. Nothing changes unless all of
+ * them are good. A smaller maxmem is evicted down to in the background.
+ * @param settings the settings to change; " " for none
+ * @param out      set to the configuration afterwards
+ * @return false if a setting was bad
+ */
+static bool configure(std::string_view settings, std::string &out) {
+    std::lock_guard<std::mutex> guard(config_lock);
+    const bool changing = !settings.empty() && settings != " ";
+    uint64_t new_maxmem = maxmem;
+    double new_low = low_mark, new_high = high_mark;
+    int new_log = log_level;
+    while (!settings.empty() && settings != " ") {
+        const std::string_view setting = settings.substr(0, settings.find('&'));
+        settings.remove_prefix(std::min(settings.size(), setting.size() + 1));
+        const size_t equals = setting.find('=');
+        if (equals == std::string_view::npos) return false;
+        const std::string_view name = setting.substr(0, equals);
+        const std::string value(setting.substr(equals + 1));
+        char *end = nullptr;
+        if (name == "maxmem") {
+            new_maxmem = strtoull(value.c_str(), &end, 10);
+        } else if (name == "low") {
+            new_low = strtod(value.c_str(), &end);
+        } else if (name == "high") {
+            new_high = strtod(value.c_str(), &end);
+        } else if (name == "log") {
+            new_log = static_cast<int>(strtol(value.c_str(), &end, 10));
+        } else {
+            return false;
+        }
+        if (value.empty() || *end != '\0') return false;
+    }
+    const uint64_t shard_mem = new_maxmem / shards.size();
+    if (shard_mem == 0 || !(new_low > 0 && new_low <= new_high &&
+                            new_high <= 100) ||
+        new_log < log_errors || new_log > log_requests) {
+        return false;
+    }
+
+    for (const auto &cache : shards) {
+        cache->set_maxmem(static_cast<Cache::size_type>(shard_mem));
+        cache->set_watermarks(new_low / 100, new_high / 100);
+    }
+    for (Adaptive_Evictor *evictor : adaptive_evictors)
+        evictor->set_capacity(shard_mem);
+    value_limit = shard_mem;
+    maxmem = new_maxmem;
+    low_mark = new_low;
+    high_mark = new_high;
+    log_level = new_log;
+
+    out = config_json();
+    if (changing && log_level >= log_config)
+        std::cerr << "==> CONFIG <==" << std::endl << out << std::endl;
+    return true;
 }
 
 /**
  * Process requests
  * @param req the request to process
- * @param sock the socket to write to
+ * @param sock the socket to write to, or an Outbox
+ * @param value the value from the body of a PUT, from read_value(); it
+ *              belongs to the cache once this returns
+ * @return true iff the connection should be kept open for another request
  */
-void process_requests(http::request<http::string_body> &req,
-                      tcp::socket &sock) {
-    std::cerr << "==> BEGIN HTTP REQUEST <==" << std::endl
-              << req << std::endl
-              << "==[ END HTTP REQUEST ]==" << std::endl;
+template <typename Stream>
+bool process_requests(http::request<http::string_body> &req, Stream &sock,
+                      Cache::byte_type *value = nullptr) {
+    if (log_level >= log_requests) {
+        std::cerr << "==> BEGIN HTTP REQUEST <==" << std::endl
+                  << req << std::endl
+                  << "==[ END HTTP REQUEST ]==" << std::endl;
+    }
 
-    // Cast the data passed by the client to a string for convenience
-    const std::string input = static_cast<std::string>(req.target());
+    // View the data passed by the client as a string for convenience
+    const std::string_view input(req.target().data(), req.target().size());
 
     // An error code object
     beast::error_code ec;
 
     // Create a new response object to be filled in later
     http::response<http::string_body> res{};
+    res.version(req.version());
+    res.keep_alive(req.keep_alive());
 
-    if (req.method() == http::verb::get) {  // GET /key HTTP/1.1:
-        key_type key = get_field1(input);
-        Cache::val_type val{};
-        std::string json_str;
+    const bool is_write = req.method() == http::verb::put ||
+                          req.method() == http::verb::delete_ ||
+                          (req.method() == http::verb::post &&
+                           (get_field1(input) == "reset" ||
+                            get_field1(input) == "flush"));
+    const std::string_view ns = namespace_of(req);
 
+    if (is_write && replica_mode &&
+        req.find(Replicator::header) == req.end()) {
+        res.result(403);  // 403 Forbidden; writes go to the primary
+
+    } else if (req.method() == http::verb::get) {  // GET /key HTTP/1.1:
+        key_view_type key = get_field1(input);
+
+        // A client with a near cache may keep what it gets; lease it out
+        // before looking, so a set right after can't be missed
+        bool leased = false;
+        auto client = req.find(Invalidator::client_header);
+        if (client != req.end() && ns.empty()) {
+            const auto id_str = client->value();
+            uint64_t id = 0;
+            std::from_chars(id_str.data(), id_str.data() + id_str.size(), id);
+            leased = invalidator.lease(id, key);
+        }
+
+        // The value is pinned in the cache while it's sent, never copied
+        const bool take_packed = compress_limit != 0 && accepts_packed(req);
+        Cache::Pinned pinned;
         try {
-            val = cache->get(key);
+            pinned = shard(key).get_pinned(ns, key, take_packed);
         } catch (std::exception &e) {
             std::cerr << "GetException: main() GET 1: " << e.what()
                       << std::endl;
             res.result(500);  // 500 Internal Server Error
-            if (ec)
-                std::cerr << "BoostError: main() GET 2: " << ec.message()
-                          << std::endl;
         }
+        const Cache::val_type val = pinned.value();
 
+        res.set(http::field::content_type, "application/json");
         if (val.data_ == nullptr || val.size_ == 0) {
             res.result(404);  // 404 Not Found
+        } else if (render_limit != 0 && client == req.end() &&
+                   req.version() == 11 && req.keep_alive() &&
+                   (!pinned.rendered().empty() || pinned.packed())) {
+            // Only a plain keep-alive GET matches what was rendered
+            return send_rendered(sock, pinned);
         } else {
-            json_str = "{key: \"" + key + "\", val: \"" + val.data_ + "\"}";
-            res.result(200);  // 200 OK
-            delete[] val.data_;
+            // The value is sent as is rather than copied into the body
+            http::response<http::empty_body> found{res.base()};
+            found.result(200);  // 200 OK
+            if (leased)
+                found.set(Invalidator::lease_header,
+                          std::to_string(invalidator.lease_length().count()));
+            const bool sent = pinned.packed()
+                                      ? write_packed(sock, found, val)
+                                      : write_value(sock, found, key, val);
+            return sent && found.keep_alive();
         }
 
-        res.set(http::field::content_type, "application/json");
-        res.body() = json_str;
-
-        std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
-                  << res << std::endl
-                  << "==[ END HTTP RESPONSE ]==" << std::endl;
-        http::write(sock, res, ec);
-        if (ec)
-            std::cerr << "BoostError: main() GET 3: " << ec.message()
-                      << std::endl;
+    } else if (req.method() == http::verb::put &&
+               value != nullptr) {  // PUT /key HTTP/1.1 with a body:
+        key_view_type key = get_field1(input);
+        if (!replicate(Replicator::Op::set, ns, key, value,
+                       [&]() {
+                           return shard(key).set_buffer(ns, key, value,
+                                                        cost_of(req));
+                       }))
+            res.result(500);  // 500 Internal Server Error
+        else
+            res.result(200);  // 200 OK
+        if (ns.empty()) invalidator.invalidate(key);
 
     } else if (req.method() == http::verb::put) {  // PUT /key/value HTTP/1.1:
-        key_type key = get_field1(input);
-        std::string data = get_field2(input);
+        key_view_type key = get_field1(input);
+        std::string_view data = get_field2(input);
         Cache::val_type val{};
 
+        // Values are stored with a terminator
         auto *data_buf = new Cache::byte_type[data.size() + 1];
-        strncpy(data_buf, data.c_str(), data.length() + 1);
+        memcpy(data_buf, data.data(), data.size());
+        data_buf[data.size()] = '\0';
         val.size_ = static_cast<Cache::size_type>(data.size() + 1);
         val.data_ = data_buf;
 
-        if (!cache->set(key, val))
+        if (!replicate(Replicator::Op::set, ns, key, data,
+                       [&]() {
+                           return shard(key).set(ns, key, val, cost_of(req));
+                       }))
             res.result(500);  // 500 Internal Server Error
         else
             res.result(200);  // 200 OK
-
-        std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
-                  << res << std::endl
-                  << "==[ END HTTP RESPONSE ]==" << std::endl;
-        http::write(sock, res, ec);
-        if (ec)
-            std::cerr << "BoostError: main() PUT: " << ec.message()
-                      << std::endl;
+        if (ns.empty()) invalidator.invalidate(key);
 
         delete[] data_buf;
 
     } else if (req.method() == http::verb::delete_) {  // DELETE /key HTTP/1.1:
-        key_type key = get_field1(input);
+        key_view_type key = get_field1(input);
 
-        if (!cache->del(key))
+        if (!replicate(Replicator::Op::del, ns, key, "",
+                       [&]() { return shard(key).del(ns, key); })) {
             res.result(404);  // 404 Not Found
-        else
+        } else {
             res.result(200);  // 200 OK
-
-        std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
-                  << res << std::endl
-                  << "==[ END HTTP RESPONSE ]==" << std::endl;
-        http::write(sock, res, ec);
-        if (ec)
-            std::cerr << "BoostError: main() DELETE: " << ec.message()
-                      << std::endl;
+            if (ns.empty()) invalidator.invalidate(key);
+        }
 
     } else if (req.method() == http::verb::head) {  // HEAD HTTP/1.1:
-        Cache::size_type space_used = cache->space_used();
-        double hit_rate = cache->hit_rate();
+        Cache::size_type used = space_used();
+        double rate = hit_rate();
 
-        if (!std::isnan(space_used)) {
+        if (!std::isnan(used)) {
             res.result(200);  // 200 OK
             res.set(http::field::content_type, "application/json");
             res.set(http::field::accept, "application/json");
             res.http::basic_fields<std::allocator<char>>::insert(
-                "Space-Used", std::to_string(space_used));
+                "Space-Used", std::to_string(used));
             res.http::basic_fields<std::allocator<char>>::insert(
-                "Hit-Rate", std::to_string(hit_rate));
+                "Hit-Rate", std::to_string(rate));
             res.http::basic_fields<std::allocator<char>>::insert(
                 "X-Clacks-Overhead", "GNU Terry Pratchett");
         } else {
             res.result(500);  // 500 Internal Server Error
         }
 
-        std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
-                  << res << std::endl
-                  << "==[ END HTTP RESPONSE ]==" << std::endl;
-        http::write(sock, res, ec);
-        if (ec)
-            std::cerr << "BoostError: main() HEAD: " << ec.message()
-                      << std::endl;
-
     } else if (req.method() == http::verb::post) {  // POST /reset HTTP/1.1:
-        std::string cmd = get_field1(input);
-        if (cmd != "reset") {
+        std::string_view cmd = get_field1(input);
+        if (cmd == "stats") {  // POST /stats[/k] HTTP/1.1:
+            const std::string_view arg = get_field2(input);
+            size_t k = 10;
+            std::from_chars(arg.data(), arg.data() + arg.size(), k);
+            res.result(200);  // 200 OK
+            res.set(http::field::content_type, "application/json");
+            res.body() = stats_json(k);
+        } else if (cmd == "config") {  // POST /config[/settings] HTTP/1.1:
+            std::string config;
+            if (!configure(get_field2(input), config)) {
+                res.result(400);  // 400 Bad Request
+            } else {
+                res.result(200);  // 200 OK
+                res.set(http::field::content_type, "application/json");
+                res.body() = config;
+            }
+        } else if (cmd == "subscribe") {  // POST /subscribe HTTP/1.1:
+            res.result(200);  // 200 OK
+            res.body() = std::to_string(invalidator.subscribe());
+        } else if (cmd == "invalidations") {  // POST /invalidations/id:
+            std::vector<key_type> keys;
+            bool all = false;
+            const bool subscribed =
+                    invalidator.wait(poll_id(input), poll_time, keys, all);
+            answer_poll(res, subscribed, keys, all);
+        } else if (cmd == "flush") {  // POST /flush/namespace HTTP/1.1:
+            const std::string_view target = get_field2(input);
+            if (!replicate(Replicator::Op::flush, target, "", "",
+                           [&]() {
+                               return all_shards([&](Cache &cache) {
+                                   return cache.flush(target);
+                               });
+                           }))
+                res.result(400);  // 400 Bad Request; no namespace
+            else
+                res.result(200);  // 200 OK
+        } else if (cmd != "reset") {
             res.result(400);  // 400 Bad Request
         } else {
-            if (!cache->reset())
+            if (!replicate(Replicator::Op::reset, "", "", "",
+                           [&]() {
+                               return all_shards([](Cache &cache) {
+                                   return cache.reset();
+                               });
+                           }))
                 res.result(500);  // 500 Internal Server Error
             else
                 res.result(205);  // 205 Reset Content
+            invalidator.invalidate_all();
         }
 
+    } else {              // error
+        res.result(400);  // 400 Bad Request
+    }
+
+    // Every response carries a length so the connection can be reused
+    res.prepare_payload();
+
+    if (log_level >= log_requests) {
         std::cerr << "==> BEGIN HTTP RESPONSE <==" << std::endl
                   << res << std::endl
                   << "==[ END HTTP RESPONSE ]==" << std::endl;
-        http::write(sock, res, ec);
-        if (ec)
-            std::cerr << "BoostError: main() POST: " << ec.message()
-                      << std::endl;
+    }
+    http::write(sock, res, ec);
+    if (ec) {
+        std::cerr << "BoostError: process_requests() " << req.method_string()
+                  << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return res.keep_alive();
+}
 
-    } else {              // error
-        res.result(400);  // 400 Bad Request
+/**
+ * A stream that keeps what's written to it, so a response can be built by
+ * the same code that writes one to a socket and sent later.
+ */
+class Outbox {
+    std::string &out;
+
+public:
+    explicit Outbox(std::string &to) : out(to) {}
+
+    template <typename Buffers>
+    size_t write_some(const Buffers &buffers) {
+        const size_t before = out.size();
+        for (net::const_buffer piece : beast::buffers_range_ref(buffers))
+            out.append(static_cast<const char *>(piece.data()), piece.size());
+        return out.size() - before;
+    }
+
+    template <typename Buffers>
+    size_t write_some(const Buffers &buffers, beast::error_code &ec) {
+        ec = {};
+        return write_some(buffers);
+    }
+};
+
+/**
+ * A connection served through io_uring: bytes come in as they arrive, are
+ * parsed as far as they go, and each request completed is processed into
+ * out, just as handle_sessions() does on a socket of its own. The body of
+ * a PUT with a length goes straight into a buffer from the cache, as
+ * read_value() does. A long poll for invalidations is parked in the
+ * Invalidator, which finishes it through the server once it's answered, so
+ * it holds up neither the ring's other connections nor a thread.
+ */
+class Uring_Session : public Uring_Server::Session {
+    Uring_Server &server;
+    const uint64_t id;
+    beast::flat_buffer in;  // Received but not yet parsed
+
+    // One at a time: the header, then a body kept as a string or a value
+    // going into value, from value_cache
+    std::optional<http::request_parser<http::empty_body>> head;
+    std::optional<http::request_parser<http::string_body>> parser;
+    std::optional<http::request_parser<http::buffer_body>> putting;
+    Cache *value_cache = nullptr;
+    Cache::byte_type *value = nullptr;
+    uint64_t length = 0;
+
+    bool waiting = false;  // On a long poll
+
+    Uring_Server::Status serve(std::string &out);
+    bool start_body(Outbox &box);
+    void park(const http::request<http::string_body> &req,
+              std::string_view target);
+
+public:
+    Uring_Session(Uring_Server &s, uint64_t i) : server(s), id(i) {}
+
+    ~Uring_Session() override {
+        if (value != nullptr) value_cache->drop_buffer(value);
+    }
+
+    Uring_Server::Status received(std::string_view data,
+                                  std::string &out) override {
+        net::buffer_copy(in.prepare(data.size()), net::buffer(data));
+        in.commit(data.size());
+        return waiting ? Uring_Server::Status::wait : serve(out);
+    }
+
+    Uring_Server::Status resumed(std::string &out) override {
+        waiting = false;
+        return serve(out);
+    }
+};
+
+/**
+ * Pick where the body of the request in head goes, now its header is in.
+ * @return false if the value is too big, having said so in box
+ */
+bool Uring_Session::start_body(Outbox &box) {
+    const bool sized = head->get().method() == http::verb::put &&
+                       !head->is_done() && head->content_length();
+    if (!sized) {
+        const bool chunked = head->get().method() == http::verb::put &&
+                             head->get().chunked();
+        parser.emplace(std::move(*head));
+        head.reset();
+        // A chunked value is gathered before it's copied, so it's kept small
+        parser->body_limit(chunked ? chunked_limit() : value_limit.load());
+        parser->eager(true);
+        return true;
+    }
+
+    const std::string_view target(head->get().target().data(),
+                                  head->get().target().size());
+    length = *head->content_length();
+    value_cache = &shard(get_field1(target));
+    if (length < value_limit)
+        value = value_cache->make_buffer(
+                static_cast<Cache::size_type>(length + 1));
+    if (value == nullptr) {
+        beast::error_code ec;
+        http::response<http::empty_body> res{http::status::payload_too_large,
+                                             head->get().version()};
+        res.keep_alive(false);
+        res.prepare_payload();
+        http::write(box, res, ec);
+        return false;
+    }
+    putting.emplace(std::move(*head));
+    head.reset();
+    putting->body_limit(length);
+    putting->eager(true);
+    putting->get().body().data = value;
+    putting->get().body().size = length;
+    return true;
+}
+
+/**
+ * Park a long poll for invalidations, to be finished with its answer.
+ */
+void Uring_Session::park(const http::request<http::string_body> &req,
+                         std::string_view target) {
+    waiting = true;
+    // The server outlives every connection; this session may not
+    invalidator.park(
+            poll_id(target), poll_time,
+            [&server = server, id = id, version = req.version(),
+             keep = req.keep_alive()](bool subscribed,
+                                      const std::vector<key_type> &keys,
+                                      bool all) {
+                http::response<http::string_body> res{};
+                res.version(version);
+                res.keep_alive(keep);
+                answer_poll(res, subscribed, keys, all);
+                res.prepare_payload();
+                std::string reply;
+                Outbox later(reply);
+                beast::error_code ec;
+                http::write(later, res, ec);
+                server.finish(id, std::move(reply), keep);
+            });
+}
+
+/**
+ * Process every request that's all in.
+ */
+Uring_Server::Status Uring_Session::serve(std::string &out) {
+    Outbox box(out);
+    while (in.size() != 0) {
+        beast::error_code ec;
+        if (!parser && !putting) {
+            if (!head) {
+                head.emplace();
+                head->body_limit(value_limit.load());
+            }
+            in.consume(head->put(in.data(), ec));
+            if (ec == http::error::need_more) break;
+            if (ec) {
+                std::cerr << "Uring_Session: " << ec.message() << std::endl;
+                return Uring_Server::Status::close;
+            }
+            if (!head->is_header_done()) continue;
+            if (!start_body(box)) return Uring_Server::Status::close;
+        }
+
+        auto done = [this]() {
+            return putting ? putting->is_done() : parser->is_done();
+        };
+        if (!done()) {
+            if (in.size() == 0) break;
+            if (putting)
+                in.consume(putting->put(in.data(), ec));
+            else
+                in.consume(parser->put(in.data(), ec));
+            if (ec == http::error::need_more) break;
+            if (ec) {
+                std::cerr << "Uring_Session: " << ec.message() << std::endl;
+                if (ec != http::error::body_limit)
+                    return Uring_Server::Status::close;
+                http::response<http::empty_body> res{
+                        http::status::payload_too_large, 11};
+                res.keep_alive(false);
+                res.prepare_payload();
+                http::write(box, res, ec);
+                return Uring_Server::Status::close;
+            }
+            if (!done()) continue;
+        }
+
+        http::request<http::string_body> req;
+        Cache::byte_type *put_value = nullptr;
+        if (putting) {
+            req = http::request<http::string_body>{
+                    std::move(putting->release().base())};
+            putting.reset();
+            put_value = value;
+            put_value[length] = '\0';  // Values are stored with a terminator
+            value = nullptr;
+        } else {
+            req = parser->release();
+            parser.reset();
+        }
+        const std::string_view target(req.target().data(),
+                                      req.target().size());
+
+        // A chunked value has no length up front, so it's gathered first,
+        // up to piece_size bytes, and copied in once at the end
+        if (put_value == nullptr && req.method() == http::verb::put &&
+            req.chunked()) {
+            const std::string &body = req.body();
+            put_value = shard(get_field1(target))
+                                .make_buffer(static_cast<Cache::size_type>(
+                                        body.size() + 1));
+            if (put_value == nullptr) {
+                http::response<http::empty_body> res{
+                        http::status::payload_too_large, req.version()};
+                res.keep_alive(false);
+                res.prepare_payload();
+                http::write(box, res, ec);
+                return Uring_Server::Status::close;
+            }
+            memcpy(put_value, body.data(), body.size());
+            put_value[body.size()] = '\0';
+        }
+
+        if (req.method() == http::verb::post &&
+            get_field1(target) == "invalidations") {
+            park(req, target);
+            return Uring_Server::Status::wait;
+        }
+
+        if (!process_requests(req, box, put_value))
+            return Uring_Server::Status::close;
+    }
+    return Uring_Server::Status::keep;
+}
+
+template <typename Stream>
+void handle_sessions(Stream &sock);
+
+/**
+ * Answer a request we're too busy for with 503 Service Unavailable, having
+ * read only its header.
+ * @param unread whether its body is still to come, so that the connection
+ *               has to be closed rather than read on
+ * @return true iff the connection can go on
+ */
+template <typename Stream>
+static bool refuse_request(Stream &sock,
+                           const http::request<http::empty_body> &req,
+                           bool unread) {
+    http::response<http::empty_body> res{http::status::service_unavailable,
+                                         req.version()};
+    res.set(http::field::retry_after, "1");
+    res.keep_alive(req.keep_alive() && !unread);
+    res.prepare_payload();
+    if (log_level >= log_requests)
+        std::cerr << "Refused " << req.method_string() << " " << req.target()
+                  << ": overloaded" << std::endl;
+    beast::error_code ec;
+    http::write(sock, res, ec);
+    return !ec && res.keep_alive();
+}
+
+/**
+ * Turn a connection away at once with 503 Service Unavailable, when there
+ * are already too many, without a thread for it or waiting on it: if the
+ * answer doesn't fit in the socket's buffer, the client only sees it close.
+ */
+template <typename Socket>
+static void refuse_connection(Socket &sock) {
+    static constexpr std::string_view busy =
+            "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    send(sock.native_handle(), busy.data(), busy.size(),
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    beast::error_code ec;
+    sock.shutdown(Socket::shutdown_both, ec);
+    sock.close(ec);
+}
+
+/**
+ * Serve a connection Admission::open() let in, then count it as closed.
+ */
+template <typename Socket>
+static void serve_connection(Socket &sock) {
+    handle_sessions(sock);
+    admission->close();
+}
+
+/**
+ * Move a client on this host over to a Shm_Channel it made, as it asked
+ * with POST /shm/name on a Unix socket: say OK, then serve the channel on
+ * this thread until either side closes it or goes away. The socket stays
+ * open meanwhile, just so each side can tell the other is still there.
+ */
+static void serve_shm(local_socket &sock,
+                      const http::request<http::string_body> &req) {
+    const std::string_view target(req.target().data(), req.target().size());
+    const std::string_view name = get_field2(target);
+    std::unique_ptr<Shm_Channel> channel;
+    if (!name.empty() && name.find('/') == std::string_view::npos) {
+        try {
+            channel = Shm_Channel::attach("/" + std::string(name));
+        } catch (const std::exception &e) {
+            std::cerr << "serve_shm(): " << e.what() << std::endl;
+        }
     }
+
+    http::response<http::empty_body> res{
+            channel ? http::status::ok : http::status::bad_request,
+            req.version()};
+    res.keep_alive(channel != nullptr);
+    res.prepare_payload();
+    beast::error_code ec;
+    http::write(sock, res, ec);
+    if (!channel || ec) return;
+
+    channel->watch(sock.native_handle());
+    handle_sessions(*channel);
 }
 
 /**
  * Handle incoming connections
  * This function will be called multiple times by std::thread
- * @param &sock the tcp socket to read a connection from
+ * Requests are read and answered until the client closes the connection or
+ * asks for it to be closed, so clients can reuse one connection.
+ * @param &sock the TCP or Unix socket, or the Shm_Channel, to read a
+ *              connection from
  */
-void handle_sessions(tcp::socket& sock) {
+template <typename Stream>
+void handle_sessions(Stream &sock) {
     beast::error_code ec;
     
-    // Buffer for reading requests
+    // Buffer for reading requests; it may hold the start of the next one
     beast::flat_buffer buf;
 
-    // A request object
-    http::request<http::string_body> req = {};
+    for (;;) {
+        // Read the header first, to see where the body should go
+        http::request_parser<http::empty_body> header;
+        http::read_header(sock, buf, header, ec);
+
+        // In case of errors
+        if (ec == http::error::end_of_stream) break;
+        if (ec) {
+            std::cerr << "http::read_header(): " << ec.message() << std::endl;
+            break;
+        }
+
+        // Wait for a slot to work in before reading any body, unless we're
+        // too busy. A long poll would hold one for nothing, stats are wanted
+        // most when busy, and a move to shared memory holds this thread for
+        // the rest of the connection anyway.
+        const std::string_view field = get_field1(std::string_view(
+                header.get().target().data(), header.get().target().size()));
+        bool exempt = header.get().method() == http::verb::post &&
+                      (field == "invalidations" || field == "stats");
+        if constexpr (std::is_same_v<Stream, local_socket>)
+            exempt = exempt || (header.get().method() == http::verb::post &&
+                                field == "shm");
+        if (!exempt && !admission->admit()) {
+            if (!refuse_request(sock, header.get(), !header.is_done())) break;
+            continue;
+        }
+
+        // Gives the slot back however this request ends
+        struct Slot {
+            bool held;
+            ~Slot() {
+                if (held) admission->release();
+            }
+        } slot{!exempt};
 
-    // Read into that object
-    http::read(sock, buf, req, ec);
+        // A request object
+        http::request<http::string_body> req = {};
+        Cache::byte_type *value = nullptr;
 
-    // In case of errors
-    if (ec == http::error::end_of_stream) return;
-    if (ec) std::cerr << "http::read(): " << ec.message() << std::endl;
+        if (header.get().method() == http::verb::put && !header.is_done()) {
+            // A value in the body goes straight into the cache
+            http::request_parser<http::buffer_body> parser{std::move(header)};
+            http::status status = http::status::ok;
+            const std::string_view target(parser.get().target().data(),
+                                          parser.get().target().size());
+            value = read_value(sock, buf, shard(get_field1(target)), parser,
+                               status);
+            req = http::request<http::string_body>{
+                    std::move(parser.release().base())};
+            if (value == nullptr) {
+                // The body may not all have been read; don't read on
+                http::response<http::empty_body> res{status, req.version()};
+                res.keep_alive(false);
+                res.prepare_payload();
+                http::write(sock, res, ec);
+                break;
+            }
+        } else {
+            http::request_parser<http::string_body> parser{std::move(header)};
+            http::read(sock, buf, parser, ec);
+            if (ec) {
+                std::cerr << "http::read(): " << ec.message() << std::endl;
+                break;
+            }
+            req = parser.release();
+        }
 
-    // Process the request and send the appropriate response
-    process_requests(req, sock);
+        const std::string_view target(req.target().data(),
+                                      req.target().size());
+
+        // A client on this host may move the rest over to shared memory
+        if constexpr (std::is_same_v<Stream, local_socket>) {
+            if (req.method() == http::verb::post &&
+                get_field1(target) == "shm") {
+                serve_shm(sock, req);
+                break;
+            }
+        }
+
+        // Process the request and send the appropriate response
+        if (!process_requests(req, sock, value)) break;
+    }
 
     // Send a graceful shutdown signal
-    sock.shutdown(tcp::socket::shutdown_send);
+    if constexpr (std::is_same_v<Stream, Shm_Channel>)
+        sock.close();
+    else
+        sock.shutdown(Stream::shutdown_send, ec);
+}
+
+/**
+ * Accept connections on our own listening socket, forever. Every acceptor
+ * binds the same port with SO_REUSEPORT, so the kernel spreads incoming
+ * connections over them and no lock is shared between them. An acceptor
+ * pinned to a CPU keeps its connections there too, since their threads
+ * inherit its affinity.
+ * @param at     where to listen
+ * @param cpu    the CPU to run on, or -1 for any
+ * @param shared whether other acceptors listen on the same port; a lone
+ *               one doesn't set SO_REUSEPORT, so a second server started
+ *               on its port still fails
+ */
+static void accept_loop(tcp::endpoint at, int cpu, bool shared) {
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        const int err =
+                pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0)
+            std::cerr << "accept_loop(): can't pin to CPU " << cpu << ": "
+                      << strerror(err) << std::endl;
+    }
+
+    try {
+        /// The io_context is required for all I/O
+        net::io_context ioc{1};
+
+        /// The acceptor receives incoming connections
+        tcp::acceptor acceptor{ioc};
+        acceptor.open(at.protocol());
+        acceptor.set_option(net::socket_base::reuse_address(true));
+        if (shared) acceptor.set_option(reuse_port(true));
+        acceptor.bind(at);
+        acceptor.listen();
+
+        if (use_uring) {
+            auto uring = Uring_Server::make(acceptor.native_handle());
+            if (uring) {
+                uring->run([](Uring_Server &server, uint64_t id) {
+                    return std::make_unique<Uring_Session>(server, id);
+                });
+                die("accept_loop(): io_uring stopped working");
+            }
+            std::cerr << "accept_loop(): no io_uring; serving connections "
+                         "with threads"
+                      << std::endl;
+        }
+
+        //
+        // Loop until the program is killed or something breaks
+        //
+        for (;;) {
+            /// This will receive the new connection
+            tcp::socket sock{ioc};
+
+            // Block until we recieve a connection
+            acceptor.accept(sock);
+            if (!admission->open()) {
+                refuse_connection(sock);
+                continue;
+            }
+
+            // Launch the session, transfer ownership of the socket
+            std::thread{std::bind(&serve_connection<tcp::socket>,
+                                  std::move(sock))}.detach();
+        }
+
+    } catch (const std::exception &e) {
+        die(std::string("accept_loop(): ") + e.what());
+    }
+}
+
+/**
+ * Accept connections from clients on this host on a Unix socket, forever,
+ * each served on a thread of its own like a TCP connection. They skip
+ * loopback TCP, and may move on to shared memory from there; see
+ * serve_shm().
+ * @param path where to make the socket; whatever is there is replaced
+ */
+static void accept_local(const std::string &path) {
+    try {
+        net::io_context ioc{1};
+        unlink(path.c_str());
+        net::local::stream_protocol::acceptor acceptor{
+                ioc, net::local::stream_protocol::endpoint(path)};
+        for (;;) {
+            local_socket sock{ioc};
+            acceptor.accept(sock);
+            if (!admission->open()) {
+                refuse_connection(sock);
+                continue;
+            }
+            std::thread{std::bind(&serve_connection<local_socket>,
+                                  std::move(sock))}.detach();
+        }
+    } catch (const std::exception &e) {
+        die(std::string("accept_local(): ") + e.what());
+    }
+}
+
+/**
+ * Answer a GET that came in a datagram.
+ * @param in   the datagram, of size bytes
+ * @param out  has room for Udp_Get::max_datagram bytes
+ * @return the size of the answer, or 0 if it isn't a request to answer
+ */
+static size_t answer_udp(const char *in, size_t size, char *out) {
+    Udp_Get::Request req{};
+    if (!Udp_Get::get_request(in, size, req)) return 0;
+
+    Cache::Pinned pinned;
+    Udp_Get::Kind kind = Udp_Get::Kind::miss;
+    try {
+        pinned = shard(req.key).get_pinned(req.ns, req.key);
+        if (pinned.value().size_ != 0) kind = Udp_Get::Kind::hit;
+    } catch (std::exception &e) {
+        std::cerr << "answer_udp(): " << e.what() << std::endl;
+        kind = Udp_Get::Kind::error;
+    }
+    const Cache::val_type val = pinned.value();
+    const std::string_view value =
+            kind == Udp_Get::Kind::hit
+                    ? std::string_view(val.data_, strnlen(val.data_, val.size_))
+                    : std::string_view();
+    const size_t wrote = Udp_Get::put_answer(out, req, kind, value);
+
+    if (log_level >= log_requests)
+        std::cerr << "UDP GET " << req.key << ": "
+                  << static_cast<char>(out[4]) << std::endl;
+    return wrote;
+}
+
+/**
+ * Answer GETs in datagrams on a socket of our own, forever. Requests are
+ * taken a batch at a time with recvmmsg(), which waits for the first and
+ * then takes whatever else has come in, and the answers go back with one
+ * sendmmsg(). Like accept_loop(), every listener binds the same port with
+ * SO_REUSEPORT when there are several, so the kernel spreads the load.
+ * @param at     where to listen
+ * @param shared whether other listeners are on the same port
+ */
+static void serve_udp(udp::endpoint at, bool shared) {
+    constexpr size_t batch = 32;
+    try {
+        net::io_context ioc{1};
+        udp::socket sock{ioc};
+        sock.open(at.protocol());
+        if (shared) sock.set_option(reuse_port(true));
+        sock.bind(at);
+        const int fd = sock.native_handle();
+
+        std::vector<char> in(batch * Udp_Get::max_datagram);
+        std::vector<char> out(batch * Udp_Get::max_datagram);
+        sockaddr_storage from[batch];
+        iovec in_iov[batch], out_iov[batch];
+        mmsghdr in_msgs[batch], out_msgs[batch];
+        for (size_t i = 0; i < batch; i++) {
+            in_iov[i] = {in.data() + i * Udp_Get::max_datagram,
+                         Udp_Get::max_datagram};
+            in_msgs[i] = {};
+            in_msgs[i].msg_hdr.msg_name = &from[i];
+            in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+            in_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        for (;;) {
+            for (mmsghdr &msg : in_msgs)
+                msg.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            const int got = recvmmsg(fd, in_msgs, batch, MSG_WAITFORONE,
+                                     nullptr);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                die(std::string("serve_udp(): recvmmsg: ") + strerror(errno));
+            }
+
+            unsigned answers = 0;
+            for (int i = 0; i < got; i++) {
+                char *answer = out.data() + answers * Udp_Get::max_datagram;
+                const size_t size = answer_udp(
+                        static_cast<const char *>(in_iov[i].iov_base),
+                        in_msgs[i].msg_len, answer);
+                if (size == 0) continue;
+                out_iov[answers] = {answer, size};
+                out_msgs[answers] = {};
+                out_msgs[answers].msg_hdr.msg_name = &from[i];
+                out_msgs[answers].msg_hdr.msg_namelen =
+                        in_msgs[i].msg_hdr.msg_namelen;
+                out_msgs[answers].msg_hdr.msg_iov = &out_iov[answers];
+                out_msgs[answers].msg_hdr.msg_iovlen = 1;
+                answers++;
+            }
+
+            // An answer that can't be sent is as good as lost; the client
+            // tries again
+            for (unsigned sent = 0; sent < answers;) {
+                const int n = sendmmsg(fd, out_msgs + sent, answers - sent, 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    std::cerr << "serve_udp(): sendmmsg: " << strerror(errno)
+                              << std::endl;
+                    sent++;
+                    continue;
+                }
+                sent += static_cast<unsigned>(n);
+            }
+        }
+    } catch (const std::exception &e) {
+        die(std::string("serve_udp(): ") + e.what());
+    }
+}
+
+/**
+ * Read a list of CPUs like 0,2,4-7.
+ * @return the CPUs, or nothing if the list is malformed
+ */
+static std::vector<int> parse_cpus(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+        const std::string_view item = list.substr(0, list.find(','));
+        list.remove_prefix(std::min(list.size(), item.size() + 1));
+        int first = -1, last = -1;
+        auto [end, ec] =
+                std::from_chars(item.data(), item.data() + item.size(), first);
+        if (ec != std::errc() || first < 0) return {};
+        last = first;
+        if (end != item.data() + item.size()) {
+            if (*end != '-') return {};
+            auto [stop, ec2] = std::from_chars(
+                    end + 1, item.data() + item.size(), last);
+            if (ec2 != std::errc() || stop != item.data() + item.size() ||
+                last < first)
+                return {};
+        }
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
 }
 
 /**
@@ -244,15 +1646,52 @@ void handle_sessions(tcp::socket& sock) {
  * -m maxmem  : Maximum memory, passed to cache
  * -s server  : assume localhost for now
  * -p port    : port to bind to
- * -t threads : ignore for now
+ * -t threads : acceptors, each with its own listening socket
+ * -c cpus    : CPUs to pin the acceptors to, e.g. 0-3 or 0,2,4
+ * -S         : give every acceptor its own shard of the cache
+ * -r replica : host:port of a replica to stream writes to; may be repeated
+ * -R         : be a replica, only accepting writes from a primary
+ * -L low     : percentage of maxmem the background evictor evicts down to
+ * -H high    : percentage of maxmem at which the background evictor starts
+ * -P bytes   : answer GETs of values up to this size from responses
+ *              rendered when they were set
+ * -u         : serve connections through io_uring where the kernel has it
+ * -e policy  : evict by fifo, lru, lfu, gdsf (size, cost and frequency),
+ *              or adaptive (whichever of fifo, lru and lfu misses least)
+ * -l level   : log errors (0), the configuration too (1), or every request
+ *              and response too (2)
+ * -z bytes   : store values of at least this size compressed
+ * -d bytes   : store values of at least this size once for all the keys
+ *              they're set under
+ * -D path    : keep evicted values in this file, and look there on misses
+ * -B bytes   : the most that file holds; 10 times maxmem by default
+ * -U path    : also listen on a Unix socket here, for clients on this host
+ * -g port    : also answer GETs of small values in datagrams on this UDP
+ *              port, with a listener per acceptor
+ * -C conns   : refuse connections past this many; 0 for no limit
+ * -I reqs    : work on at most this many requests at once
+ * -Q reqs    : queue at most this many more, and turn away the rest
+ * -W ms      : once the queue stands, shed requests that waited longer
+ *
+ * maxmem, the watermarks and the log level can be changed while running
+ * with POST /config; see configure().
  */
 int main(int argc, char *argv[]) {
     // Default values for arguments
-    size_t maxmem = 65536;
     net::ip::address server = net::ip::make_address("127.0.0.1");
     // server.make_address("127.0.0.1");
     unsigned short port = 42069;
-    int threads = 1;
+    int threads = 0;
+    std::vector<int> cpus;
+    bool sharded = false;
+    std::vector<std::string> replicas;
+    std::string policy = "fifo";
+    std::string local_path;
+    unsigned short udp_port = 0;
+    size_t max_connections = 1024;
+    size_t max_in_flight = 64;
+    size_t max_queue = 1024;
+    std::chrono::milliseconds queue_target{5};
 
     // Catch SIGTERMs
     signal(SIGTERM, signal_handler);
@@ -263,17 +1702,60 @@ int main(int argc, char *argv[]) {
                   << "\t-m [65536]     Cache's capacity in bytes." << std::endl
                   << "\t-s [127.0.0.1] address to listen on." << std::endl
                   << "\t-p [42069]     Port to listen on." << std::endl
-                  << "\t-t [1]         Number of threads to use." << std::endl
+                  << "\t-t [1]         Number of acceptors, each with its own"
+                  << " listening socket." << std::endl
+                  << "\t-c cpus        Pin acceptors to these CPUs, e.g. 0-3"
+                  << " or 0,2,4; one acceptor each by default." << std::endl
+                  << "\t-S             Split the cache into a shard per"
+                  << " acceptor." << std::endl
+                  << "\t-r host:port   Replicate writes to this server; may"
+                  << " be repeated." << std::endl
+                  << "\t-R             Be a replica; refuse writes that don't"
+                  << " come from a primary." << std::endl
+                  << "\t-L [85]        Evict in the background down to this"
+                  << " percentage of maxmem." << std::endl
+                  << "\t-H [95]        Start evicting in the background above"
+                  << " this percentage of maxmem." << std::endl
+                  << "\t-P [0]         Pre-render GET responses for values of"
+                  << " up to this many bytes." << std::endl
+                  << "\t-u             Serve connections through io_uring,"
+                  << " if the kernel has it." << std::endl
+                  << "\t-e [fifo]      Eviction policy: fifo, lru, lfu,"
+                  << " gdsf to weigh size, cost and gets, or adaptive to"
+                  << " pick the best of fifo, lru and lfu as it goes."
+                  << std::endl
+                  << "\t-l [2]         Log errors (0), the configuration (1),"
+                  << " or every request too (2)." << std::endl
+                  << "\t-z [0]         Compress values of at least this many"
+                  << " bytes." << std::endl
+                  << "\t-d [0]         Share values of at least this many"
+                  << " bytes between keys set to the same." << std::endl
+                  << "\t-D path        Keep evicted values in this file, and"
+                  << " look there on misses." << std::endl
+                  << "\t-B [10*maxmem] Most bytes to keep in that file."
+                  << std::endl
+                  << "\t-U path        Also listen on a Unix socket here, for"
+                  << " clients on this host." << std::endl
+                  << "\t-g port        Also answer GETs of small values over"
+                  << " UDP on this port." << std::endl
+                  << "\t-C [1024]      Refuse connections past this many; 0"
+                  << " for no limit." << std::endl
+                  << "\t-I [64]        Work on at most this many requests at"
+                  << " once." << std::endl
+                  << "\t-Q [1024]      Queue at most this many more requests,"
+                  << " and answer the rest with 503." << std::endl
+                  << "\t-W [5]         Once requests keep queueing, shed those"
+                  << " that waited more than this many ms." << std::endl
                   << "\t-h             Print this message." << std::endl;
         exit(status);
     };
 
     // Process command line arguments
     int option;
-    while ((option = getopt(argc, argv, "m:s:p:t:h")) != -1) {
+    while ((option = getopt(argc, argv, "m:s:p:t:c:Sr:RL:H:P:ue:l:z:d:D:B:U:g:C:I:Q:W:h")) != -1) {
         switch (option) {
             case 'm':
-                maxmem = strtoul(optarg, nullptr, 10);
+                maxmem = strtoull(optarg, nullptr, 10);
                 if (maxmem <= 0) usage(EXIT_FAILURE);
                 break;
             case 's':
@@ -286,6 +1768,83 @@ int main(int argc, char *argv[]) {
                 break;
             case 't':
                 threads = std::stoi(optarg, nullptr, 10);
+                if (threads <= 0) usage(EXIT_FAILURE);
+                break;
+            case 'c':
+                cpus = parse_cpus(optarg);
+                if (cpus.empty()) usage(EXIT_FAILURE);
+                break;
+            case 'S':
+                sharded = true;
+                break;
+            case 'r':
+                replicas.emplace_back(optarg);
+                break;
+            case 'R':
+                replica_mode = true;
+                break;
+            case 'L':
+                low_mark = strtod(optarg, nullptr);
+                break;
+            case 'H':
+                high_mark = strtod(optarg, nullptr);
+                break;
+            case 'P':
+                render_limit = static_cast<Cache::size_type>(
+                        strtoul(optarg, nullptr, 10));
+                break;
+            case 'u':
+                use_uring = true;
+                break;
+            case 'e':
+                policy = optarg;
+                if (policy != "fifo" && policy != "lru" && policy != "lfu" &&
+                    policy != "gdsf" && policy != "adaptive") {
+                    usage(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                log_level = std::stoi(optarg, nullptr, 10);
+                if (log_level < log_errors || log_level > log_requests)
+                    usage(EXIT_FAILURE);
+                break;
+            case 'z':
+                compress_limit = static_cast<Cache::size_type>(
+                        strtoull(optarg, nullptr, 10));
+                break;
+            case 'd':
+                dedup_limit = static_cast<Cache::size_type>(
+                        strtoull(optarg, nullptr, 10));
+                break;
+            case 'D':
+                disk_path = optarg;
+                break;
+            case 'B':
+                disk_capacity = strtoull(optarg, nullptr, 10);
+                if (disk_capacity == 0) usage(EXIT_FAILURE);
+                break;
+            case 'U':
+                local_path = optarg;
+                break;
+            case 'g':
+                udp_port = static_cast<unsigned short>(
+                        strtoul(optarg, nullptr, 10));
+                if (udp_port == 0) usage(EXIT_FAILURE);
+                break;
+            case 'C':
+                max_connections = strtoull(optarg, nullptr, 10);
+                break;
+            case 'I':
+                max_in_flight = strtoull(optarg, nullptr, 10);
+                if (max_in_flight == 0) usage(EXIT_FAILURE);
+                break;
+            case 'Q':
+                max_queue = strtoull(optarg, nullptr, 10);
+                break;
+            case 'W':
+                queue_target = std::chrono::milliseconds(
+                        strtoull(optarg, nullptr, 10));
+                if (queue_target.count() == 0) usage(EXIT_FAILURE);
                 break;
             case 'h':
                 usage(EXIT_SUCCESS);
@@ -296,45 +1855,122 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Debugging
-    std::cerr << "==> ARGUMENTS <==" << std::endl
-              << "maxmem : " << maxmem << std::endl
-              << "server : " << server << std::endl
-              << "port   : " << port << std::endl
-              << "threads: " << threads << std::endl
-              << "==[ END ARGUMENTS ]==" << std::endl;
-
-    // Set up the cache
-    Cache::hash_func hasher = std::hash<key_type>();
-    auto *evictor = new Fifo_Evictor();
-    cache = std::make_shared<Cache>(maxmem, 0.75, evictor, hasher);
-
-    // An error message object
-    beast::error_code ec;
+    if (threads == 0) threads = cpus.empty() ? 1 : static_cast<int>(cpus.size());
 
-    try {
-        /// The io_context is required for all I/O
-        net::io_context ioc{threads};
-        
-        /// The acceptor receives incoming connections
-        tcp::acceptor acceptor{ioc, {server, port}};
-        
-        //
-        // Loop until the program is killed or something breaks
-        //
-        for (;;) {
-            /// This will receive the new connection
-            tcp::socket sock{ioc};
-            
-            // Block until we recieve a connection
-            acceptor.accept(sock);
+    // Debugging
+    if (log_level >= log_config) {
+        std::cerr << "==> ARGUMENTS <==" << std::endl
+                  << "maxmem : " << maxmem << std::endl
+                  << "server : " << server << std::endl
+                  << "port   : " << port << std::endl
+                  << "threads: " << threads << std::endl
+                  << "cpus   : " << cpus.size() << std::endl
+                  << "shards : " << (sharded ? threads : 1) << std::endl
+                  << "replica: " << (replica_mode ? "yes" : "no") << std::endl
+                  << "streams: " << replicas.size() << std::endl
+                  << "marks  : " << low_mark << "% - " << high_mark << "%"
+                  << std::endl
+                  << "render : " << render_limit << std::endl
+                  << "uring  : " << (use_uring ? "yes" : "no") << std::endl
+                  << "evictor: " << policy << std::endl
+                  << "log    : " << log_level << std::endl
+                  << "packed : " << compress_limit << std::endl
+                  << "dedup  : " << dedup_limit << std::endl
+                  << "disk   : " << (disk_path.empty() ? "none" : disk_path)
+                  << std::endl
+                  << "unix   : " << (local_path.empty() ? "none" : local_path)
+                  << std::endl
+                  << "udp    : " << udp_port << std::endl
+                  << "admit  : " << max_connections << " connections, "
+                  << max_in_flight << " + " << max_queue << " requests, "
+                  << queue_target.count() << " ms" << std::endl
+                  << "==[ END ARGUMENTS ]==" << std::endl;
+    }
 
-            // Launch the session, transfer ownership of the socket
-            std::thread{std::bind(&handle_sessions, std::move(sock))}.detach();
+    // Set up the cache; keys come from clients, so use a seeded hash.
+    // Shards split maxmem between them.
+    const size_t shard_count = sharded ? static_cast<size_t>(threads) : 1;
+    value_limit = maxmem / shard_count;
+    if (disk_capacity == 0) disk_capacity = 10 * maxmem;
+    for (size_t i = 0; i < shard_count; i++) {
+        Cache::hash_func hasher = Seeded_Hash();
+        Evictor *evictor;
+        if (policy == "adaptive") {
+            adaptive_evictors.push_back(new Adaptive_Evictor(value_limit));
+            evictor = adaptive_evictors.back();
+        } else if (policy == "gdsf") {
+            evictor = new Gdsf_Evictor();
+        } else if (policy == "lfu") {
+            evictor = new Lfu_Evictor();
+        } else if (policy == "lru") {
+            evictor = new Lru_Evictor();
+        } else {
+            evictor = new Fifo_Evictor();
         }
-        
-    } catch (const std::exception &e) {
-        std::cerr << "main(): " << e.what() << std::endl;
+        shards.push_back(std::make_shared<Cache>(
+                static_cast<Cache::size_type>(value_limit), 0.75, evictor,
+                hasher));
+        Cache &cache = *shards.back();
+        if (render_limit != 0) cache.set_renderer(render_limit, render_head);
+        if (compress_limit != 0) cache.set_compression(compress_limit);
+        if (dedup_limit != 0) cache.set_dedup(dedup_limit);
+        if (!disk_path.empty()) {
+            const std::string path =
+                    shard_count == 1 ? disk_path
+                                     : disk_path + "." + std::to_string(i);
+            if (!cache.set_disk_tier(path, disk_capacity / shard_count))
+                exit(EXIT_FAILURE);
+        }
+        if (!cache.set_watermarks(low_mark / 100, high_mark / 100)) {
+            std::cerr << "Bad watermarks: need 0 < low <= high <= 100"
+                      << std::endl;
+            usage(EXIT_FAILURE);
+        }
+    }
+
+    // Start streaming to the replicas, each starting with a full copy, taken
+    // a few buckets of a shard at a time so writes only wait for those
+    if (!replicas.empty()) {
+        replicator = std::make_unique<Replicator>(replicas, []() {
+            return [shard = size_t(0), cursor = Cache::Cursor{}](
+                           std::vector<Replicator::Mutation> &part) mutable {
+                auto copy = [&part](std::string_view ns, key_view_type key,
+                                    Cache::val_type val) {
+                    part.push_back({Replicator::Op::set, key_type(key),
+                                    std::string(val.data_,
+                                                strnlen(val.data_, val.size_)),
+                                    std::string(ns)});
+                };
+                const size_t had = part.size();
+                while (shard < shards.size() && part.size() == had) {
+                    if (shards[shard]->for_each_step(cursor, copy_buckets,
+                                                     copy)) {
+                        shard++;
+                        cursor = Cache::Cursor{};
+                    }
+                }
+                return shard < shards.size();
+            };
+        });
+    }
+
+    admission = std::make_unique<Admission>(max_connections, max_in_flight,
+                                            max_queue, queue_target,
+                                            20 * queue_target);
+
+    // One acceptor per thread, the last one on this thread
+    const tcp::endpoint at{server, port};
+    std::vector<std::thread> acceptors;
+    if (!local_path.empty()) acceptors.emplace_back(accept_local, local_path);
+    for (int i = 0; udp_port != 0 && i < threads; i++)
+        acceptors.emplace_back(serve_udp, udp::endpoint{server, udp_port},
+                               threads > 1);
+    for (int i = 0; i + 1 < threads; i++) {
+        const int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        acceptors.emplace_back(accept_loop, at, cpu, true);
     }
+    accept_loop(at, cpus.empty() ? -1 : cpus[(threads - 1) % cpus.size()],
+                threads > 1);
+    for (std::thread &acceptor : acceptors) acceptor.join();
     return EXIT_SUCCESS;
 }
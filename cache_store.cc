@@ -5,41 +5,457 @@
  * Implement the look-aside cache interface in cache.hh.
  */
 #include <cassert>
-#include <cstring>
+#include <charconv>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "basic_cache.hh"
 #include "cache.hh"
+#include "disk_tier.hh"
 #include "fifo_evictor.hh"
+#include "lz4.hh"
+#include "seeded_hash.hh"
+
+/**
+ * Adapt an Evictor pointer, which may be null, to BasicCache's policy.
+ * These calls stay virtual; only BasicCache users get them inlined.
+ */
+struct Evictor_Ref {
+    Evictor *evictor;
+
+    void touch_key(const key_type &key, uint64_t size, double cost) {
+        if (evictor != nullptr) evictor->touch_key(key, size, cost);
+    }
+
+    void forget_key(const key_type &key) {
+        if (evictor != nullptr) evictor->forget_key(key);
+    }
+
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) {
+        if (evictor != nullptr) evictor->evict_batch(bytes, max_keys, victims);
+    }
+
+    void clear() {
+        if (evictor != nullptr) evictor->clear();
+    }
+};
+
+/**
+ * Adapt a Cache::hash_func to BasicCache's policy.
+ * The two hashers we know of are called on the key's view directly:
+ * std::hash<std::string_view> is required to agree with
+ * std::hash<std::string>, and Seeded_Hash takes a view anyway.
+ * Any other hasher gets a copy of the key.
+ */
+struct Function_Hasher {
+    Cache::hash_func hasher;
+    bool std_hasher;             // hasher is std::hash<key_type>
+    const Seeded_Hash *seeded;  // hasher is a Seeded_Hash
+
+    explicit Function_Hasher(Cache::hash_func hash)
+            : hasher(std::move(hash)),
+              std_hasher(hasher.target<std::hash<key_type>>() != nullptr),
+              seeded(hasher.target<Seeded_Hash>()) {}
+
+    Function_Hasher(const Function_Hasher &other)
+            : Function_Hasher(other.hasher) {}
+
+    size_t operator()(key_view_type key) const {
+        if (std_hasher) return std::hash<key_view_type>()(key);
+        if (seeded != nullptr) return (*seeded)(key);
+        return hasher(key_type(key));
+    }
+};
+
+/**
+ * Hand memory the allocator is holding on to back to the OS, where the
+ * allocator lets us.
+ */
+static void trim_memory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
 
 /**
  * Implement the private parts of Cache using the pimpl idiom.
  * Elements of Impl need to be public, so a struct makes sense here
+ * All the work is done by a BasicCache; Cache adds a lock, owns the
+ * evictor and runs the background reclaimer.
  */
 class Cache::Impl {
 public:
-    // These are set in the constructor
-    size_type maxmem;
-    Evictor *evictor;  // A pointer to the evictor
+    // Most keys the reclaimer evicts before letting requests have the lock
+    static constexpr size_t reclaim_batch = 32;
+
+    // Most buckets the reclaimer sweeps before letting requests have the lock
+    static constexpr size_t sweep_batch = 64;
+
+    // While the cache shrinks, the reclaimer hands free memory back to the
+    // OS each time it has evicted this many more bytes
+    static constexpr size_type trim_bytes = 4 << 20;
+
+    // Keys in a namespace are stored as <mark>ns<mark>generation<mark>key
+    static constexpr char ns_mark = '\x1f';
+
+    /**
+     * A namespace's generation is part of the stored keys of its entries,
+     * so bumping it hides them all at once. The hidden entries still take
+     * up space until they are evicted or swept.
+     */
+    struct Namespace {
+        std::atomic<uint64_t> generation{0};
+        std::atomic<size_type> used{0};  // Bytes, hidden entries included
+        std::atomic<size_t> gets{0};
+        std::atomic<size_t> hits{0};
+    };
+
+    Evictor *evictor;  // A pointer to the evictor, deleted with the cache
+
+    // Every public method but get() and hit_rate() holds this; the store
+    // lets those run alongside one writer. A get only takes it once in a
+    // long while, for hit().
+    mutable std::mutex lock;
 
-    mutable size_t successful_gets = 0;  // Number of successful calls to get()
-    mutable size_t gets = 0;             // Number of calls to get
+    BasicCache<Evictor_Ref, Function_Hasher> store;
 
-    // The table is a std::unordered_map
-    // std::unordered_map<key_type, val_type> table;
+    // Sampled heavy hitters among gets and sets; has its own lock
+    Hot_Keys hot;
 
-    // The following line may be uncommented to use a custom hasher.
-    // We have not figure out how to get that working yet
-    // default constructor: empty map
-    std::unordered_map<key_type, val_type, hash_func> table;
+    // Namespaces are never removed, so pointers to them stay good
+    mutable std::shared_mutex ns_lock;  // Guards the map, not its contents
+    std::unordered_map<key_type, std::unique_ptr<Namespace>> namespaces;
+
+    // The reclaimer thread, see Cache::set_watermarks()
+    std::thread reclaimer;
+    std::condition_variable reclaim_cv;
+    size_type low_mark = 0;   // Bytes to evict down to
+    size_type high_mark = 0;  // Bytes to start evicting at; 0 for never
+    double low_fraction = 0;  // Of maxmem, as last set
+    double high_fraction = 0;
+    bool reclaim_wanted = false;
+    bool shrinking = false;     // maxmem shrank below what's used
+    bool sweep_wanted = false;  // A namespace was flushed
+    bool stopping = false;
 
     Impl(size_type max_mem, float max_load_factor, Evictor *p_evictor,
          hash_func hasher)
-            : table(0, hasher) {
-        this->maxmem = max_mem;
-        table.max_load_factor(max_load_factor);
-        this->evictor = p_evictor;  // Use the evictor
+            : evictor(p_evictor),
+              store(max_mem, max_load_factor, Evictor_Ref{p_evictor},
+                    Function_Hasher(std::move(hasher))) {
+        store.on_drop([this](const key_type &key, size_type size) {
+            std::string_view ns;
+            if (split_key(key, ns) == nullptr) return;
+            Namespace *space = find_namespace(ns);
+            if (space != nullptr) space->used -= size;
+        });
+    }
+
+    Namespace *find_namespace(std::string_view ns) const {
+        std::shared_lock<std::shared_mutex> guard(ns_lock);
+        auto found = namespaces.find(key_type(ns));
+        return found == namespaces.end() ? nullptr : found->second.get();
+    }
+
+    /**
+     * Tell the evictor of a hit, and let it count what it put off if it
+     * asks to. Takes the lock only then.
+     */
+    void hit(key_view_type key, size_type size) const {
+        if (evictor == nullptr || !evictor->hit_key(key, size)) return;
+        std::lock_guard<std::mutex> guard(lock);
+        evictor->settle();
+    }
+
+    /**
+     * Call visit(ns, key, val) on an entry stored under stored, unless its
+     * namespace was flushed.
+     */
+    template <typename Visit>
+    void visit_stored(const key_type &stored, val_type val,
+                      Visit &&visit) const {
+        std::string_view ns;
+        uint64_t generation;
+        const char *key = split_key(stored, ns, &generation);
+        if (key == nullptr) {
+            visit("", stored, val);
+            return;
+        }
+        const Namespace *space = find_namespace(ns);
+        if (space != nullptr && space->generation == generation)
+            visit(ns, std::string_view(key, stored.c_str() + stored.size() - key),
+                  val);
+    }
+
+    Namespace &make_namespace(std::string_view ns) {
+        Namespace *space = find_namespace(ns);
+        if (space != nullptr) return *space;
+        std::unique_lock<std::shared_mutex> guard(ns_lock);
+        auto &slot = namespaces[key_type(ns)];
+        if (!slot) slot = std::make_unique<Namespace>();
+        return *slot;
+    }
+
+    /**
+     * @return the key key is stored under in namespace ns right now
+     */
+    static key_type stored_key(std::string_view ns, uint64_t generation,
+                               key_view_type key) {
+        if (ns.empty()) return key_type(key);
+        key_type stored(1, ns_mark);
+        stored.append(ns)
+                .append(1, ns_mark)
+                .append(std::to_string(generation))
+                .append(1, ns_mark)
+                .append(key);
+        return stored;
+    }
+
+    /**
+     * Take a stored key apart.
+     * @param ns set to the key's namespace
+     * @param generation if not null, set to the namespace's generation
+     *                   when the key was stored
+     * @return the key within its namespace, or null for a key that isn't in
+     *         one; then ns is left alone
+     */
+    static const char *split_key(const key_type &stored, std::string_view &ns,
+                                 uint64_t *generation = nullptr) {
+        if (stored.empty() || stored[0] != ns_mark) return nullptr;
+        const size_t ns_end = stored.find(ns_mark, 1);
+        if (ns_end == key_type::npos) return nullptr;
+        const size_t gen_end = stored.find(ns_mark, ns_end + 1);
+        if (gen_end == key_type::npos) return nullptr;
+        ns = std::string_view(stored).substr(1, ns_end - 1);
+        if (generation != nullptr)
+            std::from_chars(stored.data() + ns_end + 1,
+                            stored.data() + gen_end, *generation);
+        return stored.c_str() + gen_end + 1;
+    }
+
+    /**
+     * @return true iff key was stored in a namespace that has been flushed
+     *         since
+     */
+    bool is_stale(const key_type &key) const {
+        std::string_view ns;
+        uint64_t generation;
+        if (split_key(key, ns, &generation) == nullptr) return false;
+        const Namespace *space = find_namespace(ns);
+        return space == nullptr || space->generation != generation;
+    }
+
+    // Stored with each value of up to render_limit bytes; see set_renderer()
+    std::function<std::string(key_view_type, val_type)> render;
+    size_type render_limit = 0;
+
+    std::string rendered(key_view_type key, val_type val) const {
+        if (!render || val.size_ > render_limit) return {};
+        return render(key, val);
+    }
+
+    // Where evicted values go, if anywhere; see Cache::set_disk_tier()
+    std::unique_ptr<Disk_Tier> disk;
+
+    /**
+     * Drop what the disk tier has for a key that's being set or deleted.
+     * Needs lock.
+     * @return true iff it had something
+     */
+    bool forget_on_disk(key_view_type stored) {
+        return disk != nullptr && disk->erase(stored);
+    }
+
+    /**
+     * Look a key that missed in memory up in the disk tier, and move it back
+     * into memory unless it was set or deleted meanwhile. Takes the lock
+     * only to move it; the disk is read without it.
+     * @param packed set to whether the copy is an Lz4 frame of the value
+     * @return a new[] copy of the value as it was stored, or nullptr with
+     *         size 0 if it isn't there either
+     */
+    val_type promote(const key_type &stored, bool &packed) {
+        std::string bytes;
+        uint64_t stamp;
+        if (disk == nullptr || !disk->get(stored, bytes, packed, stamp))
+            return {nullptr, 0};
+        std::string_view ns;
+        const char *key = split_key(stored, ns);
+        const val_type val{bytes.data(), bytes.size()};
+        const std::string head =
+                packed ? std::string()
+                       : rendered(key == nullptr ? key_view_type(stored)
+                                                 : key_view_type(key),
+                                  val);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (disk->take(stored, stamp)) {
+                try {
+                    byte_type *buffer = store.make_buffer(val.size_, packed);
+                    memcpy(buffer, val.data_, val.size_);
+                    if (store.set_buffer(stored, buffer, head) &&
+                        key != nullptr) {
+                        Namespace *space = find_namespace(ns);
+                        if (space != nullptr) space->used += val.size_;
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << "Cache::get(): promote: " << e.what()
+                              << std::endl;
+                }
+                wake_reclaimer();
+            }
+        }
+        auto *copy = new byte_type[val.size_];
+        memcpy(copy, val.data_, val.size_);
+        return {copy, val.size_};
+    }
+
+    /**
+     * promote(), unpacking what it finds.
+     */
+    val_type from_disk(const key_type &stored) {
+        bool packed = false;
+        val_type val = promote(stored, packed);
+        if (!packed || val.data_ == nullptr) return val;
+        size_type raw = Lz4::raw_size(val.data_, val.size_);
+        auto *out = new byte_type[raw];
+        if (!Lz4::decompress(val.data_, val.size_, out)) {
+            delete[] out;
+            out = nullptr;
+            raw = 0;
+        }
+        delete[] val.data_;
+        return {out, raw};
+    }
+
+    // Takes no lock; see BasicCache::pack()
+    byte_type *pack(val_type val) {
+        try {
+            return store.pack(val);
+        } catch (const std::exception &e) {
+            std::cerr << "Cache::set(): compress: " << e.what() << std::endl;
+            return nullptr;
+        }
+    }
+
+    /**
+     * Store a buffer from make_buffer() or pack() under key in namespace
+     * ns; the rest of set_buffer().
+     */
+    bool store_buffer(std::string_view ns, key_view_type key,
+                      byte_type *buffer, std::string_view head, double cost) {
+        const size_type size = decltype(store)::buffer_size(buffer);
+        std::lock_guard<std::mutex> guard(lock);
+        bool ok;
+        if (ns.empty()) {
+            forget_on_disk(key);
+            ok = store.set_buffer(key, buffer, head, cost);
+        } else {
+            Namespace &space = make_namespace(ns);
+            const key_type stored = stored_key(ns, space.generation, key);
+            forget_on_disk(stored);
+            ok = store.set_buffer(stored, buffer, head, cost);
+            if (ok) space.used += size;
+        }
+        wake_reclaimer();
+        return ok;
+    }
+
+    // Needs lock; called after a set
+    void wake_reclaimer() {
+        const bool over = high_mark != 0 ? store.space_used() > high_mark
+                                         : shrinking;
+        if (over && !reclaim_wanted) {
+            reclaim_wanted = true;
+            reclaim_cv.notify_one();
+        }
+    }
+
+    // Needs lock; after the watermarks or maxmem change
+    void set_marks() {
+        if (high_fraction == 0) return;
+        const double maxmem = static_cast<double>(store.capacity());
+        low_mark = static_cast<size_type>(low_fraction * maxmem);
+        high_mark = static_cast<size_type>(high_fraction * maxmem);
+        if (high_mark == 0) high_mark = 1;
+    }
+
+    // Needs lock; what the reclaimer evicts down to
+    size_type reclaim_target() const {
+        return high_mark != 0 ? low_mark : store.capacity();
+    }
+
+    // Needs lock
+    void start_reclaimer() {
+        if (!reclaimer.joinable())
+            reclaimer = std::thread([this]() { reclaim(); });
+    }
+
+    /**
+     * Body of the reclaimer thread. Each wakeup works down to the low mark
+     * (or maxmem, after a shrink without watermarks) and sweeps out flushed
+     * namespaces, in batches, dropping the lock in between so requests
+     * aren't held up. While shrinking, freed memory goes back to the OS
+     * every trim_bytes, rather than staying with the allocator.
+     */
+    void reclaim() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping) {
+            reclaim_cv.wait(guard, [this]() {
+                return stopping || reclaim_wanted || sweep_wanted;
+            });
+            if (reclaim_wanted) {
+                reclaim_wanted = false;
+                size_type trimmed = store.space_used();
+                while (!stopping && store.space_used() > reclaim_target()) {
+                    if (store.evict_to(reclaim_target(), reclaim_batch) <
+                                reclaim_batch &&
+                        store.space_used() > reclaim_target())
+                        break;  // The evictor ran dry; wait for more sets
+                    const bool trim = shrinking &&
+                                      trimmed - store.space_used() >= trim_bytes;
+                    if (trim) trimmed = store.space_used();
+                    guard.unlock();
+                    if (trim) {
+                        trim_memory();
+                    } else {
+                        std::this_thread::yield();
+                    }
+                    guard.lock();
+                }
+                if (shrinking && store.space_used() <= store.capacity()) {
+                    shrinking = false;
+                    guard.unlock();
+                    trim_memory();
+                    guard.lock();
+                }
+            }
+            if (sweep_wanted) {
+                sweep_wanted = false;
+                size_t cursor = 0;
+                while (!stopping &&
+                       !store.sweep(cursor, sweep_batch,
+                                    [this](const key_type &key) {
+                                        return is_stale(key);
+                                    })) {
+                    guard.unlock();
+                    std::this_thread::yield();
+                    guard.lock();
+                }
+            }
+        }
     }
 };
 
@@ -53,17 +469,28 @@ public:
  *                          New insertions fail after maxmem has been exceeded.
  * @param hasher            Hash function to use on the keys.
  *                          Defaults to C++'s std::hash.
+ * @param expected_keys     How many keys to size the table for up front.
  */
 Cache::Cache(size_type maxmem, float max_load_factor, Evictor *evictor,
-             hash_func hasher)
-        : pImpl_(new Impl(maxmem, max_load_factor, evictor, hasher)) {}
+             hash_func hasher, size_t expected_keys)
+        : pImpl_(new Impl(maxmem, max_load_factor, evictor, hasher)) {
+    if (expected_keys != 0) pImpl_->store.reserve(expected_keys);
+}
 
 /**
  * Define a destructor to clean up the data buffers
  */
 Cache::~Cache() {
-    delete this->pImpl_->evictor;
+    if (this->pImpl_->reclaimer.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(this->pImpl_->lock);
+            this->pImpl_->stopping = true;
+        }
+        this->pImpl_->reclaim_cv.notify_one();
+        this->pImpl_->reclaimer.join();
+    }
     assert(Cache::reset());
+    delete this->pImpl_->evictor;
 }
 
 /**
@@ -77,186 +504,569 @@ Cache::~Cache() {
  * @param val struct
  * @return true iff the insertion of the data to the store was successful.
  */
-bool Cache::set(key_type key, val_type val) {
-    // copy key; '=' copies c++ 'std::string's
-    key_type key_cpy = key;
-
-    // Register key with the evictor
-    if (this->pImpl_->evictor != nullptr) {
-        this->pImpl_->evictor->touch_key(key);
-    }
-
-    // Find things to evict
-    size_type memused = this->space_used() + val.size_;
-    while (memused > this->pImpl_->maxmem) {
-        if (this->pImpl_->evictor != nullptr) {
-            // custom hasher should not cause SIGABRT
-            try {
-                key_type to_evict = this->pImpl_->evictor->evict();
-                if (to_evict.empty()) return false;
-                while (this->pImpl_->table.find(to_evict) ==
-                       this->pImpl_->table.end()) {
-                    to_evict = this->pImpl_->evictor->evict();
-                    if (to_evict.empty()) return false;
-                }
-                memused -= this->pImpl_->table.at(to_evict).size_;
-                this->del(to_evict);
-            } catch (const std::exception &e) {
-                std::cerr << "Cache::set(): evict, find, at, del: " << e.what()
-                          << std::endl;
-                return false;
-            }
-        } else {
-            return false;
-        }
+bool Cache::set(key_view_type key, val_type val) {
+    return set(std::string_view(), key, val);
+}
+
+/**
+ * @param key string
+ * @return val: a copy of the value associated with key in the cache,
+ *         or nullptr with size 0 if not found.
+ *         Note that the data_ pointer in the return key is a newly-allocated
+ *         copy of the data. It is the caller's responsibility to free it.
+ *         Takes no lock, so readers never wait for writers, but once in a
+ *         long while for the evictor (see Impl::hit()).
+ */
+Cache::val_type Cache::get(key_view_type key) const {
+    val_type val = this->pImpl_->store.get(key);
+    if (val.data_ != nullptr) {
+        this->pImpl_->hit(key, val.size_);
+    } else if (this->pImpl_->disk != nullptr) {
+        val = this->pImpl_->from_disk(key_type(key));
     }
+    this->pImpl_->hot.record(key, val.size_);
+    return val;
+}
 
-    try {
-        // Check to see if 'key' already exists; overwrite it
-        // Does this work when using a custom hasher?
-        if (this->pImpl_->table.find(key) != this->pImpl_->table.end()) {
-            this->del(key);
+/**
+ *  Delete object from Cache if object in Cache.
+ *  @param key of pair to erase
+ *  @return true if pair erased else false
+ */
+bool Cache::del(key_view_type key) {
+    std::lock_guard<std::mutex> guard(this->pImpl_->lock);
+    const bool on_disk = this->pImpl_->forget_on_disk(key);
+    return this->pImpl_->store.del(key) || on_disk;
+}
+
+/**
+ * @return the total amount of memory used up by all cache values (not keys).
+ */
+Cache::size_type Cache::space_used() const {
+    std::lock_guard<std::mutex> guard(this->pImpl_->lock);
+    return this->pImpl_->store.space_used();
+}
+
+/**
+ * @return the ratio of gets that had been successful.
+ */
+double Cache::hit_rate() const {
+    return this->pImpl_->store.hit_rate();
+}
+
+/**
+ * Delete all data from the cache.
+ * @return true iff successful.
+ */
+bool Cache::reset() {
+    Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    impl.hot.clear();
+    if (impl.disk != nullptr) impl.disk->clear();
+    {
+        std::shared_lock<std::shared_mutex> ns_guard(impl.ns_lock);
+        for (auto &space : impl.namespaces) {
+            space.second->used = 0;
+            space.second->gets = 0;
+            space.second->hits = 0;
         }
-    } catch (const std::exception &e) {
-        std::cout << "Cache::set(): find, del: " << e.what() << std::endl;
     }
+    return impl.store.reset();
+}
 
-    // copy val; do we need to do this?
-    auto *data_cpy = new byte_type[val.size_];
-    memcpy(data_cpy, val.data_, val.size_);
-    val_type val_cpy{data_cpy, val.size_};
+/**
+ * Start evicting in the background: once more than high * maxmem bytes are
+ * used, a thread evicts down to low * maxmem, a few keys at a time, so
+ * set() rarely has to evict inline.
+ * @param low  fraction of maxmem to evict down to
+ * @param high fraction of maxmem to start evicting at
+ * @return false if the watermarks are out of range
+ */
+bool Cache::set_watermarks(double low, double high) {
+    if (!(low > 0 && low <= high && high <= 1)) return false;
+    Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    impl.low_fraction = low;
+    impl.high_fraction = high;
+    impl.set_marks();
+    // A cache that never evicts has nothing to reclaim
+    if (impl.evictor != nullptr) impl.start_reclaimer();
+    return true;
+}
 
-    try {
-        this->pImpl_->table.insert(std::make_pair(key_cpy, val_cpy));
-    } catch (const std::exception &e) {  /// TODO: !untested?
-        // we have to delete it if it wasn't inserted
-        delete[] data_cpy;
-        std::cerr << "Cache::set(): insert: " << e.what() << std::endl;
-        return false;
+/**
+ * Change maxmem in place. Shrinking below what's used leaves the excess to
+ * the reclaimer, which evicts it a few keys at a time and trims the heap as
+ * it goes; meanwhile sets evict only as much as they add.
+ * @param maxmem the new maximum allowance for storage used by values
+ * @return false if maxmem is 0
+ */
+bool Cache::set_maxmem(size_type maxmem) {
+    if (maxmem == 0) return false;
+    Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    impl.store.set_capacity(maxmem);
+    impl.set_marks();
+    if (impl.evictor != nullptr && impl.store.space_used() > maxmem) {
+        impl.shrinking = true;
+        impl.reclaim_wanted = true;
+        impl.start_reclaimer();
+        impl.reclaim_cv.notify_one();
     }
-
     return true;
 }
 
 /**
- * @param key string
- * @return val: a copy of the value associated with key in the cache,
- *         or nullptr with size 0 if not found.
- *         Note that the data_ pointer in the return key is a newly-allocated
- *         copy of the data. It is the caller's responsibility to free it.
+ * Call visit on every <key, value> pair in the cache while holding the lock.
+ * Entries of flushed namespaces are skipped.
+ * @param visit called with each namespace, key and value; the value's data_
+ *              is only valid during the call.
  */
-Cache::val_type Cache::get(key_type key) const {
-    this->pImpl_->gets++;
+void Cache::for_each(const std::function<void(std::string_view, key_view_type,
+                                              val_type)> &visit) const {
+    const Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    impl.store.for_each([&](const key_type &stored, val_type val) {
+        impl.visit_stored(stored, val, visit);
+    });
+}
 
-    // return
-    // val_type val = {.data_: nullptr, .size_: 0}
-    Cache::val_type return_val{nullptr, 0};
+/**
+ * Call visit like for_each(), but on a few buckets at a time, holding the
+ * lock only while it visits them.
+ * @param cursor  where to go on from; start from Cursor{}
+ * @param buckets most buckets to visit in this step
+ * @return true iff the whole cache has been visited
+ */
+bool Cache::for_each_step(
+        Cursor &cursor, size_t buckets,
+        const std::function<void(std::string_view, key_view_type, val_type)>
+                &visit) const {
+    Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    return impl.store.walk(cursor.bucket, cursor.table_size, buckets,
+                           [&](const key_type &stored, val_type val) {
+                               impl.visit_stored(stored, val, visit);
+                           });
+}
 
-    try {
-        // return if the key doesn't exist
-        if (this->pImpl_->table.find(key) == this->pImpl_->table.end()) {
-            return return_val;
-        }
-    } catch (const std::exception &e) {
-        std::cout << "Cache::get(): find: " << e.what() << std::endl;
-        return return_val;
+/**
+ * Add a <key, value> pair to a namespace, like set(key, val).
+ * @param ns   the namespace; "" is the default one
+ * @param cost passed on to the evictor
+ * @return true iff the insertion of the data to the store was successful.
+ */
+bool Cache::set(std::string_view ns, key_view_type key, val_type val,
+                double cost) {
+    Impl &impl = *this->pImpl_;
+    impl.hot.record(key, val.size_);
+    const std::string head = impl.rendered(key, val);
+    byte_type *packed = head.empty() ? impl.pack(val) : nullptr;
+    if (packed != nullptr) return impl.store_buffer(ns, key, packed, {}, cost);
+    std::lock_guard<std::mutex> guard(impl.lock);
+    bool ok;
+    // The store evicts inline only if the reclaimer hasn't made room
+    if (ns.empty()) {
+        impl.forget_on_disk(key);
+        ok = impl.store.set(key, val, head, cost);
+    } else {
+        Impl::Namespace &space = impl.make_namespace(ns);
+        const key_type stored = Impl::stored_key(ns, space.generation, key);
+        impl.forget_on_disk(stored);
+        ok = impl.store.set(stored, val, head, cost);
+        if (ok) space.used += val.size_;
     }
+    impl.wake_reclaimer();
+    return ok;
+}
 
-    Cache::val_type found_val{nullptr, 0};
+/**
+ * Make room for a value that will be filled in a piece at a time.
+ * Takes no lock.
+ * @param size bytes in the value, terminator and all
+ * @return the buffer to fill in, or nullptr if the value could never fit
+ */
+Cache::byte_type *Cache::make_buffer(size_type size) {
+    if (size > this->pImpl_->store.capacity()) return nullptr;
     try {
-        // save a the value
-        found_val = this->pImpl_->table.at(key);
+        return this->pImpl_->store.make_buffer(size);
     } catch (const std::exception &e) {
-        std::cerr << "Cache::get(): at: " << e.what() << std::endl;
-        return return_val;
+        std::cerr << "Cache::make_buffer(): " << e.what() << std::endl;
+        return nullptr;
     }
+}
 
-    // deep copy buff from found_val to return_val
-    auto *buff = new byte_type[found_val.size_];
-    memcpy(buff, found_val.data_, found_val.size_);
-    return_val = {buff, found_val.size_};
+/**
+ * Store a buffer from make_buffer() under key in namespace ns, like
+ * set(ns, key, val, cost) but without copying it. The buffer is the
+ * cache's afterwards, whether or not it was stored.
+ * @return true iff the insertion of the data to the store was successful.
+ */
+bool Cache::set_buffer(std::string_view ns, key_view_type key,
+                       byte_type *buffer, double cost) {
+    Impl &impl = *this->pImpl_;
+    const size_type size = decltype(impl.store)::buffer_size(buffer);
+    impl.hot.record(key, size);
+    const std::string head = impl.rendered(key, {buffer, size});
+    if (head.empty()) {
+        byte_type *packed = impl.pack({buffer, size});
+        if (packed != nullptr) {
+            impl.store.drop_buffer(buffer);
+            buffer = packed;
+        }
+    }
+    return impl.store_buffer(ns, key, buffer, head, cost);
+}
+
+/**
+ * Give back a buffer from make_buffer() that won't be stored.
+ */
+void Cache::drop_buffer(byte_type *buffer) {
+    this->pImpl_->store.drop_buffer(buffer);
+}
 
-    this->pImpl_->successful_gets++;
+/**
+ * Look a key up in a namespace, like get(key). Takes no lock but a shared
+ * one on the list of namespaces.
+ * @param ns  the namespace; "" is the default one
+ */
+Cache::val_type Cache::get(std::string_view ns, key_view_type key) const {
+    if (ns.empty()) return get(key);
+    const Impl &impl = *this->pImpl_;
+    Impl::Namespace *space = impl.find_namespace(ns);
+    if (space == nullptr) return {nullptr, 0};
+    space->gets++;
+    const key_type stored = Impl::stored_key(ns, space->generation, key);
+    val_type val = impl.store.get(stored);
+    if (val.data_ != nullptr) {
+        impl.hit(stored, val.size_);
+    } else if (impl.disk != nullptr) {
+        val = this->pImpl_->from_disk(stored);
+    }
+    if (val.data_ != nullptr) space->hits++;
+    this->pImpl_->hot.record(key, val.size_);
+    return val;
+}
 
-    return return_val;
+/**
+ * Render something to store along with every value of up to limit bytes
+ * set from now on. Not thread safe; call it before sharing the cache.
+ * @param limit  biggest value to render for; 0 turns rendering off
+ * @param render called outside the lock with the key (without its
+ *               namespace) and the value
+ */
+void Cache::set_renderer(
+        size_type limit,
+        std::function<std::string(key_view_type, val_type)> render) {
+    this->pImpl_->render_limit = limit;
+    this->pImpl_->render = limit == 0 ? nullptr : std::move(render);
 }
 
 /**
- *  Delete object from Cache if object in Cache.
- *  Erase pair at key in table; return true if key in table else false.
- *  @param key of pair to erase
- *  @return true if pair erased else false
- *
- *  !If key or value in pair is pointer, pointed-to memory not freed.
- *  User is responsible for calling reset to free pointed-to memory.
+ * Look a key up like get(ns, key), but call visit on the stored value in
+ * place, along with what was rendered for it ("" if nothing was). Takes
+ * no lock; memory isn't reclaimed while visit runs.
+ * @param packed if not null, a compressed value is visited as it's stored,
+ *               and this says whether it was
+ * @return true iff key was found
  */
-bool Cache::del(key_type key) {
-    try {
-        // return if the key doesn't exist
-        if (this->pImpl_->table.find(key) == this->pImpl_->table.end()) {
-            return false;
+bool Cache::get_rendered(
+        std::string_view ns, key_view_type key,
+        const std::function<void(std::string_view, val_type)> &visit,
+        bool *packed) const {
+    const Impl &impl = *this->pImpl_;
+    size_type size = 0;
+    auto found = [&](std::string_view head, val_type val) {
+        size = val.size_;
+        visit(head, val);
+    };
+    auto found_stored = [&](std::string_view head, val_type val, bool p) {
+        size = val.size_;
+        *packed = p;
+        visit(head, val);
+    };
+    auto look = [&](key_view_type k) {
+        return packed == nullptr ? impl.store.find(k, found)
+                                 : impl.store.find_stored(k, found_stored);
+    };
+    Impl::Namespace *space = nullptr;
+    key_type stored;
+    if (!ns.empty()) {
+        space = impl.find_namespace(ns);
+        if (space == nullptr) return false;
+        space->gets++;
+        stored = Impl::stored_key(ns, space->generation, key);
+    }
+    const key_view_type where = ns.empty() ? key : key_view_type(stored);
+    bool hit = look(where);
+    if (hit) {
+        impl.hit(where, size);
+    } else if (impl.disk != nullptr) {
+        // Promoted values get no rendered response until they're set again
+        bool p = false;
+        const val_type val = packed == nullptr
+                                     ? this->pImpl_->from_disk(key_type(where))
+                                     : this->pImpl_->promote(key_type(where), p);
+        if (val.data_ != nullptr) {
+            if (packed != nullptr) *packed = p;
+            found(std::string_view(), val);
+            delete[] val.data_;
+            hit = true;
         }
-    } catch (const std::exception &e) {
-        std::cout << "Cache::del: find: " << e.what() << std::endl;
-        return false;
     }
+    if (hit && space != nullptr) space->hits++;
+    this->pImpl_->hot.record(key, size);
+    return hit;
+}
+
+/**
+ * Compress values of at least limit bytes as they are set from now on, where
+ * that makes them smaller. Not thread safe; call it before sharing the cache.
+ * @param limit smallest value to compress; 0 turns compression off
+ */
+void Cache::set_compression(size_type limit) {
+    this->pImpl_->store.set_compression(limit);
+}
+
+/**
+ * Look a key up like get(ns, key), but copy what's stored without
+ * decompressing it. Takes no lock but a shared one on the namespaces.
+ * @param packed set to whether the copy is an Lz4 frame of the value
+ * @return a new[] copy of what's stored, or nullptr with size 0 if not found
+ */
+Cache::val_type Cache::get_stored(std::string_view ns, key_view_type key,
+                                  bool &packed) const {
+    const Impl &impl = *this->pImpl_;
+    Impl::Namespace *space = nullptr;
+    key_type stored;
+    if (!ns.empty()) {
+        space = impl.find_namespace(ns);
+        if (space == nullptr) return {nullptr, 0};
+        space->gets++;
+        stored = Impl::stored_key(ns, space->generation, key);
+    }
+    packed = false;
+    const key_view_type where = ns.empty() ? key : key_view_type(stored);
+    val_type val = impl.store.get_stored(where, packed);
+    if (val.data_ != nullptr) {
+        impl.hit(where, val.size_);
+    } else if (impl.disk != nullptr) {
+        val = this->pImpl_->promote(key_type(where), packed);
+    }
+    if (val.data_ != nullptr && space != nullptr) space->hits++;
+    this->pImpl_->hot.record(key, val.size_);
+    return val;
+}
 
-    const byte_type *buff;
-    try {
-        // Save a pointer to the data buffer
-        buff = this->pImpl_->table.at(key).data_;
-    } catch (const std::exception &e) {
-        std::cout << "Cache::del: at: " << e.what() << std::endl;
-        return false;
+/**
+ * Look a key up like get_stored(ns, key), but pin what's stored instead of
+ * copying it. Takes no lock but a shared one on the namespaces.
+ * @param take_packed whether a compressed value may be handed back as is;
+ *                    if not, it's unpacked into a copy
+ */
+Cache::Pinned Cache::get_pinned(std::string_view ns, key_view_type key,
+                                bool take_packed) const {
+    const Impl &impl = *this->pImpl_;
+    Impl::Namespace *space = nullptr;
+    key_type stored;
+    if (!ns.empty()) {
+        space = impl.find_namespace(ns);
+        if (space == nullptr) return {};
+        space->gets++;
+        stored = Impl::stored_key(ns, space->generation, key);
     }
+    const key_view_type where = ns.empty() ? key : key_view_type(stored);
+    Pinned pinned;
+    pinned.val_ = impl.store.pin(where, pinned.rendered_, pinned.packed_,
+                                 pinned.pin_);
+    if (pinned.pin_ != nullptr) {
+        pinned.cache_ = this;
+        impl.hit(where, pinned.val_.size_);
+        if (pinned.packed_ && !take_packed) {
+            // Unpinned as soon as it's unpacked
+            const val_type frame = pinned.val_;
+            size_type raw = Lz4::raw_size(frame.data_, frame.size_);
+            auto *out = new byte_type[raw];
+            if (!Lz4::decompress(frame.data_, frame.size_, out)) {
+                delete[] out;
+                out = nullptr;
+                raw = 0;
+            }
+            pinned.release();
+            pinned.val_ = {out, raw};
+        }
+    } else if (impl.disk != nullptr) {
+        pinned.val_ = take_packed
+                              ? this->pImpl_->promote(key_type(where),
+                                                      pinned.packed_)
+                              : this->pImpl_->from_disk(key_type(where));
+    }
+    if (pinned.val_.data_ != nullptr && space != nullptr) space->hits++;
+    this->pImpl_->hot.record(key, pinned.val_.size_);
+    return pinned;
+}
+
+/**
+ * Unpin the value, or free the copy if that's what's held.
+ */
+void Cache::Pinned::release() {
+    if (pin_ != nullptr) {
+        cache_->pImpl_->store.unpin(pin_);
+    } else {
+        delete[] val_.data_;
+    }
+    cache_ = nullptr;
+    pin_ = nullptr;
+    val_ = {nullptr, 0};
+    rendered_ = {};
+    packed_ = false;
+}
 
-    bool ret;
+/**
+ * Keep values evicted from here from now on in a disk tier: a log of up to
+ * capacity bytes in the file at path. Not thread safe; call it before
+ * sharing the cache.
+ * @return false if the file can't be opened
+ */
+bool Cache::set_disk_tier(const std::string &path, size_type capacity) {
+    Impl &impl = *this->pImpl_;
     try {
-        // Remove the entry
-        ret = this->pImpl_->table.erase(key);
+        impl.disk = std::make_unique<Disk_Tier>(path, capacity);
     } catch (const std::exception &e) {
-        std::cout << "Cache::del: erase: " << e.what() << std::endl;
+        std::cerr << "Cache::set_disk_tier(): " << e.what() << std::endl;
         return false;
     }
+    // Entries of flushed namespaces would never be looked up again
+    impl.store.on_evict([&impl](const key_type &key, val_type val,
+                                bool packed) {
+        if (!impl.is_stale(key)) impl.disk->put(key, val.data_, val.size_, packed);
+    });
+    return true;
+}
 
-    // Free the buffer
-    delete[] buff;
+/**
+ * @return what the disk tier holds and how it's done; all 0 without one
+ */
+Disk_Tier::Stats Cache::disk_stats() const {
+    const Impl &impl = *this->pImpl_;
+    if (impl.disk == nullptr) return Disk_Tier::Stats{};
+    return impl.disk->stats();
+}
 
-    return ret;
+/**
+ * @return how many values are stored compressed, and how big they are
+ *         before and after
+ */
+Cache::Compression_Stats Cache::compression_stats() const {
+    const Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    return {impl.store.packed_values(), impl.store.packed_raw_bytes(),
+            impl.store.packed_bytes()};
 }
 
 /**
- * @return the total amount of memory used up by all cache values (not keys).
+ * Share values of at least limit bytes between the keys they're set under
+ * from now on, when they're the same. Not thread safe; call it before
+ * sharing the cache.
+ * @param limit smallest value to share; 0 turns deduplication off
  */
-Cache::size_type Cache::space_used() const {
-    size_type mem = 0;
-    for (const auto &entry : this->pImpl_->table) {
-        mem += entry.second.size_;
+void Cache::set_dedup(size_type limit) {
+    this->pImpl_->store.set_dedup(limit);
+}
+
+/**
+ * @return how many keys share a value stored under another, and the bytes
+ *         that saves
+ */
+Cache::Dedup_Stats Cache::dedup_stats() const {
+    const Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    return {impl.store.deduped_keys(), impl.store.deduped_bytes()};
+}
+
+/**
+ * Delete a key from a namespace, like del(key).
+ * @param ns  the namespace; "" is the default one
+ */
+bool Cache::del(std::string_view ns, key_view_type key) {
+    if (ns.empty()) return del(key);
+    Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    Impl::Namespace *space = impl.find_namespace(ns);
+    if (space == nullptr) return false;
+    const key_type stored = Impl::stored_key(ns, space->generation, key);
+    const bool on_disk = impl.forget_on_disk(stored);
+    return impl.store.del(stored) || on_disk;
+}
+
+/**
+ * Drop every key in a namespace at once: the namespace moves to a new
+ * generation, and the old entries are swept out in the background or
+ * evicted as usual.
+ * @param ns the namespace; the default one can't be flushed
+ * @return true iff ns could be flushed
+ */
+bool Cache::flush(std::string_view ns) {
+    if (ns.empty()) return false;
+    Impl &impl = *this->pImpl_;
+    std::lock_guard<std::mutex> guard(impl.lock);
+    Impl::Namespace *space = impl.find_namespace(ns);
+    if (space == nullptr) return true;  // Nothing was ever in it
+    space->generation++;
+    space->gets = 0;
+    space->hits = 0;
+    impl.start_reclaimer();
+    impl.sweep_wanted = true;
+    impl.reclaim_cv.notify_one();
+    return true;
+}
+
+/**
+ * @return the space used and hit rate of every namespace but the default
+ *         one. Space still held by flushed entries is counted until they
+ *         are swept or evicted.
+ */
+std::vector<Cache::Namespace_Stats> Cache::namespace_stats() const {
+    const Impl &impl = *this->pImpl_;
+    std::vector<Namespace_Stats> all;
+    std::shared_lock<std::shared_mutex> guard(impl.ns_lock);
+    for (const auto &space : impl.namespaces) {
+        const size_t gets = space.second->gets, hits = space.second->hits;
+        all.push_back({space.first, space.second->used,
+                       gets == 0 ? 0
+                                 : static_cast<double>(hits) /
+                                           static_cast<double>(gets)});
     }
-    return mem;
+    return all;
 }
 
 /**
- * @return the ratio of gets that had been successful.
+ * @param k        most keys to return
+ * @param by_bytes rank keys by bytes set and got instead of by requests
+ * @return the hottest keys, hottest first, with estimated counts
  */
-double Cache::hit_rate() const {
-    if (this->pImpl_->gets == 0) return 0;
-    return static_cast<double>(this->pImpl_->successful_gets) /
-           static_cast<double>(this->pImpl_->gets);
+std::vector<Hot_Keys::Entry> Cache::hot_keys(size_t k, bool by_bytes) const {
+    return this->pImpl_->hot.top(k, by_bytes);
 }
 
 /**
- * Delete all data from the cache.
- * @return true iff successful.
+ * The cache object is already in this process; don't call this.
+ * @param maxmem would be the most bytes for a near cache
  */
-bool Cache::reset() {
-    // Make sure the value data are all cleaned up
-    for (auto pair = this->pImpl_->table.begin();
-         pair != this->pImpl_->table.end();
-         pair = this->pImpl_->table.erase(pair)) {
-        delete[] pair->second.data_;
-    }
-    this->pImpl_->successful_gets = 0;  // Number of successful calls to get()
-    this->pImpl_->gets = 0;             // Number of calls to get
-    return this->pImpl_->table.empty();
+bool Cache::set_near_cache([[maybe_unused]] size_type maxmem) {
+    assert(false);
+    return false;
+}
+
+/**
+ * The cache object is already in this process; don't call this.
+ * @param port    would be the server's UDP port
+ * @param timeout would be how long to wait for an answer
+ * @param tries   would be how many times to ask
+ */
+bool Cache::set_udp([[maybe_unused]] unsigned short port,
+                    [[maybe_unused]] std::chrono::milliseconds timeout,
+                    [[maybe_unused]] unsigned tries) {
+    assert(false);
+    return false;
 }
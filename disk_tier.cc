@@ -0,0 +1,221 @@
+/**
+ * disk_tier.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the disk tier in disk_tier.hh.
+ */
+#include "disk_tier.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+/**
+ * Open and empty the file, and start the writer.
+ */
+Disk_Tier::Disk_Tier(std::string file, uint64_t capacity, size_t segments)
+    : path(std::move(file)),
+      fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)),
+      segment_count(std::max<size_t>(segments, 1)),
+      segment_size(std::max<uint64_t>(capacity / segment_count, 1)),
+      segment_keys(segment_count) {
+    if (fd < 0)
+        throw std::runtime_error("Disk_Tier: " + path + ": " +
+                                 strerror(errno));
+    counts.capacity = segment_size * segment_count;
+    writer = std::thread([this]() { write_runs(); });
+}
+
+/**
+ * Write out what's queued, then remove the file.
+ */
+Disk_Tier::~Disk_Tier() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    close(fd);
+    unlink(path.c_str());
+}
+
+/**
+ * Drop an entry from the index. The caller holds lock.
+ */
+void Disk_Tier::forget(std::unordered_map<key_type, Entry>::iterator found) {
+    used -= found->second.size;
+    index.erase(found);
+}
+
+/**
+ * Move the log on to the next segment, forgetting whatever is still in
+ * it. The caller holds lock.
+ */
+void Disk_Tier::next_segment() {
+    segment = (segment + 1) % segment_count;
+    head = segment * segment_size;
+    std::vector<key_type> &keys = segment_keys[segment];
+    if (keys.empty()) return;
+    for (const key_type &key : keys) {
+        auto found = index.find(key);
+        // The key may have been put again since, somewhere else
+        if (found != index.end() && found->second.offset >= head &&
+            found->second.offset < head + segment_size)
+            forget(found);
+    }
+    std::vector<key_type>().swap(keys);
+    counts.reclaimed++;
+}
+
+/**
+ * Body of the writer thread: write each run once it's the oldest, without
+ * holding the lock, and let it go once it's on disk. What's queued is
+ * written before the thread stops.
+ */
+void Disk_Tier::write_runs() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [this]() { return stopping || !runs.empty(); });
+        if (runs.empty()) return;
+        // Elements of a deque stay put as more are added
+        Run &run = runs.front();
+        run.sealed = true;
+        guard.unlock();
+
+        size_t done = 0;
+        while (done < run.bytes.size()) {
+            const ssize_t wrote =
+                    pwrite(fd, run.bytes.data() + done, run.bytes.size() - done,
+                           static_cast<off_t>(run.offset + done));
+            if (wrote < 0 && errno == EINTR) continue;
+            if (wrote <= 0) {
+                std::cerr << "Disk_Tier: write: " << strerror(errno)
+                          << std::endl;
+                break;
+            }
+            done += static_cast<size_t>(wrote);
+        }
+
+        guard.lock();
+        counts.writes += run.values;
+        pending -= run.bytes.size();
+        runs.pop_front();
+    }
+}
+
+/**
+ * Queue a copy of key's value to be written at the end of the log.
+ */
+void Disk_Tier::put(const key_type &key, const char *data, uint64_t size,
+                    bool packed) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = index.find(key);
+    if (found != index.end()) forget(found);
+    if (size > segment_size || pending + size > max_pending) {
+        counts.dropped++;
+        return;
+    }
+    if (head + size > (segment + 1) * segment_size) next_segment();
+
+    if (runs.empty() || runs.back().sealed ||
+        runs.back().offset + runs.back().bytes.size() != head)
+        runs.push_back(Run{head, {}});
+    Run &run = runs.back();
+    run.bytes.append(data, size);
+    run.values++;
+    pending += size;
+
+    index[key] = Entry{head, size, ++stamps, packed};
+    segment_keys[segment].push_back(key);
+    head += size;
+    used += size;
+    wake.notify_one();
+}
+
+bool Disk_Tier::get(key_view_type key, std::string &out, bool &packed,
+                    uint64_t &stamp) {
+    std::unique_lock<std::mutex> guard(lock);
+    auto found = index.find(key_type(key));
+    if (found == index.end()) {
+        counts.misses++;
+        return false;
+    }
+    const Entry entry = found->second;
+    packed = entry.packed;
+    stamp = entry.stamp;
+
+    // The newest run to cover it has it, if it isn't written yet
+    for (auto run = runs.rbegin(); run != runs.rend(); ++run) {
+        if (entry.offset < run->offset ||
+            entry.offset + entry.size > run->offset + run->bytes.size())
+            continue;
+        out.assign(run->bytes, entry.offset - run->offset, entry.size);
+        counts.hits++;
+        return true;
+    }
+    guard.unlock();
+
+    out.resize(entry.size);
+    size_t done = 0;
+    while (done < entry.size) {
+        const ssize_t got = pread(fd, out.data() + done, entry.size - done,
+                                  static_cast<off_t>(entry.offset + done));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        done += static_cast<size_t>(got);
+    }
+
+    // If its segment was reused while we read, it's gone from the index
+    guard.lock();
+    found = index.find(key_type(key));
+    if (done < entry.size || found == index.end() ||
+        found->second.stamp != entry.stamp) {
+        counts.misses++;
+        return false;
+    }
+    counts.hits++;
+    return true;
+}
+
+bool Disk_Tier::take(key_view_type key, uint64_t stamp) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = index.find(key_type(key));
+    if (found == index.end() || found->second.stamp != stamp) return false;
+    forget(found);
+    return true;
+}
+
+bool Disk_Tier::erase(key_view_type key) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = index.find(key_type(key));
+    if (found == index.end()) return false;
+    forget(found);
+    return true;
+}
+
+/**
+ * Forget every key. Runs already queued are still written, to no one.
+ */
+void Disk_Tier::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<key_type, Entry>().swap(index);
+    for (std::vector<key_type> &keys : segment_keys)
+        std::vector<key_type>().swap(keys);
+    segment = 0;
+    head = 0;
+    used = 0;
+}
+
+Disk_Tier::Stats Disk_Tier::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    Stats out = counts;
+    out.keys = index.size();
+    out.bytes = used;
+    return out;
+}
@@ -0,0 +1,133 @@
+/**
+ * disk_tier.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare a second tier for values evicted from memory, on local disk.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "evictor.hh"
+
+/**
+ * Keeps values evicted from memory in a log in one file, with an index of
+ * where each key's value is in memory.
+ *
+ * The file is split into segments that are written in order, round and
+ * round: when the log runs into the next segment, whatever is still in it
+ * is forgotten, so the oldest values go first. put() only copies a value
+ * onto the end of a queue of runs to write, and a thread of its own writes
+ * them out with one pwrite() each, so evicting never waits for the disk;
+ * if the thread is too far behind, values are dropped instead. get() finds
+ * a value still in the queue there, and otherwise reads it with pread()
+ * without holding the lock, then makes sure its segment wasn't reused
+ * meanwhile.
+ *
+ * Nothing is kept across restarts: the file is emptied when opened and
+ * removed when closed. Safe to call from any thread.
+ */
+class Disk_Tier {
+public:
+    struct Stats {
+        size_t keys;        // Values on disk or on their way
+        uint64_t bytes;     // Their sizes
+        uint64_t capacity;  // Size of the file, in bytes
+        size_t hits;        // Gets that found a value
+        size_t misses;      // and that didn't
+        size_t writes;      // Values written to the file
+        size_t dropped;     // Too big, or put while the writer was behind
+        size_t reclaimed;   // Segments reused, oldest first
+    };
+
+private:
+    // Most bytes queued for the writer before put() drops values
+    static constexpr uint64_t max_pending = 16 << 20;
+
+    struct Entry {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t stamp;  // Tells a value apart from one later put there
+        bool packed;
+    };
+
+    // Values put one after another, to be written at offset
+    struct Run {
+        uint64_t offset;
+        std::string bytes;
+        size_t values = 0;
+        bool sealed = false;  // Being written; no more may be added
+    };
+
+    const std::string path;
+    int fd;
+    const size_t segment_count;
+    const uint64_t segment_size;
+
+    mutable std::mutex lock;  // Guards everything below
+    std::condition_variable wake;
+    std::unordered_map<key_type, Entry> index;
+    // Keys put in each segment, some since gone, to forget when it's reused
+    std::vector<std::vector<key_type>> segment_keys;
+    size_t segment = 0;  // Being written
+    uint64_t head = 0;   // Where the next value goes
+    uint64_t stamps = 0;
+    uint64_t used = 0;
+    std::deque<Run> runs;  // Oldest first
+    uint64_t pending = 0;  // Bytes in runs
+    Stats counts{};
+    bool stopping = false;
+    std::thread writer;
+
+    void forget(std::unordered_map<key_type, Entry>::iterator found);
+    void next_segment();
+    void write_runs();
+
+public:
+    /**
+     * @param path     file to keep values in; emptied
+     * @param capacity most bytes to keep in it
+     * @param segments how many pieces it's reused in
+     * @throw std::runtime_error if the file can't be opened
+     */
+    Disk_Tier(std::string path, uint64_t capacity, size_t segments = 16);
+
+    ~Disk_Tier();
+
+    Disk_Tier(const Disk_Tier &) = delete;
+    Disk_Tier &operator=(const Disk_Tier &) = delete;
+
+    // Keep a copy of key's value, as it was stored, in place of any other
+    void put(const key_type &key, const char *data, uint64_t size,
+             bool packed);
+
+    /**
+     * Read key's value.
+     * @param out    set to the value as it was put
+     * @param packed set to what put() was told
+     * @param stamp  set to something to pass to take()
+     * @return true iff key was found
+     */
+    bool get(key_view_type key, std::string &out, bool &packed,
+             uint64_t &stamp);
+
+    // Forget key if it still has the value get() gave that stamp for
+    // @return true iff it did
+    bool take(key_view_type key, uint64_t stamp);
+
+    // Forget key; true iff it was kept
+    bool erase(key_view_type key);
+
+    // Forget every key
+    void clear();
+
+    Stats stats() const;
+};
@@ -0,0 +1,200 @@
+/**
+ * epoch.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Epoch-based memory reclamation, so readers can walk shared structures
+ * without taking locks.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Readers wrap their accesses in an Epoch::Guard. Writers unlink things
+ * as usual and then retire() them instead of freeing them; a retired
+ * object is freed once every reader that might have seen it has left its
+ * guard.
+ *
+ * The global epoch only moves forward once every active reader has seen
+ * the current one, so anything retired in epoch e is safe to free once
+ * the global epoch reaches e + 2.
+ *
+ * There is one domain per process. Guards nest and are cheap: one store
+ * to a thread-local record and a fence. Retiring takes a mutex, which is
+ * fine as writers are already serialized by their own locks.
+ */
+class Epoch {
+public:
+    using free_func = void (*)(void *ptr, void *ctx);
+
+private:
+    // One per thread; never freed, but reused after its thread exits
+    struct Record {
+        std::atomic<uint64_t> state{0};  // (epoch << 1) | 1 while active
+        std::atomic<bool> in_use{true};
+        unsigned nesting = 0;
+        Record *next = nullptr;
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        void *ptr;
+        free_func fn;
+        void *ctx;
+    };
+
+    // How many retires between attempts to free things
+    static constexpr size_t collect_every = 64;
+
+    struct Domain {
+        std::atomic<uint64_t> global{1};
+        std::atomic<Record *> records{nullptr};
+        std::mutex limbo_lock;  // Guards limbo and since_collect
+        std::vector<Retired> limbo;
+        size_t since_collect = 0;
+    };
+
+    /**
+     * The domain is never destroyed, so caches that are destroyed during
+     * static destruction can still retire things.
+     */
+    static Domain &domain() {
+        static Domain *d = new Domain();
+        return *d;
+    }
+
+    /**
+     * Claim a record for this thread the first time it is needed, and give
+     * it back when the thread exits.
+     */
+    struct Holder {
+        Record *record = nullptr;
+
+        Holder() {
+            std::atomic<Record *> &records = domain().records;
+            for (Record *r = records.load(); r != nullptr; r = r->next) {
+                bool free = false;
+                if (r->in_use.compare_exchange_strong(free, true)) {
+                    record = r;
+                    return;
+                }
+            }
+            record = new Record();
+            record->next = records.load();
+            while (!records.compare_exchange_weak(record->next, record)) {
+            }
+        }
+
+        ~Holder() {
+            record->state.store(0);
+            record->in_use.store(false);
+        }
+    };
+
+    static Record &local() {
+        thread_local Holder holder;
+        return *holder.record;
+    }
+
+    /**
+     * Move the epoch on if every active reader is in the current one, then
+     * free whatever is old enough. Needs limbo_lock.
+     */
+    static void collect_locked() {
+        Domain &d = domain();
+        std::vector<Retired> &limbo = d.limbo;
+        uint64_t now = d.global.load();
+        bool can_advance = true;
+        for (Record *r = d.records.load(); r != nullptr; r = r->next) {
+            const uint64_t state = r->state.load();
+            if ((state & 1) != 0 && (state >> 1) != now) {
+                can_advance = false;
+                break;
+            }
+        }
+        if (can_advance && d.global.compare_exchange_strong(now, now + 1)) {
+            now++;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < limbo.size(); i++) {
+            if (limbo[i].epoch + 2 <= now) {
+                limbo[i].fn(limbo[i].ptr, limbo[i].ctx);
+            } else {
+                limbo[kept++] = limbo[i];
+            }
+        }
+        limbo.resize(kept);
+        d.since_collect = 0;
+    }
+
+public:
+    /**
+     * A read-side critical section: nothing retired after it starts is
+     * freed until it ends.
+     */
+    class Guard {
+    private:
+        Record &record;
+
+    public:
+        Guard() : record(local()) {
+            if (record.nesting++ == 0) {
+                record.state.store((domain().global.load() << 1) | 1);
+            }
+        }
+
+        ~Guard() {
+            if (--record.nesting == 0) record.state.store(0);
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    /**
+     * Free ptr with fn(ptr, ctx) once no reader can be using it.
+     * ptr must already be unreachable for new readers.
+     */
+    static void retire(void *ptr, free_func fn, void *ctx) {
+        Domain &d = domain();
+        std::lock_guard<std::mutex> guard(d.limbo_lock);
+        d.limbo.push_back({d.global.load(), ptr, fn, ctx});
+        if (++d.since_collect >= collect_every) collect_locked();
+    }
+
+    /**
+     * Try to free whatever is safe to free now.
+     */
+    static void collect() {
+        std::lock_guard<std::mutex> guard(domain().limbo_lock);
+        collect_locked();
+    }
+
+    /**
+     * Wait for every reader that is currently in a guard to leave it, and
+     * free everything retired before this call. Must not be called from
+     * inside a guard.
+     */
+    static void synchronize() {
+        Domain &d = domain();
+        const uint64_t target = d.global.load() + 2;
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> guard(d.limbo_lock);
+                collect_locked();
+                bool done = d.global.load() >= target;
+                for (const Retired &retired : d.limbo) {
+                    if (retired.epoch + 2 <= target) done = false;
+                }
+                if (done) return;
+            }
+            std::this_thread::yield();
+        }
+    }
+};
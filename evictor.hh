@@ -4,11 +4,18 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 // Data type to use as keys for Cache and Evictors:
 using key_type = std::string;
 
+// Cache lookups also take a view of a key, so callers holding the key in
+// some other buffer don't have to copy it into a key_type first:
+using key_view_type = std::string_view;
+
 // Abstract base class to define evictions policies.
 // It allows touching a key (on a set or get event), and request for
 // eviction, which also deletes a key. There is no explicit deletion
@@ -23,7 +30,51 @@ class Evictor {
   // Inform evictor that a certain key has been set or get:
   virtual void touch_key(const key_type&) = 0;
 
+  // Inform evictor that a key has been set, with the size of its value in
+  // bytes and what the client says the value costs to fetch again (1 if it
+  // didn't say). Policies that weigh neither can leave this as it is.
+  virtual void touch_key(const key_type& key, uint64_t /* size */,
+                         double /* cost */) {
+    touch_key(key);
+  }
+
+  // Inform evictor that a get found a key, with the size of its value.
+  // Gets don't hold the cache's lock, so this may be called from several
+  // threads at once, alongside the other calls: a policy that counts hits
+  // must guard them itself. Returns true if it has put off counting so
+  // many that the cache should take its lock and call settle() now.
+  virtual bool hit_key(key_view_type, uint64_t /* size */) { return false; }
+
+  // Inform evictor, under the cache's lock, that it may count the hits it
+  // put off (see hit_key()).
+  virtual void settle() {}
+
+  // Inform evictor, under the cache's lock, that a key it was told of was
+  // got count more times. An evictor that counts hits itself (see
+  // hit_queue.hh) passes what it counted on to the evictors it is made of
+  // this way, rather than have each count every get again.
+  virtual void add_hits(const key_type&, uint64_t /* count */) {}
+
+  // Inform evictor that a key was deleted rather than evicted, so it needn't
+  // keep track of it any more.
+  virtual void forget_key(const key_type&) {}
+
   // Request evictor for the next key to evict, and remove it from evictor.
   // If evictor doesn't know what to evict, return an empty key ("").
   virtual const key_type evict() = 0;
+
+  // Request evictor for keys whose values add up to at least bytes, as far
+  // as it was told their sizes, but no more than max_keys of them; append
+  // them to victims and remove them from evictor. The cache may no longer
+  // hold some of them, so it asks again if it's still short. Leave victims
+  // alone if there's nothing to evict. By default this is one evict().
+  virtual void evict_batch(uint64_t /* bytes */, size_t /* max_keys */,
+                           std::vector<key_type>& victims) {
+    key_type key = evict();
+    if (!key.empty()) victims.push_back(std::move(key));
+  }
+
+  // Forget every key at once, because the cache was reset. This should be
+  // quick, as the cache is locked meanwhile.
+  virtual void clear() {}
 };
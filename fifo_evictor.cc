@@ -20,7 +20,19 @@ Fifo_Evictor::~Fifo_Evictor() = default;
  * Let the evictor know about a new entry in the cache
  * @param key The key being added to/removed from/read from the cache
  */
-void Fifo_Evictor::touch_key(const key_type &key) { this->keys.push(key); }
+void Fifo_Evictor::touch_key(const key_type &key) {
+    this->keys.emplace(key, 0);
+}
+
+/**
+ * Let the evictor know about a new entry in the cache and its size, so
+ * evict_batch() knows how many keys make enough room. Cost is ignored.
+ * @param key  The key being added to the cache
+ * @param size Bytes in its value
+ */
+void Fifo_Evictor::touch_key(const key_type &key, uint64_t size, double) {
+    this->keys.emplace(key, size);
+}
 
 /**
  * Evict the oldest required members of the cache to make way for a new member
@@ -30,7 +42,34 @@ const key_type Fifo_Evictor::evict() {
     if (this->keys.empty()) {
         return "";
     }
-    key_type key = this->keys.front();
+    key_type key = std::move(this->keys.front().first);
     this->keys.pop();
     return key;
 }
+
+/**
+ * Evict the oldest keys until their values add up to bytes. A key of
+ * unknown size ends the batch, since we can't tell what it frees.
+ * @param victims the keys to remove are appended to this
+ */
+void Fifo_Evictor::evict_batch(uint64_t bytes, size_t max_keys,
+                               std::vector<key_type> &victims) {
+    uint64_t freed = 0;
+    for (size_t taken = 0; taken < max_keys && freed < bytes &&
+                           !this->keys.empty();
+         taken++) {
+        const uint64_t size = this->keys.front().second;
+        victims.push_back(std::move(this->keys.front().first));
+        this->keys.pop();
+        if (size == 0) return;
+        freed += size;
+    }
+}
+
+/**
+ * Forget every key. Only the queue's blocks and the few keys too long to be
+ * stored inline have to be freed.
+ */
+void Fifo_Evictor::clear() {
+    std::queue<std::pair<key_type, uint64_t>>().swap(this->keys);
+}
@@ -8,12 +8,14 @@
 #pragma once
 
 #include <queue>
+#include <utility>
 
 #include "evictor.hh"
 
-class Fifo_Evictor : virtual public Evictor {
+class Fifo_Evictor final : virtual public Evictor {
 private:
-    std::queue<key_type> keys;
+    // Keys in the order they were set, with their sizes; 0 if not known
+    std::queue<std::pair<key_type, uint64_t>> keys;
 
 public:
     Fifo_Evictor();
@@ -22,5 +24,12 @@ public:
 
     void touch_key(const key_type &) override;
 
+    void touch_key(const key_type &key, uint64_t size, double cost) override;
+
     const key_type evict() override;
+
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) override;
+
+    void clear() override;
 };
@@ -0,0 +1,202 @@
+/**
+ * gdsf_evictor.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the GDSF eviction policy interface in gdsf_evictor.hh.
+ */
+#include "gdsf_evictor.hh"
+
+#include <algorithm>
+
+/**
+ * A trivial constructor for a GDSF evictor object.
+ */
+Gdsf_Evictor::Gdsf_Evictor() = default;
+
+/**
+ * A trivial destructor for a GDSF evictor object.
+ */
+Gdsf_Evictor::~Gdsf_Evictor() = default;
+
+double Gdsf_Evictor::priority(const Entry &entry) const {
+    return clock + static_cast<double>(entry.frequency) * entry.cost /
+                           static_cast<double>(entry.size);
+}
+
+void Gdsf_Evictor::swap_entries(size_t a, size_t b) {
+    std::swap(heap[a], heap[b]);
+    where[heap[a].key] = a;
+    where[heap[b].key] = b;
+}
+
+/**
+ * Restore the heap above i after heap[i].priority shrank.
+ */
+void Gdsf_Evictor::sift_up(size_t i) {
+    while (i > 0 && heap[(i - 1) / 2].priority > heap[i].priority) {
+        swap_entries(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * Restore the heap below i after heap[i].priority grew.
+ */
+void Gdsf_Evictor::sift_down(size_t i) {
+    for (;;) {
+        size_t least = i;
+        const size_t left = 2 * i + 1, right = left + 1;
+        if (left < heap.size() && heap[left].priority < heap[least].priority)
+            least = left;
+        if (right < heap.size() && heap[right].priority < heap[least].priority)
+            least = right;
+        if (least == i) return;
+        swap_entries(i, least);
+        i = least;
+    }
+}
+
+/**
+ * Take heap[i] out of the heap, filling its place with the last entry.
+ */
+void Gdsf_Evictor::remove(size_t i) {
+    const size_t last = heap.size() - 1;
+    if (i != last) swap_entries(i, last);
+    where.erase(heap.back().key);
+    heap.pop_back();
+    if (i < heap.size()) {
+        sift_up(i);
+        sift_down(i);
+    }
+}
+
+/**
+ * Add the hits counted since the last call.
+ */
+void Gdsf_Evictor::count_hits() {
+    hits.drain([this](const key_type &key, const Hit_Queue::Hits &got) {
+        add_hits(key, got.count);
+    });
+}
+
+/**
+ * Let the evictor know a key was set, without its size or cost; a key we
+ * know keeps the ones it had, and a new one counts as one byte that costs
+ * one to get again.
+ * @param key The key being added to the cache
+ */
+void Gdsf_Evictor::touch_key(const key_type &key) {
+    auto found = where.find(key);
+    if (found == where.end()) {
+        touch_key(key, 1, 1);
+    } else {
+        const Entry &entry = heap[found->second];
+        touch_key(key, entry.size, entry.cost);
+    }
+}
+
+/**
+ * Let the evictor know a key was set, counting it as a use if it was
+ * already there.
+ * @param key  The key being added to the cache
+ * @param size Bytes in its value
+ * @param cost What it costs to get the value again
+ */
+void Gdsf_Evictor::touch_key(const key_type &key, uint64_t size, double cost) {
+    count_hits();
+    size = std::max<uint64_t>(size, 1);
+    cost = std::max(cost, 0.0);
+    auto found = where.find(key);
+    if (found == where.end()) {
+        const size_t i = heap.size();
+        heap.push_back({key, 0, size, cost, 1});
+        heap[i].priority = priority(heap[i]);
+        where[key] = i;
+        sift_up(i);
+        return;
+    }
+    const size_t i = found->second;
+    Entry &entry = heap[i];
+    entry.frequency++;
+    entry.size = size;
+    entry.cost = cost;
+    entry.priority = priority(entry);
+    // A bigger value may have lowered it
+    sift_up(i);
+    sift_down(i);
+}
+
+/**
+ * Count a hit on key, to be added by the next call made under the cache's
+ * lock. Safe to call from any thread.
+ */
+bool Gdsf_Evictor::hit_key(key_view_type key, uint64_t) {
+    return hits.push(key);
+}
+
+/**
+ * Count the gets hit_key() put off.
+ */
+void Gdsf_Evictor::settle() { count_hits(); }
+
+/**
+ * Add hits on key counted elsewhere. A key we no longer know of (evicted
+ * or deleted since) is left out.
+ */
+void Gdsf_Evictor::add_hits(const key_type &key, uint64_t count) {
+    auto found = where.find(key);
+    if (count == 0 || found == where.end()) return;
+    Entry &entry = heap[found->second];
+    entry.frequency += count;
+    entry.priority = priority(entry);
+    sift_down(found->second);
+}
+
+/**
+ * Stop tracking a key that was deleted.
+ */
+void Gdsf_Evictor::forget_key(const key_type &key) {
+    auto found = where.find(key);
+    if (found != where.end()) remove(found->second);
+}
+
+/**
+ * Evict the key of least priority, moving the clock up to it.
+ * @return The key of the item to remove, or "" if there are none
+ */
+const key_type Gdsf_Evictor::evict() {
+    count_hits();
+    if (heap.empty()) return "";
+    key_type key = heap.front().key;
+    clock = heap.front().priority;
+    remove(0);
+    return key;
+}
+
+/**
+ * Evict keys of least priority until their values add up to bytes, moving
+ * the clock up to the last of them.
+ * @param victims the keys to remove are appended to this
+ */
+void Gdsf_Evictor::evict_batch(uint64_t bytes, size_t max_keys,
+                               std::vector<key_type> &victims) {
+    count_hits();
+    uint64_t freed = 0;
+    for (size_t taken = 0; taken < max_keys && freed < bytes && !heap.empty();
+         taken++) {
+        freed += heap.front().size;
+        clock = heap.front().priority;
+        victims.push_back(heap.front().key);
+        remove(0);
+    }
+}
+
+/**
+ * Forget every key and start the clock over.
+ */
+void Gdsf_Evictor::clear() {
+    std::vector<Entry>().swap(heap);
+    std::unordered_map<key_type, size_t>().swap(where);
+    clock = 0;
+    hits.clear();
+}
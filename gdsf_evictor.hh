@@ -0,0 +1,76 @@
+/**
+ * gdsf_evictor.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the Greedy-Dual-Size-Frequency eviction policy interface.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "evictor.hh"
+#include "hit_queue.hh"
+
+/**
+ * Evicts the key of least priority
+ *     clock + frequency * cost / size,
+ * so small values, values that are got often and values that cost a lot to
+ * get again stay the longest, and one big cold value goes before the many
+ * small hot ones it would take to make the same room. The clock rises to
+ * the priority of each key evicted, so a key that was popular long ago
+ * ages out once newer keys overtake it.
+ *
+ * Keys are kept in a min-heap on priority, indexed by key, so every touch,
+ * hit, forget and eviction is O(log n). Hits are counted apart and added
+ * at the next call made under the cache's lock (see hit_queue.hh).
+ */
+class Gdsf_Evictor final : virtual public Evictor {
+private:
+    struct Entry {
+        key_type key;
+        double priority;
+        uint64_t size;
+        double cost;
+        uint64_t frequency;
+    };
+
+    std::vector<Entry> heap;
+    std::unordered_map<key_type, size_t> where;  // key -> heap index
+    double clock = 0;
+
+    Hit_Queue hits;
+
+    double priority(const Entry &entry) const;
+    void swap_entries(size_t a, size_t b);
+    void sift_up(size_t i);
+    void sift_down(size_t i);
+    void remove(size_t i);
+    void count_hits();
+
+public:
+    Gdsf_Evictor();
+
+    ~Gdsf_Evictor() override;
+
+    void touch_key(const key_type &) override;
+
+    void touch_key(const key_type &key, uint64_t size, double cost) override;
+
+    bool hit_key(key_view_type key, uint64_t size) override;
+
+    void settle() override;
+
+    void add_hits(const key_type &key, uint64_t count) override;
+
+    void forget_key(const key_type &key) override;
+
+    const key_type evict() override;
+
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) override;
+
+    void clear() override;
+};
@@ -0,0 +1,96 @@
+/**
+ * hash_ring.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the consistent hash ring in hash_ring.hh.
+ */
+#include "hash_ring.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * Create an empty ring.
+ * @param vnodes_per_node number of points each node gets on the ring;
+ *                        more points give a more even key distribution
+ */
+Hash_Ring::Hash_Ring(size_t vnodes_per_node)
+        : vnodes(vnodes_per_node == 0 ? 1 : vnodes_per_node) {}
+
+/**
+ * Place a node on the ring.
+ * @param node name of the node, usually "host:port"
+ * @return false if the node was already on the ring
+ */
+bool Hash_Ring::add_node(const std::string &node) {
+    if (std::find(names.begin(), names.end(), node) != names.end())
+        return false;
+    for (size_t i = 0; i < vnodes; i++) {
+        // On the off chance two points collide the earlier node keeps it,
+        // which is fine as long as every client does the same.
+        points.emplace(hash(node + '#' + std::to_string(i)), node);
+    }
+    names.push_back(node);
+    return true;
+}
+
+/**
+ * Take a node off the ring; its keys fall through to the next points.
+ * @param node name of the node
+ * @return false if the node wasn't on the ring
+ */
+bool Hash_Ring::remove_node(const std::string &node) {
+    auto it = std::find(names.begin(), names.end(), node);
+    if (it == names.end()) return false;
+    names.erase(it);
+    for (auto point = points.begin(); point != points.end();) {
+        if (point->second == node)
+            point = points.erase(point);
+        else
+            ++point;
+    }
+    return true;
+}
+
+/**
+ * @param key the key to place
+ * @return the name of the node that owns key
+ * @throw std::runtime_error if the ring is empty
+ */
+const std::string &Hash_Ring::node_for(const key_type &key) const {
+    if (points.empty()) throw std::runtime_error("Hash_Ring: no nodes");
+    auto point = points.lower_bound(hash(key));
+    if (point == points.end()) point = points.begin();  // Wrap around
+    return point->second;
+}
+
+/**
+ * @return the names of all nodes on the ring, in the order they were added
+ */
+const std::vector<std::string> &Hash_Ring::nodes() const { return names; }
+
+/**
+ * @return true iff there are no nodes on the ring
+ */
+bool Hash_Ring::empty() const { return names.empty(); }
+
+/**
+ * A hash that is stable across processes and builds, so that every client
+ * places keys the same way (std::hash makes no such promise).
+ * This is 64-bit FNV-1a followed by the murmur3 finalizer to spread the bits.
+ * @param str bytes to hash
+ * @return a position on the ring
+ */
+uint64_t Hash_Ring::hash(const std::string &str) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : str) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb3fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -0,0 +1,43 @@
+/**
+ * hash_ring.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare a consistent hash ring used to spread keys over cache servers.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "evictor.hh"
+
+/**
+ * Each node is placed on the ring at a number of pseudo-random points
+ * (virtual nodes); a key belongs to the first point clockwise from its hash.
+ * Adding or removing one of N nodes only moves the keys that landed on its
+ * points, roughly 1/N of them.
+ */
+class Hash_Ring {
+private:
+    size_t vnodes;                           // Points per node
+    std::map<uint64_t, std::string> points;  // Ring position -> node name
+    std::vector<std::string> names;          // Nodes currently on the ring
+
+public:
+    explicit Hash_Ring(size_t vnodes_per_node = 160);
+
+    bool add_node(const std::string &node);
+
+    bool remove_node(const std::string &node);
+
+    const std::string &node_for(const key_type &key) const;
+
+    const std::vector<std::string> &nodes() const;
+
+    bool empty() const;
+
+    static uint64_t hash(const std::string &str);
+};
@@ -0,0 +1,105 @@
+/**
+ * hit_queue.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the gets counted for evictors that count them.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "evictor.hh"
+
+/**
+ * Gets don't hold the cache's lock, so an evictor that counts them can't
+ * touch its own structures from Evictor::hit_key(). It counts the hit here
+ * instead, and drains the counts from its next call made under the cache's
+ * lock.
+ *
+ * Threads are dealt the stripes in turn, so with up to 64 threads each
+ * counts in a stripe of its own; past that, threads share stripes, and
+ * only those sharing one ever wait on each other. A hit on a key already
+ * counted since the last drain allocates nothing. No hit is dropped: a
+ * stripe holds one count for each key got since the last drain, and once
+ * it holds stripe_keys of them, push() asks for a drain, so a long run of
+ * gets with no writes to drain them can't grow it without bound.
+ */
+class Hit_Queue {
+public:
+    struct Hits {
+        uint64_t count;
+        uint64_t size;  // Of the value the last hit found
+    };
+
+private:
+    static constexpr size_t stripes = 64;
+
+    struct alignas(64) Stripe {
+        std::mutex lock;  // Contended by drain() and threads sharing it
+        std::unordered_map<key_type, Hits> counts;
+        key_type looking;  // Reused to look keys up without allocating
+    };
+
+    Stripe stripe[stripes];
+
+    // Threads take stripes in turn the first time they count a hit
+    static size_t my_stripe() {
+        static std::atomic<size_t> next{0};
+        static thread_local const size_t mine = next++ % stripes;
+        return mine;
+    }
+
+public:
+    // Most keys a stripe counts before push() asks for a drain
+    static constexpr size_t stripe_keys = 4096;
+
+    /**
+     * Count a hit on key, whose value has size bytes. Safe to call from any
+     * thread.
+     * @return true iff this thread's stripe is full, and should be drained
+     *         before it counts another key
+     */
+    bool push(key_view_type key, uint64_t size = 0) {
+        Stripe &mine = stripe[my_stripe()];
+        std::lock_guard<std::mutex> guard(mine.lock);
+        mine.looking.assign(key.data(), key.size());
+        auto found = mine.counts.find(mine.looking);
+        if (found == mine.counts.end()) {
+            mine.counts.emplace(mine.looking, Hits{1, size});
+        } else {
+            found->second.count++;
+            found->second.size = size;
+        }
+        return mine.counts.size() >= stripe_keys;
+    }
+
+    /**
+     * Call count(key, hits) for every key got since the last drain, one
+     * stripe at a time. Hits on different threads in between count as
+     * happening together.
+     */
+    template <typename Count>
+    void drain(Count &&count) {
+        std::unordered_map<key_type, Hits> counting;
+        for (Stripe &each : stripe) {
+            {
+                std::lock_guard<std::mutex> guard(each.lock);
+                if (each.counts.empty()) continue;
+                counting.swap(each.counts);
+            }
+            for (const auto &hit : counting) count(hit.first, hit.second);
+            counting.clear();
+        }
+    }
+
+    void clear() {
+        for (Stripe &each : stripe) {
+            std::lock_guard<std::mutex> guard(each.lock);
+            each.counts.clear();
+        }
+    }
+};
@@ -0,0 +1,150 @@
+/**
+ * hot_keys.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the hot key tracker in hot_keys.hh.
+ */
+#include "hot_keys.hh"
+
+#include <algorithm>
+#include <atomic>
+
+/**
+ * @param cap the most keys counted at once
+ */
+Hot_Keys::Sketch::Sketch(size_t cap) : capacity(cap == 0 ? 1 : cap) {
+    heap.reserve(capacity);
+    where.reserve(capacity);
+}
+
+void Hot_Keys::Sketch::swap_entries(size_t a, size_t b) {
+    std::swap(heap[a], heap[b]);
+    where[heap[a].key] = a;
+    where[heap[b].key] = b;
+}
+
+/**
+ * Restore the heap below i after heap[i].count grew.
+ */
+void Hot_Keys::Sketch::sift_down(size_t i) {
+    for (;;) {
+        size_t least = i;
+        const size_t left = 2 * i + 1, right = left + 1;
+        if (left < heap.size() && heap[left].count < heap[least].count)
+            least = left;
+        if (right < heap.size() && heap[right].count < heap[least].count)
+            least = right;
+        if (least == i) return;
+        swap_entries(i, least);
+        i = least;
+    }
+}
+
+/**
+ * Count weight more for key, replacing the least counted key if key is new
+ * and the summary is full. The newcomer inherits that key's count as its
+ * error.
+ */
+void Hot_Keys::Sketch::add(const key_type &key, uint64_t weight) {
+    auto found = where.find(key);
+    if (found != where.end()) {
+        heap[found->second].count += weight;
+        sift_down(found->second);
+        return;
+    }
+
+    if (heap.size() < capacity) {
+        // A new entry at least as big as nothing; bubble it up
+        size_t i = heap.size();
+        heap.push_back({key, weight, 0});
+        where[key] = i;
+        while (i > 0 && heap[(i - 1) / 2].count > heap[i].count) {
+            swap_entries(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+
+    Entry &least = heap.front();
+    where.erase(least.key);
+    least.key = key;
+    least.error = least.count;
+    least.count += weight;
+    where[key] = 0;
+    sift_down(0);
+}
+
+/**
+ * @param k     most entries to return
+ * @param scale what to multiply counts by to undo sampling
+ * @return the k biggest entries, biggest first
+ */
+std::vector<Hot_Keys::Entry> Hot_Keys::Sketch::top(size_t k,
+                                                   uint64_t scale) const {
+    std::vector<Entry> sorted(heap);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Entry &a, const Entry &b) { return a.count > b.count; });
+    if (sorted.size() > k) sorted.resize(k);
+    for (Entry &entry : sorted) {
+        entry.count *= scale;
+        entry.error *= scale;
+    }
+    return sorted;
+}
+
+void Hot_Keys::Sketch::clear() {
+    heap.clear();
+    where.clear();
+}
+
+/**
+ * @param capacity how many keys each summary counts; the top capacity / 2
+ *                 or so are reliable
+ * @param sample   look at one in this many calls to record()
+ */
+Hot_Keys::Hot_Keys(size_t capacity, uint32_t sample)
+        : sample_every(sample == 0 ? 1 : sample),
+          requests(capacity),
+          bytes(capacity) {}
+
+/**
+ * Note a request for key that moved size bytes. Cheap unless this call is
+ * sampled.
+ */
+void Hot_Keys::record(key_view_type key, uint64_t size) {
+    // A coin flip rather than a countdown, so threads that only serve a
+    // few requests are sampled fairly too. Thread ids get reused, so every
+    // thread is seeded from a counter instead.
+    static std::atomic<uint64_t> threads{0};
+    thread_local uint64_t state =
+            (threads.fetch_add(1, std::memory_order_relaxed) + 1) *
+            0x9E3779B97F4A7C15ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    if (sample_every > 1 && state % sample_every != 0) return;
+
+    const key_type copy(key);
+    std::lock_guard<std::mutex> guard(lock);
+    requests.add(copy, 1);
+    if (size != 0) bytes.add(copy, size);
+}
+
+/**
+ * @param k        most keys to return
+ * @param by_bytes rank by bytes moved instead of by requests
+ * @return the hottest keys, hottest first
+ */
+std::vector<Hot_Keys::Entry> Hot_Keys::top(size_t k, bool by_bytes) const {
+    std::lock_guard<std::mutex> guard(lock);
+    return (by_bytes ? bytes : requests).top(k, sample_every);
+}
+
+/**
+ * Forget everything counted so far.
+ */
+void Hot_Keys::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    requests.clear();
+    bytes.clear();
+}
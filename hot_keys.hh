@@ -0,0 +1,65 @@
+/**
+ * hot_keys.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare a tracker for the most requested keys.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "evictor.hh"
+
+/**
+ * Find the heaviest keys of a request stream in fixed memory, by number of
+ * requests and by bytes moved, using the space-saving algorithm: at most
+ * capacity keys are counted, and a key that isn't counted takes over the
+ * smallest counter. A count may be overestimated by at most its error.
+ *
+ * Each call to record() is looked at with probability 1 / sample_every,
+ * and only those take a lock; counts are scaled back up when reported.
+ */
+class Hot_Keys {
+public:
+    struct Entry {
+        key_type key;
+        uint64_t count;  // Estimated requests or bytes
+        uint64_t error;  // count may be over by at most this much
+    };
+
+private:
+    // One space-saving summary, kept as a min-heap on count
+    class Sketch {
+    private:
+        size_t capacity;
+        std::vector<Entry> heap;
+        std::unordered_map<key_type, size_t> where;  // key -> heap index
+
+        void swap_entries(size_t a, size_t b);
+        void sift_down(size_t i);
+
+    public:
+        explicit Sketch(size_t cap);
+        void add(const key_type &key, uint64_t weight);
+        std::vector<Entry> top(size_t k, uint64_t scale) const;
+        void clear();
+    };
+
+    const uint32_t sample_every;
+    mutable std::mutex lock;
+    Sketch requests;
+    Sketch bytes;
+
+public:
+    explicit Hot_Keys(size_t capacity = 64, uint32_t sample = 16);
+
+    void record(key_view_type key, uint64_t size);
+
+    std::vector<Entry> top(size_t k, bool by_bytes) const;
+
+    void clear();
+};
@@ -0,0 +1,257 @@
+/**
+ * invalidator.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the near cache invalidations in invalidator.hh.
+ */
+#include "invalidator.hh"
+
+#include <algorithm>
+
+/**
+ * @param lease  how long a client may serve a key without asking again
+ * @param leases most keys tracked for one client; gets beyond that aren't
+ *               leased, so the client doesn't keep them
+ * @param idle   forget clients that haven't polled for this long
+ */
+Invalidator::Invalidator(std::chrono::milliseconds lease, size_t leases,
+                         std::chrono::seconds idle)
+        : lease_time(lease), max_leases(leases), idle_time(idle) {}
+
+/**
+ * Stop the timer thread; polls still parked are never answered.
+ */
+Invalidator::~Invalidator() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    timer_wake.notify_all();
+    if (timer.joinable()) timer.join();
+}
+
+/**
+ * Stop looking for id when key changes. Needs lock.
+ */
+void Invalidator::drop_holder(const key_type &key, uint64_t id) {
+    auto found = holders.find(key);
+    if (found == holders.end()) return;
+    std::vector<uint64_t> &ids = found->second;
+    ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+    if (ids.empty()) holders.erase(found);
+}
+
+/**
+ * Forget the leases of a watcher that have run out. Needs lock.
+ */
+void Invalidator::drop_expired(uint64_t id, Watcher &watcher,
+                               clock::time_point now) {
+    for (auto it = watcher.leases.begin(); it != watcher.leases.end();) {
+        if (it->second <= now) {
+            drop_holder(it->first, id);
+            it = watcher.leases.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Hand client id what it has to drop, and count it as seen. Needs lock.
+ * @return false if id isn't subscribed (any more)
+ */
+bool Invalidator::take(uint64_t id, std::vector<key_type> &keys, bool &all) {
+    auto found = watchers.find(id);
+    if (found == watchers.end()) return false;
+    Watcher &watcher = found->second;
+    keys.swap(watcher.pending);
+    watcher.pending.clear();
+    all = watcher.flush;
+    watcher.flush = false;
+    watcher.last_seen = clock::now();
+    return true;
+}
+
+/**
+ * Take client id's parked poll, if it has one, off to be answered with
+ * what it has to drop. Needs lock.
+ */
+void Invalidator::unpark(uint64_t id, std::vector<Due> &due) {
+    auto found = parked.find(id);
+    if (found == parked.end()) return;
+    due.push_back({std::move(found->second.answer), false, {}, false});
+    parked.erase(found);
+    Due &poll = due.back();
+    poll.subscribed = take(id, poll.keys, poll.all);
+}
+
+/**
+ * Answer polls taken off by unpark(), without holding lock.
+ */
+void Invalidator::answer(std::vector<Due> &due) {
+    for (Due &poll : due) poll.answer(poll.subscribed, poll.keys, poll.all);
+}
+
+/**
+ * Answer parked polls as they run out of time.
+ */
+void Invalidator::run_timer() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping) {
+        clock::time_point next = clock::time_point::max();
+        for (const auto &poll : parked)
+            next = std::min(next, poll.second.deadline);
+        if (next == clock::time_point::max())
+            timer_wake.wait(guard);
+        else
+            timer_wake.wait_until(guard, next);
+
+        const clock::time_point now = clock::now();
+        std::vector<uint64_t> expired;
+        for (const auto &poll : parked)
+            if (poll.second.deadline <= now) expired.push_back(poll.first);
+        if (expired.empty()) continue;
+        std::vector<Due> due;
+        for (uint64_t id : expired) unpark(id, due);
+        guard.unlock();
+        answer(due);
+        guard.lock();
+    }
+}
+
+/**
+ * Start tracking a new client, and forget the ones that went away.
+ * @return the client's id
+ */
+uint64_t Invalidator::subscribe() {
+    std::lock_guard<std::mutex> guard(lock);
+    const clock::time_point now = clock::now();
+    for (auto it = watchers.begin(); it != watchers.end();) {
+        if (now - it->second.last_seen > idle_time) {
+            for (const auto &leased : it->second.leases)
+                drop_holder(leased.first, it->first);
+            it = watchers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    const uint64_t id = next_id++;
+    watchers[id].last_seen = now;
+    return id;
+}
+
+/**
+ * Lease key to client id, before the key is looked up, so no change made
+ * after the lookup can be missed.
+ * @return true iff the client may keep the key for lease_length()
+ */
+bool Invalidator::lease(uint64_t id, key_view_type key) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = watchers.find(id);
+    if (found == watchers.end()) return false;
+    Watcher &watcher = found->second;
+
+    const clock::time_point now = clock::now();
+    const key_type copy(key);
+    auto leased = watcher.leases.find(copy);
+    if (leased == watcher.leases.end()) {
+        if (watcher.leases.size() >= max_leases) {
+            drop_expired(id, watcher, now);
+            if (watcher.leases.size() >= max_leases) return false;
+        }
+        holders[copy].push_back(id);
+        leased = watcher.leases.emplace(copy, now).first;
+    }
+    leased->second = now + lease_time;
+    return true;
+}
+
+/**
+ * Tell every client holding key that it changed.
+ */
+void Invalidator::invalidate(key_view_type key) {
+    std::unique_lock<std::mutex> guard(lock);
+    auto found = holders.find(key_type(key));
+    if (found == holders.end()) return;
+
+    const clock::time_point now = clock::now();
+    std::vector<Due> due;
+    for (uint64_t id : found->second) {
+        auto watcher = watchers.find(id);
+        if (watcher == watchers.end()) continue;
+        auto leased = watcher->second.leases.find(found->first);
+        if (leased == watcher->second.leases.end()) continue;
+        const bool live = leased->second > now;
+        if (live) watcher->second.pending.push_back(found->first);
+        watcher->second.leases.erase(leased);
+        if (live) unpark(id, due);
+    }
+    holders.erase(found);
+    ready.notify_all();
+    guard.unlock();
+    answer(due);
+}
+
+/**
+ * Tell every client to drop everything, after a reset.
+ */
+void Invalidator::invalidate_all() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (auto &watcher : watchers) {
+        watcher.second.leases.clear();
+        watcher.second.pending.clear();
+        watcher.second.flush = true;
+    }
+    holders.clear();
+    std::vector<Due> due;
+    while (!parked.empty()) unpark(parked.begin()->first, due);
+    ready.notify_all();
+    guard.unlock();
+    answer(due);
+}
+
+/**
+ * The long poll: wait for invalidations for client id.
+ * @param timeout longest to wait if there are none
+ * @param keys    filled with the keys to drop
+ * @param all     set if the client must drop everything
+ * @return false if id isn't subscribed (any more), so the client can't
+ *         trust anything it has
+ */
+bool Invalidator::wait(uint64_t id, std::chrono::milliseconds timeout,
+                       std::vector<key_type> &keys, bool &all) {
+    std::unique_lock<std::mutex> guard(lock);
+    auto has_news = [&]() {
+        auto found = watchers.find(id);
+        return found == watchers.end() || found->second.flush ||
+               !found->second.pending.empty();
+    };
+    ready.wait_for(guard, timeout, has_news);
+    return take(id, keys, all);
+}
+
+/**
+ * The long poll, without a thread waiting on it: answer at once if there's
+ * news for client id, or else once there is, or once timeout has passed.
+ * A poll parked before it for the same client is answered now.
+ * @param reply called with what wait() would have returned and filled in,
+ *              from whichever thread answers
+ */
+void Invalidator::park(uint64_t id, std::chrono::milliseconds timeout,
+                       Answer reply) {
+    std::unique_lock<std::mutex> guard(lock);
+    std::vector<Due> due;
+    unpark(id, due);
+    auto found = watchers.find(id);
+    if (found == watchers.end() || found->second.flush ||
+        !found->second.pending.empty()) {
+        due.push_back({std::move(reply), false, {}, false});
+        due.back().subscribed = take(id, due.back().keys, due.back().all);
+    } else {
+        parked[id] = {clock::now() + timeout, std::move(reply)};
+        if (!timer.joinable()) timer = std::thread(&Invalidator::run_timer, this);
+        timer_wake.notify_one();
+    }
+    guard.unlock();
+    answer(due);
+}
@@ -0,0 +1,120 @@
+/**
+ * invalidator.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the server side of the clients' near caches.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "evictor.hh"
+
+/**
+ * Remembers which clients hold which keys in their near caches, and tells
+ * them when those keys change.
+ *
+ * A client subscribes once and then keeps a long poll open for its
+ * invalidations. Each GET it makes on its subscription leases the key: the
+ * client may serve the key itself until the lease runs out, or until it
+ * hears that the key was set, deleted or reset. A lease is tracked only
+ * once; after its invalidation is sent the client must get the key again.
+ * If an invalidation is lost, the lease still bounds how stale the copy
+ * can get.
+ *
+ * A poll either waits on a thread of its own, or is parked here with what
+ * to do once it's answered; then the write that invalidates a key answers
+ * it, or a timer thread does once it has waited long enough.
+ */
+class Invalidator {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Headers used by the protocol
+    static constexpr const char *client_header = "X-Near-Cache";
+    static constexpr const char *lease_header = "X-Lease";
+    static constexpr const char *all_header = "X-Invalidate-All";
+
+    // Answers a parked poll: whether the client is still subscribed, the
+    // keys it must drop, and whether it must drop everything
+    using Answer = std::function<void(bool subscribed,
+                                      const std::vector<key_type> &keys,
+                                      bool all)>;
+
+private:
+    struct Watcher {
+        std::unordered_map<key_type, clock::time_point> leases;
+        std::vector<key_type> pending;  // Invalidations not yet sent
+        bool flush = false;             // Everything was invalidated
+        clock::time_point last_seen;
+    };
+
+    const std::chrono::milliseconds lease_time;
+    const size_t max_leases;  // Per watcher
+    const std::chrono::seconds idle_time;
+
+    std::mutex lock;  // Guards everything below
+    std::condition_variable ready;
+    std::unordered_map<uint64_t, Watcher> watchers;
+    std::unordered_map<key_type, std::vector<uint64_t>> holders;
+    uint64_t next_id = 1;
+
+    struct Parked {
+        clock::time_point deadline;
+        Answer answer;
+    };
+
+    // A parked poll taken off to be answered once lock is let go
+    struct Due {
+        Answer answer;
+        bool subscribed;
+        std::vector<key_type> keys;
+        bool all;
+    };
+
+    std::unordered_map<uint64_t, Parked> parked;  // By client
+    std::condition_variable timer_wake;  // A poll was parked, or stopping
+    std::thread timer;                   // Started by the first park()
+    bool stopping = false;
+
+    void drop_holder(const key_type &key, uint64_t id);
+    void drop_expired(uint64_t id, Watcher &watcher, clock::time_point now);
+    bool take(uint64_t id, std::vector<key_type> &keys, bool &all);
+    void unpark(uint64_t id, std::vector<Due> &due);
+    static void answer(std::vector<Due> &due);
+    void run_timer();
+
+public:
+    explicit Invalidator(
+            std::chrono::milliseconds lease = std::chrono::seconds(2),
+            size_t leases = 4096,
+            std::chrono::seconds idle = std::chrono::seconds(30));
+
+    ~Invalidator();
+
+    Invalidator(const Invalidator &) = delete;
+    Invalidator &operator=(const Invalidator &) = delete;
+
+    uint64_t subscribe();
+
+    bool lease(uint64_t id, key_view_type key);
+
+    void invalidate(key_view_type key);
+
+    void invalidate_all();
+
+    bool wait(uint64_t id, std::chrono::milliseconds timeout,
+              std::vector<key_type> &keys, bool &all);
+
+    void park(uint64_t id, std::chrono::milliseconds timeout, Answer reply);
+
+    std::chrono::milliseconds lease_length() const { return lease_time; }
+};
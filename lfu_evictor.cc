@@ -0,0 +1,141 @@
+/**
+ * lfu_evictor.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the LFU eviction policy interface in lfu_evictor.hh.
+ */
+#include "lfu_evictor.hh"
+
+/**
+ * A trivial constructor for an LFU evictor object.
+ */
+Lfu_Evictor::Lfu_Evictor() = default;
+
+/**
+ * A trivial destructor for an LFU evictor object.
+ */
+Lfu_Evictor::~Lfu_Evictor() = default;
+
+/**
+ * Count uses of key, adding it if it's new.
+ * @param size  its value's size, or 0 to keep the one we know
+ * @param count how many uses, only for a key we know
+ */
+void Lfu_Evictor::use(const key_type &key, uint64_t size, uint64_t count) {
+    auto found = where.find(key);
+    if (found == where.end()) {
+        const rank_type rank{1, uses++};
+        order.emplace(rank, key);
+        where.emplace(key, Entry{rank, size});
+        return;
+    }
+    Entry &entry = found->second;
+    auto node = order.extract(entry.rank);
+    entry.rank = {entry.rank.first + count, uses++};
+    node.key() = entry.rank;
+    order.insert(std::move(node));
+    if (size != 0) entry.size = size;
+}
+
+/**
+ * Add the hits counted since the last call.
+ */
+void Lfu_Evictor::count_hits() {
+    hits.drain([this](const key_type &key, const Hit_Queue::Hits &got) {
+        add_hits(key, got.count);
+    });
+}
+
+/**
+ * Let the evictor know a key was set, counting it as a use.
+ * @param key The key being added to the cache
+ */
+void Lfu_Evictor::touch_key(const key_type &key) {
+    count_hits();
+    use(key, 0);
+}
+
+/**
+ * Let the evictor know a key was set, with its size for evict_batch().
+ * Cost is ignored.
+ * @param key  The key being added to the cache
+ * @param size Bytes in its value
+ */
+void Lfu_Evictor::touch_key(const key_type &key, uint64_t size, double) {
+    count_hits();
+    use(key, size);
+}
+
+/**
+ * Count a get of key. Safe to call from any thread.
+ */
+bool Lfu_Evictor::hit_key(key_view_type key, uint64_t) {
+    return hits.push(key);
+}
+
+/**
+ * Count the gets hit_key() put off.
+ */
+void Lfu_Evictor::settle() { count_hits(); }
+
+/**
+ * Add gets of key counted elsewhere. A key we no longer know of (evicted
+ * or deleted since) is left out.
+ */
+void Lfu_Evictor::add_hits(const key_type &key, uint64_t count) {
+    if (count != 0 && where.find(key) != where.end()) use(key, 0, count);
+}
+
+/**
+ * Stop tracking a key that was deleted.
+ */
+void Lfu_Evictor::forget_key(const key_type &key) {
+    auto found = where.find(key);
+    if (found == where.end()) return;
+    order.erase(found->second.rank);
+    where.erase(found);
+}
+
+/**
+ * Evict the least frequently used key.
+ * @return The key of the item to remove, or "" if there are none
+ */
+const key_type Lfu_Evictor::evict() {
+    count_hits();
+    if (order.empty()) return "";
+    key_type key = std::move(order.begin()->second);
+    order.erase(order.begin());
+    where.erase(key);
+    return key;
+}
+
+/**
+ * Evict the least frequently used keys until their values add up to bytes.
+ * A key of unknown size ends the batch, since we can't tell what it frees.
+ * @param victims the keys to remove are appended to this
+ */
+void Lfu_Evictor::evict_batch(uint64_t bytes, size_t max_keys,
+                              std::vector<key_type> &victims) {
+    count_hits();
+    uint64_t freed = 0;
+    for (size_t taken = 0; taken < max_keys && freed < bytes && !order.empty();
+         taken++) {
+        auto found = where.find(order.begin()->second);
+        const uint64_t size = found->second.size;
+        where.erase(found);
+        victims.push_back(std::move(order.begin()->second));
+        order.erase(order.begin());
+        if (size == 0) return;
+        freed += size;
+    }
+}
+
+/**
+ * Forget every key.
+ */
+void Lfu_Evictor::clear() {
+    std::map<rank_type, key_type>().swap(order);
+    std::unordered_map<key_type, Entry>().swap(where);
+    uses = 0;
+    hits.clear();
+}
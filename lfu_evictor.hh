@@ -0,0 +1,66 @@
+/**
+ * lfu_evictor.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the LFU eviction policy interface.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "evictor.hh"
+#include "hit_queue.hh"
+
+/**
+ * Evicts the key that was set or got the fewest times, the one used least
+ * recently of those if there's a tie. Keys are kept in a map ordered on
+ * (uses, last use), indexed by key, so every call is O(log n). Hits are
+ * counted apart and added at the next call made under the cache's lock
+ * (see hit_queue.hh).
+ */
+class Lfu_Evictor final : virtual public Evictor {
+private:
+    using rank_type = std::pair<uint64_t, uint64_t>;  // (uses, last use)
+
+    struct Entry {
+        rank_type rank;
+        uint64_t size;  // 0 if not known
+    };
+
+    std::map<rank_type, key_type> order;  // Least frequently used first
+    std::unordered_map<key_type, Entry> where;
+    uint64_t uses = 0;  // Stamps each use, so ties go to the oldest
+    Hit_Queue hits;
+
+    void use(const key_type &key, uint64_t size, uint64_t count = 1);
+    void count_hits();
+
+public:
+    Lfu_Evictor();
+
+    ~Lfu_Evictor() override;
+
+    void touch_key(const key_type &) override;
+
+    void touch_key(const key_type &key, uint64_t size, double cost) override;
+
+    bool hit_key(key_view_type key, uint64_t size) override;
+
+    void settle() override;
+
+    void add_hits(const key_type &key, uint64_t count) override;
+
+    void forget_key(const key_type &key) override;
+
+    const key_type evict() override;
+
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) override;
+
+    void clear() override;
+};
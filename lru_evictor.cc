@@ -0,0 +1,134 @@
+/**
+ * lru_evictor.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the LRU eviction policy interface in lru_evictor.hh.
+ */
+#include "lru_evictor.hh"
+
+/**
+ * A trivial constructor for an LRU evictor object.
+ */
+Lru_Evictor::Lru_Evictor() = default;
+
+/**
+ * A trivial destructor for an LRU evictor object.
+ */
+Lru_Evictor::~Lru_Evictor() = default;
+
+/**
+ * Move key to the front, adding it if it's new.
+ * @param size its value's size, or 0 to keep the one we know
+ */
+void Lru_Evictor::use(const key_type &key, uint64_t size) {
+    auto found = where.find(key);
+    if (found == where.end()) {
+        order.push_front(key);
+        where.emplace(key, Entry{order.begin(), size});
+        return;
+    }
+    order.splice(order.begin(), order, found->second.place);
+    if (size != 0) found->second.size = size;
+}
+
+/**
+ * Apply the hits counted since the last call.
+ */
+void Lru_Evictor::count_hits() {
+    hits.drain([this](const key_type &key, const Hit_Queue::Hits &) {
+        add_hits(key, 1);
+    });
+}
+
+/**
+ * Let the evictor know a key was set.
+ * @param key The key being added to the cache
+ */
+void Lru_Evictor::touch_key(const key_type &key) {
+    count_hits();
+    use(key, 0);
+}
+
+/**
+ * Let the evictor know a key was set, with its size for evict_batch().
+ * Cost is ignored.
+ * @param key  The key being added to the cache
+ * @param size Bytes in its value
+ */
+void Lru_Evictor::touch_key(const key_type &key, uint64_t size, double) {
+    count_hits();
+    use(key, size);
+}
+
+/**
+ * Count a get of key. Safe to call from any thread.
+ */
+bool Lru_Evictor::hit_key(key_view_type key, uint64_t) {
+    return hits.push(key);
+}
+
+/**
+ * Count the gets hit_key() put off.
+ */
+void Lru_Evictor::settle() { count_hits(); }
+
+/**
+ * Move key to the front for gets counted elsewhere. A key we no longer know
+ * of (evicted or deleted since) is left out.
+ */
+void Lru_Evictor::add_hits(const key_type &key, uint64_t count) {
+    if (count != 0 && where.find(key) != where.end()) use(key, 0);
+}
+
+/**
+ * Stop tracking a key that was deleted.
+ */
+void Lru_Evictor::forget_key(const key_type &key) {
+    auto found = where.find(key);
+    if (found == where.end()) return;
+    order.erase(found->second.place);
+    where.erase(found);
+}
+
+/**
+ * Evict the least recently used key.
+ * @return The key of the item to remove, or "" if there are none
+ */
+const key_type Lru_Evictor::evict() {
+    count_hits();
+    if (order.empty()) return "";
+    key_type key = std::move(order.back());
+    order.pop_back();
+    where.erase(key);
+    return key;
+}
+
+/**
+ * Evict the least recently used keys until their values add up to bytes.
+ * A key of unknown size ends the batch, since we can't tell what it frees.
+ * @param victims the keys to remove are appended to this
+ */
+void Lru_Evictor::evict_batch(uint64_t bytes, size_t max_keys,
+                              std::vector<key_type> &victims) {
+    count_hits();
+    uint64_t freed = 0;
+    for (size_t taken = 0; taken < max_keys && freed < bytes && !order.empty();
+         taken++) {
+        auto found = where.find(order.back());
+        const uint64_t size = found->second.size;
+        where.erase(found);
+        victims.push_back(std::move(order.back()));
+        order.pop_back();
+        if (size == 0) return;
+        freed += size;
+    }
+}
+
+/**
+ * Forget every key.
+ */
+void Lru_Evictor::clear() {
+    std::list<key_type>().swap(order);
+    std::unordered_map<key_type, Entry>().swap(where);
+    hits.clear();
+}
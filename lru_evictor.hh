@@ -0,0 +1,61 @@
+/**
+ * lru_evictor.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the LRU eviction policy interface.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "evictor.hh"
+#include "hit_queue.hh"
+
+/**
+ * Evicts the key that was set or got the longest ago. Keys are kept in a
+ * list from most to least recently used, indexed by key, so every call is
+ * O(1). Hits are counted and applied at the next call made under the
+ * cache's lock (see hit_queue.hh).
+ */
+class Lru_Evictor final : virtual public Evictor {
+private:
+    struct Entry {
+        std::list<key_type>::iterator place;
+        uint64_t size;  // 0 if not known
+    };
+
+    std::list<key_type> order;  // Most recently used first
+    std::unordered_map<key_type, Entry> where;
+    Hit_Queue hits;
+
+    void use(const key_type &key, uint64_t size);
+    void count_hits();
+
+public:
+    Lru_Evictor();
+
+    ~Lru_Evictor() override;
+
+    void touch_key(const key_type &) override;
+
+    void touch_key(const key_type &key, uint64_t size, double cost) override;
+
+    bool hit_key(key_view_type key, uint64_t size) override;
+
+    void settle() override;
+
+    void add_hits(const key_type &key, uint64_t count) override;
+
+    void forget_key(const key_type &key) override;
+
+    const key_type evict() override;
+
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) override;
+
+    void clear() override;
+};
@@ -0,0 +1,185 @@
+/**
+ * lz4.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * A small LZ4 block compressor for values, with a frame that records the
+ * size to decompress to.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Compresses to the LZ4 block format: runs of literals, each followed by
+ * a copy of up to 64 KiB back, found through a table of the last place
+ * each 4-byte sequence was seen. It's one pass with no entropy coding, so
+ * it runs at memory speed and text shrinks a few times over.
+ *
+ * A frame is the uncompressed size, 8 bytes little-endian, then the block.
+ * decompress() checks every length and offset against both buffers, so a
+ * frame from the network can't make it read or write out of bounds.
+ */
+class Lz4 {
+private:
+    static constexpr size_t hash_bits = 12;
+    static constexpr size_t min_match = 4;
+    // The format ends with at least this many literals
+    static constexpr size_t last_literals = 5;
+    // and no match starts within this many bytes of the end
+    static constexpr size_t match_limit = 12;
+    static constexpr size_t max_offset = 65535;
+
+    static uint32_t read32(const char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static size_t hash(uint32_t v) {
+        return (v * 2654435761U) >> (32 - hash_bits);
+    }
+
+    // Lengths of 15 and up spill past the token in bytes of up to 255
+    static void put_length(char *&out, size_t n) {
+        for (; n >= 255; n -= 255) *out++ = static_cast<char>(255);
+        *out++ = static_cast<char>(n);
+    }
+
+    static bool get_length(const unsigned char *&in, const unsigned char *end,
+                           size_t &n) {
+        unsigned char b;
+        do {
+            if (in == end) return false;
+            b = *in++;
+            n += b;
+        } while (b == 255);
+        return true;
+    }
+
+    static void put_literals(char *&out, const char *from, size_t n,
+                             size_t match) {
+        *out++ = static_cast<char>(((n < 15 ? n : 15) << 4) |
+                                   (match < 15 ? match : 15));
+        if (n >= 15) put_length(out, n - 15);
+        memcpy(out, from, n);
+        out += n;
+    }
+
+public:
+    static constexpr size_t frame_head = 8;
+
+    /**
+     * @return the most bytes compress() can write for size bytes
+     */
+    static constexpr size_t bound(size_t size) {
+        return frame_head + size + size / 255 + 16;
+    }
+
+    /**
+     * Compress size bytes at in into a frame at out, which has room for
+     * bound(size) bytes.
+     * @return the size of the frame
+     */
+    static size_t compress(const char *in, size_t size, char *out) {
+        char *op = out;
+        for (size_t i = 0; i < frame_head; i++)
+            *op++ = static_cast<char>(static_cast<uint64_t>(size) >> (8 * i));
+
+        const char *ip = in, *anchor = in;
+        const char *const end = in + size;
+        if (size > match_limit) {
+            uint32_t table[size_t(1) << hash_bits] = {};
+            const char *const limit = end - match_limit;
+            while (ip < limit) {
+                const uint32_t seq = read32(ip);
+                const size_t h = hash(seq);
+                const char *ref = in + table[h];
+                table[h] = static_cast<uint32_t>(ip - in);
+                if (ref >= ip || static_cast<size_t>(ip - ref) > max_offset ||
+                    read32(ref) != seq) {
+                    ip++;
+                    continue;
+                }
+                while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+                const char *match_end = ip + min_match;
+                for (const char *r = ref + min_match;
+                     match_end < end - last_literals && *match_end == *r; r++)
+                    match_end++;
+
+                const auto match = static_cast<size_t>(match_end - ip) - min_match;
+                put_literals(op, anchor, static_cast<size_t>(ip - anchor), match);
+                const auto offset = static_cast<size_t>(ip - ref);
+                *op++ = static_cast<char>(offset);
+                *op++ = static_cast<char>(offset >> 8);
+                if (match >= 15) put_length(op, match - 15);
+                ip = anchor = match_end;
+            }
+        }
+        put_literals(op, anchor, static_cast<size_t>(end - anchor), 0);
+        return static_cast<size_t>(op - out);
+    }
+
+    /**
+     * @return the size a frame of size bytes decompresses to, or 0 if it's
+     *         too short to say
+     */
+    static uint64_t raw_size(const char *frame, size_t size) {
+        if (size < frame_head) return 0;
+        uint64_t raw = 0;
+        for (size_t i = 0; i < frame_head; i++)
+            raw |= static_cast<uint64_t>(static_cast<unsigned char>(frame[i]))
+                   << (8 * i);
+        return raw;
+    }
+
+    /**
+     * Decompress a frame of size bytes into out, which has room for
+     * raw_size(frame, size) bytes.
+     * @return false if the frame is corrupt
+     */
+    static bool decompress(const char *frame, size_t size, char *out) {
+        const uint64_t raw = raw_size(frame, size);
+        if (size < frame_head) return false;
+        auto *ip = reinterpret_cast<const unsigned char *>(frame) + frame_head;
+        const auto *const iend = reinterpret_cast<const unsigned char *>(frame) + size;
+        char *op = out;
+        char *const oend = out + raw;
+        while (ip < iend) {
+            const unsigned token = *ip++;
+            size_t literals = token >> 4;
+            if (literals == 15 && !get_length(ip, iend, literals)) return false;
+            if (literals > static_cast<size_t>(iend - ip) ||
+                literals > static_cast<size_t>(oend - op))
+                return false;
+            memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+            if (ip == iend) break;  // The last run has no match
+
+            if (iend - ip < 2) return false;
+            const size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            size_t match = token & 15;
+            if (match == 15 && !get_length(ip, iend, match)) return false;
+            match += min_match;
+            if (offset == 0 || offset > static_cast<size_t>(op - out) ||
+                match > static_cast<size_t>(oend - op))
+                return false;
+            const char *from = op - offset;
+            if (offset >= match) {
+                memcpy(op, from, match);
+                op += match;
+            } else {
+                // Overlapping: each byte copied may be copied again
+                for (size_t i = 0; i < match; i++) *op++ = *from++;
+            }
+        }
+        return op == oend;
+    }
+};
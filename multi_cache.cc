@@ -0,0 +1,265 @@
+/**
+ * multi_cache.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the multi-server client in multi_cache.hh.
+ */
+#include "multi_cache.hh"
+
+#include <future>
+#include <iostream>
+#include <stdexcept>
+
+/**
+ * Split "host:port" into its two halves.
+ * @param endpoint the string to split
+ * @return {host, port}
+ * @throw std::invalid_argument if there is no port
+ */
+static std::pair<std::string, std::string> split_endpoint(
+        const std::string &endpoint) {
+    // "unix:path" and "shm:path" are for servers on this host; see Cache
+    const bool local = endpoint.rfind("unix:", 0) == 0 ||
+                       endpoint.rfind("shm:", 0) == 0;
+    const size_t colon = local ? endpoint.find(':') : endpoint.rfind(':');
+    if (colon == std::string::npos || colon + 1 == endpoint.size())
+        throw std::invalid_argument("bad endpoint: " + endpoint);
+    return {endpoint.substr(0, colon), endpoint.substr(colon + 1)};
+}
+
+/**
+ * Create a client for a set of cache servers.
+ * @param endpoints       the servers, each given as "host:port"
+ * @param vnodes_per_node points each server gets on the hash ring
+ */
+Multi_Cache::Multi_Cache(const std::vector<std::string> &endpoints,
+                         size_t vnodes_per_node)
+        : ring(vnodes_per_node) {
+    for (const auto &endpoint : endpoints) add_node(endpoint);
+}
+
+/**
+ * The Cache clients close their own connections.
+ */
+Multi_Cache::~Multi_Cache() = default;
+
+/**
+ * Connect to another server and give it its share of the keys.
+ * @param endpoint "host:port" of the server
+ * @return false if the server was already known
+ */
+bool Multi_Cache::add_node(const std::string &endpoint) {
+    if (nodes.count(endpoint) != 0) return false;
+    auto host_port = split_endpoint(endpoint);
+    auto node = std::make_unique<Node>();
+    node->cache = std::make_unique<Cache>(host_port.first, host_port.second);
+    nodes.emplace(endpoint, std::move(node));
+    return ring.add_node(endpoint);
+}
+
+/**
+ * Stop using a server. Its keys are routed to the remaining servers, where
+ * they will miss until they are set again.
+ * @param endpoint "host:port" of the server
+ * @return false if the server wasn't known
+ */
+bool Multi_Cache::remove_node(const std::string &endpoint) {
+    if (!ring.remove_node(endpoint)) return false;
+    nodes.erase(endpoint);
+    return true;
+}
+
+/**
+ * @return every server in use, as "host:port"
+ */
+std::vector<std::string> Multi_Cache::endpoints() const {
+    return ring.nodes();
+}
+
+/**
+ * @param key the key to place
+ * @return the "host:port" of the server that owns key
+ */
+const std::string &Multi_Cache::endpoint_for(const key_type &key) const {
+    return ring.node_for(key);
+}
+
+/**
+ * @param key the key to place
+ * @return the node that owns key
+ */
+Multi_Cache::Node &Multi_Cache::node_for(const key_type &key) const {
+    return *nodes.at(ring.node_for(key));
+}
+
+/**
+ * Run op on every key, with the keys of each node handled by their own thread.
+ * @param keys the keys to work on
+ * @param op   called as op(Cache &, index into keys) with the node locked
+ * @return the results of op, in the same order as keys
+ */
+template <typename Result, typename Op>
+std::vector<Result> Multi_Cache::run_parallel(
+        const std::vector<const key_type *> &keys, Op op) {
+    // Group the indices of the keys by the node that owns them
+    std::map<Node *, std::vector<size_t>> groups;
+    for (size_t i = 0; i < keys.size(); i++) {
+        groups[&node_for(*keys[i])].push_back(i);
+    }
+
+    auto run_group = [&op](Node *node, const std::vector<size_t> &indices) {
+        std::lock_guard<std::mutex> guard(node->lock);
+        std::vector<Result> out;
+        out.reserve(indices.size());
+        for (size_t i : indices) out.push_back(op(*node->cache, i));
+        return out;
+    };
+
+    // Every group but the first gets its own thread; the first runs here.
+    std::vector<std::future<std::vector<Result>>> futures;
+    for (auto group = std::next(groups.begin()); group != groups.end();
+         ++group) {
+        futures.push_back(std::async(std::launch::async, run_group,
+                                     group->first, std::cref(group->second)));
+    }
+
+    std::vector<Result> results(keys.size());
+    auto collect = [&results](const std::vector<size_t> &indices,
+                              const std::vector<Result> &out) {
+        for (size_t j = 0; j < out.size(); j++) results[indices[j]] = out[j];
+    };
+
+    if (!groups.empty()) {
+        collect(groups.begin()->second,
+                run_group(groups.begin()->first, groups.begin()->second));
+    }
+    size_t f = 0;
+    for (auto group = std::next(groups.begin()); group != groups.end();
+         ++group) {
+        collect(group->second, futures[f++].get());
+    }
+    return results;
+}
+
+/**
+ * Add or replace a <key, value> pair on the server that owns key.
+ * @param key string
+ * @param val struct
+ * @return true iff the insertion of the data to the store was successful.
+ */
+bool Multi_Cache::set(const key_type &key, Cache::val_type val) {
+    Node &node = node_for(key);
+    std::lock_guard<std::mutex> guard(node.lock);
+    return node.cache->set(key, val);
+}
+
+/**
+ * @param key string
+ * @return a newly-allocated copy of the value, or nullptr with size 0 if
+ *         not found. It is the caller's responsibility to free it.
+ */
+Cache::val_type Multi_Cache::get(const key_type &key) const {
+    Node &node = node_for(key);
+    std::lock_guard<std::mutex> guard(node.lock);
+    return node.cache->get(key);
+}
+
+/**
+ * Delete object from the server that owns key.
+ * @param key of pair to erase
+ * @return true if pair erased else false
+ */
+bool Multi_Cache::del(const key_type &key) {
+    Node &node = node_for(key);
+    std::lock_guard<std::mutex> guard(node.lock);
+    return node.cache->del(key);
+}
+
+/**
+ * Set many pairs at once, talking to all servers in parallel.
+ * @param items the <key, value> pairs
+ * @return whether each pair was stored, in the same order as items
+ */
+std::vector<bool> Multi_Cache::set_many(
+        const std::vector<std::pair<key_type, Cache::val_type>> &items) {
+    std::vector<const key_type *> keys;
+    keys.reserve(items.size());
+    for (const auto &item : items) keys.push_back(&item.first);
+    return run_parallel<bool>(keys, [&items](Cache &cache, size_t i) {
+        return cache.set(items[i].first, items[i].second);
+    });
+}
+
+/**
+ * Get many values at once, talking to all servers in parallel.
+ * @param keys the keys to look up
+ * @return the values, as from get(), in the same order as keys.
+ *         It is the caller's responsibility to free them.
+ */
+std::vector<Cache::val_type> Multi_Cache::get_many(
+        const std::vector<key_type> &keys) {
+    std::vector<const key_type *> key_ptrs;
+    key_ptrs.reserve(keys.size());
+    for (const auto &key : keys) key_ptrs.push_back(&key);
+    return run_parallel<Cache::val_type>(
+            key_ptrs,
+            [&keys](Cache &cache, size_t i) { return cache.get(keys[i]); });
+}
+
+/**
+ * Delete many keys at once, talking to all servers in parallel.
+ * @param keys the keys to delete
+ * @return whether each key was deleted, in the same order as keys
+ */
+std::vector<bool> Multi_Cache::del_many(const std::vector<key_type> &keys) {
+    std::vector<const key_type *> key_ptrs;
+    key_ptrs.reserve(keys.size());
+    for (const auto &key : keys) key_ptrs.push_back(&key);
+    return run_parallel<bool>(key_ptrs, [&keys](Cache &cache, size_t i) {
+        return cache.del(keys[i]);
+    });
+}
+
+/**
+ * @return the memory used by values on all servers together.
+ */
+Cache::size_type Multi_Cache::space_used() const {
+    Cache::size_type total = 0;
+    for (const auto &node : nodes) {
+        std::lock_guard<std::mutex> guard(node.second->lock);
+        total += node.second->cache->space_used();
+    }
+    return total;
+}
+
+/**
+ * The servers only report their ratios, not their counts, so this is the
+ * unweighted mean of the servers' hit rates.
+ * @return the mean hit rate of all servers.
+ */
+double Multi_Cache::hit_rate() const {
+    if (nodes.empty()) return 0;
+    double total = 0;
+    for (const auto &node : nodes) {
+        std::lock_guard<std::mutex> guard(node.second->lock);
+        total += node.second->cache->hit_rate();
+    }
+    return total / static_cast<double>(nodes.size());
+}
+
+/**
+ * Reset every server.
+ * @return true iff all of them were reset.
+ */
+bool Multi_Cache::reset() {
+    bool ok = true;
+    for (const auto &node : nodes) {
+        std::lock_guard<std::mutex> guard(node.second->lock);
+        if (!node.second->cache->reset()) {
+            std::cerr << "Multi_Cache::reset(): " << node.first << " failed"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
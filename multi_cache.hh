@@ -0,0 +1,81 @@
+/**
+ * multi_cache.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare a client that spreads keys over several cache servers.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cache.hh"
+#include "hash_ring.hh"
+
+/**
+ * Talks to any number of cache_server processes, each given as "host:port",
+ * or as "unix:path" or "shm:path" for one on this host (see Cache).
+ * Keys are routed with a Hash_Ring. Every node has a single networked Cache
+ * (one kept-alive connection) that is shared by all calls to that node.
+ * The *_many() calls split their keys by node and talk to all the nodes in
+ * parallel.
+ * Calls may come from several threads at once, but adding and removing nodes
+ * must not overlap with any other call.
+ */
+class Multi_Cache {
+private:
+    struct Node {
+        std::mutex lock;  // A Cache client can only do one request at a time
+        std::unique_ptr<Cache> cache;
+    };
+
+    Hash_Ring ring;
+    std::map<std::string, std::unique_ptr<Node>> nodes;
+
+    Node &node_for(const key_type &key) const;
+
+    template <typename Result, typename Op>
+    std::vector<Result> run_parallel(const std::vector<const key_type *> &keys,
+                                     Op op);
+
+public:
+    explicit Multi_Cache(const std::vector<std::string> &endpoints,
+                         size_t vnodes_per_node = 160);
+
+    ~Multi_Cache();
+
+    Multi_Cache(const Multi_Cache &) = delete;
+    Multi_Cache &operator=(const Multi_Cache &) = delete;
+
+    bool add_node(const std::string &endpoint);
+
+    bool remove_node(const std::string &endpoint);
+
+    std::vector<std::string> endpoints() const;
+
+    const std::string &endpoint_for(const key_type &key) const;
+
+    bool set(const key_type &key, Cache::val_type val);
+
+    Cache::val_type get(const key_type &key) const;
+
+    bool del(const key_type &key);
+
+    std::vector<bool> set_many(
+            const std::vector<std::pair<key_type, Cache::val_type>> &items);
+
+    std::vector<Cache::val_type> get_many(const std::vector<key_type> &keys);
+
+    std::vector<bool> del_many(const std::vector<key_type> &keys);
+
+    Cache::size_type space_used() const;
+
+    double hit_rate() const;
+
+    bool reset();
+};
@@ -0,0 +1,261 @@
+/**
+ * replicator.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the replication stream in replicator.hh.
+ */
+#include "replicator.hh"
+
+#include <boost/asio/io_service.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "cache.hh"
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+namespace http = beast::http;    // from <boost/beast/http.hpp>
+namespace net = boost::asio;     // from <boost/asio.hpp>
+using tcp = net::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
+
+/**
+ * Start a sender thread for every replica.
+ * @param endpoints the replicas, each given as "host:port"
+ * @param snap      copies the cache a part at a time for a full sync
+ * @param batch     most mutations written before reading the responses
+ * @param queue     most mutations a replica may fall behind by before it
+ *                  is given a full sync instead, outside of one
+ */
+Replicator::Replicator(const std::vector<std::string> &endpoints,
+                       snapshot_func snap, size_t batch, size_t queue)
+        : snapshot(std::move(snap)),
+          max_batch(batch == 0 ? 1 : batch),
+          max_queue(queue) {
+    for (const auto &endpoint : endpoints) {
+        const size_t colon = endpoint.rfind(':');
+        if (colon == std::string::npos)
+            throw std::invalid_argument("bad replica: " + endpoint);
+        auto replica = std::make_unique<Replica>();
+        replica->host = endpoint.substr(0, colon);
+        replica->port = endpoint.substr(colon + 1);
+        replicas.push_back(std::move(replica));
+    }
+    for (auto &replica : replicas) {
+        Replica *r = replica.get();
+        r->sender = std::thread([this, r]() { run(*r); });
+    }
+}
+
+/**
+ * Stop and join the sender threads. Anything still queued is dropped.
+ */
+Replicator::~Replicator() {
+    stopping = true;
+    for (auto &replica : replicas) {
+        {
+            std::lock_guard<std::mutex> guard(replica->lock);
+            replica->ready.notify_all();
+        }
+        if (replica->sender.joinable()) replica->sender.join();
+    }
+}
+
+/**
+ * The lock that orders the sets and dels of mutation's key.
+ */
+std::mutex &Replicator::order_lock(const Mutation &mutation) {
+    const size_t hash = std::hash<std::string>()(mutation.key) * 31 +
+                        std::hash<std::string>()(mutation.ns);
+    return order_locks[hash % order_stripes];
+}
+
+/**
+ * Number a mutation that was just applied and queue it for every replica.
+ * A replica that has fallen too far behind loses its queue and is synced
+ * from scratch instead.
+ * Called with the mutation's order lock held.
+ * @param mutation what to send
+ */
+void Replicator::push(const Mutation &mutation) {
+    const uint64_t number = next_number++;
+    for (auto &replica : replicas) {
+        std::lock_guard<std::mutex> guard(replica->lock);
+        // The copy will include it, or already did
+        if (replica->needs_sync || number < replica->from) continue;
+        if (replica->queue.size() >= max_queue && !replica->copying) {
+            replica->queue.clear();
+            replica->needs_sync = true;
+        } else {
+            replica->queue.push_back(mutation);
+        }
+        replica->ready.notify_one();
+    }
+}
+
+/**
+ * Write a batch of mutations as back-to-back HTTP requests, then read all
+ * the responses.
+ * @return true iff every request got a response
+ */
+static bool send_batch(beast::tcp_stream &stream, beast::flat_buffer &buffer,
+                       const std::string &host,
+                       std::vector<Replicator::Mutation>::const_iterator first,
+                       std::vector<Replicator::Mutation>::const_iterator last) {
+    beast::error_code ec;
+    std::ostringstream out;
+    size_t count = 0;
+    for (auto mutation = first; mutation != last; ++mutation, count++) {
+        http::request<http::string_body> req;
+        switch (mutation->op) {
+            case Replicator::Op::set:
+                // Like the client: the value is the body, unless it's empty
+                req.method(http::verb::put);
+                req.target('/' + mutation->key +
+                           (mutation->val.empty() ? "/" : ""));
+                req.body() = mutation->val;
+                break;
+            case Replicator::Op::del:
+                req.method(http::verb::delete_);
+                req.target('/' + mutation->key);
+                break;
+            case Replicator::Op::reset:
+                req.method(http::verb::post);
+                req.target("/reset");
+                break;
+            case Replicator::Op::flush:
+                req.method(http::verb::post);
+                req.target("/flush/" + mutation->ns);
+                break;
+        }
+        if (!mutation->ns.empty() && mutation->op != Replicator::Op::flush)
+            req.set(Cache::namespace_header, mutation->ns);
+        req.version(11);
+        req.set(http::field::host, host);
+        req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+        req.set(Replicator::header, "1");
+        req.keep_alive(true);
+        req.prepare_payload();
+        out << req;
+    }
+
+    net::write(stream, net::buffer(out.str()), ec);
+    if (ec) {
+        std::cerr << "Replicator: write: " << ec.message() << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        http::response<http::string_body> res;
+        http::read(stream, buffer, res, ec);
+        if (ec) {
+            std::cerr << "Replicator: read: " << ec.message() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Check an idle connection without blocking, so that a replica that went
+ * away (and may have come back empty) is noticed even if we have nothing
+ * to send it.
+ * @return true iff the replica closed the connection or it broke
+ */
+static bool peer_closed(tcp::socket &sock) {
+    beast::error_code ec, ignored;
+    char byte;
+    sock.non_blocking(true, ignored);
+    sock.receive(net::buffer(&byte, 1), tcp::socket::message_peek, ec);
+    sock.non_blocking(false, ignored);
+    return ec != net::error::would_block;
+}
+
+/**
+ * The sender thread of one replica.
+ * @param replica the replica to feed
+ */
+void Replicator::run(Replica &replica) {
+    net::io_context ioc;
+    tcp::resolver resolver{ioc};
+    beast::tcp_stream stream{ioc};
+    beast::flat_buffer buffer;
+    beast::error_code ec;
+    part_func copy;  // The copy under way, if any
+
+    while (!stopping) {
+        if (!stream.socket().is_open()) {
+            auto results = resolver.resolve(replica.host, replica.port, ec);
+            if (!ec) stream.connect(results, ec);
+            if (ec) {
+                std::cerr << "Replicator: " << replica.host << ':'
+                          << replica.port << ": " << ec.message() << std::endl;
+                stream.socket().close(ec);
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            buffer.clear();
+            std::lock_guard<std::mutex> guard(replica.lock);
+            replica.needs_sync = true;
+        }
+
+        std::vector<Mutation> batch;
+        bool sync;
+        {
+            std::unique_lock<std::mutex> lock(replica.lock);
+            const bool woken = replica.ready.wait_for(
+                    lock, std::chrono::seconds(1), [&]() {
+                        return stopping || replica.needs_sync ||
+                               replica.copying || !replica.queue.empty();
+                    });
+            if (stopping) break;
+            if (!woken) {
+                lock.unlock();
+                if (peer_closed(stream.socket())) stream.socket().close(ec);
+                continue;
+            }
+            sync = replica.needs_sync;
+            if (sync) {
+                // Mark where the copy starts; the queue picks up from there
+                replica.queue.clear();
+                replica.needs_sync = false;
+                replica.copying = true;
+                replica.from = next_number;
+            }
+            while (!sync && !replica.queue.empty() &&
+                   batch.size() < max_batch) {
+                batch.push_back(std::move(replica.queue.front()));
+                replica.queue.pop_front();
+            }
+        }
+
+        if (sync) {
+            copy = snapshot();
+            batch.push_back(Mutation{Op::reset, "", "", ""});
+        }
+        // Then the next part of the copy, taken after what's queued so far
+        bool copied = false;
+        if (copy) copied = !copy(batch);
+
+        bool ok = true;
+        for (size_t i = 0; ok && i < batch.size(); i += max_batch) {
+            auto last = batch.size() - i > max_batch
+                                ? batch.begin() + (i + max_batch)
+                                : batch.end();
+            ok = send_batch(stream, buffer, replica.host, batch.begin() + i,
+                            last);
+        }
+        if (!ok) stream.socket().close(ec);  // Reconnect and sync again
+        if (copied || !ok) {
+            copy = nullptr;
+            std::lock_guard<std::mutex> guard(replica.lock);
+            replica.copying = false;
+        }
+    }
+
+    stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+}
@@ -0,0 +1,130 @@
+/**
+ * replicator.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare the primary side of primary/replica replication between servers.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "evictor.hh"
+
+/**
+ * Streams the mutations of a primary cache_server to its replicas.
+ * Every replica has its own queue and sender thread; a request on the
+ * primary only appends to the queues and never waits for the network.
+ * The sender sends its queue in batches, writing a whole batch of requests
+ * before reading any of the responses.
+ *
+ * Whenever a sender (re)connects, or its queue overflowed, the replica is
+ * reset and then gets a full copy of the primary. The copy doesn't stop
+ * writes: every mutation is numbered once it's applied, and the sender
+ * marks the next number before copying. What was numbered before the mark
+ * is in the copy; what comes after is queued, and may be in the copy as
+ * well, which sending it again doesn't change. The copy is taken and sent
+ * a part at a time, with the queue sent in between, so it never holds the
+ * primary up for long or needs memory for all of it at once. Since the
+ * queue keeps draining, it isn't bounded while a copy is under way:
+ * overflowing would only start the copy over, and under steady writes a
+ * big copy might never finish.
+ *
+ * Mutations of the same key are applied and queued in the same order,
+ * under one of order_stripes locks picked by the key, so writes to
+ * different keys don't wait for each other. A reset or flush takes all of
+ * them.
+ */
+class Replicator {
+public:
+    enum class Op { set, del, reset, flush };
+
+    struct Mutation {
+        Op op;
+        key_type key;
+        std::string val;  // Only used by set
+        std::string ns;   // The namespace of a set or del; flush's target
+    };
+
+    // Add a copy of the next part of the cache to a batch as sets, returning
+    // false once the whole cache has been copied. It runs alongside writes,
+    // so a part should hold no lock for longer than it takes to copy it.
+    using part_func = std::function<bool(std::vector<Mutation> &)>;
+
+    // Start copying the cache, from the start
+    using snapshot_func = std::function<part_func()>;
+
+    // Requests sent by a primary carry this header so replicas accept them
+    static constexpr const char *header = "X-Replication";
+
+private:
+    struct Replica {
+        std::string host;
+        std::string port;
+        std::mutex lock;  // Guards queue, needs_sync, copying and from
+        std::condition_variable ready;
+        std::deque<Mutation> queue;
+        bool needs_sync = true;
+        bool copying = false;  // A copy is under way; see the class comment
+        uint64_t from = 0;  // Mutations numbered lower are in the last copy
+        std::thread sender;
+    };
+
+    static constexpr size_t order_stripes = 64;
+
+    snapshot_func snapshot;
+    size_t max_batch;
+    size_t max_queue;
+
+    std::atomic<uint64_t> next_number{0};
+    std::mutex order_locks[order_stripes];
+
+    std::vector<std::unique_ptr<Replica>> replicas;
+    std::atomic<bool> stopping{false};
+
+    std::mutex &order_lock(const Mutation &mutation);
+    void push(const Mutation &mutation);
+
+    void run(Replica &replica);
+
+public:
+    Replicator(const std::vector<std::string> &endpoints, snapshot_func snap,
+               size_t batch = 64, size_t queue = 65536);
+
+    ~Replicator();
+
+    Replicator(const Replicator &) = delete;
+    Replicator &operator=(const Replicator &) = delete;
+
+    /**
+     * Apply a mutation to the local cache and, if that worked, queue it for
+     * every replica.
+     * @param mutation what to send to the replicas
+     * @param apply    performs the mutation locally, returning true on success
+     * @return whatever apply returned
+     */
+    template <typename Apply>
+    bool apply(const Mutation &mutation, Apply apply) {
+        if (mutation.op == Op::set || mutation.op == Op::del) {
+            std::lock_guard<std::mutex> guard(order_lock(mutation));
+            if (!apply()) return false;
+            push(mutation);
+            return true;
+        }
+        std::unique_lock<std::mutex> all[order_stripes];
+        for (size_t i = 0; i < order_stripes; i++)
+            all[i] = std::unique_lock<std::mutex>(order_locks[i]);
+        if (!apply()) return false;
+        push(mutation);
+        return true;
+    }
+};
@@ -0,0 +1,112 @@
+/**
+ * seeded_hash.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * A fast keyed hash for cache keys.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string_view>
+
+/**
+ * The wyhash construction: 64-bit reads folded together with 64x64->128 bit
+ * multiplies. It is not a cryptographic hash, but its output depends on a
+ * secret seed, so clients can't precompute keys that all land in one chain
+ * (hash flooding). Every Seeded_Hash made without an explicit seed uses the
+ * same random per-process seed.
+ */
+class Seeded_Hash {
+private:
+    __extension__ typedef unsigned __int128 uint128;
+
+    static constexpr uint64_t secret[4] = {
+            0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+            0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+
+    uint64_t seed;
+
+    static void mum(uint64_t &a, uint64_t &b) {
+        uint128 r = a;
+        r *= b;
+        a = static_cast<uint64_t>(r);
+        b = static_cast<uint64_t>(r >> 64);
+    }
+
+    static uint64_t mix(uint64_t a, uint64_t b) {
+        mum(a, b);
+        return a ^ b;
+    }
+
+    static uint64_t read8(const unsigned char *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t read4(const unsigned char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t process_seed() {
+        static const uint64_t random = []() {
+            std::random_device device;
+            return (static_cast<uint64_t>(device()) << 32) ^ device();
+        }();
+        return random;
+    }
+
+public:
+    Seeded_Hash() : seed(process_seed()) {}
+
+    explicit Seeded_Hash(uint64_t s) : seed(s) {}
+
+    size_t operator()(std::string_view key) const {
+        const auto *p = reinterpret_cast<const unsigned char *>(key.data());
+        const size_t len = key.size();
+        uint64_t s = seed ^ mix(seed ^ secret[0], secret[1]);
+        uint64_t a, b;
+        if (len <= 16) {
+            if (len >= 4) {
+                const size_t step = (len >> 3) << 2;
+                a = (read4(p) << 32) | read4(p + step);
+                b = (read4(p + len - 4) << 32) | read4(p + len - 4 - step);
+            } else if (len > 0) {
+                a = (static_cast<uint64_t>(p[0]) << 16) |
+                    (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if (i > 48) {
+                uint64_t s1 = s, s2 = s;
+                do {
+                    s = mix(read8(p) ^ secret[1], read8(p + 8) ^ s);
+                    s1 = mix(read8(p + 16) ^ secret[2], read8(p + 24) ^ s1);
+                    s2 = mix(read8(p + 32) ^ secret[3], read8(p + 40) ^ s2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                s ^= s1 ^ s2;
+            }
+            while (i > 16) {
+                s = mix(read8(p) ^ secret[1], read8(p + 8) ^ s);
+                i -= 16;
+                p += 16;
+            }
+            a = read8(p + i - 16);
+            b = read8(p + i - 8);
+        }
+        a ^= secret[1];
+        b ^= s;
+        mum(a, b);
+        return static_cast<size_t>(mix(a ^ secret[0] ^ len, b ^ secret[1]));
+    }
+};
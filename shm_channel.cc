@@ -0,0 +1,258 @@
+/**
+ * shm_channel.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the shared memory channel in shm_channel.hh.
+ */
+#include "shm_channel.hh"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+// Tells a region from anything else that might have the name
+static constexpr uint64_t shm_magic = 0x68732d6568636163;  // "cache-sh"
+
+// Checks of the other side's counter before sleeping, if there's a CPU for
+// the other side to run on meanwhile
+static const int spins = std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+
+// Longest a sleep goes without checking whether the other side is gone
+static constexpr long nap_ns = 50 * 1000 * 1000;
+
+/**
+ * Bytes one way. head and tail count every byte written and read, modulo
+ * 2^32; the byte at a count is at that count modulo ring_size. Each sits on
+ * its own cache line, so the writer and reader don't fight over them.
+ */
+struct Shm_Channel::Ring {
+    alignas(64) std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> reader_sleeping{0};  // On head
+    alignas(64) std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> writer_sleeping{0};  // On tail
+    alignas(64) char data[ring_size];
+};
+
+struct Shm_Channel::Region {
+    uint64_t magic = shm_magic;
+    std::atomic<uint32_t> closed{0};
+    Ring requests;   // Client to server
+    Ring responses;  // Server to client
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                      sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futexes need plain 32-bit words");
+
+static void futex_wait(std::atomic<uint32_t> &word, uint32_t seen) {
+    const timespec nap{0, nap_ns};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, seen,
+            &nap, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE,
+            INT_MAX, nullptr, nullptr, 0);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static std::runtime_error shm_error(const std::string &name,
+                                    const char *what) {
+    return std::runtime_error("Shm_Channel: " + name + ": " + what + ": " +
+                              strerror(errno));
+}
+
+Shm_Channel::Shm_Channel(Region *region, bool server)
+    : region(region),
+      in(server ? region->requests : region->responses),
+      out(server ? region->responses : region->requests) {}
+
+std::unique_ptr<Shm_Channel> Shm_Channel::create(const std::string &name) {
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) throw shm_error(name, "shm_open");
+    void *at = MAP_FAILED;
+    if (ftruncate(fd, sizeof(Region)) == 0)
+        at = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    if (at == MAP_FAILED) {
+        const auto error = shm_error(name, "mmap");
+        ::close(fd);
+        shm_unlink(name.c_str());
+        throw error;
+    }
+    ::close(fd);
+    return std::unique_ptr<Shm_Channel>(
+            new Shm_Channel(new (at) Region, false));
+}
+
+std::unique_ptr<Shm_Channel> Shm_Channel::attach(const std::string &name) {
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) throw shm_error(name, "shm_open");
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size != sizeof(Region)) {
+        ::close(fd);
+        throw std::runtime_error("Shm_Channel: " + name + ": wrong size");
+    }
+    void *at = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    if (at == MAP_FAILED) {
+        const auto error = shm_error(name, "mmap");
+        ::close(fd);
+        throw error;
+    }
+    ::close(fd);
+    auto *region = static_cast<Region *>(at);
+    if (region->magic != shm_magic) {
+        munmap(at, sizeof(Region));
+        throw std::runtime_error("Shm_Channel: " + name + ": not a channel");
+    }
+    return std::unique_ptr<Shm_Channel>(new Shm_Channel(region, true));
+}
+
+/**
+ * Close the channel and unmap our view of it; the region goes once both
+ * sides have, and it's unlinked.
+ */
+Shm_Channel::~Shm_Channel() {
+    close();
+    munmap(region, sizeof(Region));
+}
+
+bool Shm_Channel::is_open() const {
+    return region->closed.load(std::memory_order_acquire) == 0;
+}
+
+void Shm_Channel::close() {
+    if (region->closed.exchange(1) != 0) return;
+    for (Ring *ring : {&region->requests, &region->responses}) {
+        futex_wake(ring->head);
+        futex_wake(ring->tail);
+    }
+}
+
+/**
+ * Whether the socket we were told to watch has been closed at the other end.
+ */
+bool Shm_Channel::peer_gone() const {
+    if (peer < 0) return false;
+    pollfd p{peer, POLLRDHUP, 0};
+    return poll(&p, 1, 0) > 0 &&
+           (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+/**
+ * Wait for the other side to move counter on from seen: spin a while, then
+ * sleep on it, having said so in sleeping. Both that and the other side's
+ * move of the counter are sequentially consistent, so either it sees we're
+ * asleep and wakes us, or we see it moved and don't sleep.
+ * @return false if the channel closed first
+ */
+bool Shm_Channel::wait(std::atomic<uint32_t> &counter, uint32_t seen,
+                       std::atomic<uint32_t> &sleeping) {
+    for (int i = 0; i < spins; i++) {
+        if (counter.load(std::memory_order_acquire) != seen) return true;
+        cpu_relax();
+    }
+    for (;;) {
+        sleeping.store(1);
+        if (counter.load() != seen) break;
+        if (!is_open()) {
+            sleeping.store(0);
+            return false;
+        }
+        futex_wait(counter, seen);
+        if (counter.load() != seen) break;
+        if (peer_gone()) {
+            sleeping.store(0);
+            close();
+            return false;
+        }
+    }
+    sleeping.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+size_t Shm_Channel::read(char *data, size_t size) {
+    Ring &ring = in;
+    const uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+    uint32_t head = ring.head.load(std::memory_order_acquire);
+    if (head == tail) {
+        if (!wait(ring.head, tail, ring.reader_sleeping)) return 0;
+        head = ring.head.load(std::memory_order_acquire);
+    }
+
+    // Don't trust the other side with how far we may read
+    const size_t n = std::min<size_t>(size, std::min(head - tail, ring_size));
+    const size_t at = tail % ring_size;
+    const size_t first = std::min(n, ring_size - at);
+    memcpy(data, ring.data + at, first);
+    memcpy(data + first, ring.data, n - first);
+
+    ring.tail.store(tail + static_cast<uint32_t>(n));
+    if (ring.writer_sleeping.load() != 0) futex_wake(ring.tail);
+    return n;
+}
+
+/**
+ * Wait for room to write.
+ * @return how many bytes there's room for, or 0 once the channel is closed
+ */
+size_t Shm_Channel::room() {
+    Ring &ring = out;
+    if (!is_open()) return 0;
+    const uint32_t head = ring.head.load(std::memory_order_relaxed);
+    uint32_t tail = ring.tail.load(std::memory_order_acquire);
+    if (head - tail >= ring_size) {
+        if (!wait(ring.tail, tail, ring.writer_sleeping)) return 0;
+        tail = ring.tail.load(std::memory_order_acquire);
+    }
+    return ring_size - std::min(head - tail, ring_size);
+}
+
+/**
+ * Copy data in offset bytes past what's been written, within room().
+ */
+void Shm_Channel::fill(size_t offset, const char *data, size_t size) {
+    Ring &ring = out;
+    const size_t at = (ring.head.load(std::memory_order_relaxed) + offset) %
+                      ring_size;
+    const size_t first = std::min(size, ring_size - at);
+    memcpy(ring.data + at, data, first);
+    memcpy(ring.data, data + first, size - first);
+}
+
+/**
+ * Pass on the next size bytes, and wake the reader if it's asleep.
+ */
+void Shm_Channel::commit(size_t size) {
+    Ring &ring = out;
+    ring.head.store(ring.head.load(std::memory_order_relaxed) +
+                    static_cast<uint32_t>(size));
+    if (ring.reader_sleeping.load() != 0) futex_wake(ring.head);
+}
+
+size_t Shm_Channel::write(const char *data, size_t size) {
+    const size_t n = std::min(size, room());
+    if (n == 0) return 0;
+    fill(0, data, n);
+    commit(n);
+    return n;
+}
@@ -0,0 +1,159 @@
+/**
+ * shm_channel.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare a byte stream through shared memory, for clients on the server's
+ * own host.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/system/system_error.hpp>
+
+/**
+ * Two rings of bytes in one shared memory region, requests one way and
+ * responses the other, that a client and the server on the same host speak
+ * HTTP through instead of a socket.
+ *
+ * Each ring has one writer and one reader, who only ever move their own
+ * counter on, so passing bytes takes no lock and no system call. A side
+ * with nothing to read (or no room to write) spins for a moment, then
+ * sleeps on the other side's counter with a futex; the other side only
+ * makes the system call to wake it if it said it was going to sleep.
+ *
+ * The client makes the region with shm_open() and names it to the server
+ * over a Unix socket (see cache_server.cc), and both keep that socket open
+ * for as long as the channel, so each notices if the other goes away.
+ *
+ * It has read_some() and write_some(), so Beast can use it as a stream.
+ * One thread at a time on each side.
+ */
+class Shm_Channel {
+public:
+    static constexpr uint32_t ring_size = 1 << 20;  // Bytes each way
+
+private:
+    struct Ring;
+    struct Region;
+
+    Region *region;
+    Ring &in, &out;
+    int peer = -1;  // Socket that closes if the other side goes away
+
+    Shm_Channel(Region *region, bool server);
+
+    bool wait(std::atomic<uint32_t> &counter, uint32_t seen,
+              std::atomic<uint32_t> &sleeping);
+    bool peer_gone() const;
+
+    // Writing is in three steps, so a gather write wakes the reader once:
+    // wait for room, copy in pieces, then pass them all on
+    size_t room();
+    void fill(size_t offset, const char *data, size_t size);
+    void commit(size_t size);
+
+public:
+    /**
+     * Make a region for a new channel, as the client.
+     * @param name for shm_open(); hand it to attach(), then shm_unlink() it
+     * @throw std::runtime_error if it can't be made
+     */
+    static std::unique_ptr<Shm_Channel> create(const std::string &name);
+
+    /**
+     * Take the server's end of a channel a client made.
+     * @throw std::runtime_error if there's no such region
+     */
+    static std::unique_ptr<Shm_Channel> attach(const std::string &name);
+
+    ~Shm_Channel();
+
+    Shm_Channel(const Shm_Channel &) = delete;
+    Shm_Channel &operator=(const Shm_Channel &) = delete;
+
+    // Give up on the other side once fd, a socket to it, is closed
+    void watch(int fd) { peer = fd; }
+
+    /**
+     * Copy out what's there, up to size bytes, waiting for at least one.
+     * @return how many, or 0 once the channel is closed and empty
+     */
+    size_t read(char *data, size_t size);
+
+    /**
+     * Copy in as much of data as there's room for, waiting for room.
+     * @return how many bytes, or 0 once the channel is closed
+     */
+    size_t write(const char *data, size_t size);
+
+    // Close both ways; the other side reads what's left, then end of file
+    void close();
+
+    bool is_open() const;
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers,
+                     boost::system::error_code &ec) {
+        ec = {};
+        auto end = boost::asio::buffer_sequence_end(buffers);
+        for (auto it = boost::asio::buffer_sequence_begin(buffers); it != end;
+             ++it) {
+            const boost::asio::mutable_buffer buffer(*it);
+            if (buffer.size() == 0) continue;
+            const size_t got = read(static_cast<char *>(buffer.data()),
+                                    buffer.size());
+            if (got == 0) ec = boost::asio::error::eof;
+            return got;
+        }
+        return 0;
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers) {
+        boost::system::error_code ec;
+        const size_t got = read_some(buffers, ec);
+        if (ec) throw boost::system::system_error(ec);
+        return got;
+    }
+
+    // Writes as much of the buffers as there's room for, all at once
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence &buffers,
+                      boost::system::error_code &ec) {
+        ec = {};
+        if (boost::asio::buffer_size(buffers) == 0) return 0;
+        const size_t free = room();
+        if (free == 0) {
+            ec = boost::asio::error::broken_pipe;
+            return 0;
+        }
+        size_t total = 0;
+        auto end = boost::asio::buffer_sequence_end(buffers);
+        for (auto it = boost::asio::buffer_sequence_begin(buffers);
+             it != end && total < free; ++it) {
+            const boost::asio::const_buffer buffer(*it);
+            const size_t n = std::min(buffer.size(), free - total);
+            fill(total, static_cast<const char *>(buffer.data()), n);
+            total += n;
+        }
+        commit(total);
+        return total;
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence &buffers) {
+        boost::system::error_code ec;
+        const size_t wrote = write_some(buffers, ec);
+        if (ec) throw boost::system::system_error(ec);
+        return wrote;
+    }
+};
@@ -0,0 +1,117 @@
+/**
+ * test_admission.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Test the server's admission control, on a clock the test moves by hand.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include "admission.hh"
+
+using std::chrono::milliseconds;
+
+// A clock that only moves when told to
+static std::atomic<Admission::clock::rep> ticks{0};
+
+static Admission::clock::time_point fake_now() {
+    return Admission::clock::time_point(Admission::clock::duration(ticks));
+}
+
+static void advance(milliseconds by) {
+    ticks += std::chrono::duration_cast<Admission::clock::duration>(by)
+                     .count();
+}
+
+// Ask for a slot on another thread, once this one has one; it's queued by
+// the time this returns
+static std::thread queue_one(Admission &admission, std::atomic<int> &admitted) {
+    const size_t queued = admission.stats().queued;
+    std::thread waiting([&admission, &admitted]() {
+        if (admission.admit()) {
+            admitted++;
+            admission.release();
+        }
+    });
+    while (admission.stats().queued == queued) std::this_thread::yield();
+    return waiting;
+}
+
+TEST_CASE("Connections, slots and a bounded queue") {
+    Admission admission(2, 1, 1, milliseconds(5), milliseconds(100),
+                        fake_now);
+    REQUIRE(admission.open());
+    REQUIRE(admission.open());
+    REQUIRE(!admission.open());
+    admission.close();
+    REQUIRE(admission.open());
+
+    REQUIRE(admission.admit());
+    std::atomic<int> admitted{0};
+    std::thread waiting = queue_one(admission, admitted);
+    REQUIRE(!admission.admit());  // The queue is full
+    admission.release();
+    waiting.join();
+    REQUIRE(admitted == 1);
+
+    const Admission::Stats stats = admission.stats();
+    REQUIRE(stats.connections == 2);
+    REQUIRE(stats.refused_connections == 1);
+    REQUIRE(stats.in_flight == 0);
+    REQUIRE(stats.queued == 0);
+    REQUIRE(stats.admitted == 2);
+    REQUIRE(stats.rejected == 1);
+    REQUIRE(stats.shed == 0);
+}
+
+TEST_CASE("A burst waits, a standing queue is shed") {
+    Admission admission(0, 1, 8, milliseconds(5), milliseconds(200),
+                        fake_now);
+    std::atomic<int> admitted{0};
+
+    // Past target, but the queue hasn't stood for an interval yet
+    REQUIRE(admission.admit());
+    std::thread burst = queue_one(admission, admitted);
+    advance(milliseconds(50));
+    admission.release();
+    burst.join();
+    REQUIRE(admitted == 1);
+
+    // By the time either gets to the front, the queue has stood too long
+    REQUIRE(admission.admit());
+    std::thread first = queue_one(admission, admitted);
+    advance(milliseconds(100));
+    std::thread second = queue_one(admission, admitted);
+    advance(milliseconds(150));
+    admission.release();
+    first.join();
+    second.join();
+    REQUIRE(admitted == 1);
+    const Admission::Stats stats = admission.stats();
+    REQUIRE(stats.shed == 2);
+    REQUIRE(stats.in_flight == 0);
+    REQUIRE(stats.queued == 0);
+}
+
+TEST_CASE("Nothing waits longer than interval") {
+    Admission admission(0, 1, 8, milliseconds(5), milliseconds(20),
+                        fake_now);
+    std::atomic<int> admitted{0};
+
+    REQUIRE(admission.admit());
+    std::thread waiting = queue_one(admission, admitted);
+    advance(milliseconds(20));
+    // It sleeps on the real clock, so it sees the time when it next wakes;
+    // the longest it could sleep is the real interval
+    waiting.join();
+    REQUIRE(admitted == 0);
+    REQUIRE(admission.stats().shed == 1);
+    REQUIRE(admission.stats().queued == 0);
+    admission.release();
+    REQUIRE(admission.stats().in_flight == 0);
+}
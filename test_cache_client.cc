@@ -5,15 +5,27 @@
  * Test the cache but with catch.hpp
  */
 
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define CATCH_CONFIG_MAIN 
+#include <boost/asio/ip/udp.hpp>
 #include <catch2/catch.hpp>
 
 #include "cache.hh"
 #include "fifo_evictor.hh"
+#include "udp_get.hh"
 
 // Should be equivalent to values used by server in testing
 static const Cache::size_type maxmem = 65536;
@@ -84,7 +96,6 @@ static bool data_are_valid() {
                     delete[] val.data_;
                     return false;
                 }
-                delete[] val.data_;
             }
             delete[] val.data_;
         } catch (const std::exception &e) {
@@ -130,11 +141,11 @@ static bool del_data() {
             if (val.data_ != nullptr && val.size_ != 0) {
                 delete[] val.data_;
                 if (!cache->del(key)) return false;
+            } else {
+                delete[] val.data_;
             }
-            delete[] val.data_;
             cache->del(key);
         } catch (const std::exception &e) {
-            delete[] val.data_;
             std::cerr << "get_data(): " << e.what() << std::endl;
             return false;
         }
@@ -227,3 +238,286 @@ TEST_CASE("Edge cases") {
         REQUIRE(cache->reset() == true);
     }
 }
+
+TEST_CASE("Near cache") {
+    Cache near("localhost", "42069");
+    REQUIRE(near.set_near_cache(1024) == true);
+    REQUIRE(near.set_near_cache(1024) == false);
+
+    // Wait for the near cache to subscribe; until then gets aren't kept
+    const char one[] = "one";
+    REQUIRE(cache->set("near", {one, sizeof(one)}));
+    auto got_from_server = [&]() {
+        // After a miss a hit always moves the hit rate
+        Cache::val_type miss = cache->get("never_set");
+        REQUIRE(miss.data_ == nullptr);
+        const double before = cache->hit_rate();
+        Cache::val_type val = near.get("near");
+        delete[] val.data_;
+        return cache->hit_rate() != before;
+    };
+    for (int tries = 0; tries < 50 && got_from_server(); tries++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    SECTION("Repeated gets are served locally") {
+        REQUIRE(got_from_server() == false);
+        Cache::val_type val = near.get("near");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(strcmp(val.data_, "one") == 0);
+        delete[] val.data_;
+    }
+
+    SECTION("Sets elsewhere are pushed to the near cache") {
+        const char two[] = "two";
+        REQUIRE(cache->set("near", {two, sizeof(two)}));
+        bool updated = false;
+        for (int tries = 0; tries < 50 && !updated; tries++) {
+            Cache::val_type val = near.get("near");
+            updated = val.data_ != nullptr && strcmp(val.data_, "two") == 0;
+            delete[] val.data_;
+            if (!updated)
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        REQUIRE(updated);
+    }
+
+    SECTION("Deletes and resets elsewhere are pushed too") {
+        REQUIRE(cache->del("near"));
+        bool gone = false;
+        for (int tries = 0; tries < 50 && !gone; tries++) {
+            Cache::val_type val = near.get("near");
+            gone = val.data_ == nullptr;
+            delete[] val.data_;
+            if (!gone)
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        REQUIRE(gone);
+    }
+
+    REQUIRE(cache->reset() == true);
+}
+
+TEST_CASE("Namespaces over the network") {
+    const char one[] = "one";
+    REQUIRE(cache->set("tenant", "key", {one, sizeof(one)}));
+    REQUIRE(cache->get("key").data_ == nullptr);
+    Cache::val_type val = cache->get("tenant", "key");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(strcmp(val.data_, "one") == 0);
+    delete[] val.data_;
+
+    REQUIRE(cache->flush("tenant"));
+    REQUIRE(cache->get("tenant", "key").data_ == nullptr);
+    REQUIRE(cache->set("tenant", "key", {one, sizeof(one)}));
+    REQUIRE(cache->del("tenant", "key"));
+    REQUIRE(cache->reset() == true);
+}
+
+TEST_CASE("Large values in request bodies") {
+    // Bigger than any request target, and with slashes in it
+    std::string big(40000, 'x');
+    big[100] = '/';
+    const auto size = static_cast<Cache::size_type>(big.size() + 1);
+    REQUIRE(cache->set("big", {big.c_str(), size}));
+    Cache::val_type val = cache->get("big");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(val.size_ == size);
+    REQUIRE(big == val.data_);
+    delete[] val.data_;
+
+    // Too big to ever fit; the server hangs up, and we carry on
+    const std::string huge(maxmem + 1, 'y');
+    REQUIRE(!cache->set("huge", {huge.c_str(),
+                                 static_cast<Cache::size_type>(huge.size())}));
+    REQUIRE(cache->get("huge").data_ == nullptr);
+
+    const char empty[] = "";
+    REQUIRE(cache->set("empty", {empty, sizeof(empty)}));
+    val = cache->get("empty");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(strcmp(val.data_, "") == 0);
+    delete[] val.data_;
+    REQUIRE(cache->reset() == true);
+}
+
+TEST_CASE("Clients on the server's host") {
+    // The server is started with -U /tmp/cache_server.sock
+    for (const char *transport : {"unix", "shm"}) {
+        Cache local(transport, "/tmp/cache_server.sock");
+        const std::string big(40000, 'z');
+        const auto size = static_cast<Cache::size_type>(big.size() + 1);
+        REQUIRE(local.set("big", {big.c_str(), size}));
+        for (int i = 0; i < 3; i++) {
+            Cache::val_type val = local.get("big");
+            REQUIRE(val.data_ != nullptr);
+            REQUIRE(big == val.data_);
+            delete[] val.data_;
+        }
+
+        // Seen through TCP too
+        Cache::val_type val = cache->get("big");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(val.size_ == size);
+        delete[] val.data_;
+
+        REQUIRE(local.del("big"));
+        REQUIRE(local.get("big").data_ == nullptr);
+        REQUIRE(local.reset() == true);
+    }
+}
+
+TEST_CASE("Gets over UDP") {
+    // The server is started with -g 42069
+    Cache client("localhost", "42069");
+    REQUIRE(client.set_udp(42069));
+    REQUIRE(!client.set_udp(42069));
+
+    const char small[] = "small";
+    REQUIRE(client.set("small", {small, sizeof(small)}));
+    REQUIRE(client.set("tenant", "small", {small, sizeof(small)}));
+    for (int i = 0; i < 3; i++) {
+        Cache::val_type val = client.get("small");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(val.size_ == sizeof(small));
+        REQUIRE(strcmp(val.data_, small) == 0);
+        delete[] val.data_;
+    }
+    Cache::val_type val = client.get("tenant", "small");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(strcmp(val.data_, small) == 0);
+    delete[] val.data_;
+    REQUIRE(client.get("missing").data_ == nullptr);
+
+    // Too big for a datagram, so it comes over TCP
+    const std::string big(4000, 'b');
+    REQUIRE(client.set("big", {big.c_str(),
+                               static_cast<Cache::size_type>(big.size() + 1)}));
+    val = client.get("big");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(big == val.data_);
+    delete[] val.data_;
+
+    // The answer is never bigger than the request, so only a padded one
+    // gets the value back
+    const std::string medium(100, 'm');
+    REQUIRE(client.set("medium",
+                       {medium.c_str(),
+                        static_cast<Cache::size_type>(medium.size() + 1)}));
+    boost::asio::io_context ioc;
+    boost::asio::ip::udp::socket udp(ioc);
+    udp.connect({boost::asio::ip::make_address("127.0.0.1"), 42069});
+    char request[Udp_Get::max_datagram], answer[Udp_Get::max_datagram];
+    for (size_t pad_to : {size_t(0), Udp_Get::max_datagram}) {
+        const size_t size =
+                Udp_Get::put_request(request, 7, "", "medium", pad_to);
+        REQUIRE(size == std::max(pad_to, Udp_Get::request_head + 6));
+        udp.send(boost::asio::buffer(request, size));
+        const size_t got = udp.receive(boost::asio::buffer(answer));
+        REQUIRE(got <= size);
+        uint32_t id = 0;
+        Udp_Get::Kind kind{};
+        std::string_view value;
+        REQUIRE(Udp_Get::get_answer(answer, got, id, kind, value));
+        REQUIRE(id == 7);
+        REQUIRE(kind == (pad_to == 0 ? Udp_Get::Kind::too_big
+                                     : Udp_Get::Kind::hit));
+    }
+
+    // Nothing listens here, so every get falls back to TCP
+    Cache fallback("localhost", "42069");
+    REQUIRE(fallback.set_udp(42099, std::chrono::milliseconds(5), 2));
+    val = fallback.get("small");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(strcmp(val.data_, small) == 0);
+    delete[] val.data_;
+    REQUIRE(client.reset() == true);
+}
+
+/**
+ * Start ./cache_server with args, its output thrown away.
+ * @return its process ID
+ */
+static pid_t start_server(std::vector<std::string> args) {
+    args.insert(args.begin(), "./cache_server");
+    std::vector<char *> argv;
+    for (std::string &arg : args) argv.push_back(arg.data());
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    pid_t pid = -1;
+    const int error = posix_spawn(&pid, argv[0], &actions, nullptr,
+                                  argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    REQUIRE(error == 0);
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+// Whether done() comes true within ten seconds
+static bool eventually(const std::function<bool()> &done) {
+    const auto give_up =
+            std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() > give_up) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return true;
+}
+
+// The value of key as a string, or "" if it isn't there
+static std::string value_of(Cache &client, key_view_type key) {
+    Cache::val_type val = client.get(key);
+    if (val.data_ == nullptr) return "";
+    std::string value(val.data_);
+    delete[] val.data_;
+    return value;
+}
+
+TEST_CASE("Replication from a primary to a replica") {
+    // Both are started here, on ports of their own, so that the replica can
+    // come up after the primary has been written to
+    const pid_t primary = start_server({"-p", "42080", "-r", "localhost:42081"});
+    Cache to_primary("localhost", "42080");
+    Cache to_replica("localhost", "42081");
+    REQUIRE(eventually([&]() { return to_primary.set("old", {"1", 2}); }));
+    REQUIRE(to_primary.set("gone", {"1", 2}));
+    REQUIRE(to_primary.del("gone"));
+    for (int i = 0; i < 500; i++)
+        REQUIRE(to_primary.set("many" + std::to_string(i), {"1", 2}));
+
+    // The replica gets a full copy when it comes up, sent in many parts
+    const pid_t replica = start_server({"-p", "42081", "-R"});
+    REQUIRE(eventually([&]() { return value_of(to_replica, "old") == "1"; }));
+    REQUIRE(value_of(to_replica, "gone").empty());
+    REQUIRE(eventually([&]() {
+        for (int i = 0; i < 500; i++)
+            if (value_of(to_replica, "many" + std::to_string(i)) != "1")
+                return false;
+        return true;
+    }));
+    REQUIRE(!to_replica.set("old", {"2", 2}));  // Writes go to the primary
+
+    // Then every write to the primary, in order
+    REQUIRE(to_primary.set("new", {"1", 2}));
+    REQUIRE(to_primary.set("old", {"2", 2}));
+    REQUIRE(to_primary.set("old", {"3", 2}));
+    REQUIRE(eventually([&]() {
+        return value_of(to_replica, "new") == "1" &&
+               value_of(to_replica, "old") == "3";
+    }));
+    REQUIRE(to_primary.del("new"));
+    REQUIRE(eventually([&]() { return value_of(to_replica, "new").empty(); }));
+    REQUIRE(to_primary.reset());
+    REQUIRE(eventually([&]() { return value_of(to_replica, "old").empty(); }));
+
+    stop_server(replica);
+    stop_server(primary);
+}
@@ -5,15 +5,24 @@
  * Test the cache but with catch.hpp
  */
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define CATCH_CONFIG_MAIN 
 #include <catch2/catch.hpp>
 
+#include "basic_cache.hh"
 #include "cache.hh"
 #include "fifo_evictor.hh"
+#include "hot_keys.hh"
+#include "lz4.hh"
+#include "seeded_hash.hh"
 
 // Two of the parameters for Cache::Cache(), used in init_cache()
 static const Cache::size_type maxmem = 256;
@@ -226,3 +235,750 @@ TEST_CASE("Edge cases") {
     REQUIRE(cache->hit_rate() >= 0);
     REQUIRE(cache->reset() == true);
 }
+
+TEST_CASE("Overwrites, views and custom hashers") {
+
+    std::shared_ptr<Cache> cache;
+    try {
+        // A deliberately bad hasher puts every key in the same chain
+        Cache::hash_func hasher = [](const key_type &) { return size_t(42); };
+        cache = std::make_shared<Cache>(maxmem, maxload, new Fifo_Evictor(),
+                                        hasher);
+    } catch (const std::exception &e) {
+        std::cerr << "Init Cache 1: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    const char big[200] = "big";
+    const char small[20] = "small";
+
+    SECTION("Overwriting a key makes room for itself") {
+        REQUIRE(cache->set("a", {big, sizeof(big)}) == true);
+        REQUIRE(cache->set("a", {big, sizeof(big)}) == true);
+        REQUIRE(cache->space_used() == sizeof(big));
+        REQUIRE(cache->set("a", {small, sizeof(small)}) == true);
+        REQUIRE(cache->space_used() == sizeof(small));
+    }
+
+    SECTION("Keys can be looked up through a view") {
+        const std::string buffer = "/key/junk";
+        const key_view_type key = std::string_view(buffer).substr(1, 3);
+        REQUIRE(cache->set(key, {small, sizeof(small)}) == true);
+        Cache::val_type val = cache->get("key");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(val.size_ == sizeof(small));
+        REQUIRE(std::string(val.data_) == small);
+        delete[] val.data_;
+        REQUIRE(cache->del(key) == true);
+        REQUIRE(cache->del(key) == false);
+    }
+
+    SECTION("Values bigger than maxmem are refused without evicting") {
+        REQUIRE(cache->set("a", {small, sizeof(small)}) == true);
+        const std::string huge(maxmem + 1, 'x');
+        REQUIRE(cache->set("b", {huge.c_str(), maxmem + 1}) == false);
+        REQUIRE(cache->space_used() == sizeof(small));
+    }
+
+    SECTION("Colliding keys evict each other correctly") {
+        for (int round = 0; round < 3; round++) {
+            for (size_t i = 0; i < 64; i++) {
+                REQUIRE(cache->set(std::to_string(i), {small, sizeof(small)}));
+                REQUIRE(cache->space_used() <= maxmem);
+            }
+        }
+        // FIFO keeps the newest ones
+        Cache::val_type val = cache->get("63");
+        REQUIRE(val.data_ != nullptr);
+        delete[] val.data_;
+        REQUIRE(cache->get("0").data_ == nullptr);
+    }
+
+    REQUIRE(cache->reset() == true);
+    REQUIRE(cache->space_used() == 0);
+}
+
+TEST_CASE("BasicCache with compile-time policies") {
+    BasicCache<Fifo_Evictor> store(maxmem, maxload);
+
+    SECTION("Behaves like a Cache") {
+        for (size_t i = min_data; i < max_data; i++) {
+            const std::string data = make_data(i);
+            REQUIRE(store.set(std::to_string(i),
+                              {data.c_str(), static_cast<Cache::size_type>(
+                                                     data.size() + 1)}));
+            REQUIRE(store.space_used() <= maxmem);
+        }
+        Cache::val_type val = store.get(std::to_string(max_data - 1));
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(make_data(max_data - 1) == val.data_);
+        delete[] val.data_;
+        REQUIRE(store.get(std::to_string(min_data)).data_ == nullptr);
+        REQUIRE(store.del(std::to_string(max_data - 1)) == true);
+        REQUIRE(store.hit_rate() == 0.5);
+    }
+
+    SECTION("Never evicts without an evictor") {
+        BasicCache<> fixed(maxmem, maxload);
+        const char chunk[100] = "chunk";
+        REQUIRE(fixed.set("a", {chunk, sizeof(chunk)}) == true);
+        REQUIRE(fixed.set("b", {chunk, sizeof(chunk)}) == true);
+        REQUIRE(fixed.set("c", {chunk, sizeof(chunk)}) == false);
+        REQUIRE(fixed.space_used() == 2 * sizeof(chunk));
+    }
+
+    REQUIRE(store.reset() == true);
+}
+
+TEST_CASE("Seeded hashes") {
+    const Seeded_Hash a(1), b(1), c(2);
+    std::string key;
+    for (size_t len = 0; len < 100; len++) {
+        REQUIRE(a(key) == b(key));
+        REQUIRE(a(key) != c(key));
+        // Changing any one byte changes the hash
+        for (size_t i = 0; i < len; i++) {
+            std::string other = key;
+            other[i] ^= 1;
+            REQUIRE(a(other) != a(key));
+        }
+        key.push_back(static_cast<char>('a' + len % 26));
+    }
+}
+
+TEST_CASE("Background eviction between watermarks") {
+    std::shared_ptr<Cache> cache = std::make_shared<Cache>(
+            maxmem, maxload, new Fifo_Evictor(), std::hash<key_type>());
+
+    REQUIRE(cache->set_watermarks(0.9, 0.5) == false);
+    REQUIRE(cache->set_watermarks(0, 0.5) == false);
+    REQUIRE(cache->set_watermarks(0.25, 0.5) == true);
+
+    const char chunk[16] = "chunk";
+    for (size_t i = 0; i < 64; i++) {
+        REQUIRE(cache->set(std::to_string(i), {chunk, sizeof(chunk)}));
+        REQUIRE(cache->space_used() <= maxmem);
+    }
+
+    // The reclaimer works down to the low watermark on its own
+    for (int tries = 0; tries < 100 && cache->space_used() > maxmem / 4;
+         tries++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(cache->space_used() <= maxmem / 4);
+
+    // The newest keys are still there
+    Cache::val_type val = cache->get("63");
+    REQUIRE(val.data_ != nullptr);
+    delete[] val.data_;
+}
+
+TEST_CASE("Resizing maxmem while in use") {
+    std::shared_ptr<Cache> cache = std::make_shared<Cache>(
+            4096, maxload, new Fifo_Evictor(), std::hash<key_type>());
+    const char chunk[16] = "chunk";
+    for (size_t i = 0; i < 256; i++)
+        REQUIRE(cache->set(std::to_string(i), {chunk, sizeof(chunk)}));
+    REQUIRE(cache->space_used() == 4096);
+
+    REQUIRE(cache->set_maxmem(0) == false);
+    REQUIRE(cache->set_maxmem(1024));
+    // Sets go on meanwhile, without adding to what's used
+    REQUIRE(cache->set("new", {chunk, sizeof(chunk)}));
+    REQUIRE(cache->space_used() <= 4096);
+    for (int tries = 0; tries < 100 && cache->space_used() > 1024; tries++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(cache->space_used() <= 1024);
+    Cache::val_type val = cache->get("new");
+    REQUIRE(val.data_ != nullptr);
+    delete[] val.data_;
+
+    // Growing makes room at once, past what 32 bits could count
+    const Cache::size_type huge = Cache::size_type(6) << 30;
+    REQUIRE(cache->set_maxmem(huge));
+    const Cache::size_type used = cache->space_used();
+    for (size_t i = 0; i < 256; i++)
+        REQUIRE(cache->set("more" + std::to_string(i), {chunk, sizeof(chunk)}));
+    REQUIRE(cache->space_used() == used + 256 * sizeof(chunk));
+}
+
+TEST_CASE("Lock-free gets alongside a writer") {
+    std::shared_ptr<Cache> cache = std::make_shared<Cache>(
+            1 << 20, maxload, new Fifo_Evictor(), std::hash<key_type>());
+    const char hot[] = "hot";
+    REQUIRE(cache->set("hot", {hot, sizeof(hot)}));
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> misses{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; r++) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                Cache::val_type val = cache->get("hot");
+                if (val.data_ == nullptr || strcmp(val.data_, "hot") != 0)
+                    misses++;
+                delete[] val.data_;
+                val = cache->get("cold");
+                delete[] val.data_;
+            }
+        });
+    }
+
+    // Grow the table many times over, overwrite and delete under the readers
+    for (size_t i = 0; i < 20000; i++) {
+        const std::string key = std::to_string(i);
+        const auto size = static_cast<Cache::size_type>(key.size() + 1);
+        REQUIRE(cache->set(key, {key.c_str(), size}));
+        if (i % 3 == 0) REQUIRE(cache->del(key));
+        REQUIRE(cache->set("hot", {hot, sizeof(hot)}));
+    }
+    done = true;
+    for (auto &reader : readers) reader.join();
+
+    REQUIRE(misses == 0);
+    Cache::val_type val = cache->get("19999");
+    REQUIRE(val.data_ != nullptr);
+    REQUIRE(strcmp(val.data_, "19999") == 0);
+    delete[] val.data_;
+}
+
+TEST_CASE("Incremental growth and pre-sizing") {
+    for (size_t expected : {size_t(0), size_t(5000)}) {
+        Cache cache(1 << 20, maxload, new Fifo_Evictor(),
+                    std::hash<key_type>(), expected);
+        // Every prefix of the inserts leaves some growth half done; all the
+        // keys must still be found, whichever table they are in
+        for (size_t i = 0; i < 5000; i++) {
+            const std::string key = std::to_string(i);
+            const auto size = static_cast<Cache::size_type>(key.size() + 1);
+            REQUIRE(cache.set(key, {key.c_str(), size}));
+            if (i % 97 != 0) continue;
+            for (size_t j = 0; j <= i; j += 7) {
+                const std::string old = std::to_string(j);
+                Cache::val_type val = cache.get(old);
+                REQUIRE(val.data_ != nullptr);
+                REQUIRE(old == val.data_);
+                delete[] val.data_;
+            }
+        }
+        size_t seen = 0;
+        cache.for_each([&](std::string_view, key_view_type,
+                           Cache::val_type) { seen++; });
+        REQUIRE(seen == 5000);
+        REQUIRE(cache.del("4999"));
+        REQUIRE(cache.get("4999").data_ == nullptr);
+    }
+}
+
+TEST_CASE("Walking a step at a time while the cache grows") {
+    Cache cache(1024 * 1024, maxload, new Fifo_Evictor());
+    for (size_t i = 0; i < 100; i++)
+        REQUIRE(cache.set(std::to_string(i), {"x", 2}));
+
+    // Keys set along the way grow the table under the walk
+    std::unordered_map<key_type, int> seen;
+    auto visit = [&seen](std::string_view, key_view_type key,
+                         Cache::val_type) { seen[key_type(key)]++; };
+    Cache::Cursor cursor;
+    size_t first_size = 0, added = 0;
+    while (!cache.for_each_step(cursor, 4, visit)) {
+        if (first_size == 0) first_size = cursor.table_size;
+        for (size_t i = 0; i < 3; i++, added++)
+            REQUIRE(cache.set("new" + std::to_string(added), {"x", 2}));
+    }
+    REQUIRE(cursor.table_size > first_size);
+    for (size_t i = 0; i < 100; i++) REQUIRE(seen[std::to_string(i)] == 1);
+    for (const auto &visits : seen) REQUIRE(visits.second == 1);
+}
+
+TEST_CASE("Values filled in place") {
+    Cache cache(4096, maxload, new Fifo_Evictor(), std::hash<key_type>());
+    REQUIRE(cache.make_buffer(4097) == nullptr);
+
+    Cache::byte_type *buffer = cache.make_buffer(6);
+    REQUIRE(buffer != nullptr);
+    memcpy(buffer, "piece", 6);
+    REQUIRE(cache.set_buffer("", "key", buffer));
+    buffer = cache.make_buffer(4);
+    memcpy(buffer, "two", 4);
+    REQUIRE(cache.set_buffer("tenant", "key", buffer));
+    cache.drop_buffer(cache.make_buffer(100));
+
+    Cache::val_type val = cache.get("key");
+    REQUIRE(val.size_ == 6);
+    REQUIRE(strcmp(val.data_, "piece") == 0);
+    delete[] val.data_;
+    val = cache.get("tenant", "key");
+    REQUIRE(strcmp(val.data_, "two") == 0);
+    delete[] val.data_;
+    REQUIRE(cache.space_used() == 10);
+}
+
+TEST_CASE("Pre-rendered values") {
+    Cache cache(4096, maxload, new Fifo_Evictor(), std::hash<key_type>());
+    cache.set_renderer(8, [](key_view_type key, Cache::val_type val) {
+        return key_type(key) + "=" + std::to_string(val.size_);
+    });
+    const char small[] = "small", large[] = "too large";
+    REQUIRE(cache.set("a", {small, sizeof(small)}));
+    REQUIRE(cache.set("tenant", "b", {large, sizeof(large)}));
+
+    std::string rendered, value;
+    auto visit = [&](std::string_view head, Cache::val_type val) {
+        rendered = head;
+        value = val.data_;
+    };
+    REQUIRE(cache.get_rendered("", "a", visit));
+    REQUIRE(rendered == "a=6");
+    REQUIRE(value == "small");
+    REQUIRE(cache.get_rendered("tenant", "b", visit));
+    REQUIRE(rendered.empty());
+    REQUIRE(value == "too large");
+    REQUIRE(!cache.get_rendered("", "b", visit));
+
+    // What's rendered doesn't count as space used, and get() is unchanged
+    REQUIRE(cache.space_used() == sizeof(small) + sizeof(large));
+    Cache::val_type val = cache.get("a");
+    REQUIRE(val.size_ == sizeof(small));
+    delete[] val.data_;
+}
+
+TEST_CASE("Pinned values outlive their keys") {
+    Cache cache(4096, maxload, new Fifo_Evictor(), std::hash<key_type>());
+    cache.set_renderer(8, [](key_view_type key, Cache::val_type val) {
+        return key_type(key) + "=" + std::to_string(val.size_);
+    });
+    const char small[] = "small", large[] = "too large";
+    REQUIRE(cache.set("a", {small, sizeof(small)}));
+    REQUIRE(cache.set("tenant", "b", {large, sizeof(large)}));
+    REQUIRE(!cache.get_pinned("", "b").value().data_);
+
+    Cache::Pinned a = cache.get_pinned("", "a");
+    Cache::Pinned b = cache.get_pinned("tenant", "b");
+    REQUIRE(a.rendered() == "a=6");
+    REQUIRE(b.rendered().empty());
+    REQUIRE(!a.packed());
+
+    // Set over, deleted, then everything reset, and still there
+    REQUIRE(cache.set("a", {large, sizeof(large)}));
+    REQUIRE(cache.del("tenant", "b"));
+    cache.reset();
+    REQUIRE(cache.space_used() == 0);
+    REQUIRE(strcmp(a.value().data_, "small") == 0);
+    REQUIRE(a.value().size_ == sizeof(small));
+    REQUIRE(strcmp(b.value().data_, "too large") == 0);
+
+    // Moving one hands the pin over
+    Cache::Pinned moved = std::move(a);
+    REQUIRE(!a.value().data_);
+    REQUIRE(moved.rendered() == "a=6");
+}
+
+TEST_CASE("Hot keys") {
+    SECTION("Heavy hitters in fixed space") {
+        Hot_Keys hot(8, 1);
+        // Two heavy keys among many that are seen once each
+        for (size_t i = 0; i < 1000; i++) {
+            hot.record("heavy", 1);
+            if (i % 2 == 0) hot.record("big", 1000);
+            hot.record(std::to_string(i), 1);
+        }
+        std::vector<Hot_Keys::Entry> top = hot.top(2, false);
+        REQUIRE(top.size() == 2);
+        REQUIRE(top[0].key == "heavy");
+        REQUIRE(top[0].count - top[0].error <= 1000);
+        REQUIRE(top[0].count >= 1000);
+        REQUIRE(top[1].key == "big");
+
+        top = hot.top(100, true);
+        REQUIRE(top.size() == 8);
+        REQUIRE(top[0].key == "big");
+        REQUIRE(top[0].count >= 500000);
+
+        hot.clear();
+        REQUIRE(hot.top(10, false).empty());
+    }
+
+    SECTION("Fed by the cache") {
+        Cache cache(maxmem, maxload, new Fifo_Evictor());
+        const char val[] = "val";
+        REQUIRE(cache.set("hot", {val, sizeof(val)}));
+        for (size_t i = 0; i < 1600; i++) {
+            Cache::val_type got = cache.get(i % 8 == 0 ? "cold" : "hot");
+            delete[] got.data_;
+        }
+        std::vector<Hot_Keys::Entry> top = cache.hot_keys(1);
+        REQUIRE(top.size() == 1);
+        REQUIRE(top[0].key == "hot");
+        REQUIRE(cache.hot_keys(1, true)[0].key == "hot");
+        REQUIRE(cache.reset());
+        REQUIRE(cache.hot_keys(1).empty());
+    }
+}
+
+TEST_CASE("Namespaces") {
+    Cache cache(4096, maxload, new Fifo_Evictor());
+    const char one[] = "one", two[] = "two";
+
+    SECTION("Keys in different namespaces don't collide") {
+        REQUIRE(cache.set("key", {one, sizeof(one)}));
+        REQUIRE(cache.set("a", "key", {two, sizeof(two)}));
+        Cache::val_type val = cache.get("key");
+        REQUIRE(strcmp(val.data_, "one") == 0);
+        delete[] val.data_;
+        val = cache.get("a", "key");
+        REQUIRE(strcmp(val.data_, "two") == 0);
+        delete[] val.data_;
+        REQUIRE(cache.get("b", "key").data_ == nullptr);
+        REQUIRE(cache.del("a", "key"));
+        REQUIRE(!cache.del("a", "key"));
+        val = cache.get("", "key");
+        REQUIRE(val.data_ != nullptr);
+        delete[] val.data_;
+    }
+
+    SECTION("Flushing hides a whole namespace") {
+        for (int i = 0; i < 100; i++) {
+            const std::string key = std::to_string(i);
+            REQUIRE(cache.set("a", key, {one, sizeof(one)}));
+            REQUIRE(cache.set("b", key, {two, sizeof(two)}));
+        }
+        REQUIRE(!cache.flush(""));
+        REQUIRE(cache.flush("a"));
+        REQUIRE(cache.get("a", "7").data_ == nullptr);
+        Cache::val_type val = cache.get("b", "7");
+        REQUIRE(strcmp(val.data_, "two") == 0);
+        delete[] val.data_;
+
+        // New sets go in the new generation
+        REQUIRE(cache.set("a", "7", {two, sizeof(two)}));
+        val = cache.get("a", "7");
+        REQUIRE(strcmp(val.data_, "two") == 0);
+        delete[] val.data_;
+
+        size_t visited = 0;
+        cache.for_each([&](std::string_view ns, key_view_type,
+                           Cache::val_type) {
+            if (ns == "a") visited++;
+        });
+        REQUIRE(visited == 1);
+
+        // The old entries are swept out in the background
+        for (int tries = 0; tries < 100 &&
+                            cache.space_used() > 101 * sizeof(one);
+             tries++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        REQUIRE(cache.space_used() == 101 * sizeof(one));
+    }
+
+    SECTION("Per-namespace stats") {
+        REQUIRE(cache.set("a", "x", {one, sizeof(one)}));
+        REQUIRE(cache.set("a", "y", {two, sizeof(two)}));
+        REQUIRE(cache.set("b", "x", {one, sizeof(one)}));
+        REQUIRE(cache.set("a", "x", {two, sizeof(two)}));  // Overwrite
+        delete[] cache.get("a", "x").data_;
+        delete[] cache.get("a", "z").data_;
+
+        std::vector<Cache::Namespace_Stats> stats = cache.namespace_stats();
+        REQUIRE(stats.size() == 2);
+        for (const auto &space : stats) {
+            if (space.name == "a") {
+                REQUIRE(space.space_used == sizeof(one) + sizeof(two));
+                REQUIRE(space.hit_rate == 0.5);
+            } else {
+                REQUIRE(space.name == "b");
+                REQUIRE(space.space_used == sizeof(one));
+                REQUIRE(space.hit_rate == 0);
+            }
+        }
+        REQUIRE(cache.del("b", "x"));
+        REQUIRE(cache.reset());
+        for (const auto &space : cache.namespace_stats())
+            REQUIRE(space.space_used == 0);
+    }
+}
+
+// What's been freed through Counting_Alloc, on this thread and on any
+static thread_local size_t frees_here = 0;
+static std::atomic<size_t> frees_anywhere{0};
+
+// Counts frees, so a test can tell which thread did them
+template <typename T>
+struct Counting_Alloc {
+    using value_type = T;
+
+    Counting_Alloc() = default;
+    template <typename U>
+    Counting_Alloc(const Counting_Alloc<U> &) {}
+
+    T *allocate(size_t n) { return std::allocator<T>().allocate(n); }
+
+    void deallocate(T *p, size_t n) {
+        frees_here++;
+        frees_anywhere++;
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const Counting_Alloc<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const Counting_Alloc<U> &) const { return false; }
+};
+
+TEST_CASE("Reset frees in the background") {
+    BasicCache<No_Evictor, Seeded_Hash, Counting_Alloc<char>> cache(
+            1 << 24, maxload);
+    const char chunk[64] = "chunk";
+    const size_t keys = 100000;
+    for (size_t i = 0; i < keys; i++)
+        REQUIRE(cache.set(std::to_string(i), {chunk, sizeof(chunk)}));
+
+    // Readers may still be in the old table while it's swapped out
+    std::atomic<bool> done{false};
+    std::thread reader([&]() {
+        while (!done) delete[] cache.get("12345").data_;
+    });
+
+    // The caller only swaps the table out; none of it is freed here
+    const size_t here = frees_here, anywhere = frees_anywhere;
+    REQUIRE(cache.reset());
+    REQUIRE(frees_here == here);
+    done = true;
+    reader.join();
+    REQUIRE(cache.space_used() == 0);
+    REQUIRE(cache.get("12345").data_ == nullptr);
+
+    // The freer gets through every node and value in its own time
+    for (int waits = 0; waits < 10000 && frees_anywhere - anywhere < 2 * keys;
+         waits++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE(frees_anywhere - anywhere >= 2 * keys);
+    REQUIRE(frees_here == here);
+
+    // The new table works as before
+    REQUIRE(cache.set("new", {chunk, sizeof(chunk)}));
+    Cache::val_type val = cache.get("new");
+    REQUIRE(val.data_ != nullptr);
+    delete[] val.data_;
+}
+
+TEST_CASE("Compressed values") {
+    Cache cache(1 << 20, maxload, new Fifo_Evictor());
+    cache.set_compression(256);
+    std::string text;
+    for (int i = 0; text.size() < 8192; i++)
+        text.append("{\"id\": ").append(std::to_string(i)).append(", \"ok\": true}, ");
+    REQUIRE(cache.set("text", {text.c_str(), text.size() + 1}));
+
+    SECTION("Stored smaller, got back whole") {
+        REQUIRE(cache.space_used() < text.size() / 2);
+        Cache::val_type val = cache.get("text");
+        REQUIRE(val.size_ == text.size() + 1);
+        REQUIRE(text == val.data_);
+        delete[] val.data_;
+
+        const Cache::Compression_Stats stats = cache.compression_stats();
+        REQUIRE(stats.values == 1);
+        REQUIRE(stats.raw_bytes == text.size() + 1);
+        REQUIRE(stats.bytes == cache.space_used());
+    }
+
+    SECTION("Got as stored") {
+        bool packed = false;
+        Cache::val_type val = cache.get_stored("", "text", packed);
+        REQUIRE(packed);
+        REQUIRE(Lz4::raw_size(val.data_, val.size_) == text.size() + 1);
+        std::string raw(text.size() + 1, '\0');
+        REQUIRE(Lz4::decompress(val.data_, val.size_, raw.data()));
+        REQUIRE(raw.c_str() == text);
+        delete[] val.data_;
+    }
+
+    SECTION("Pinned as stored, or unpacked") {
+        Cache::Pinned stored = cache.get_pinned("", "text", true);
+        REQUIRE(stored.packed());
+        REQUIRE(Lz4::raw_size(stored.value().data_, stored.value().size_) ==
+                text.size() + 1);
+        Cache::Pinned raw = cache.get_pinned("", "text");
+        REQUIRE(!raw.packed());
+        REQUIRE(text == raw.value().data_);
+    }
+
+    SECTION("Small and incompressible values stay as they are") {
+        std::string noise(4096, '\0');
+        uint64_t x = 88172645463325252ULL;
+        for (char &c : noise) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            c = static_cast<char>(x);
+        }
+        REQUIRE(cache.set("noise", {noise.data(), noise.size()}));
+        REQUIRE(cache.set("small", {"small", 6}));
+        bool packed = true;
+        Cache::val_type val = cache.get_stored("", "noise", packed);
+        REQUIRE(!packed);
+        REQUIRE(val.size_ == noise.size());
+        delete[] val.data_;
+        REQUIRE(cache.compression_stats().values == 1);
+    }
+
+    SECTION("Overwritten and deleted values are uncounted") {
+        REQUIRE(cache.set("text", {"small", 6}));
+        REQUIRE(cache.compression_stats().values == 0);
+        REQUIRE(cache.set("text", {text.c_str(), text.size() + 1}));
+        REQUIRE(cache.del("text"));
+        REQUIRE(cache.compression_stats().bytes == 0);
+        REQUIRE(cache.space_used() == 0);
+    }
+
+    SECTION("Walked whole") {
+        size_t seen = 0;
+        cache.for_each([&](std::string_view, key_view_type key,
+                           Cache::val_type val) {
+            REQUIRE(key == "text");
+            REQUIRE(text == val.data_);
+            seen++;
+        });
+        REQUIRE(seen == 1);
+    }
+}
+
+TEST_CASE("Deduplicated values") {
+    // Room for two values, without sharing
+    Cache cache(2 * 1024, maxload, new Fifo_Evictor());
+    cache.set_dedup(64);
+    const std::string blob(1024 - 1, 'b'), other(1024 - 1, 'o');
+    const Cache::val_type val{blob.c_str(), blob.size() + 1};
+    for (int i = 0; i < 10; i++)
+        REQUIRE(cache.set("key" + std::to_string(i), val));
+
+    SECTION("Charged once") {
+        REQUIRE(cache.space_used() == val.size_);
+        for (int i = 0; i < 10; i++) {
+            Cache::val_type got = cache.get("key" + std::to_string(i));
+            REQUIRE(got.data_ != nullptr);
+            REQUIRE(blob == got.data_);
+            delete[] got.data_;
+        }
+        const Cache::Dedup_Stats stats = cache.dedup_stats();
+        REQUIRE(stats.keys == 9);
+        REQUIRE(stats.saved_bytes == 9 * val.size_);
+    }
+
+    SECTION("Freed with the last key") {
+        for (int i = 0; i < 9; i++)
+            REQUIRE(cache.del("key" + std::to_string(i)));
+        REQUIRE(cache.space_used() == val.size_);
+        REQUIRE(cache.dedup_stats().keys == 0);
+        Cache::val_type got = cache.get("key9");
+        REQUIRE(blob == got.data_);
+        delete[] got.data_;
+        REQUIRE(cache.del("key9"));
+        REQUIRE(cache.space_used() == 0);
+    }
+
+    SECTION("Overwriting one key leaves the others") {
+        REQUIRE(cache.set("key0", {other.c_str(), other.size() + 1}));
+        REQUIRE(cache.space_used() == 2 * val.size_);
+        REQUIRE(cache.dedup_stats().keys == 8);
+        Cache::val_type got = cache.get("key1");
+        REQUIRE(blob == got.data_);
+        delete[] got.data_;
+        // Setting the same value again changes nothing
+        REQUIRE(cache.set("key1", val));
+        REQUIRE(cache.space_used() == 2 * val.size_);
+    }
+
+    SECTION("Small values aren't shared") {
+        REQUIRE(cache.set("a", {"small", 6}));
+        REQUIRE(cache.set("b", {"small", 6}));
+        REQUIRE(cache.space_used() == val.size_ + 12);
+    }
+
+    SECTION("Reset forgets shared values") {
+        REQUIRE(cache.reset());
+        REQUIRE(cache.dedup_stats().keys == 0);
+        REQUIRE(cache.set("again", val));
+        REQUIRE(cache.space_used() == val.size_);
+    }
+}
+
+TEST_CASE("Disk tier") {
+    // Room for four values in memory and 64 on disk
+    Cache cache(4 * 256, maxload, new Fifo_Evictor());
+    const std::string path = "/tmp/test_cache_store." +
+                             std::to_string(std::hash<std::thread::id>()(
+                                     std::this_thread::get_id()));
+    REQUIRE(cache.set_disk_tier(path, 64 * 256));
+    auto value_of = [](int i) { return std::string(255, char('a' + i % 26)); };
+    for (int i = 0; i < 20; i++) {
+        const std::string val = value_of(i);
+        REQUIRE(cache.set("key" + std::to_string(i), {val.c_str(), 256}));
+    }
+    REQUIRE(cache.space_used() <= 4 * 256);
+    REQUIRE(cache.disk_stats().keys >= 16);
+
+    SECTION("Misses are found on disk and promoted") {
+        Cache::val_type val = cache.get("key0");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(value_of(0) == val.data_);
+        delete[] val.data_;
+        const Disk_Tier::Stats stats = cache.disk_stats();
+        REQUIRE(stats.hits == 1);
+        // It's in memory again, so the next get doesn't go to disk
+        val = cache.get("key0");
+        REQUIRE(val.data_ != nullptr);
+        delete[] val.data_;
+        REQUIRE(cache.disk_stats().hits == 1);
+        REQUIRE(cache.get("nowhere").data_ == nullptr);
+        REQUIRE(cache.disk_stats().misses == 1);
+    }
+
+    SECTION("Sets and deletes aren't undone from disk") {
+        REQUIRE(cache.del("key1"));
+        REQUIRE(cache.get("key1").data_ == nullptr);
+        REQUIRE(cache.set("key2", {"new", 4}));
+        Cache::val_type val = cache.get("key2");
+        REQUIRE(std::string("new") == val.data_);
+        delete[] val.data_;
+        REQUIRE(cache.reset());
+        REQUIRE(cache.get("key3").data_ == nullptr);
+        REQUIRE(cache.disk_stats().keys == 0);
+    }
+
+    SECTION("Oldest segments are reused first") {
+        for (int i = 20; i < 200; i++) {
+            const std::string val = value_of(i);
+            REQUIRE(cache.set("key" + std::to_string(i), {val.c_str(), 256}));
+        }
+        const Disk_Tier::Stats stats = cache.disk_stats();
+        REQUIRE(stats.reclaimed > 0);
+        REQUIRE(stats.bytes <= stats.capacity);
+        REQUIRE(cache.get("key0").data_ == nullptr);
+        Cache::val_type val = cache.get("key190");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(value_of(190) == val.data_);
+        delete[] val.data_;
+    }
+
+    SECTION("Namespaced and compressed values come back too") {
+        Cache packed(4 * 256, maxload, new Fifo_Evictor());
+        REQUIRE(packed.set_disk_tier(path + ".packed", 64 * 256));
+        packed.set_compression(64);
+        const std::string text(2000, 'z');
+        REQUIRE(packed.set("ns", "big", {text.c_str(), text.size() + 1}));
+        for (int i = 0; i < 100; i++) {
+            const std::string val = value_of(i);
+            REQUIRE(packed.set("ns", std::to_string(i), {val.c_str(), 256}));
+        }
+        Cache::val_type val = packed.get("ns", "big");
+        REQUIRE(val.data_ != nullptr);
+        REQUIRE(text == val.data_);
+        delete[] val.data_;
+        val = packed.get("ns", "3");
+        REQUIRE(value_of(3) == val.data_);
+        delete[] val.data_;
+    }
+}
@@ -0,0 +1,361 @@
+/**
+ * test_evictors.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Test the eviction policies, alone and in a cache.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include "adaptive_evictor.hh"
+#include "cache.hh"
+#include "fifo_evictor.hh"
+#include "gdsf_evictor.hh"
+#include "hit_queue.hh"
+#include "lfu_evictor.hh"
+#include "lru_evictor.hh"
+
+// Store n bytes of c under key
+static bool set_bytes(Cache &cache, const key_type &key, size_t n,
+                      char c = 'x') {
+    const std::string data(n - 1, c);
+    return cache.set(key, {data.c_str(), static_cast<Cache::size_type>(n)});
+}
+
+// Whether key is in the cache, without counting as a hit
+static bool holds(const Cache &cache, const key_type &key) {
+    bool found = false;
+    cache.for_each([&](std::string_view, key_view_type k, Cache::val_type) {
+        found = found || k == key;
+    });
+    return found;
+}
+
+TEST_CASE("FIFO evicts in the order keys were set") {
+    Fifo_Evictor fifo;
+    fifo.touch_key("a");
+    fifo.touch_key("b", 1000, 5);  // Sizes and costs change nothing
+    fifo.touch_key("c");
+    REQUIRE(fifo.evict() == "a");
+    REQUIRE(fifo.evict() == "b");
+    REQUIRE(fifo.evict() == "c");
+    REQUIRE(fifo.evict().empty());
+}
+
+TEST_CASE("LRU evicts the key used longest ago") {
+    Lru_Evictor lru;
+    lru.touch_key("a", 10, 1);
+    lru.touch_key("b", 10, 1);
+    lru.touch_key("c", 10, 1);
+    lru.hit_key("a", 10);
+    REQUIRE(lru.evict() == "b");
+    lru.forget_key("c");
+    lru.touch_key("d");
+    REQUIRE(lru.evict() == "a");
+    REQUIRE(lru.evict() == "d");
+    REQUIRE(lru.evict().empty());
+}
+
+TEST_CASE("LFU evicts the key used least, then the oldest") {
+    Lfu_Evictor lfu;
+    lfu.touch_key("a", 10, 1);
+    lfu.touch_key("b", 10, 1);
+    lfu.touch_key("c", 10, 1);
+    lfu.touch_key("d", 10, 1);
+    lfu.hit_key("a", 10);
+    lfu.hit_key("a", 10);
+    lfu.touch_key("b", 10, 1);
+    lfu.forget_key("d");
+    REQUIRE(lfu.evict() == "c");
+    REQUIRE(lfu.evict() == "b");
+    REQUIRE(lfu.evict() == "a");
+    REQUIRE(lfu.evict().empty());
+}
+
+TEST_CASE("Batches of victims cover the bytes asked for") {
+    std::vector<key_type> victims;
+
+    SECTION("FIFO") {
+        Fifo_Evictor fifo;
+        for (int i = 0; i < 10; i++)
+            fifo.touch_key("k" + std::to_string(i), 10, 1);
+        fifo.evict_batch(25, SIZE_MAX, victims);
+        REQUIRE(victims == std::vector<key_type>{"k0", "k1", "k2"});
+        fifo.evict_batch(1000, 2, victims);
+        REQUIRE(victims.size() == 5);  // No more than max_keys
+        // A key of unknown size ends a batch
+        fifo.touch_key("unknown");
+        fifo.evict_batch(1000, SIZE_MAX, victims);
+        REQUIRE(victims.size() == 11);  // k5 to k9, then unknown
+        REQUIRE(victims.back() == "unknown");
+        victims.clear();
+        fifo.evict_batch(1000, SIZE_MAX, victims);
+        REQUIRE(victims.empty());
+    }
+
+    SECTION("GDSF") {
+        Gdsf_Evictor gdsf;
+        gdsf.touch_key("small", 10, 1);
+        gdsf.touch_key("big", 100, 1);
+        gdsf.touch_key("medium", 50, 1);
+        gdsf.evict_batch(120, SIZE_MAX, victims);
+        REQUIRE(victims == std::vector<key_type>{"big", "medium"});
+        REQUIRE(gdsf.evict() == "small");
+    }
+}
+
+TEST_CASE("GDSF weighs size, cost and frequency") {
+    Gdsf_Evictor gdsf;
+
+    SECTION("the biggest value goes first") {
+        gdsf.touch_key("small", 10, 1);
+        gdsf.touch_key("big", 1000, 1);
+        gdsf.touch_key("medium", 100, 1);
+        REQUIRE(gdsf.evict() == "big");
+        REQUIRE(gdsf.evict() == "medium");
+        REQUIRE(gdsf.evict() == "small");
+        REQUIRE(gdsf.evict().empty());
+    }
+
+    SECTION("a costly value outlasts a cheap one its size") {
+        gdsf.touch_key("costly", 100, 10);
+        gdsf.touch_key("cheap", 100, 1);
+        REQUIRE(gdsf.evict() == "cheap");
+    }
+
+    SECTION("hits and sets count as uses") {
+        gdsf.touch_key("a", 100, 1);
+        gdsf.touch_key("b", 100, 1);
+        gdsf.touch_key("c", 100, 1);
+        for (int i = 0; i < 3; i++) gdsf.hit_key("a", 100);
+        gdsf.touch_key("c", 100, 1);
+        REQUIRE(gdsf.evict() == "b");
+        REQUIRE(gdsf.evict() == "c");
+        REQUIRE(gdsf.evict() == "a");
+    }
+
+    SECTION("old popularity ages out") {
+        gdsf.touch_key("old", 1, 1);
+        for (int i = 0; i < 5; i++) gdsf.hit_key("old", 1);  // Priority 6
+        // Each eviction moves the clock up, so newer keys start higher
+        for (int i = 0; i < 10; i++) {
+            const key_type key = "new" + std::to_string(i);
+            gdsf.touch_key(key, 1, 1);
+            if (gdsf.evict() == "old") {
+                REQUIRE(i > 0);
+                return;
+            }
+        }
+        FAIL("the old key was never evicted");
+    }
+
+    SECTION("forgotten and cleared keys aren't evicted") {
+        gdsf.touch_key("a", 1, 1);
+        gdsf.touch_key("b", 2, 1);
+        gdsf.touch_key("c", 3, 1);
+        gdsf.forget_key("c");
+        gdsf.hit_key("c", 3);  // Too late; ignored
+        REQUIRE(gdsf.evict() == "b");
+        gdsf.clear();
+        REQUIRE(gdsf.evict().empty());
+    }
+}
+
+TEST_CASE("GDSF makes room with one big value, not many small ones") {
+    auto run = [](Evictor *evictor) {
+        Cache cache(1024, 0.75, evictor);
+        // The small values are hot: got after every set
+        auto get_small = [&cache]() {
+            for (int i = 0; i < 8; i++) {
+                Cache::val_type val = cache.get("small" + std::to_string(i));
+                delete[] val.data_;
+            }
+        };
+        for (int i = 0; i < 8; i++)
+            REQUIRE(set_bytes(cache, "small" + std::to_string(i), 64));
+        get_small();
+        REQUIRE(set_bytes(cache, "big1", 600));
+        get_small();
+        REQUIRE(set_bytes(cache, "big2", 600));
+        REQUIRE(holds(cache, "big2"));
+        int small = 0;
+        for (int i = 0; i < 8; i++)
+            small += holds(cache, "small" + std::to_string(i));
+        return small;
+    };
+    // FIFO has to evict every small value before it gets to big1
+    REQUIRE(run(new Fifo_Evictor()) == 0);
+    // GDSF evicts two small ones for big1 and then just big1 for big2
+    REQUIRE(run(new Gdsf_Evictor()) == 6);
+}
+
+// Get key from the cache times times on each of threads threads at once
+static void get_at_once(const Cache &cache, const key_type &key,
+                        int threads, int times) {
+    std::atomic<int> misses{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < threads; t++) {
+        readers.emplace_back([&cache, &key, &misses, times]() {
+            for (int i = 0; i < times; i++) {
+                Cache::val_type val = cache.get(key);
+                if (val.data_ == nullptr) misses++;
+                delete[] val.data_;
+            }
+        });
+    }
+    for (std::thread &reader : readers) reader.join();
+    REQUIRE(misses == 0);
+}
+
+TEST_CASE("Every hit on a hot key counts, however many threads get it") {
+    SECTION("GDSF") {
+        auto *gdsf = new Gdsf_Evictor();
+        Cache cache(250, 0.75, gdsf);
+        REQUIRE(set_bytes(cache, "a", 100));
+        REQUIRE(set_bytes(cache, "b", 100));
+        // Nothing is counted under the cache's lock in between, so a got
+        // 8000 times has to lose to b got 9000 times
+        get_at_once(cache, "a", 4, 2000);
+        get_at_once(cache, "b", 1, 9000);
+        REQUIRE(set_bytes(cache, "c", 100));
+        REQUIRE(!holds(cache, "a"));
+        REQUIRE(holds(cache, "b"));
+        REQUIRE(holds(cache, "c"));
+    }
+
+    SECTION("adaptive") {
+        // The window ends on exactly the two sets and every hit
+        auto *adaptive = new Adaptive_Evictor(1000, 1, 2 + 4 * 3000);
+        Cache cache(1000, 0.75, adaptive);
+        REQUIRE(set_bytes(cache, "a", 100));
+        REQUIRE(set_bytes(cache, "b", 100));
+        get_at_once(cache, "a", 4, 3000);
+        for (const auto &ratio : adaptive->report().miss_ratios)
+            REQUIRE(ratio.second == 0);
+        REQUIRE(set_bytes(cache, "c", 100));
+        for (const auto &ratio : adaptive->report().miss_ratios)
+            REQUIRE(ratio.second == Approx(2.0 / (2 + 4 * 3000)));
+    }
+}
+
+TEST_CASE("A stripe full of hits asks to be drained") {
+    Hit_Queue hits;
+    for (size_t i = 0; i + 1 < Hit_Queue::stripe_keys; i++)
+        REQUIRE(!hits.push(std::to_string(i)));
+    REQUIRE(!hits.push("0"));  // Not a new key
+    REQUIRE(hits.push("last"));
+
+    uint64_t counted = 0;
+    hits.drain([&counted](const key_type &, const Hit_Queue::Hits &got) {
+        counted += got.count;
+    });
+    REQUIRE(counted == Hit_Queue::stripe_keys + 1);
+    REQUIRE(!hits.push("last"));
+}
+
+/**
+ * FIFO, counting how often the cache asks it for victims.
+ */
+class Counting_Evictor final : public Evictor {
+public:
+    Fifo_Evictor fifo;
+    size_t evicts = 0;
+    size_t batches = 0;
+
+    void touch_key(const key_type &key) override { fifo.touch_key(key); }
+    void touch_key(const key_type &key, uint64_t size, double cost) override {
+        fifo.touch_key(key, size, cost);
+    }
+    const key_type evict() override {
+        evicts++;
+        return fifo.evict();
+    }
+    void evict_batch(uint64_t bytes, size_t max_keys,
+                     std::vector<key_type> &victims) override {
+        batches++;
+        fifo.evict_batch(bytes, max_keys, victims);
+    }
+};
+
+TEST_CASE("A big set makes its room in one batch") {
+    auto *counting = new Counting_Evictor();
+    Cache cache(10000, 0.75, counting);
+    for (int i = 0; i < 1000; i++)
+        REQUIRE(set_bytes(cache, "small" + std::to_string(i), 10));
+    REQUIRE(set_bytes(cache, "big", 5000));
+    REQUIRE(counting->batches == 1);
+    REQUIRE(counting->evicts == 0);
+    REQUIRE(cache.space_used() == 10000);
+    REQUIRE(!holds(cache, "small499"));
+    REQUIRE(holds(cache, "small500"));
+}
+
+TEST_CASE("Deleted and overwritten keys keep GDSF in step") {
+    auto *gdsf = new Gdsf_Evictor();
+    Cache cache(256, 0.75, gdsf);
+    REQUIRE(set_bytes(cache, "a", 100));
+    REQUIRE(set_bytes(cache, "b", 100));
+    REQUIRE(cache.del("b"));
+    // b is forgotten, so the cache asks for a once it's full again
+    REQUIRE(set_bytes(cache, "a", 100, 'y'));
+    REQUIRE(set_bytes(cache, "c", 200));
+    REQUIRE(!holds(cache, "a"));
+    REQUIRE(holds(cache, "c"));
+    REQUIRE(cache.space_used() == 200);
+}
+
+TEST_CASE("The adaptive policy follows whichever misses least") {
+    // Simulate every key, in room for ten values of ten bytes
+    Adaptive_Evictor adaptive(100, 1, 100);
+    REQUIRE(adaptive.report().active == "lru");
+
+    // Five hot keys, each got twice, between scans of ten keys set once:
+    // a scan flushes the hot keys from LRU and FIFO, but not from LFU
+    int unique = 0;
+    for (int round = 0; round < 100; round++) {
+        for (int twice = 0; twice < 2; twice++)
+            for (int i = 0; i < 5; i++)
+                adaptive.hit_key("hot" + std::to_string(i), 10);
+        for (int i = 0; i < 10; i++)
+            adaptive.touch_key("scan" + std::to_string(unique++), 10, 1);
+    }
+    Adaptive_Evictor::Report report = adaptive.report();
+    REQUIRE(report.active == "lfu");
+    REQUIRE(report.miss_ratios.size() == 3);
+    REQUIRE(report.miss_ratios[2].first == "lfu");
+    REQUIRE(report.miss_ratios[2].second < report.miss_ratios[1].second);
+
+    // Then eight new keys over and over: LFU holds on to the old hot keys
+    // and has room for only five of them
+    for (int round = 0; round < 200; round++)
+        for (int i = 0; i < 8; i++)
+            adaptive.touch_key("new" + std::to_string(i), 10, 1);
+    REQUIRE(adaptive.report().active != "lfu");
+}
+
+TEST_CASE("A cache stays in step with the adaptive policy") {
+    Cache cache(1000, 0.75, new Adaptive_Evictor(1000, 1, 50));
+    for (int i = 0; i < 500; i++) {
+        REQUIRE(set_bytes(cache, "key" + std::to_string(i), 10));
+        for (int hot = 0; hot < 5; hot++) {
+            Cache::val_type val = cache.get("key" + std::to_string(hot));
+            delete[] val.data_;
+        }
+    }
+    REQUIRE(cache.space_used() <= 1000);
+    REQUIRE(holds(cache, "key499"));
+    for (int hot = 0; hot < 5; hot++)
+        REQUIRE(holds(cache, "key" + std::to_string(hot)));
+    // The policy in use has a victim for every key the cache holds
+    REQUIRE(set_bytes(cache, "last", 1000));
+    REQUIRE(holds(cache, "last"));
+    REQUIRE(cache.space_used() == 1000);
+}
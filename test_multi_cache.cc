@@ -0,0 +1,149 @@
+/**
+ * test_multi_cache.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Test the hash ring, and the multi-server client against three local
+ * servers listening on ports 42069, 42070 and 42071.
+ */
+
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include "hash_ring.hh"
+#include "multi_cache.hh"
+
+static const std::vector<std::string> endpoints = {
+        "localhost:42069", "localhost:42070", "localhost:42071"};
+
+// Used to compute the data stored in the cache
+static const size_t min_data = 1;
+static const size_t max_data = 33;
+static const char *val_stub = "https:%20%20www.gutenberg.org%20files";
+
+// A little helper function to build a predictable data string
+static std::string make_data(size_t i) {
+    return val_stub + std::to_string(i) + "%20" + std::to_string(i) + ".txt";
+}
+
+// Keys used to check how the ring spreads things around
+static std::vector<key_type> many_keys() {
+    std::vector<key_type> keys;
+    for (size_t i = 0; i < 20000; i++) keys.push_back("key" + std::to_string(i));
+    return keys;
+}
+
+TEST_CASE("The ring spreads keys evenly") {
+    Hash_Ring ring;
+    for (const auto &endpoint : endpoints) REQUIRE(ring.add_node(endpoint));
+    REQUIRE(ring.add_node(endpoints[0]) == false);
+
+    std::map<std::string, size_t> counts;
+    for (const auto &key : many_keys()) counts[ring.node_for(key)]++;
+
+    REQUIRE(counts.size() == endpoints.size());
+    for (const auto &count : counts) {
+        // A third each, give or take
+        REQUIRE(count.second > 20000 / 3 * 3 / 4);
+        REQUIRE(count.second < 20000 / 3 * 5 / 4);
+    }
+}
+
+TEST_CASE("Adding or removing a node only moves its share of keys") {
+    Hash_Ring ring;
+    for (const auto &endpoint : endpoints) ring.add_node(endpoint);
+    std::vector<key_type> keys = many_keys();
+
+    std::map<key_type, std::string> before;
+    for (const auto &key : keys) before[key] = ring.node_for(key);
+
+    SECTION("Add a fourth node") {
+        ring.add_node("localhost:42072");
+        size_t moved = 0;
+        for (const auto &key : keys) {
+            const std::string &now = ring.node_for(key);
+            if (now != before[key]) {
+                REQUIRE(now == "localhost:42072");  // Only to the new node
+                moved++;
+            }
+        }
+        REQUIRE(moved > keys.size() / 4 * 3 / 4);
+        REQUIRE(moved < keys.size() / 4 * 5 / 4);
+    }
+
+    SECTION("Remove a node") {
+        REQUIRE(ring.remove_node(endpoints[1]));
+        REQUIRE(ring.remove_node(endpoints[1]) == false);
+        for (const auto &key : keys) {
+            if (before[key] != endpoints[1])
+                REQUIRE(ring.node_for(key) == before[key]);
+            else
+                REQUIRE(ring.node_for(key) != endpoints[1]);
+        }
+    }
+}
+
+TEST_CASE("Set, get and delete across several servers") {
+    Multi_Cache cache(endpoints);
+    REQUIRE(cache.reset() == true);
+
+    std::vector<std::string> data;
+    std::vector<std::pair<key_type, Cache::val_type>> items;
+    std::vector<key_type> keys;
+    for (size_t i = min_data; i < max_data; i++) data.push_back(make_data(i));
+    for (size_t i = min_data; i < max_data; i++) {
+        const std::string &str = data[i - min_data];
+        keys.push_back(std::to_string(i));
+        items.emplace_back(keys.back(),
+                           Cache::val_type{str.c_str(),
+                                           static_cast<Cache::size_type>(
+                                                   str.size() + 1)});
+    }
+
+    SECTION("One at a time") {
+        for (const auto &item : items)
+            REQUIRE(cache.set(item.first, item.second) == true);
+        for (size_t i = 0; i < keys.size(); i++) {
+            Cache::val_type val = cache.get(keys[i]);
+            REQUIRE(val.data_ != nullptr);
+            REQUIRE(data[i] == val.data_);
+            delete[] val.data_;
+        }
+        for (const auto &key : keys) REQUIRE(cache.del(key) == true);
+        for (const auto &key : keys) REQUIRE(cache.get(key).data_ == nullptr);
+    }
+
+    SECTION("In batches") {
+        for (bool ok : cache.set_many(items)) REQUIRE(ok == true);
+        std::vector<Cache::val_type> vals = cache.get_many(keys);
+        REQUIRE(vals.size() == keys.size());
+        for (size_t i = 0; i < vals.size(); i++) {
+            REQUIRE(vals[i].data_ != nullptr);
+            REQUIRE(data[i] == vals[i].data_);
+            delete[] vals[i].data_;
+        }
+        REQUIRE(cache.space_used() > 0);
+        for (bool ok : cache.del_many(keys)) REQUIRE(ok == true);
+        REQUIRE(cache.space_used() == 0);
+    }
+
+    SECTION("Each key lives on exactly one server") {
+        for (bool ok : cache.set_many(items)) REQUIRE(ok == true);
+        for (const auto &endpoint : endpoints) {
+            const size_t colon = endpoint.rfind(':');
+            Cache single(endpoint.substr(0, colon), endpoint.substr(colon + 1));
+            for (const auto &key : keys) {
+                Cache::val_type val = single.get(key);
+                REQUIRE((val.data_ != nullptr) ==
+                        (cache.endpoint_for(key) == endpoint));
+                delete[] val.data_;
+            }
+        }
+    }
+
+    REQUIRE(cache.reset() == true);
+}
@@ -0,0 +1,150 @@
+/**
+ * udp_get.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * The datagrams of the UDP fast path for small GETs.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+/**
+ * A GET in one datagram and its answer in another, for values small enough
+ * that TCP's connection and HTTP's framing would cost more than the value.
+ *
+ * Both start with the same 8 bytes: a request ID, 4 bytes little-endian,
+ * that the answer repeats so a client can tell it from the answer to an
+ * earlier try; a kind; a byte of zero; and the length of the namespace, 2
+ * bytes little-endian (0 in answers). A request then has the length of the
+ * key, 2 bytes little-endian, the namespace, the key, and padding; an
+ * answer to a hit has the value, without its terminator.
+ *
+ * An answer is never bigger than the request it answers, so the server
+ * can't be used to flood a third party with answers to small requests
+ * sent from its address. Clients pad their requests to max_datagram, which
+ * is never fragmented. A value that doesn't fit is answered with too_big,
+ * and the client gets it over TCP instead. Writes only ever go over TCP.
+ */
+class Udp_Get {
+public:
+    // What fits in a 1500-byte frame after the IP and UDP headers
+    static constexpr size_t max_datagram = 1472;
+    static constexpr size_t head_size = 8;
+    static constexpr size_t request_head = head_size + 2;
+    static constexpr size_t max_value = max_datagram - head_size;
+
+    enum class Kind : char {
+        get = 'g',      // A request
+        hit = 'h',      // The value follows
+        miss = 'm',     // No such key
+        too_big = 'b',  // Ask over TCP
+        error = 'e'     // The server couldn't look
+    };
+
+    struct Request {
+        uint32_t id;
+        std::string_view ns;
+        std::string_view key;
+        size_t size;  // Of the datagram, which the answer mustn't exceed
+    };
+
+private:
+    static void put_head(char *out, uint32_t id, Kind kind, size_t ns_size) {
+        for (size_t i = 0; i < 4; i++)
+            out[i] = static_cast<char>(id >> (8 * i));
+        out[4] = static_cast<char>(kind);
+        out[5] = 0;
+        out[6] = static_cast<char>(ns_size);
+        out[7] = static_cast<char>(ns_size >> 8);
+    }
+
+    static size_t get16(const char *in) {
+        return static_cast<unsigned char>(in[0]) |
+               static_cast<size_t>(static_cast<unsigned char>(in[1])) << 8;
+    }
+
+    static uint32_t get_id(const char *in) {
+        uint32_t id = 0;
+        for (size_t i = 0; i < 4; i++)
+            id |= static_cast<uint32_t>(static_cast<unsigned char>(in[i]))
+                  << (8 * i);
+        return id;
+    }
+
+public:
+    /**
+     * Write a request into out, which has room for max_datagram bytes.
+     * @param pad_to size to pad it to with zeroes, which bounds the size of
+     *               the answer; up to max_datagram
+     * @return its size, or 0 if it doesn't fit
+     */
+    static size_t put_request(char *out, uint32_t id, std::string_view ns,
+                              std::string_view key,
+                              size_t pad_to = max_datagram) {
+        const size_t size = request_head + ns.size() + key.size();
+        if (key.empty() || size > max_datagram) return 0;
+        put_head(out, id, Kind::get, ns.size());
+        out[head_size] = static_cast<char>(key.size());
+        out[head_size + 1] = static_cast<char>(key.size() >> 8);
+        memcpy(out + request_head, ns.data(), ns.size());
+        memcpy(out + request_head + ns.size(), key.data(), key.size());
+        if (pad_to <= size) return size;
+        pad_to = pad_to < max_datagram ? pad_to : max_datagram;
+        memset(out + size, 0, pad_to - size);
+        return pad_to;
+    }
+
+    /**
+     * Read a request, pointing into in.
+     * @return false if it isn't one
+     */
+    static bool get_request(const char *in, size_t size, Request &out) {
+        if (size <= request_head || in[4] != static_cast<char>(Kind::get))
+            return false;
+        const size_t ns_size = get16(in + 6);
+        const size_t key_size = get16(in + head_size);
+        if (key_size == 0 || ns_size + key_size > size - request_head)
+            return false;
+        out.id = get_id(in);
+        out.ns = std::string_view(in + request_head, ns_size);
+        out.key = std::string_view(in + request_head + ns_size, key_size);
+        out.size = size;
+        return true;
+    }
+
+    /**
+     * Write an answer into out, which has room for max_datagram bytes; a
+     * value that would make it bigger than the request makes it too_big.
+     * @param value only for a hit
+     * @return its size, never more than request.size
+     */
+    static size_t put_answer(char *out, const Request &request, Kind kind,
+                             std::string_view value = {}) {
+        const uint32_t id = request.id;
+        if (kind == Kind::hit && head_size + value.size() > request.size)
+            kind = Kind::too_big;
+        put_head(out, id, kind, 0);
+        if (kind != Kind::hit) return head_size;
+        memcpy(out + head_size, value.data(), value.size());
+        return head_size + value.size();
+    }
+
+    /**
+     * Read an answer, pointing into in.
+     * @param value set to the value, for a hit
+     * @return false if it isn't one
+     */
+    static bool get_answer(const char *in, size_t size, uint32_t &id,
+                           Kind &kind, std::string_view &value) {
+        if (size < head_size) return false;
+        kind = static_cast<Kind>(in[4]);
+        if (kind == Kind::get) return false;
+        id = get_id(in);
+        value = std::string_view(in + head_size, size - head_size);
+        return true;
+    }
+};
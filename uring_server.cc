@@ -0,0 +1,464 @@
+/**
+ * uring_server.cc
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Implement the io_uring connection loop in uring_server.hh, on the raw
+ * system calls.
+ */
+#include "uring_server.hh"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+// Submissions in the ring; completions get twice as many
+static constexpr unsigned ring_entries = 1024;
+
+// Receive buffers handed to the kernel, and the size of each
+static constexpr unsigned recv_buffers = 256;
+static constexpr size_t recv_buffer_size = 16 * 1024;
+
+// The one group our receive buffers are in
+static constexpr uint16_t buffer_group = 0;
+
+// What a completion is for: the low bits of its user_data; the rest is
+// the connection's id
+enum Kind : uint64_t {
+    accept_kind = 1,
+    recv_kind,
+    send_kind,
+    wake_kind,
+    buffer_kind  // A receive buffer handed back
+};
+static constexpr unsigned kind_bits = 3;
+
+static uint64_t tag(uint64_t id, Kind kind) { return id << kind_bits | kind; }
+
+/**
+ * The memory shared with the kernel: the submission and completion rings,
+ * the submissions themselves and the receive buffers.
+ */
+struct Uring_Server::Ring {
+    int fd = -1;
+
+    void *sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void *cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sqes_size = 0;
+
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned sq_local_tail = 0;  // Where the next submission goes
+
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    char *buffers = static_cast<char *>(MAP_FAILED);
+
+    ~Ring() {
+        if (buffers != MAP_FAILED)
+            munmap(buffers, recv_buffers * recv_buffer_size);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        if (fd >= 0) close(fd);
+    }
+
+    /**
+     * Map the rings of a new io_uring and hand it the receive buffers.
+     * @return false if the kernel can't do what we need
+     */
+    bool setup() {
+        io_uring_params params{};
+        // Only our thread submits; these save the kernel some work
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+        fd = static_cast<int>(
+                syscall(__NR_io_uring_setup, ring_entries, &params));
+        if (fd < 0 && errno == EINVAL) {
+            params = {};
+            fd = static_cast<int>(
+                    syscall(__NR_io_uring_setup, ring_entries, &params));
+        }
+        if (fd < 0) return fail("io_uring_setup");
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size =
+                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) return fail("mmap");
+        cq_ring = single_mmap ? sq_ring
+                              : mmap(nullptr, cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd,
+                                     IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) return fail("mmap");
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(
+                mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return fail("mmap");
+
+        auto *sq = static_cast<char *>(sq_ring);
+        sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_local_tail = *sq_tail;
+
+        auto *cq = static_cast<char *>(cq_ring);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // The receive buffers, all handed to the kernel at once; it picks
+        // one for each receive and we hand it back after
+        buffers = static_cast<char *>(
+                mmap(nullptr, recv_buffers * recv_buffer_size,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                     0));
+        if (buffers == MAP_FAILED) return fail("mmap");
+        provide(0, recv_buffers);
+        if (!submit(1)) return false;
+        const io_uring_cqe &done = cqes[*cq_head & cq_mask];
+        const int res = done.res;
+        __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+        if (res < 0) {
+            errno = -res;
+            return fail("IORING_OP_PROVIDE_BUFFERS");
+        }
+        return true;
+    }
+
+    static bool fail(const char *what) {
+        std::cerr << "Uring_Server: " << what << ": " << strerror(errno)
+                  << std::endl;
+        return false;
+    }
+
+    /**
+     * @return a cleared submission to fill in; it goes to the kernel on
+     *         the next submit()
+     */
+    io_uring_sqe *next_sqe() {
+        while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+               sq_entries)
+            submit(0);  // Full; let the kernel take some
+        const unsigned index = sq_local_tail & sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_local_tail++;
+        return sqe;
+    }
+
+    /**
+     * Hand every pending submission to the kernel in one call, and wait
+     * until there are at least wait completions.
+     * @return false if the ring is broken
+     */
+    bool submit(unsigned wait) {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        for (;;) {
+            const unsigned pending =
+                    sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (syscall(__NR_io_uring_enter, fd, pending, wait,
+                        wait != 0 ? IORING_ENTER_GETEVENTS : 0, nullptr,
+                        0) >= 0)
+                return true;
+            // Too many completions waiting; the caller reaps them first
+            if (errno == EBUSY && wait == 0) return true;
+            if (errno != EINTR) return fail("io_uring_enter");
+        }
+    }
+
+    /**
+     * Hand count receive buffers from bid on to the kernel, with the next
+     * submit().
+     */
+    void provide(uint16_t bid, unsigned count) {
+        io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+        sqe->len = recv_buffer_size;
+        sqe->buf_group = buffer_group;
+        sqe->off = bid;
+        sqe->user_data = tag(0, buffer_kind);
+    }
+
+    char *buffer(uint16_t bid) const { return buffers + bid * recv_buffer_size; }
+};
+
+/**
+ * Set up an io_uring to serve the connections of listen_fd.
+ * @return the server, or nullptr if this kernel can't do it (it needs
+ *         5.7 or so for provided buffers)
+ */
+std::unique_ptr<Uring_Server> Uring_Server::make(int listen_fd) {
+    auto ring = std::make_unique<Ring>();
+    if (!ring->setup()) return nullptr;
+    const int wake = eventfd(0, EFD_CLOEXEC);
+    if (wake < 0) {
+        Ring::fail("eventfd");
+        return nullptr;
+    }
+    return std::unique_ptr<Uring_Server>(
+            new Uring_Server(std::move(ring), listen_fd, wake));
+}
+
+Uring_Server::Uring_Server(std::unique_ptr<Ring> r, int listen_fd, int wake)
+        : ring(std::move(r)), listener(listen_fd), wake_fd(wake) {}
+
+Uring_Server::~Uring_Server() {
+    for (auto &entry : connections) close(entry.second.fd);
+    close(wake_fd);
+}
+
+void Uring_Server::arm_accept() {
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag(0, accept_kind);
+}
+
+void Uring_Server::arm_recv(uint64_t id, Connection &conn) {
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    if (multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = tag(id, recv_kind);
+    conn.receiving = true;
+}
+
+void Uring_Server::arm_wake() {
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wake_count);
+    sqe->len = sizeof(wake_count);
+    sqe->user_data = tag(0, wake_kind);
+}
+
+/**
+ * Send out on conn after whatever is already being sent; one send is in
+ * flight per connection at a time.
+ */
+void Uring_Server::send(uint64_t id, Connection &conn, std::string &out) {
+    if (out.empty()) return;
+    if (!conn.sending.empty()) {
+        conn.queued.append(out);
+        out.clear();
+        return;
+    }
+    conn.sending.swap(out);
+    out.clear();
+    conn.sent = 0;
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(conn.sending.data());
+    sqe->len = static_cast<uint32_t>(conn.sending.size());
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(id, send_kind);
+}
+
+/**
+ * Close conn once its answers are sent. Shutting the socket down ends its
+ * receive, and the connection goes once nothing is in flight on it.
+ */
+void Uring_Server::close_when_done(uint64_t id, Connection &conn) {
+    conn.closing = true;
+    if (!conn.sending.empty()) return;
+    if (conn.receiving) {
+        shutdown(conn.fd, SHUT_RDWR);
+        return;
+    }
+    close(conn.fd);
+    connections.erase(id);
+}
+
+/**
+ * Act on what a session said about conn.
+ */
+void Uring_Server::apply(uint64_t id, Connection &conn, Status status,
+                         std::string &out) {
+    send(id, conn, out);
+    if (status == Status::close) close_when_done(id, conn);
+}
+
+void Uring_Server::on_accept(int res, uint32_t flags, const Factory &factory) {
+    if (res >= 0) {
+        const uint64_t id = next_id++;
+        Connection &conn = connections[id];
+        conn.fd = res;
+        conn.session = factory(*this, id);
+        arm_recv(id, conn);
+    } else if (res == -EINVAL && multishot_accept) {
+        multishot_accept = false;  // An older kernel; one at a time then
+    } else {
+        std::cerr << "Uring_Server: accept: " << strerror(-res) << std::endl;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) arm_accept();
+}
+
+void Uring_Server::on_recv(uint64_t id, int res, uint32_t flags) {
+    auto found = connections.find(id);
+    if (found == connections.end()) return;
+    Connection &conn = found->second;
+    if (!(flags & IORING_CQE_F_MORE)) conn.receiving = false;
+
+    if (res > 0) {
+        const auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+        std::string out;
+        Status status = Status::close;
+        if (!conn.closing)
+            status = conn.session->received(
+                    std::string_view(ring->buffer(bid),
+                                     static_cast<size_t>(res)),
+                    out);
+        ring->provide(bid, 1);
+        apply(id, conn, status, out);
+        // apply() may have closed it
+        found = connections.find(id);
+        if (found == connections.end()) return;
+    } else if (res == -EINVAL && multishot_recv) {
+        multishot_recv = false;  // An older kernel; one at a time then
+    } else if (res != -ENOBUFS) {
+        // The client hung up, or we shut it down
+        if (res < 0 && res != -ECONNRESET)
+            std::cerr << "Uring_Server: recv: " << strerror(-res) << std::endl;
+        conn.closing = true;
+    }
+
+    if (conn.closing) {
+        if (!conn.receiving) close_when_done(id, conn);
+    } else if (!conn.receiving) {
+        arm_recv(id, conn);
+    }
+}
+
+void Uring_Server::on_send(uint64_t id, int res) {
+    auto found = connections.find(id);
+    if (found == connections.end()) return;
+    Connection &conn = found->second;
+    if (res < 0) {
+        conn.sending.clear();
+        conn.queued.clear();
+        close_when_done(id, conn);
+        return;
+    }
+    conn.sent += static_cast<size_t>(res);
+    if (conn.sent < conn.sending.size()) {
+        // Partial; send the rest
+        io_uring_sqe *sqe = ring->next_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.sent);
+        sqe->len = static_cast<uint32_t>(conn.sending.size() - conn.sent);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(id, send_kind);
+        return;
+    }
+    conn.sending.clear();
+    std::string next;
+    next.swap(conn.queued);
+    send(id, conn, next);
+    if (conn.closing && conn.sending.empty()) close_when_done(id, conn);
+}
+
+/**
+ * Pass on the answers finish() was given.
+ */
+void Uring_Server::on_wake() {
+    std::vector<Finished> done;
+    {
+        std::lock_guard<std::mutex> guard(finished_lock);
+        done.swap(finished);
+    }
+    for (Finished &reply : done) {
+        auto found = connections.find(reply.id);
+        if (found == connections.end()) continue;  // It went away meanwhile
+        Connection &conn = found->second;
+        Status status = Status::close;
+        if (reply.keep && !conn.closing)
+            status = conn.session->resumed(reply.reply);
+        apply(reply.id, conn, status, reply.reply);
+    }
+    arm_wake();
+}
+
+/**
+ * Serve connections until the ring breaks: reap every completion there is,
+ * then submit everything they led to in one call that also waits for more.
+ * @param factory makes the session for each new connection
+ */
+void Uring_Server::run(const Factory &factory) {
+    arm_accept();
+    arm_wake();
+    for (;;) {
+        if (!ring->submit(1)) return;
+        unsigned head = *ring->cq_head;
+        const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            const uint64_t id = cqe.user_data >> kind_bits;
+            switch (static_cast<Kind>(cqe.user_data & ((1 << kind_bits) - 1))) {
+                case accept_kind:
+                    on_accept(cqe.res, cqe.flags, factory);
+                    break;
+                case recv_kind:
+                    on_recv(id, cqe.res, cqe.flags);
+                    break;
+                case send_kind:
+                    on_send(id, cqe.res);
+                    break;
+                case wake_kind:
+                    on_wake();
+                    break;
+                case buffer_kind:
+                    break;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Answer a session that returned wait. Any thread may call this.
+ * @param id    the connection's id, as given to the factory
+ * @param reply what to send
+ * @param keep  false to close the connection after sending it
+ */
+void Uring_Server::finish(uint64_t id, std::string reply, bool keep) {
+    {
+        std::lock_guard<std::mutex> guard(finished_lock);
+        finished.push_back({id, std::move(reply), keep});
+    }
+    const uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0)
+        std::cerr << "Uring_Server::finish(): " << strerror(errno)
+                  << std::endl;
+}
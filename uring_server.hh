@@ -0,0 +1,116 @@
+/**
+ * uring_server.hh
+ * Talib Pierson & Thalia Wright
+ * November 2020
+ * Declare a connection loop on Linux's io_uring.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Serves the connections of one listening socket from one thread, with
+ * every accept, receive and send going through an io_uring, so the kernel
+ * is entered once per batch of completions rather than once per read or
+ * write. Accepts and receives are multishot where the kernel has it: one
+ * submission keeps producing connections or data. Data arrives in buffers
+ * from a pool handed to the kernel up front, so nothing is allocated or
+ * set aside per connection for receiving.
+ *
+ * What's said on a connection is up to a Session, which gets bytes and
+ * answers with bytes. A Session that can't answer at once (a long poll)
+ * returns wait and has someone call finish() later, from any thread.
+ */
+class Uring_Server {
+public:
+    enum class Status {
+        keep,   // Go on reading
+        close,  // Close once what's been answered is sent
+        wait    // An answer will come through finish()
+    };
+
+    class Session {
+    public:
+        virtual ~Session() = default;
+
+        /**
+         * Take bytes the client sent, and append the answers to whatever
+         * requests they complete to out.
+         */
+        virtual Status received(std::string_view data, std::string &out) = 0;
+
+        /**
+         * Go on after a wait, with whatever was received meanwhile.
+         */
+        virtual Status resumed(std::string &out) = 0;
+    };
+
+    using Factory =
+            std::function<std::unique_ptr<Session>(Uring_Server &, uint64_t)>;
+
+private:
+    struct Ring;
+
+    struct Connection {
+        int fd;
+        std::unique_ptr<Session> session;
+        std::string sending;  // In flight
+        size_t sent = 0;      // Bytes of sending already gone
+        std::string queued;   // To send after sending
+        bool receiving = false;
+        bool closing = false;
+    };
+
+    struct Finished {
+        uint64_t id;
+        std::string reply;
+        bool keep;
+    };
+
+    std::unique_ptr<Ring> ring;
+    int listener;
+    int wake_fd;
+    uint64_t wake_count = 0;  // Where the wake_fd read goes
+    bool multishot_accept = true;
+    bool multishot_recv = true;
+
+    uint64_t next_id = 1;
+    std::unordered_map<uint64_t, Connection> connections;
+
+    std::mutex finished_lock;  // Guards finished
+    std::vector<Finished> finished;
+
+    Uring_Server(std::unique_ptr<Ring> r, int listen_fd, int wake);
+
+    void arm_accept();
+    void arm_recv(uint64_t id, Connection &conn);
+    void arm_wake();
+    void send(uint64_t id, Connection &conn, std::string &out);
+    void close_when_done(uint64_t id, Connection &conn);
+    void apply(uint64_t id, Connection &conn, Status status, std::string &out);
+
+    void on_accept(int res, uint32_t flags, const Factory &factory);
+    void on_recv(uint64_t id, int res, uint32_t flags);
+    void on_send(uint64_t id, int res);
+    void on_wake();
+
+public:
+    static std::unique_ptr<Uring_Server> make(int listen_fd);
+
+    ~Uring_Server();
+
+    Uring_Server(const Uring_Server &) = delete;
+    Uring_Server &operator=(const Uring_Server &) = delete;
+
+    void run(const Factory &factory);
+
+    void finish(uint64_t id, std::string reply, bool keep);
+};